@@ -150,6 +150,46 @@ syscall(struct trapframe *tf)
 
 			break;
 
+		case SYS_readv:
+			val = myreadv(tf->tf_a0, (const_userptr_t)tf->tf_a1,
+				      tf->tf_a2);
+			err = val.errno;
+			if (val.errno == NO_ERROR) {
+				retval_h = (int) val.val_h;
+			}
+			break;
+
+		case SYS_writev:
+			val = mywritev(tf->tf_a0, (const_userptr_t)tf->tf_a1,
+				       tf->tf_a2);
+			err = val.errno;
+			if (val.errno == NO_ERROR) {
+				retval_h = (int) val.val_h;
+			}
+			break;
+
+		case SYS_pread:
+		case SYS_pwrite:
+			/* The 64-bit offset is aligned, so it's on the stack */
+			err = copyin((const_userptr_t)tf->tf_sp+16, &pos,
+				     sizeof(pos));
+			if (err) {
+				break;
+			}
+			if (callno == SYS_pread) {
+				val = mypread(tf->tf_a0, (void*)tf->tf_a1,
+					      tf->tf_a2, pos);
+			} else {
+				val = mypwrite(tf->tf_a0, (void*)tf->tf_a1,
+					       tf->tf_a2, pos);
+			}
+			err = val.errno;
+			if (val.errno == NO_ERROR) {
+				retval_h = (int) val.val_h;
+			}
+
+			break;
+
 		case SYS_lseek:
 			join32to64((uint32_t) tf->tf_a2, (uint32_t) tf->tf_a3, &pos);
 			copyin((const_userptr_t)tf->tf_sp+16, &whence, sizeof(int));
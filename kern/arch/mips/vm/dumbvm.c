@@ -58,29 +58,20 @@
 /* (this must be > 64K so argument blocks of size ARG_MAX will fit) */
 #define DUMBVM_STACKPAGES    18
 
-/*
- * Wrap ram_stealmem in a spinlock.
- */
-static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
-
 void
 vm_bootstrap(void)
 {
-	/* Do nothing. */
+	coremap_bootstrap();
 }
 
+/*
+ * Get physical pages from the coremap. AS is NULL for kernel memory.
+ */
 static
 paddr_t
-getppages(unsigned long npages)
+getppages(unsigned long npages, struct addrspace *as, vaddr_t vaddr)
 {
-	paddr_t addr;
-
-	spinlock_acquire(&stealmem_lock);
-
-	addr = ram_stealmem(npages);
-
-	spinlock_release(&stealmem_lock);
-	return addr;
+	return coremap_alloc(npages, as, vaddr);
 }
 
 /* Allocate/free some kernel-space virtual pages */
@@ -88,7 +79,7 @@ vaddr_t
 alloc_kpages(int npages)
 {
 	paddr_t pa;
-	pa = getppages(npages);
+	pa = getppages(npages, NULL, 0);
 	if (pa==0) {
 		return 0;
 	}
@@ -98,9 +89,41 @@ alloc_kpages(int npages)
 void
 free_kpages(vaddr_t addr)
 {
-	/* nothing - leak the memory. */
+	coremap_free(KVADDR_TO_PADDR(addr));
+}
+
+void
+vm_textpurge(struct vnode *vn)
+{
+	/* dumbvm doesn't share pages. */
+	(void)vn;
+}
 
-	(void)addr;
+void
+vm_prefault(const struct uio *uio)
+{
+	/* dumbvm loads everything at exec time. */
+	(void)uio;
+}
+
+void
+vm_textpurgefs(struct fs *fs)
+{
+	(void)fs;
+}
+
+void
+vm_printstats(void)
+{
+	kprintf("dumbvm: no statistics\n");
+}
+
+int
+vm_swapon(const char *device)
+{
+	/* dumbvm doesn't page. */
+	(void)device;
+	return ENOSYS;
 }
 
 void
@@ -239,6 +262,15 @@ as_create(void)
 void
 as_destroy(struct addrspace *as)
 {
+	if (as->as_pbase1 != 0) {
+		coremap_free(as->as_pbase1);
+	}
+	if (as->as_pbase2 != 0) {
+		coremap_free(as->as_pbase2);
+	}
+	if (as->as_stackpbase != 0) {
+		coremap_free(as->as_stackpbase);
+	}
 	kfree(as);
 }
 
@@ -322,17 +354,18 @@ as_prepare_load(struct addrspace *as)
 	KASSERT(as->as_pbase2 == 0);
 	KASSERT(as->as_stackpbase == 0);
 
-	as->as_pbase1 = getppages(as->as_npages1);
+	as->as_pbase1 = getppages(as->as_npages1, as, as->as_vbase1);
 	if (as->as_pbase1 == 0) {
 		return ENOMEM;
 	}
 
-	as->as_pbase2 = getppages(as->as_npages2);
+	as->as_pbase2 = getppages(as->as_npages2, as, as->as_vbase2);
 	if (as->as_pbase2 == 0) {
 		return ENOMEM;
 	}
 
-	as->as_stackpbase = getppages(DUMBVM_STACKPAGES);
+	as->as_stackpbase = getppages(DUMBVM_STACKPAGES, as,
+				      USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE);
 	if (as->as_stackpbase == 0) {
 		return ENOMEM;
 	}
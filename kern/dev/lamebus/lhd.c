@@ -36,7 +36,8 @@
 #include <lib.h>
 #include <uio.h>
 #include <membar.h>
-#include <synch.h>
+#include <wchan.h>
+#include <iosched.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -96,15 +97,148 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Requests.
+ *
+ * Each call to lhd_io becomes one request for a contiguous run of
+ * sectors. The hardware only has a one-sector buffer and does one
+ * sector per operation, so the interrupt handler chains the sectors
+ * of a request itself, copying each one between the on-card buffer
+ * and the request's (kernel) buffer and starting the next, and wakes
+ * the requesting thread only when the whole run is done. Requests
+ * that arrive while the disk is busy wait in the I/O scheduler
+ * (iosched.h), which decides the order they are started in, so any
+ * number of threads can have I/O outstanding at once.
+ *
+ * The scheduler may hand back a batch of requests, each continuing
+ * on disk where the last one stops, chained through ir_merged. The
+ * interrupt handler runs through the batch the same way it runs
+ * through the sectors of one request, completing each request as it
+ * finishes.
+ *
+ * The scheduler and the active request are protected by lh_lock,
+ * which is a spinlock because the interrupt handler takes it.
+ */
+struct lhd_req {
+	struct ioreq r_io;		/* sectors, direction; must be first */
+	uint32_t r_xfered;		/* number of sectors done so far */
+	char *r_data;			/* r_nsect sectors of kernel memory */
+	int r_result;			/* result, once done */
+	bool r_done;			/* true when finished */
+};
+
+#define r_sector r_io.ir_block
+#define r_nsect  r_io.ir_nblocks
+#define r_write  r_io.ir_write
+
+/*
+ * Start the next sector of the active request.
+ */
+static
+void
+lhd_startsect(struct lhd_softc *lh)
+{
+	struct lhd_req *req = lh->lh_active;
+	uint32_t statval = LHD_WORKING;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+	KASSERT(req != NULL);
+	KASSERT(req->r_xfered < req->r_nsect);
+
+	/*
+	 * Are we writing? If so, transfer the data to the on-card
+	 * buffer.
+	 */
+	if (req->r_write) {
+		memcpy(lh->lh_buf, req->r_data + req->r_xfered*LHD_SECTSIZE,
+		       LHD_SECTSIZE);
+		membar_store_store();
+		statval |= LHD_ISWRITE;
+	}
+
+	/* Tell it what sector we want... */
+	lhd_wreg(lh, LHD_REG_SECT, req->r_sector + req->r_xfered);
+
+	/* and start the operation. */
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * If the disk is idle, start the request the scheduler picks.
+ */
+static
+void
+lhd_startnext(struct lhd_softc *lh)
+{
+	struct ioreq *io;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	if (lh->lh_active != NULL) {
+		return;
+	}
+
+	io = iosched_next(lh->lh_sched);
+	if (io == NULL) {
+		return;
+	}
+
+	lh->lh_active = (struct lhd_req *)io;
+	lhd_startsect(lh);
+}
+
+/*
+ * Record that a sector has completed. Move on to the next sector of
+ * the request, or, if it's finished or failed, save the result, wake
+ * its thread, and go on to the next request in the batch, or if the
+ * batch is done, the next one from the scheduler.
  */
 static
 void
 lhd_iodone(struct lhd_softc *lh, int err)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct lhd_req *req, *next;
+
+	spinlock_acquire(&lh->lh_lock);
+
+	req = lh->lh_active;
+	if (req == NULL) {
+		kprintf("lhd%d: Spurious completion\n", lh->lh_unit);
+		spinlock_release(&lh->lh_lock);
+		return;
+	}
+
+	/*
+	 * Are we reading? If so, and if we succeeded, transfer the
+	 * data out of the on-card buffer.
+	 */
+	if (err == 0) {
+		if (!req->r_write) {
+			membar_load_load();
+			memcpy(req->r_data + req->r_xfered*LHD_SECTSIZE,
+			       lh->lh_buf, LHD_SECTSIZE);
+		}
+		req->r_xfered++;
+	}
+
+	if (err == 0 && req->r_xfered < req->r_nsect) {
+		lhd_startsect(lh);
+	}
+	else {
+		next = (struct lhd_req *)req->r_io.ir_merged;
+		iosched_done(lh->lh_sched, &req->r_io);
+		req->r_result = err;
+		req->r_done = true;
+		wchan_wakeall(lh->lh_wchan, &lh->lh_lock);
+		lh->lh_active = next;
+		if (next != NULL) {
+			lhd_startsect(lh);
+		}
+		else {
+			lhd_startnext(lh);
+		}
+	}
+
+	spinlock_release(&lh->lh_lock);
 }
 
 /*
@@ -196,6 +330,11 @@ lhd_reset(struct lhd_softc *lh)
 
 /*
  * I/O function (for both reads and writes)
+ *
+ * If the uio is a single kernel buffer (as for filesystem blocks) the
+ * sectors are transferred straight into or out of it; otherwise they
+ * go through a bounce buffer, since the interrupt handler can't touch
+ * user memory.
  */
 static
 int
@@ -207,8 +346,9 @@ lhd_io(struct device *d, struct uio *uio)
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
+	size_t bytes = uio->uio_resid;
+	struct lhd_req req;
+	bool direct;
 	int result;
 
 	/* Don't allow I/O that isn't sector-aligned. */
@@ -217,66 +357,70 @@ lhd_io(struct device *d, struct uio *uio)
 	}
 
 	/* Don't allow I/O past the end of the disk. */
-	/* XXX this check can overflow */
-	if (sector+len > lh->lh_dev.d_blocks) {
+	if (sector > lh->lh_dev.d_blocks ||
+	    len > lh->lh_dev.d_blocks - sector) {
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	if (len == 0) {
+		return 0;
 	}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
-
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
-
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
+	direct = (uio->uio_segflg == UIO_SYSSPACE && uio->uio_iovcnt == 1 &&
+		  uio->uio_iov->iov_len == bytes);
+	if (direct) {
+		req.r_data = uio->uio_iov->iov_kbase;
+	}
+	else {
+		req.r_data = kmalloc(bytes);
+		if (req.r_data == NULL) {
+			return ENOMEM;
+		}
 		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-			membar_store_store();
+			result = uiomove(req.r_data, bytes, uio);
 			if (result) {
-				V(lh->lh_clear);
+				kfree(req.r_data);
 				return result;
 			}
 		}
+	}
 
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
-
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
-
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			membar_load_load();
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+	req.r_sector = sector;
+	req.r_nsect = len;
+	req.r_xfered = 0;
+	req.r_write = (uio->uio_rw == UIO_WRITE);
+	req.r_result = 0;
+	req.r_done = false;
+
+	/* Queue the request, start something if the disk is idle, and wait. */
+	spinlock_acquire(&lh->lh_lock);
+	iosched_add(lh->lh_sched, &req.r_io);
+	lhd_startnext(lh);
+	while (!req.r_done) {
+		wchan_sleep(lh->lh_wchan, &lh->lh_lock);
+	}
+	spinlock_release(&lh->lh_lock);
+
+	result = req.r_result;
+
+	if (direct) {
+		if (result == 0) {
+			/* Account for the transfer as uiomove would. */
+			uio->uio_iov->iov_kbase =
+				(char *)uio->uio_iov->iov_kbase + bytes;
+			uio->uio_iov->iov_len = 0;
+			uio->uio_resid = 0;
+			uio->uio_offset += bytes;
 		}
-
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
-		if (result) {
-			return result;
+	}
+	else {
+		if (result == 0 && uio->uio_rw == UIO_READ) {
+			result = uiomove(req.r_data, bytes, uio);
 		}
+		kfree(req.r_data);
 	}
 
-	return 0;
+	return result;
 }
 
 static const struct device_ops lhd_devops = {
@@ -293,6 +437,7 @@ int
 config_lhd(struct lhd_softc *lh, int lhdno)
 {
 	char name[32];
+	char *schedname;
 
 	/* Figure out what our name is. */
 	snprintf(name, sizeof(name), "lhd%d", lhdno);
@@ -300,17 +445,24 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
+	/* Set up the request queue. */
+	lh->lh_wchan = wchan_create("lhd");
+	if (lh->lh_wchan == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&lh->lh_lock);
+	schedname = kstrdup(name);
+	if (schedname == NULL) {
+		wchan_destroy(lh->lh_wchan);
 		return ENOMEM;
 	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
+	lh->lh_sched = iosched_create(schedname, &lh->lh_lock);
+	if (lh->lh_sched == NULL) {
+		kfree(schedname);
+		wchan_destroy(lh->lh_wchan);
 		return ENOMEM;
 	}
+	lh->lh_active = NULL;
 
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_ops = &lhd_devops;
@@ -30,6 +30,7 @@
 #ifndef _LAMEBUS_LHD_H_
 #define _LAMEBUS_LHD_H_
 
+#include <spinlock.h>
 #include <device.h>
 
 /*
@@ -37,6 +38,9 @@
  */
 #define LHD_SECTSIZE  512
 
+struct lhd_req;		/* private to lhd.c */
+struct iosched;
+
 /*
  * Hardware device data associated with lhd (LAMEbus hard disk)
  */
@@ -51,9 +55,10 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct spinlock lh_lock;	/* Protects the request queue */
+	struct wchan *lh_wchan;		/* Requesters wait here */
+	struct iosched *lh_sched;	/* Requests not yet started */
+	struct lhd_req *lh_active;	/* Request the disk is working on */
 
 	struct device lh_dev;		/* VFS device structure */
 };
@@ -31,49 +31,356 @@
  * SFS filesystem
  *
  * Block allocation.
+ *
+ * Callers pass a goal block, where they would like the new block to
+ * be: just after the previous block of the same file, say, so files
+ * come out contiguous on disk and can be read without seeking. We
+ * take the first free block at or after the goal, wrapping around to
+ * the start of the disk if need be.
+ *
+ * To avoid crawling through long stretches of full bitmap, the disk
+ * is divided into regions of SFS_REGIONBLOCKS blocks, and the number
+ * of free blocks in each is kept in sfs_regionfree (under
+ * sfs_freemaplock); regions with none are skipped without looking at
+ * the bitmap.
+ *
+ * A newly allocated block must read as zeros, but writing zeros to
+ * it is a waste if the whole block is about to be overwritten, as it
+ * usually is. So instead it is marked in sfs_zeromap, and until it
+ * next reaches the disk, the buffer cache fills it with zeros rather
+ * than reading it (sfs_bisnew, sfs_bwritten). Blocks that are still
+ * marked when the volume is synced get their zeros written then
+ * (sfs_bzerosync), so nothing stale is exposed after a remount.
+ *
+ * On a journaled volume, allocating and freeing must be done within
+ * a journal handle (sfs_jbegin), so the bitmap changes are committed
+ * along with the metadata that refers to the blocks. A freed block
+ * is cleared in the bitmap at once, so the commit records it as
+ * free, but it can't be handed out again until that commit is done:
+ * until then a crash would bring back the old metadata pointing at
+ * it, and it mustn't hold anybody else's data. Such blocks are kept
+ * in sfs_freedmap, one map for each of the running and committing
+ * transactions (by sequence number parity), and only counted in
+ * sfs_regionfree once the freeing transaction commits (sfs_bcommitted).
+ * So right after a big remove a nearly full volume can say ENOSPC
+ * until the syncer's next commit.
+ *
+ * Which blocks of the bitmap itself have changed since they were
+ * last written (or logged) is kept in sfs_freemapdirty, one bit per
+ * bitmap block, so a sync writes only those and not the whole map.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <bitmap.h>
+#include <synch.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/* Blocks per region; a multiple of the bitmap's 32-bit scan unit */
+#define SFS_REGIONBLOCKS 256
+
+/*
+ * Note that the bitmap block holding the bit for DISKBLOCK has
+ * changed. The caller holds sfs_freemaplock.
+ */
+static
+void
+sfs_freemap_touch(struct sfs_fs *sfs, daddr_t diskblock)
+{
+	unsigned mapblock = diskblock / SFS_BLOCKBITS;
+
+	if (!bitmap_isset(sfs->sfs_freemapdirty, mapblock)) {
+		bitmap_mark(sfs->sfs_freemapdirty, mapblock);
+		sfs->sfs_nfreemapdirty++;
+	}
+}
+
+/*
+ * Check whether block MAPBLOCK of the bitmap has changed, and if so
+ * mark it clean again; the caller is about to write it out. The
+ * caller holds sfs_freemaplock.
+ */
+bool
+sfs_freemap_takedirty(struct sfs_fs *sfs, unsigned mapblock)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	if (!bitmap_isset(sfs->sfs_freemapdirty, mapblock)) {
+		return false;
+	}
+	bitmap_unmark(sfs->sfs_freemapdirty, mapblock);
+	KASSERT(sfs->sfs_nfreemapdirty > 0);
+	sfs->sfs_nfreemapdirty--;
+	return true;
+}
+
+/*
+ * Set up the region free counts from the freemap. Called at mount
+ * time, after the freemap has been loaded.
+ */
+int
+sfs_balloc_init(struct sfs_fs *sfs)
+{
+	uint32_t nblocks = sfs->sfs_super.sp_nblocks;
+	unsigned i;
+	daddr_t block;
+
+	sfs->sfs_nregions = DIVROUNDUP(nblocks, SFS_REGIONBLOCKS);
+	sfs->sfs_regionfree = kmalloc(sfs->sfs_nregions * sizeof(uint32_t));
+	if (sfs->sfs_regionfree == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<sfs->sfs_nregions; i++) {
+		sfs->sfs_regionfree[i] = 0;
+	}
+
+	sfs->sfs_zeromap = bitmap_create(nblocks);
+	if (sfs->sfs_zeromap == NULL) {
+		kfree(sfs->sfs_regionfree);
+		return ENOMEM;
+	}
+	sfs->sfs_nzero = 0;
+
+	sfs->sfs_freemapdirty = bitmap_create(SFS_BITBLOCKS(nblocks));
+	if (sfs->sfs_freemapdirty == NULL) {
+		bitmap_destroy(sfs->sfs_zeromap);
+		kfree(sfs->sfs_regionfree);
+		return ENOMEM;
+	}
+	sfs->sfs_nfreemapdirty = 0;
+
+	sfs->sfs_freedmap[0] = sfs->sfs_freedmap[1] = NULL;
+	sfs->sfs_nfreed[0] = sfs->sfs_nfreed[1] = 0;
+	if (sfs->sfs_journal != NULL) {
+		sfs->sfs_freedmap[0] = bitmap_create(nblocks);
+		sfs->sfs_freedmap[1] = bitmap_create(nblocks);
+		if (sfs->sfs_freedmap[0] == NULL ||
+		    sfs->sfs_freedmap[1] == NULL) {
+			if (sfs->sfs_freedmap[0] != NULL) {
+				bitmap_destroy(sfs->sfs_freedmap[0]);
+			}
+			if (sfs->sfs_freedmap[1] != NULL) {
+				bitmap_destroy(sfs->sfs_freedmap[1]);
+			}
+			bitmap_destroy(sfs->sfs_freemapdirty);
+			bitmap_destroy(sfs->sfs_zeromap);
+			kfree(sfs->sfs_regionfree);
+			return ENOMEM;
+		}
+	}
+
+	/* Blocks past the end of the disk are marked in use; skip them */
+	for (block=0; block<nblocks; block++) {
+		if (!bitmap_isset(sfs->sfs_freemap, block)) {
+			sfs->sfs_regionfree[block / SFS_REGIONBLOCKS]++;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Free the region counts and zero, dirty, and freed maps, at unmount.
+ */
+void
+sfs_balloc_cleanup(struct sfs_fs *sfs)
+{
+	unsigned i;
+
+	for (i=0; i<2; i++) {
+		if (sfs->sfs_freedmap[i] != NULL) {
+			bitmap_destroy(sfs->sfs_freedmap[i]);
+			sfs->sfs_freedmap[i] = NULL;
+		}
+	}
+	KASSERT(sfs->sfs_nfreemapdirty == 0);
+	bitmap_destroy(sfs->sfs_freemapdirty);
+	sfs->sfs_freemapdirty = NULL;
+	KASSERT(sfs->sfs_nzero == 0);
+	bitmap_destroy(sfs->sfs_zeromap);
+	sfs->sfs_zeromap = NULL;
+	kfree(sfs->sfs_regionfree);
+	sfs->sfs_regionfree = NULL;
+	sfs->sfs_nregions = 0;
+}
+
+/*
+ * Check if a block that's free in the bitmap was freed by a
+ * transaction that hasn't committed yet. The caller holds
+ * sfs_freemaplock.
+ */
+static
+bool
+sfs_bfreeing(struct sfs_fs *sfs, daddr_t block)
+{
+	if (sfs->sfs_journal == NULL) {
+		return false;
+	}
+	return bitmap_isset(sfs->sfs_freedmap[0], block) ||
+		bitmap_isset(sfs->sfs_freedmap[1], block);
+}
+
 /*
- * Zero out a disk block.
+ * Find a free block, as close after GOAL as possible. The caller
+ * holds sfs_freemaplock.
  */
 static
 int
-sfs_clearblock(struct sfs_fs *sfs, daddr_t block)
+sfs_bfind(struct sfs_fs *sfs, daddr_t goal, daddr_t *ret)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
-	return sfs_writeblock(sfs, block, zeros);
+	unsigned region, i, start;
+	daddr_t block;
+	int result;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	if (goal >= sfs->sfs_super.sp_nblocks) {
+		goal = 0;
+	}
+
+	/*
+	 * Visit each region once, starting with the goal's, and then
+	 * the goal's region again from its start, since the free
+	 * blocks in it might all be before the goal.
+	 */
+	region = goal / SFS_REGIONBLOCKS;
+	for (i=0; i<=sfs->sfs_nregions; i++) {
+		if (sfs->sfs_regionfree[region] > 0) {
+			start = (i == 0) ? goal : region * SFS_REGIONBLOCKS;
+			result = bitmap_findfree(sfs->sfs_freemap, start,
+						 &block);
+			/* regionfree doesn't count these, so one remains */
+			while (result == 0 && sfs_bfreeing(sfs, block)) {
+				result = bitmap_findfree(sfs->sfs_freemap,
+							 block + 1, &block);
+			}
+			if (result == 0 &&
+			    block / SFS_REGIONBLOCKS == region) {
+				*ret = block;
+				return 0;
+			}
+		}
+		region = (region + 1) % sfs->sfs_nregions;
+	}
+	return ENOSPC;
 }
 
 /*
- * Allocate a block.
+ * Allocate a block, preferably at or soon after GOAL.
  */
 int
-sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock)
+sfs_balloc(struct sfs_fs *sfs, daddr_t goal, daddr_t *diskblock)
 {
 	int result;
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	result = sfs_bfind(sfs, goal, diskblock);
 	if (result) {
+		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
-	sfs->sfs_freemapdirty = true;
+	bitmap_mark(sfs->sfs_freemap, *diskblock);
+	KASSERT(sfs->sfs_regionfree[*diskblock / SFS_REGIONBLOCKS] > 0);
+	sfs->sfs_regionfree[*diskblock / SFS_REGIONBLOCKS]--;
+	sfs_freemap_touch(sfs, *diskblock);
+
+	/*
+	 * It reads as zeros until written. Mark it before dropping the
+	 * lock, so that a read-ahead request that gets to it from now
+	 * on fills it with zeros rather than the old contents.
+	 */
+	KASSERT(!bitmap_isset(sfs->sfs_zeromap, *diskblock));
+	bitmap_mark(sfs->sfs_zeromap, *diskblock);
+	sfs->sfs_nzero++;
+	lock_release(sfs->sfs_freemaplock);
 
 	if (*diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: balloc: invalid block %u\n", *diskblock);
 	}
 
-	/* Clear block before returning it */
-	result = sfs_clearblock(sfs, *diskblock);
-	if (result) {
-		bitmap_unmark(sfs->sfs_freemap, *diskblock);
+	/*
+	 * Read-ahead may have cached the old contents before the mark;
+	 * get rid of them. This waits for a read or write of the old
+	 * buffer that's still in progress (sfs_buf_writeout doesn't
+	 * clear the mark if it was set after the write started).
+	 */
+	sfs_buf_discard(sfs, *diskblock);
+
+	return 0;
+}
+
+/*
+ * Check if a block has been allocated and not written since, and
+ * so should read as zeros. Called by the buffer cache with the
+ * buffer for the block busy.
+ */
+bool
+sfs_bisnew(struct sfs_fs *sfs, daddr_t diskblock)
+{
+	bool ret;
+
+	lock_acquire(sfs->sfs_freemaplock);
+	ret = bitmap_isset(sfs->sfs_zeromap, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+	return ret;
+}
+
+/*
+ * Note that a block has been written to disk, so its on-disk
+ * contents are now real. Called by the buffer cache with the buffer
+ * for the block busy.
+ */
+void
+sfs_bwritten(struct sfs_fs *sfs, daddr_t diskblock)
+{
+	lock_acquire(sfs->sfs_freemaplock);
+	if (bitmap_isset(sfs->sfs_zeromap, diskblock)) {
+		bitmap_unmark(sfs->sfs_zeromap, diskblock);
+		KASSERT(sfs->sfs_nzero > 0);
+		sfs->sfs_nzero--;
 	}
-	return result;
+	lock_release(sfs->sfs_freemaplock);
+}
+
+/*
+ * Get the zeros onto the disk for every new block that hasn't been
+ * written yet, by dirtying it in the buffer cache; the caller then
+ * syncs the cache. Called from sfs_sync.
+ */
+int
+sfs_bzerosync(struct sfs_fs *sfs)
+{
+	struct sfs_buf *buf;
+	daddr_t block;
+	int result;
+
+	/* Usually there are none; don't scan the map for nothing. */
+	lock_acquire(sfs->sfs_freemaplock);
+	if (sfs->sfs_nzero == 0) {
+		lock_release(sfs->sfs_freemaplock);
+		return 0;
+	}
+	lock_release(sfs->sfs_freemaplock);
+
+	for (block=0; block<sfs->sfs_super.sp_nblocks; block++) {
+		if (!sfs_bisnew(sfs, block)) {
+			continue;
+		}
+		/* This fills it with zeros, unless someone beat us to it. */
+		result = sfs_buf_read(sfs, block, &buf);
+		if (result) {
+			return result;
+		}
+		/*
+		 * Metadata in the journal gets home by checkpoint;
+		 * writing it here could get ahead of the commit.
+		 */
+		if (!sfs_jread(sfs, block, NULL)) {
+			sfs_buf_markdirty(buf);
+		}
+		sfs_buf_release(buf);
+	}
+	return 0;
 }
 
 /*
@@ -82,8 +389,55 @@ sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock)
 void
 sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 {
+	unsigned which;
+
+	/* Don't bother writing back whatever was cached for it */
+	sfs_buf_discard(sfs, diskblock);
+	/* nor replaying whatever was logged for it */
+	sfs_jrevoke(sfs, diskblock);
+	/* We're in a handle, so the running transaction won't change */
+	which = sfs_jrunningseq(sfs) % 2;
+
+	lock_acquire(sfs->sfs_freemaplock);
 	bitmap_unmark(sfs->sfs_freemap, diskblock);
-	sfs->sfs_freemapdirty = true;
+	if (sfs->sfs_journal != NULL) {
+		/* Not to be reused until the free is committed */
+		bitmap_mark(sfs->sfs_freedmap[which], diskblock);
+		sfs->sfs_nfreed[which]++;
+	}
+	else {
+		sfs->sfs_regionfree[diskblock / SFS_REGIONBLOCKS]++;
+	}
+	sfs_freemap_touch(sfs, diskblock);
+	if (bitmap_isset(sfs->sfs_zeromap, diskblock)) {
+		bitmap_unmark(sfs->sfs_zeromap, diskblock);
+		KASSERT(sfs->sfs_nzero > 0);
+		sfs->sfs_nzero--;
+	}
+	lock_release(sfs->sfs_freemaplock);
+}
+
+/*
+ * Transaction SEQ has committed: the blocks it freed may now be
+ * reused. Called from the journal.
+ */
+void
+sfs_bcommitted(struct sfs_fs *sfs, uint32_t seq)
+{
+	struct bitmap *map = sfs->sfs_freedmap[seq % 2];
+	unsigned *countp = &sfs->sfs_nfreed[seq % 2];
+	daddr_t block;
+
+	lock_acquire(sfs->sfs_freemaplock);
+	for (block=0; *countp > 0; block++) {
+		KASSERT(block < sfs->sfs_super.sp_nblocks);
+		if (bitmap_isset(map, block)) {
+			bitmap_unmark(map, block);
+			(*countp)--;
+			sfs->sfs_regionfree[block / SFS_REGIONBLOCKS]++;
+		}
+	}
+	lock_release(sfs->sfs_freemaplock);
 }
 
 /*
@@ -92,10 +446,15 @@ sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 int
 sfs_bused(struct sfs_fs *sfs, daddr_t diskblock)
 {
+	int ret;
+
 	if (diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: sfs_bused called on out of range block %u\n",
 		      diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	ret = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+	return ret;
 }
 
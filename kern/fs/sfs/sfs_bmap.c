@@ -35,10 +35,26 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/*
+ * Choose where to allocate a new block for a file: right after PREV,
+ * the disk block holding the previous part of the file, if there is
+ * one, or else right after the inode.
+ */
+static
+daddr_t
+sfs_bmap_goal(struct sfs_vnode *sv, daddr_t prev)
+{
+	if (prev != 0) {
+		return prev + 1;
+	}
+	return sv->sv_ino + 1;
+}
+
 /*
  * Look up the disk block number (from 0 up to the number of blocks on
  * the disk) given a file and the logical block number within that
@@ -49,25 +65,33 @@ int
 sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 	 daddr_t *diskblock)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *idbuf;
+	uint32_t *iddata;
 	daddr_t block;
 	daddr_t idblock;
+	daddr_t goal;
 	uint32_t idnum, idoff;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	COMPILE_ASSERT(SFS_DBPERIDB * sizeof(uint32_t) == SFS_BLOCKSIZE);
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
-	/* Since we're using a static buffer, we'd better be locked. */
-	KASSERT(vfs_biglock_do_i_hold());
+	/*
+	 * An inline file has no blocks. Callers that want to allocate
+	 * one must move its data out first (sfs_inline_promote).
+	 */
+	if (sv->sv_i.sfi_flags & SFS_IF_INLINE) {
+		KASSERT(!doalloc);
+		*diskblock = 0;
+		return 0;
+	}
+
+	/* Files created since extents were added use those */
+	if (sv->sv_i.sfi_flags & SFS_IF_EXTENTS) {
+		return sfs_ext_bmap(sv, fileblock, doalloc, diskblock);
+	}
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -82,7 +106,9 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		 * Do we need to allocate?
 		 */
 		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
+			goal = sfs_bmap_goal(sv, fileblock > 0 ?
+				sv->sv_i.sfi_direct[fileblock-1] : 0);
+			result = sfs_balloc(sfs, goal, &block);
 			if (result) {
 				return result;
 			}
@@ -142,7 +168,8 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		 * the indirect block. Thus, we need to allocate an
 		 * indirect block.
 		 */
-		result = sfs_balloc(sfs, &idblock);
+		goal = sfs_bmap_goal(sv, sv->sv_i.sfi_direct[SFS_NDIRECT-1]);
+		result = sfs_balloc(sfs, goal, &idblock);
 		if (result) {
 			return result;
 		}
@@ -153,38 +180,38 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		/* Mark the inode dirty */
 		sv->sv_dirty = true;
 
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
+		/* It reads as zeros; sfs_balloc has seen to that */
 	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_readblock(sfs, idblock, idbuf);
-		if (result) {
-			return result;
-		}
+
+	/*
+	 * Load the indirect block.
+	 */
+	result = sfs_buf_read(sfs, idblock, &idbuf);
+	if (result) {
+		return result;
 	}
+	iddata = sfs_buf_map(idbuf);
 
 	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
+	block = iddata[idoff];
 
 	/* If there's no block there, allocate one */
 	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
+		/* The first one goes after the indirect block itself */
+		goal = sfs_bmap_goal(sv, idoff > 0 ? iddata[idoff-1] : idblock);
+		result = sfs_balloc(sfs, goal, &block);
 		if (result) {
+			sfs_buf_release(idbuf);
 			return result;
 		}
 
 		/* Remember the block we allocated */
-		idbuf[idoff] = block;
+		iddata[idoff] = block;
 
-		/* The indirect block is now dirty; write it back */
-		result = sfs_writeblock(sfs, idblock, idbuf);
-		if (result) {
-			return result;
-		}
+		/* The indirect block is now dirty */
+		sfs_buf_markmeta(idbuf);
 	}
+	sfs_buf_release(idbuf);
 
 	/* Hand back the result and return. */
 	if (block != 0 && !sfs_bused(sfs, block)) {
@@ -196,21 +223,67 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Move the contents of an inline file (see kern/sfs.h) out of the
+ * inode into a data block, and from then on map it with an extent
+ * tree (sfs_extent.c). Called when the file is about to grow past
+ * SFS_INLINESIZE. The caller must hold the vnode's lock.
  */
 int
-sfs_itrunc(struct sfs_vnode *sv, off_t len)
+sfs_inline_promote(struct sfs_vnode *sv)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *buf;
+	char *data;
+	daddr_t block;
+	uint32_t size;
+	int result;
+
+	if ((sv->sv_i.sfi_flags & SFS_IF_INLINE) == 0) {
+		return 0;
+	}
+
+	size = sv->sv_i.sfi_size;
+	KASSERT(size <= SFS_INLINESIZE);
+
+	block = 0;
+	if (size > 0) {
+		result = sfs_balloc(sfs, sfs_bmap_goal(sv, 0), &block);
+		if (result) {
+			return result;
+		}
+		result = sfs_buf_get(sfs, block, &buf);
+		if (result) {
+			sfs_bfree(sfs, block);
+			return result;
+		}
+		data = sfs_buf_map(buf);
+		memcpy(data, sv->sv_i.sfi_u.sfu_inline, size);
+		bzero(data + size, SFS_BLOCKSIZE - size);
+		if (sv->sv_i.sfi_type == SFS_TYPE_DIR) {
+			sfs_buf_markmeta(buf);
+		}
+		else {
+			sfs_buf_markdirty(buf);
+		}
+		sfs_buf_release(buf);
+	}
+
+	/* This replaces the inline data with the extent root */
+	sfs_ext_create(sv, block);
+	return 0;
+}
 
+/*
+ * Called for ftruncate() and from sfs_reclaim. The caller must hold
+ * the vnode's lock, except in sfs_reclaim, where nobody else can
+ * reach the vnode anyway.
+ */
+int
+sfs_itrunc(struct sfs_vnode *sv, off_t len)
+{
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *idbuf;
+	uint32_t *iddata;
 
 	/* Length in blocks (divide rounding up) */
 	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
@@ -221,9 +294,37 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 	int result;
 	int hasnonzero, iddirty;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	/* As in sfs_io: BLOCKLEN and sfi_size can't hold more */
+	if (len > SFS_MAXFILESIZE) {
+		return EFBIG;
+	}
+
+	if (sv->sv_i.sfi_flags & SFS_IF_INLINE) {
+		if (len > (off_t)SFS_INLINESIZE) {
+			result = sfs_inline_promote(sv);
+			if (result) {
+				return result;
+			}
+		}
+		else {
+			/* Bytes past EOF are kept zero */
+			if (len < sv->sv_i.sfi_size) {
+				bzero(sv->sv_i.sfi_u.sfu_inline + len,
+				      sv->sv_i.sfi_size - len);
+			}
+			sv->sv_i.sfi_size = len;
+			sv->sv_dirty = true;
+			return 0;
+		}
+	}
 
-	vfs_biglock_acquire();
+	if (sv->sv_i.sfi_flags & SFS_IF_EXTENTS) {
+		result = sfs_ext_trunc(sv, blocklen);
+		if (result) {
+			return result;
+		}
+		goto setsize;
+	}
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -251,50 +352,55 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 		/* We're past the proposed EOF; may need to free stuff */
 
 		/* Read the indirect block */
-		result = sfs_readblock(sfs, idblock, idbuf);
+		result = sfs_buf_read(sfs, idblock, &idbuf);
 		if (result) {
-			vfs_biglock_release();
 			return result;
 		}
+		iddata = sfs_buf_map(idbuf);
 
 		hasnonzero = 0;
 		iddirty = 0;
 		for (j=0; j<SFS_DBPERIDB; j++) {
 			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
+			if (blocklen < baseblock+j && iddata[j] != 0) {
+				sfs_bfree(sfs, iddata[j]);
+				iddata[j] = 0;
 				iddirty = 1;
 			}
 			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
+			if (iddata[j]!=0) {
 				hasnonzero=1;
 			}
 		}
 
+		if (iddirty) {
+			sfs_buf_markmeta(idbuf);
+		}
+		sfs_buf_release(idbuf);
+
 		if (!hasnonzero) {
 			/* The whole indirect block is empty now; free it */
 			sfs_bfree(sfs, idblock);
 			sv->sv_i.sfi_indirect = 0;
 			sv->sv_dirty = true;
 		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_writeblock(sfs, idblock, idbuf);
-			if (result) {
-				vfs_biglock_release();
-				return result;
-			}
-		}
 	}
 
+ setsize:
 	/* Set the file size */
 	sv->sv_i.sfi_size = len;
 
+	/* An empty file has no blocks left; keep its data inline again */
+	if (len == 0) {
+		KASSERT(sv->sv_i.sfi_indirect == 0);
+		sv->sv_i.sfi_flags = SFS_IF_INLINE;
+		bzero(sv->sv_i.sfi_u.sfu_inline,
+		      sizeof(sv->sv_i.sfi_u.sfu_inline));
+	}
+
 	/* Mark the inode dirty */
 	sv->sv_dirty = true;
 
-	vfs_biglock_release();
 	return 0;
 }
 
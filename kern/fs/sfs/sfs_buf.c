@@ -0,0 +1,803 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * SFS filesystem
+ *
+ * Block buffer cache.
+ *
+ * All inode, indirect block, directory, and file data I/O goes
+ * through here. Buffers are hashed by (device, block number) and kept
+ * on an LRU list while not in use; the least recently used buffer is
+ * recycled when we run out, preferring ones that are clean. Modified
+ * buffers are marked dirty and written back by the syncer thread
+ * (sfs_fsops.c) once they have been dirty for a while or too many are
+ * dirty, when the volume is synced, or, failing those, when evicted.
+ *
+ * The superblock and the free block bitmap are not cached here;
+ * struct sfs_fs keeps its own in-memory copies of those.
+ *
+ * A buffer handed out by sfs_buf_get or sfs_buf_read is "busy" and
+ * belongs to the caller until sfs_buf_release; anyone else asking
+ * for the same block waits. A thread must therefore not try to get
+ * a block it already holds.
+ *
+ * Blocks read by the read-ahead thread (sfs_buf_prefetch) are marked
+ * so the reader can tell whether read-ahead got there first, which
+ * is how sfs_readahead.c sizes its window.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <synch.h>
+#include <vfs.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/* Maximum number of buffers in the cache */
+#define SFS_NBUFS       64
+
+/* Number of hash buckets (prime) */
+#define SFS_BUFHASH     61
+
+/*
+ * Dirty buffer thresholds for write-back: above SFS_DIRTYHIGH the
+ * syncer writes back the oldest dirty buffers until no more than
+ * SFS_DIRTYLOW are left, however young.
+ */
+#define SFS_DIRTYHIGH   (SFS_NBUFS / 2)
+#define SFS_DIRTYLOW    (SFS_NBUFS / 4)
+
+/* How far down the LRU list to look for a clean buffer to recycle */
+#define SFS_CLEANSCAN   (SFS_NBUFS / 4)
+
+struct sfs_buf {
+	struct sfs_fs *b_fs;		/* volume the block belongs to */
+	daddr_t b_block;		/* block number on that volume */
+	void *b_data;			/* SFS_BLOCKSIZE bytes */
+	bool b_valid;			/* b_data holds the block contents */
+	bool b_dirty;			/* b_data is newer than the disk */
+	bool b_busy;			/* handed out to someone */
+	bool b_prefetched;		/* brought in by read-ahead, not used */
+	struct timespec b_dirtytime;	/* when b_dirty was last set */
+	struct sfs_buf *b_hashnext;	/* hash chain */
+	struct sfs_buf *b_lruprev;	/* LRU list (only when not busy) */
+	struct sfs_buf *b_lrunext;
+};
+
+static struct lock *sfs_buflock;	/* protects everything below */
+static struct cv *sfs_bufcv;		/* signaled when a buffer is freed up */
+static struct sfs_buf *sfs_bufhash[SFS_BUFHASH];
+static struct sfs_buf *sfs_lruhead;	/* least recently used */
+static struct sfs_buf *sfs_lrutail;	/* most recently used */
+static unsigned sfs_nbufs;		/* buffers allocated so far */
+static unsigned sfs_ndirty;		/* buffers with b_dirty set */
+
+/*
+ * Hash function.
+ */
+static
+unsigned
+sfs_buf_hashfunc(struct sfs_fs *sfs, daddr_t block)
+{
+	uintptr_t dev = (uintptr_t)sfs->sfs_device;
+
+	return (unsigned)((dev >> 4) ^ block) % SFS_BUFHASH;
+}
+
+////////////////////////////////////////////////////////////
+// LRU list and hash table
+
+static
+void
+sfs_lru_remove(struct sfs_buf *b)
+{
+	if (b->b_lruprev != NULL) {
+		b->b_lruprev->b_lrunext = b->b_lrunext;
+	}
+	else {
+		KASSERT(sfs_lruhead == b);
+		sfs_lruhead = b->b_lrunext;
+	}
+	if (b->b_lrunext != NULL) {
+		b->b_lrunext->b_lruprev = b->b_lruprev;
+	}
+	else {
+		KASSERT(sfs_lrutail == b);
+		sfs_lrutail = b->b_lruprev;
+	}
+	b->b_lruprev = b->b_lrunext = NULL;
+}
+
+static
+void
+sfs_lru_append(struct sfs_buf *b)
+{
+	b->b_lrunext = NULL;
+	b->b_lruprev = sfs_lrutail;
+	if (sfs_lrutail != NULL) {
+		sfs_lrutail->b_lrunext = b;
+	}
+	else {
+		sfs_lruhead = b;
+	}
+	sfs_lrutail = b;
+}
+
+static
+void
+sfs_lru_prepend(struct sfs_buf *b)
+{
+	b->b_lruprev = NULL;
+	b->b_lrunext = sfs_lruhead;
+	if (sfs_lruhead != NULL) {
+		sfs_lruhead->b_lruprev = b;
+	}
+	else {
+		sfs_lrutail = b;
+	}
+	sfs_lruhead = b;
+}
+
+static
+void
+sfs_hash_remove(struct sfs_buf *b)
+{
+	struct sfs_buf **bp;
+
+	bp = &sfs_bufhash[sfs_buf_hashfunc(b->b_fs, b->b_block)];
+	while (*bp != b) {
+		KASSERT(*bp != NULL);
+		bp = &(*bp)->b_hashnext;
+	}
+	*bp = b->b_hashnext;
+	b->b_hashnext = NULL;
+}
+
+static
+void
+sfs_hash_insert(struct sfs_buf *b)
+{
+	unsigned h = sfs_buf_hashfunc(b->b_fs, b->b_block);
+
+	b->b_hashnext = sfs_bufhash[h];
+	sfs_bufhash[h] = b;
+}
+
+static
+struct sfs_buf *
+sfs_hash_find(struct sfs_fs *sfs, daddr_t block)
+{
+	struct sfs_buf *b;
+
+	b = sfs_bufhash[sfs_buf_hashfunc(sfs, block)];
+	for (; b != NULL; b = b->b_hashnext) {
+		if (b->b_fs == sfs && b->b_block == block) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////
+// Buffer acquisition
+
+/*
+ * Write a dirty buffer back to disk. The buffer must be busy (so
+ * nobody else touches it) and sfs_buflock must not be held.
+ */
+static
+int
+sfs_buf_writeout(struct sfs_buf *b)
+{
+	bool wasnew;
+	int result;
+
+	KASSERT(b->b_busy);
+	KASSERT(b->b_valid);
+	KASSERT(b->b_dirty);
+	KASSERT(!lock_do_i_hold(sfs_buflock));
+
+	/*
+	 * If the block is freed and allocated again while this is
+	 * being written, it's marked new after we started, and the
+	 * mark must stay: what we're writing is the old contents.
+	 */
+	wasnew = sfs_bisnew(b->b_fs, b->b_block);
+	result = sfs_writeblock(b->b_fs, b->b_block, b->b_data);
+	if (result == 0) {
+		if (wasnew) {
+			sfs_bwritten(b->b_fs, b->b_block);
+		}
+		lock_acquire(sfs_buflock);
+		b->b_dirty = false;
+		KASSERT(sfs_ndirty > 0);
+		sfs_ndirty--;
+		lock_release(sfs_buflock);
+	}
+	return result;
+}
+
+/*
+ * Fill in the contents of a busy buffer: from the journal, if it has
+ * a copy that hasn't been written home yet; from the disk; or, if
+ * the block is newly allocated and hasn't been written yet, with
+ * zeros.
+ */
+static
+int
+sfs_buf_fill(struct sfs_buf *b)
+{
+	int result;
+
+	KASSERT(b->b_busy);
+	KASSERT(!b->b_valid);
+
+	if (sfs_jread(b->b_fs, b->b_block, b->b_data)) {
+		/* nothing more to do */
+	}
+	else if (sfs_bisnew(b->b_fs, b->b_block)) {
+		bzero(b->b_data, SFS_BLOCKSIZE);
+	}
+	else {
+		result = sfs_readblock(b->b_fs, b->b_block, b->b_data);
+		if (result) {
+			return result;
+		}
+	}
+	b->b_valid = true;
+	return 0;
+}
+
+/*
+ * Find the idle buffer to recycle: the least recently used clean
+ * one near the front of the LRU list, or else the one at the front.
+ */
+static
+struct sfs_buf *
+sfs_buf_victim(void)
+{
+	struct sfs_buf *b;
+	unsigned i;
+
+	for (b = sfs_lruhead, i = 0;
+	     b != NULL && i < SFS_CLEANSCAN;
+	     b = b->b_lrunext, i++) {
+		if (!b->b_dirty) {
+			return b;
+		}
+	}
+	return sfs_lruhead;
+}
+
+/*
+ * Find a buffer to hold a block we don't have. Either allocate a new
+ * one, or recycle the least recently used idle buffer, writing it
+ * back first if it's dirty. Returns with the buffer busy and not in
+ * the hash table, or NULL if the caller should look again (because
+ * sfs_buflock was dropped in here).
+ */
+static
+struct sfs_buf *
+sfs_buf_recycle(int *err)
+{
+	struct sfs_buf *b;
+
+	KASSERT(lock_do_i_hold(sfs_buflock));
+	*err = 0;
+
+	if (sfs_nbufs < SFS_NBUFS) {
+		b = kmalloc(sizeof(struct sfs_buf));
+		if (b != NULL) {
+			b->b_data = kmalloc(SFS_BLOCKSIZE);
+			if (b->b_data == NULL) {
+				kfree(b);
+				b = NULL;
+			}
+		}
+		if (b != NULL) {
+			sfs_nbufs++;
+			b->b_fs = NULL;
+			b->b_block = 0;
+			b->b_valid = false;
+			b->b_dirty = false;
+			b->b_busy = true;
+			b->b_prefetched = false;
+			b->b_hashnext = NULL;
+			b->b_lruprev = b->b_lrunext = NULL;
+			return b;
+		}
+		/* Out of memory; fall back to recycling */
+	}
+
+	b = sfs_buf_victim();
+	if (b == NULL) {
+		if (sfs_nbufs == 0) {
+			*err = ENOMEM;
+			return NULL;
+		}
+		/* Everything is in use; wait for something to come back */
+		cv_wait(sfs_bufcv, sfs_buflock);
+		return NULL;
+	}
+
+	sfs_lru_remove(b);
+	b->b_busy = true;
+
+	if (b->b_dirty) {
+		/* Write it back without holding up everyone else. */
+		lock_release(sfs_buflock);
+		*err = sfs_buf_writeout(b);
+		lock_acquire(sfs_buflock);
+		if (*err) {
+			/* Put it back; the caller will fail. */
+			b->b_busy = false;
+			sfs_lru_append(b);
+			cv_broadcast(sfs_bufcv, sfs_buflock);
+			return NULL;
+		}
+		/*
+		 * Somebody may have been waiting for this block while
+		 * we wrote it out; let them have it. Otherwise, being
+		 * clean and at the front of the LRU list, it's what
+		 * we'll get when the caller tries again.
+		 */
+		b->b_busy = false;
+		sfs_lru_prepend(b);
+		cv_broadcast(sfs_bufcv, sfs_buflock);
+		return NULL;
+	}
+
+	if (b->b_fs != NULL) {
+		sfs_hash_remove(b);
+	}
+	if (b->b_prefetched) {
+		/* Read ahead too far, or too early */
+		sfs_readahead_wasted();
+		b->b_prefetched = false;
+	}
+	b->b_fs = NULL;
+	b->b_valid = false;
+	return b;
+}
+
+/*
+ * Get the buffer for block BLOCK of SFS, marked busy. If READIT is
+ * set, make sure it contains the on-disk contents; otherwise the
+ * caller intends to overwrite the whole block and the contents may
+ * be garbage.
+ */
+static
+int
+sfs_buf_lookup(struct sfs_fs *sfs, daddr_t block, bool readit,
+	       struct sfs_buf **ret)
+{
+	struct sfs_buf *b;
+	int result;
+
+	lock_acquire(sfs_buflock);
+	while (1) {
+		b = sfs_hash_find(sfs, block);
+		if (b != NULL) {
+			if (b->b_busy) {
+				cv_wait(sfs_bufcv, sfs_buflock);
+				continue;
+			}
+			sfs_lru_remove(b);
+			b->b_busy = true;
+			break;
+		}
+
+		b = sfs_buf_recycle(&result);
+		if (result) {
+			lock_release(sfs_buflock);
+			return result;
+		}
+		if (b != NULL) {
+			b->b_fs = sfs;
+			b->b_block = block;
+			sfs_hash_insert(b);
+			break;
+		}
+	}
+	lock_release(sfs_buflock);
+
+	if (readit && !b->b_valid) {
+		result = sfs_buf_fill(b);
+		if (result) {
+			sfs_buf_release(b);
+			return result;
+		}
+	}
+
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Get a buffer for a block, reading it in if necessary.
+ */
+int
+sfs_buf_read(struct sfs_fs *sfs, daddr_t block, struct sfs_buf **ret)
+{
+	return sfs_buf_lookup(sfs, block, true, ret);
+}
+
+/*
+ * Get a buffer for a block that the caller is going to overwrite
+ * completely, without bothering to read it. The caller should fill
+ * in the whole block and call sfs_buf_markdirty. If it doesn't, and
+ * the block wasn't already cached, the buffer is thrown away on
+ * release.
+ */
+int
+sfs_buf_get(struct sfs_fs *sfs, daddr_t block, struct sfs_buf **ret)
+{
+	return sfs_buf_lookup(sfs, block, false, ret);
+}
+
+/*
+ * Read a block into the cache on behalf of read-ahead, if it isn't
+ * there already, and leave it there unused.
+ */
+int
+sfs_buf_prefetch(struct sfs_fs *sfs, daddr_t block)
+{
+	struct sfs_buf *b;
+	int result;
+
+	result = sfs_buf_lookup(sfs, block, false, &b);
+	if (result) {
+		return result;
+	}
+	if (!b->b_valid) {
+		result = sfs_buf_fill(b);
+		if (result) {
+			sfs_buf_release(b);
+			return result;
+		}
+	}
+	/*
+	 * Mark it even if it was already cached: either way the
+	 * reader will find it without waiting for the disk.
+	 */
+	b->b_prefetched = true;
+	sfs_buf_release(b);
+	return 0;
+}
+
+/*
+ * Check whether a busy buffer was prefetched and hasn't been looked
+ * at since, and clear the mark.
+ */
+bool
+sfs_buf_wasprefetched(struct sfs_buf *b)
+{
+	bool ret;
+
+	KASSERT(b->b_busy);
+	ret = b->b_prefetched;
+	b->b_prefetched = false;
+	return ret;
+}
+
+/*
+ * Return the data area of a busy buffer.
+ */
+void *
+sfs_buf_map(struct sfs_buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_data;
+}
+
+/*
+ * Check if a busy buffer holds the block's contents (always true for
+ * sfs_buf_read).
+ */
+bool
+sfs_buf_isvalid(struct sfs_buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_valid;
+}
+
+/*
+ * Note that the contents of a busy buffer have been changed.
+ */
+void
+sfs_buf_markdirty(struct sfs_buf *b)
+{
+	KASSERT(b->b_busy);
+	b->b_valid = true;
+	if (!b->b_dirty) {
+		lock_acquire(sfs_buflock);
+		b->b_dirty = true;
+		gettime(&b->b_dirtytime);
+		sfs_ndirty++;
+		lock_release(sfs_buflock);
+	}
+}
+
+/*
+ * Note that the contents of a busy buffer holding metadata (an
+ * inode, directory, or indirect block) have been changed. On a
+ * journaled volume the change goes into the journal, which writes
+ * it home after it's committed, and the buffer stays clean; it must
+ * be called within a handle (sfs_jbegin). Otherwise it's the same as
+ * sfs_buf_markdirty.
+ */
+void
+sfs_buf_markmeta(struct sfs_buf *b)
+{
+	KASSERT(b->b_busy);
+	if (b->b_fs->sfs_journal == NULL) {
+		sfs_buf_markdirty(b);
+		return;
+	}
+	b->b_valid = true;
+	sfs_jlog(b->b_fs, b->b_block, b->b_data);
+	if (b->b_dirty) {
+		/* Written as something else before; the log has it now */
+		lock_acquire(sfs_buflock);
+		b->b_dirty = false;
+		KASSERT(sfs_ndirty > 0);
+		sfs_ndirty--;
+		lock_release(sfs_buflock);
+	}
+}
+
+/*
+ * Give a buffer back to the cache.
+ */
+void
+sfs_buf_release(struct sfs_buf *b)
+{
+	lock_acquire(sfs_buflock);
+	KASSERT(b->b_busy);
+	b->b_busy = false;
+	if (!b->b_valid) {
+		/* Never filled in; don't let anyone else find garbage. */
+		sfs_hash_remove(b);
+		b->b_fs = NULL;
+	}
+	sfs_lru_append(b);
+	cv_broadcast(sfs_bufcv, sfs_buflock);
+	lock_release(sfs_buflock);
+}
+
+////////////////////////////////////////////////////////////
+// Whole-volume operations
+
+/*
+ * Called when a block is freed: whatever is cached for it is now
+ * meaningless, so throw it away rather than writing it back later.
+ * The caller must not be holding the buffer.
+ */
+void
+sfs_buf_discard(struct sfs_fs *sfs, daddr_t block)
+{
+	struct sfs_buf *b;
+
+	lock_acquire(sfs_buflock);
+	while ((b = sfs_hash_find(sfs, block)) != NULL && b->b_busy) {
+		cv_wait(sfs_bufcv, sfs_buflock);
+	}
+	if (b != NULL) {
+		sfs_hash_remove(b);
+		b->b_fs = NULL;
+		b->b_valid = false;
+		if (b->b_dirty) {
+			b->b_dirty = false;
+			KASSERT(sfs_ndirty > 0);
+			sfs_ndirty--;
+		}
+		b->b_prefetched = false;
+		/* Reuse it first */
+		sfs_lru_remove(b);
+		sfs_lru_prepend(b);
+	}
+	lock_release(sfs_buflock);
+}
+
+/*
+ * Write back every dirty buffer belonging to SFS.
+ */
+int
+sfs_buf_sync(struct sfs_fs *sfs)
+{
+	struct sfs_buf *b;
+	unsigned i;
+	int result;
+
+	lock_acquire(sfs_buflock);
+	i = 0;
+	while (i < SFS_BUFHASH) {
+		for (b = sfs_bufhash[i]; b != NULL; b = b->b_hashnext) {
+			if (b->b_fs == sfs && b->b_dirty) {
+				break;
+			}
+		}
+		if (b == NULL) {
+			i++;
+			continue;
+		}
+		if (b->b_busy) {
+			/* Someone's using it; wait and rescan this chain */
+			cv_wait(sfs_bufcv, sfs_buflock);
+			continue;
+		}
+
+		sfs_lru_remove(b);
+		b->b_busy = true;
+		lock_release(sfs_buflock);
+
+		result = sfs_buf_writeout(b);
+
+		lock_acquire(sfs_buflock);
+		b->b_busy = false;
+		sfs_lru_append(b);
+		cv_broadcast(sfs_bufcv, sfs_buflock);
+		if (result) {
+			lock_release(sfs_buflock);
+			return result;
+		}
+	}
+	lock_release(sfs_buflock);
+	return 0;
+}
+
+/*
+ * Find the idle dirty buffer of SFS that has been dirty longest.
+ */
+static
+struct sfs_buf *
+sfs_buf_oldestdirty(struct sfs_fs *sfs)
+{
+	struct sfs_buf *b, *oldest;
+	struct timespec diff;
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(sfs_buflock));
+
+	oldest = NULL;
+	for (i=0; i<SFS_BUFHASH; i++) {
+		for (b = sfs_bufhash[i]; b != NULL; b = b->b_hashnext) {
+			if (b->b_fs != sfs || !b->b_dirty || b->b_busy) {
+				continue;
+			}
+			if (oldest != NULL) {
+				timespec_sub(&b->b_dirtytime,
+					     &oldest->b_dirtytime, &diff);
+				if (diff.tv_sec >= 0) {
+					continue;
+				}
+			}
+			oldest = b;
+		}
+	}
+	return oldest;
+}
+
+/*
+ * Write back the dirty buffers of SFS that have been dirty for AGE
+ * seconds or more; and if more than SFS_DIRTYHIGH buffers are dirty,
+ * write back the oldest until no more than SFS_DIRTYLOW are. Buffers
+ * in use are left alone. Called by the syncer.
+ */
+int
+sfs_buf_writeback(struct sfs_fs *sfs, unsigned age)
+{
+	struct sfs_buf *b;
+	struct timespec now, diff;
+	bool pressure;
+	int result;
+
+	gettime(&now);
+
+	lock_acquire(sfs_buflock);
+	pressure = sfs_ndirty > SFS_DIRTYHIGH;
+	while ((b = sfs_buf_oldestdirty(sfs)) != NULL) {
+		pressure = pressure && sfs_ndirty > SFS_DIRTYLOW;
+		timespec_sub(&now, &b->b_dirtytime, &diff);
+		if (!pressure && diff.tv_sec < (time_t)age) {
+			/* Everything else is younger still */
+			break;
+		}
+
+		sfs_lru_remove(b);
+		b->b_busy = true;
+		lock_release(sfs_buflock);
+
+		result = sfs_buf_writeout(b);
+
+		lock_acquire(sfs_buflock);
+		b->b_busy = false;
+		sfs_lru_append(b);
+		cv_broadcast(sfs_bufcv, sfs_buflock);
+		if (result) {
+			lock_release(sfs_buflock);
+			return result;
+		}
+	}
+	lock_release(sfs_buflock);
+	return 0;
+}
+
+/*
+ * Drop every buffer belonging to SFS. Called at unmount, after the
+ * volume has been synced.
+ */
+void
+sfs_buf_unmount(struct sfs_fs *sfs)
+{
+	struct sfs_buf *b, *next;
+	unsigned i;
+
+	lock_acquire(sfs_buflock);
+	for (i=0; i<SFS_BUFHASH; i++) {
+		for (b = sfs_bufhash[i]; b != NULL; b = next) {
+			next = b->b_hashnext;
+			if (b->b_fs != sfs) {
+				continue;
+			}
+			KASSERT(!b->b_busy);
+			KASSERT(!b->b_dirty);
+			sfs_hash_remove(b);
+			b->b_fs = NULL;
+			b->b_valid = false;
+			b->b_prefetched = false;
+		}
+	}
+	lock_release(sfs_buflock);
+}
+
+/*
+ * Set up the buffer cache. Called once at boot.
+ */
+void
+sfs_bootstrap(void)
+{
+	sfs_buflock = lock_create("sfs buffer cache");
+	if (sfs_buflock == NULL) {
+		panic("sfs: Could not create buffer cache lock\n");
+	}
+	sfs_bufcv = cv_create("sfs buffer cache");
+	if (sfs_bufcv == NULL) {
+		panic("sfs: Could not create buffer cache cv\n");
+	}
+	sfs_lruhead = sfs_lrutail = NULL;
+	sfs_nbufs = 0;
+	sfs_ndirty = 0;
+
+	sfs_readahead_bootstrap();
+	sfs_syncer_bootstrap();
+}
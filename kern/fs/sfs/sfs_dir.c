@@ -31,6 +31,9 @@
  * SFS filesystem
  *
  * Directory I/O
+ *
+ * Everything in here expects the caller to hold the directory's
+ * sv_lock.
  */
 #include <types.h>
 #include <kern/errno.h>
@@ -130,18 +133,384 @@ sfs_dir_nentries(struct sfs_vnode *sv)
 	return size / sizeof(struct sfs_dir);
 }
 
+////////////////////////////////////////////////////////////
+// Name index
+
+/*
+ * In-memory index of a directory, so that looking up a name doesn't
+ * mean reading every entry.
+ *
+ * Each used slot has a struct sfs_dirent_ix, found through a hash
+ * chain on its name and through di_slots by slot number (so unlink,
+ * which only knows the slot, is also cheap). Free slots are kept on
+ * a stack so creates can reuse one without scanning. The index is
+ * built the first time a directory is searched and is then updated
+ * by sfs_dir_link and sfs_dir_unlink. If memory runs out while
+ * updating it, it is thrown away and rebuilt on the next search.
+ *
+ * Protected by the directory's sv_lock.
+ */
+
+#define SFS_DIRIX_INITHASH	16
+#define SFS_DIRIX_LOAD		2
+#define SFS_DIRPERBLOCK		(SFS_BLOCKSIZE / sizeof(struct sfs_dir))
+
+struct sfs_dirent_ix {
+	char de_name[SFS_NAMELEN];	/* name (null terminated) */
+	uint32_t de_ino;		/* inode number */
+	int de_slot;			/* slot in the directory */
+	struct sfs_dirent_ix *de_next;	/* next in hash chain */
+};
+
+struct sfs_dirindex {
+	struct sfs_dirent_ix **di_hash;	/* hash chains */
+	unsigned di_hashsize;		/* number of chains (power of 2) */
+	unsigned di_nnames;		/* number of entries */
+	struct sfs_dirent_ix **di_slots; /* entry for each slot, or NULL */
+	unsigned di_nslots;		/* slots covered by di_slots */
+	unsigned di_maxslots;		/* allocated size of di_slots */
+	int *di_free;			/* stack of free slots */
+	unsigned di_nfree;		/* number of free slots on stack */
+	unsigned di_maxfree;		/* allocated size of di_free */
+};
+
+static
+unsigned
+sfs_dirix_hashname(const char *name, unsigned size)
+{
+	unsigned h = 0;
+
+	while (*name) {
+		h = h*33 + (unsigned char)*name++;
+	}
+	return h & (size - 1);
+}
+
+/*
+ * Grow a kmalloc'd array to hold at least WANT elements of size
+ * ELTSIZE, doubling to keep appends cheap. New space is zeroed.
+ */
+static
+int
+sfs_dirix_growarray(void **arr, unsigned *max, unsigned want,
+		    size_t eltsize)
+{
+	unsigned newmax;
+	void *newarr;
+
+	if (want <= *max) {
+		return 0;
+	}
+	newmax = *max ? *max : 16;
+	while (newmax < want) {
+		newmax *= 2;
+	}
+	newarr = kmalloc(newmax * eltsize);
+	if (newarr == NULL) {
+		return ENOMEM;
+	}
+	bzero(newarr, newmax * eltsize);
+	if (*arr != NULL) {
+		memcpy(newarr, *arr, *max * eltsize);
+		kfree(*arr);
+	}
+	*arr = newarr;
+	*max = newmax;
+	return 0;
+}
+
+/*
+ * Throw away a directory's index, if it has one. Also called from
+ * sfs_reclaim.
+ */
+void
+sfs_dir_dropindex(struct sfs_vnode *sv)
+{
+	struct sfs_dirindex *di = sv->sv_dirindex;
+	struct sfs_dirent_ix *de, *next;
+	unsigned i;
+
+	if (di == NULL) {
+		return;
+	}
+	for (i=0; i<di->di_hashsize; i++) {
+		for (de = di->di_hash[i]; de != NULL; de = next) {
+			next = de->de_next;
+			kfree(de);
+		}
+	}
+	kfree(di->di_hash);
+	if (di->di_slots != NULL) {
+		kfree(di->di_slots);
+	}
+	if (di->di_free != NULL) {
+		kfree(di->di_free);
+	}
+	kfree(di);
+	sv->sv_dirindex = NULL;
+}
+
+/*
+ * Double the number of hash chains. Failing is harmless; the chains
+ * just get longer.
+ */
+static
+void
+sfs_dirix_rehash(struct sfs_dirindex *di)
+{
+	struct sfs_dirent_ix **newhash, *de, *next;
+	unsigned newsize, i, ix;
+
+	newsize = di->di_hashsize * 2;
+	newhash = kmalloc(newsize * sizeof(struct sfs_dirent_ix *));
+	if (newhash == NULL) {
+		return;
+	}
+	for (i=0; i<newsize; i++) {
+		newhash[i] = NULL;
+	}
+	for (i=0; i<di->di_hashsize; i++) {
+		for (de = di->di_hash[i]; de != NULL; de = next) {
+			next = de->de_next;
+			ix = sfs_dirix_hashname(de->de_name, newsize);
+			de->de_next = newhash[ix];
+			newhash[ix] = de;
+		}
+	}
+	kfree(di->di_hash);
+	di->di_hash = newhash;
+	di->di_hashsize = newsize;
+}
+
+/*
+ * Make sure di_slots covers slot SLOT. Slots added in between (there
+ * shouldn't be any, as directories grow one entry at a time) start
+ * out as neither used nor free.
+ */
+static
+int
+sfs_dirix_coverslot(struct sfs_dirindex *di, int slot)
+{
+	int result;
+
+	result = sfs_dirix_growarray((void **)&di->di_slots,
+				     &di->di_maxslots, slot+1,
+				     sizeof(struct sfs_dirent_ix *));
+	if (result) {
+		return result;
+	}
+	if ((unsigned)slot >= di->di_nslots) {
+		di->di_nslots = slot+1;
+	}
+	return 0;
+}
+
+/*
+ * Record that SLOT holds NAME -> INO.
+ */
+static
+int
+sfs_dirix_add(struct sfs_dirindex *di, const char *name, uint32_t ino,
+	      int slot)
+{
+	struct sfs_dirent_ix *de;
+	unsigned ix;
+	int result;
+
+	result = sfs_dirix_coverslot(di, slot);
+	if (result) {
+		return result;
+	}
+	KASSERT(di->di_slots[slot] == NULL);
+
+	de = kmalloc(sizeof(*de));
+	if (de == NULL) {
+		return ENOMEM;
+	}
+	strcpy(de->de_name, name);
+	de->de_ino = ino;
+	de->de_slot = slot;
+
+	if (di->di_nnames >= di->di_hashsize * SFS_DIRIX_LOAD) {
+		sfs_dirix_rehash(di);
+	}
+	ix = sfs_dirix_hashname(name, di->di_hashsize);
+	de->de_next = di->di_hash[ix];
+	di->di_hash[ix] = de;
+	di->di_nnames++;
+	di->di_slots[slot] = de;
+	return 0;
+}
+
+/*
+ * Push a free slot.
+ */
+static
+int
+sfs_dirix_pushfree(struct sfs_dirindex *di, int slot)
+{
+	int result;
+
+	result = sfs_dirix_growarray((void **)&di->di_free, &di->di_maxfree,
+				     di->di_nfree+1, sizeof(int));
+	if (result) {
+		return result;
+	}
+	di->di_free[di->di_nfree++] = slot;
+	return 0;
+}
+
+/*
+ * Take SLOT off the free stack, if it's there. It's normally on top,
+ * because that's where sfs_dir_findname got it from.
+ */
+static
+void
+sfs_dirix_takefree(struct sfs_dirindex *di, int slot)
+{
+	unsigned i;
+
+	for (i=di->di_nfree; i-- > 0; ) {
+		if (di->di_free[i] == slot) {
+			di->di_free[i] = di->di_free[--di->di_nfree];
+			return;
+		}
+	}
+}
+
+static
+struct sfs_dirent_ix *
+sfs_dirix_find(struct sfs_dirindex *di, const char *name)
+{
+	struct sfs_dirent_ix *de;
+
+	de = di->di_hash[sfs_dirix_hashname(name, di->di_hashsize)];
+	while (de != NULL && strcmp(de->de_name, name)) {
+		de = de->de_next;
+	}
+	return de;
+}
+
+/*
+ * Build the index for a directory by reading it a block at a time.
+ */
+static
+int
+sfs_dir_buildindex(struct sfs_vnode *sv)
+{
+	struct sfs_dir tsd[SFS_DIRPERBLOCK];
+	struct sfs_dirindex *di;
+	struct iovec iov;
+	struct uio ku;
+	int nentries, i, j, n, result;
+
+	KASSERT(sv->sv_dirindex == NULL);
+
+	di = kmalloc(sizeof(*di));
+	if (di == NULL) {
+		return ENOMEM;
+	}
+	bzero(di, sizeof(*di));
+	di->di_hash = kmalloc(SFS_DIRIX_INITHASH *
+			      sizeof(struct sfs_dirent_ix *));
+	if (di->di_hash == NULL) {
+		kfree(di);
+		return ENOMEM;
+	}
+	di->di_hashsize = SFS_DIRIX_INITHASH;
+	for (i=0; i<SFS_DIRIX_INITHASH; i++) {
+		di->di_hash[i] = NULL;
+	}
+	sv->sv_dirindex = di;
+
+	nentries = sfs_dir_nentries(sv);
+	for (i=0; i<nentries; i+=n) {
+		n = nentries - i;
+		if (n > (int)SFS_DIRPERBLOCK) {
+			n = SFS_DIRPERBLOCK;
+		}
+		uio_kinit(&iov, &ku, tsd, n * sizeof(struct sfs_dir),
+			  i * sizeof(struct sfs_dir), UIO_READ);
+		result = sfs_io(sv, &ku);
+		if (result) {
+			sfs_dir_dropindex(sv);
+			return result;
+		}
+		if (ku.uio_resid > 0) {
+			panic("sfs: readdir: Short entry (inode %u)\n",
+			      sv->sv_ino);
+		}
+
+		for (j=0; j<n; j++) {
+			if (tsd[j].sfd_ino == SFS_NOINO) {
+				result = sfs_dirix_coverslot(di, i+j);
+				if (result == 0) {
+					result = sfs_dirix_pushfree(di, i+j);
+				}
+			}
+			else {
+				/* Ensure null termination, just in case */
+				tsd[j].sfd_name[sizeof(tsd[j].sfd_name)-1] = 0;
+
+				/* Each name may legally appear only once... */
+				KASSERT(sfs_dirix_find(di,
+					tsd[j].sfd_name) == NULL);
+
+				result = sfs_dirix_add(di, tsd[j].sfd_name,
+						       tsd[j].sfd_ino, i+j);
+			}
+			if (result) {
+				sfs_dir_dropindex(sv);
+				return result;
+			}
+		}
+	}
+
+	return 0;
+}
+
 /*
  * Search a directory for a particular filename in a directory, and
  * return its inode number, its slot, and/or the slot number of an
  * empty directory slot if one is found.
+ *
+ * This goes through the name index, building it if need be; if the
+ * index can't be built, fall back to reading every entry.
  */
 int
 sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 		uint32_t *ino, int *slot, int *emptyslot)
 {
+	struct sfs_dirindex *di;
+	struct sfs_dirent_ix *de;
 	struct sfs_dir tsd;
 	int found, nentries, i, result;
 
+	if (sv->sv_dirindex == NULL) {
+		result = sfs_dir_buildindex(sv);
+		if (result && result != ENOMEM) {
+			return result;
+		}
+	}
+
+	di = sv->sv_dirindex;
+	if (di != NULL) {
+		if (emptyslot != NULL && di->di_nfree > 0) {
+			*emptyslot = di->di_free[di->di_nfree - 1];
+		}
+		de = sfs_dirix_find(di, name);
+		if (de == NULL) {
+			return ENOENT;
+		}
+		if (slot != NULL) {
+			*slot = de->de_slot;
+		}
+		if (ino != NULL) {
+			*ino = de->de_ino;
+		}
+		return 0;
+	}
+
 	nentries = sfs_dir_nentries(sv);
 
 	/* For each slot... */
@@ -221,7 +590,19 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	}
 
 	/* Write the entry. */
-	return sfs_writedir(sv, emptyslot, &sd);
+	result = sfs_writedir(sv, emptyslot, &sd);
+	if (result) {
+		return result;
+	}
+
+	/* Update the index, or drop it if we can't. */
+	if (sv->sv_dirindex != NULL) {
+		sfs_dirix_takefree(sv->sv_dirindex, emptyslot);
+		if (sfs_dirix_add(sv->sv_dirindex, name, ino, emptyslot)) {
+			sfs_dir_dropindex(sv);
+		}
+	}
+	return 0;
 }
 
 /*
@@ -230,14 +611,41 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 int
 sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 {
+	struct sfs_dirindex *di;
+	struct sfs_dirent_ix *de, **pp;
 	struct sfs_dir sd;
+	int result;
 
 	/* Initialize a suitable directory entry... */
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = SFS_NOINO;
 
 	/* ... and write it */
-	return sfs_writedir(sv, slot, &sd);
+	result = sfs_writedir(sv, slot, &sd);
+	if (result) {
+		return result;
+	}
+
+	/* Take it out of the index and make the slot available. */
+	di = sv->sv_dirindex;
+	if (di != NULL) {
+		KASSERT((unsigned)slot < di->di_nslots);
+		de = di->di_slots[slot];
+		KASSERT(de != NULL);
+		pp = &di->di_hash[sfs_dirix_hashname(de->de_name,
+						     di->di_hashsize)];
+		while (*pp != de) {
+			pp = &(*pp)->de_next;
+		}
+		*pp = de->de_next;
+		di->di_slots[slot] = NULL;
+		di->di_nnames--;
+		kfree(de);
+		if (sfs_dirix_pushfree(di, slot)) {
+			sfs_dir_dropindex(sv);
+		}
+	}
+	return 0;
 }
 
 /*
@@ -0,0 +1,723 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * SFS filesystem
+ *
+ * Extent trees.
+ *
+ * Files that outgrow the inode (see sfs_inline_promote) map their
+ * blocks with a B-tree of extents instead of with direct and
+ * indirect block pointers; the on-disk format is described in
+ * kern/sfs.h. A file written sequentially gets its blocks next to
+ * each other (sfs_balloc is asked for the block after the previous
+ * one), so each new block usually just lengthens the last extent,
+ * and even a large file has few extents, which mostly fit in the
+ * root in the inode.
+ *
+ * The extent found by the last lookup is remembered in the vnode
+ * (sv_extcache), so mapping the blocks of a sequential read or
+ * write one after another doesn't search the tree each time.
+ *
+ * Insertion splits full nodes on the way down, so there is always
+ * room in the parent for the new entry a split makes. The tree only
+ * gets shallower when it is truncated to nothing.
+ *
+ * All of this runs with the vnode locked. Nodes are metadata
+ * (sfs_buf_markmeta).
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <vfs.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/*
+ * A node of the tree being looked at: either the root in the inode
+ * (xv_buf is NULL) or a node block, held busy in xv_buf.
+ */
+struct sfs_extview {
+	struct sfs_buf *xv_buf;
+	daddr_t xv_block;		/* 0 for the root */
+	uint16_t *xv_nentries;
+	unsigned xv_depth;
+	unsigned xv_max;
+	struct sfs_extent *xv_ext;
+};
+
+/* Statistics */
+static struct spinlock sfs_extstatlock = SPINLOCK_INITIALIZER;
+static unsigned sfs_extstat_lookups;	/* blocks mapped */
+static unsigned sfs_extstat_cached;	/* found in sv_extcache */
+static unsigned sfs_extstat_noderead;	/* node blocks looked at */
+static unsigned sfs_extstat_splits;	/* nodes split or root grown */
+
+////////////////////////////////////////////////////////////
+// Nodes
+
+static
+void
+sfs_ext_root(struct sfs_vnode *sv, struct sfs_extview *xv)
+{
+	struct sfs_extroot *root = &sv->sv_i.sfi_u.sfu_extents;
+
+	xv->xv_buf = NULL;
+	xv->xv_block = 0;
+	xv->xv_nentries = &root->er_nentries;
+	xv->xv_depth = root->er_depth;
+	xv->xv_max = SFS_EXTPERROOT;
+	xv->xv_ext = root->er_ext;
+}
+
+static
+void
+sfs_ext_setview(struct sfs_extview *xv, struct sfs_buf *buf, daddr_t block)
+{
+	struct sfs_extnode *node = sfs_buf_map(buf);
+
+	xv->xv_buf = buf;
+	xv->xv_block = block;
+	xv->xv_nentries = &node->en_nentries;
+	xv->xv_depth = node->en_depth;
+	xv->xv_max = SFS_EXTPERNODE;
+	xv->xv_ext = node->en_ext;
+}
+
+/*
+ * Get the node at BLOCK, which should have depth DEPTH.
+ */
+static
+int
+sfs_ext_readnode(struct sfs_vnode *sv, daddr_t block, unsigned depth,
+		 struct sfs_extview *xv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_extnode *node;
+	struct sfs_buf *buf;
+	int result;
+
+	if (block == 0 || block >= sfs->sfs_super.sp_nblocks ||
+	    !sfs_bused(sfs, block)) {
+		panic("sfs: Extent node %u of file %u is not an allocated "
+		      "block\n", block, sv->sv_ino);
+	}
+
+	result = sfs_buf_read(sfs, block, &buf);
+	if (result) {
+		return result;
+	}
+	node = sfs_buf_map(buf);
+	if (node->en_magic != SFS_EXTMAGIC || node->en_depth != depth ||
+	    node->en_nentries > SFS_EXTPERNODE) {
+		panic("sfs: Bad extent node %u in file %u\n",
+		      block, sv->sv_ino);
+	}
+	sfs_ext_setview(xv, buf, block);
+
+	spinlock_acquire(&sfs_extstatlock);
+	sfs_extstat_noderead++;
+	spinlock_release(&sfs_extstatlock);
+	return 0;
+}
+
+/*
+ * Allocate an empty node of depth DEPTH, near GOAL.
+ */
+static
+int
+sfs_ext_newnode(struct sfs_vnode *sv, daddr_t goal, unsigned depth,
+		struct sfs_extview *xv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_extnode *node;
+	struct sfs_buf *buf;
+	daddr_t block;
+	int result;
+
+	result = sfs_balloc(sfs, goal, &block);
+	if (result) {
+		return result;
+	}
+	result = sfs_buf_get(sfs, block, &buf);
+	if (result) {
+		sfs_bfree(sfs, block);
+		return result;
+	}
+	node = sfs_buf_map(buf);
+	bzero(node, SFS_BLOCKSIZE);
+	node->en_magic = SFS_EXTMAGIC;
+	node->en_depth = depth;
+	sfs_ext_setview(xv, buf, block);
+
+	spinlock_acquire(&sfs_extstatlock);
+	sfs_extstat_splits++;
+	spinlock_release(&sfs_extstatlock);
+	return 0;
+}
+
+/*
+ * Note that a node has been changed.
+ */
+static
+void
+sfs_ext_dirty(struct sfs_vnode *sv, struct sfs_extview *xv)
+{
+	if (xv->xv_buf != NULL) {
+		sfs_buf_markmeta(xv->xv_buf);
+	}
+	else {
+		sv->sv_dirty = true;
+	}
+}
+
+static
+void
+sfs_ext_release(struct sfs_extview *xv)
+{
+	if (xv->xv_buf != NULL) {
+		sfs_buf_release(xv->xv_buf);
+		xv->xv_buf = NULL;
+	}
+}
+
+/*
+ * Find the last entry of a (nonempty) node whose ex_fileblock is at
+ * or before FILEBLOCK, or the first entry if there is none.
+ */
+static
+unsigned
+sfs_ext_search(const struct sfs_extview *xv, uint32_t fileblock)
+{
+	unsigned lo, hi, mid;
+
+	KASSERT(*xv->xv_nentries > 0);
+
+	lo = 0;
+	hi = *xv->xv_nentries;
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (xv->xv_ext[mid].ex_fileblock <= fileblock) {
+			lo = mid;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/*
+ * Remove entry I from a node, keeping unused entries zeroed.
+ */
+static
+void
+sfs_ext_remove(struct sfs_extview *xv, unsigned i)
+{
+	unsigned n = *xv->xv_nentries;
+
+	KASSERT(i < n);
+	memmove(&xv->xv_ext[i], &xv->xv_ext[i+1],
+		(n - i - 1) * sizeof(struct sfs_extent));
+	bzero(&xv->xv_ext[n-1], sizeof(struct sfs_extent));
+	*xv->xv_nentries = n - 1;
+}
+
+/*
+ * Insert an entry into a node at position I.
+ */
+static
+void
+sfs_ext_add(struct sfs_extview *xv, unsigned i, uint32_t fileblock,
+	    daddr_t block, uint32_t len)
+{
+	unsigned n = *xv->xv_nentries;
+
+	KASSERT(n < xv->xv_max);
+	KASSERT(i <= n);
+	memmove(&xv->xv_ext[i+1], &xv->xv_ext[i],
+		(n - i) * sizeof(struct sfs_extent));
+	xv->xv_ext[i].ex_fileblock = fileblock;
+	xv->xv_ext[i].ex_block = block;
+	xv->xv_ext[i].ex_len = len;
+	*xv->xv_nentries = n + 1;
+}
+
+////////////////////////////////////////////////////////////
+// Lookup
+
+/*
+ * Find the disk block for FILEBLOCK, or 0 if it's a hole.
+ */
+static
+int
+sfs_ext_lookup(struct sfs_vnode *sv, uint32_t fileblock, daddr_t *diskblock)
+{
+	struct sfs_extent *e = &sv->sv_extcache;
+	struct sfs_extview xv, child;
+	bool cached;
+	int result;
+
+	cached = e->ex_len > 0 && fileblock >= e->ex_fileblock &&
+		fileblock - e->ex_fileblock < e->ex_len;
+
+	spinlock_acquire(&sfs_extstatlock);
+	sfs_extstat_lookups++;
+	if (cached) {
+		sfs_extstat_cached++;
+	}
+	spinlock_release(&sfs_extstatlock);
+
+	if (cached) {
+		*diskblock = e->ex_block + (fileblock - e->ex_fileblock);
+		return 0;
+	}
+
+	*diskblock = 0;
+	sfs_ext_root(sv, &xv);
+	while (*xv.xv_nentries > 0) {
+		e = &xv.xv_ext[sfs_ext_search(&xv, fileblock)];
+		if (e->ex_fileblock > fileblock) {
+			/* before the first extent */
+			break;
+		}
+		if (xv.xv_depth == 0) {
+			if (fileblock - e->ex_fileblock < e->ex_len) {
+				*diskblock = e->ex_block +
+					(fileblock - e->ex_fileblock);
+				sv->sv_extcache = *e;
+			}
+			break;
+		}
+		result = sfs_ext_readnode(sv, e->ex_block, xv.xv_depth - 1,
+					  &child);
+		sfs_ext_release(&xv);
+		if (result) {
+			return result;
+		}
+		xv = child;
+	}
+	sfs_ext_release(&xv);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// Insertion
+
+/*
+ * The root is full: move its entries to a new node and make that the
+ * root's only child.
+ */
+static
+int
+sfs_ext_grow(struct sfs_vnode *sv)
+{
+	struct sfs_extroot *root = &sv->sv_i.sfi_u.sfu_extents;
+	struct sfs_extview nv;
+	int result;
+
+	if (root->er_depth >= SFS_EXTMAXDEPTH) {
+		return EFBIG;
+	}
+
+	result = sfs_ext_newnode(sv, sv->sv_ino + 1, root->er_depth, &nv);
+	if (result) {
+		return result;
+	}
+	memcpy(nv.xv_ext, root->er_ext,
+	       root->er_nentries * sizeof(struct sfs_extent));
+	*nv.xv_nentries = root->er_nentries;
+	sfs_ext_dirty(sv, &nv);
+
+	bzero(root->er_ext, sizeof(root->er_ext));
+	root->er_depth++;
+	root->er_nentries = 1;
+	root->er_ext[0].ex_fileblock = nv.xv_ext[0].ex_fileblock;
+	root->er_ext[0].ex_block = nv.xv_block;
+	root->er_ext[0].ex_len = 0;
+	sv->sv_dirty = true;
+
+	sfs_ext_release(&nv);
+	return 0;
+}
+
+/*
+ * CHILD, the node that entry I of PARENT points to, is full. Move
+ * the upper half of it to a new node and enter that in PARENT. Then
+ * leave CHILD as whichever of the two FILEBLOCK belongs in, and
+ * release the other.
+ */
+static
+int
+sfs_ext_split(struct sfs_vnode *sv, struct sfs_extview *parent, unsigned i,
+	      struct sfs_extview *child, uint32_t fileblock)
+{
+	struct sfs_extview nv;
+	unsigned n, half;
+	int result;
+
+	result = sfs_ext_newnode(sv, child->xv_block + 1, child->xv_depth,
+				 &nv);
+	if (result) {
+		return result;
+	}
+
+	n = *child->xv_nentries;
+	half = n / 2;
+	memcpy(nv.xv_ext, &child->xv_ext[half],
+	       (n - half) * sizeof(struct sfs_extent));
+	*nv.xv_nentries = n - half;
+	bzero(&child->xv_ext[half], (n - half) * sizeof(struct sfs_extent));
+	*child->xv_nentries = half;
+
+	sfs_ext_add(parent, i + 1, nv.xv_ext[0].ex_fileblock, nv.xv_block, 0);
+
+	sfs_ext_dirty(sv, &nv);
+	sfs_ext_dirty(sv, child);
+	if (fileblock >= nv.xv_ext[0].ex_fileblock) {
+		sfs_ext_release(child);
+		*child = nv;
+	}
+	else {
+		sfs_ext_release(&nv);
+	}
+	return 0;
+}
+
+/*
+ * Add a leaf entry mapping FILEBLOCK to BLOCK to node XV, joining it
+ * to an adjacent extent if it continues one on disk.
+ */
+static
+void
+sfs_ext_addleaf(struct sfs_vnode *sv, struct sfs_extview *xv,
+		uint32_t fileblock, daddr_t block)
+{
+	struct sfs_extent *ext = xv->xv_ext;
+	unsigned n = *xv->xv_nentries;
+	unsigned i, pos;
+
+	KASSERT(xv->xv_depth == 0);
+
+	pos = 0;
+	if (n > 0) {
+		i = sfs_ext_search(xv, fileblock);
+		if (ext[i].ex_fileblock <= fileblock) {
+			KASSERT(fileblock - ext[i].ex_fileblock >=
+				ext[i].ex_len);
+			if (ext[i].ex_fileblock + ext[i].ex_len == fileblock &&
+			    ext[i].ex_block + ext[i].ex_len == block) {
+				/* The usual case: extend it */
+				ext[i].ex_len++;
+				if (i + 1 < n &&
+				    ext[i+1].ex_fileblock == fileblock + 1 &&
+				    ext[i+1].ex_block == block + 1) {
+					/* It now runs into the next one */
+					ext[i].ex_len += ext[i+1].ex_len;
+					sfs_ext_remove(xv, i + 1);
+				}
+				sv->sv_extcache = ext[i];
+				return;
+			}
+			pos = i + 1;
+		}
+	}
+
+	if (pos < n && ext[pos].ex_fileblock == fileblock + 1 &&
+	    ext[pos].ex_block == block + 1) {
+		/* Filling in just before an extent */
+		ext[pos].ex_fileblock--;
+		ext[pos].ex_block--;
+		ext[pos].ex_len++;
+	}
+	else {
+		sfs_ext_add(xv, pos, fileblock, block, 1);
+	}
+	sv->sv_extcache = ext[pos];
+}
+
+/*
+ * Map FILEBLOCK, which is a hole, to BLOCK.
+ */
+static
+int
+sfs_ext_insert(struct sfs_vnode *sv, uint32_t fileblock, daddr_t block)
+{
+	struct sfs_extview xv, child;
+	struct sfs_extent *e;
+	bool changed;
+	unsigned i;
+	int result;
+
+	if (sv->sv_i.sfi_u.sfu_extents.er_nentries == SFS_EXTPERROOT) {
+		result = sfs_ext_grow(sv);
+		if (result) {
+			return result;
+		}
+	}
+
+	sfs_ext_root(sv, &xv);
+	changed = false;
+	while (xv.xv_depth > 0) {
+		i = sfs_ext_search(&xv, fileblock);
+		e = &xv.xv_ext[i];
+		if (e->ex_fileblock > fileblock) {
+			/* New first block; keep the index accurate */
+			e->ex_fileblock = fileblock;
+			changed = true;
+		}
+
+		result = sfs_ext_readnode(sv, e->ex_block, xv.xv_depth - 1,
+					  &child);
+		if (result == 0 && *child.xv_nentries == child.xv_max) {
+			result = sfs_ext_split(sv, &xv, i, &child, fileblock);
+			if (result) {
+				sfs_ext_release(&child);
+			}
+			else {
+				changed = true;
+			}
+		}
+		if (changed) {
+			sfs_ext_dirty(sv, &xv);
+		}
+		sfs_ext_release(&xv);
+		if (result) {
+			return result;
+		}
+		xv = child;
+		changed = false;
+	}
+
+	sfs_ext_addleaf(sv, &xv, fileblock, block);
+	sfs_ext_dirty(sv, &xv);
+	sfs_ext_release(&xv);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// Truncation
+
+/*
+ * Free everything in the subtree XV at or past file block BLOCKLEN.
+ * Sets *CHANGED if XV was changed.
+ */
+static
+int
+sfs_ext_truncnode(struct sfs_vnode *sv, struct sfs_extview *xv,
+		  uint32_t blocklen, bool *changed)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_extview child;
+	struct sfs_extent *e;
+	uint32_t keep, j, key;
+	bool childchanged;
+	int result;
+
+	/* Entries are sorted, so everything to go is at the end */
+	while (*xv->xv_nentries > 0) {
+		e = &xv->xv_ext[*xv->xv_nentries - 1];
+		key = e->ex_fileblock;
+
+		if (xv->xv_depth == 0) {
+			if (key + e->ex_len <= blocklen) {
+				break;
+			}
+			keep = key >= blocklen ? 0 : blocklen - key;
+			for (j = keep; j < e->ex_len; j++) {
+				sfs_bfree(sfs, e->ex_block + j);
+			}
+			*changed = true;
+			if (keep > 0) {
+				e->ex_len = keep;
+				break;
+			}
+			sfs_ext_remove(xv, *xv->xv_nentries - 1);
+			continue;
+		}
+
+		/* The last child covers everything from KEY on */
+		result = sfs_ext_readnode(sv, e->ex_block, xv->xv_depth - 1,
+					  &child);
+		if (result) {
+			return result;
+		}
+		childchanged = false;
+		result = sfs_ext_truncnode(sv, &child, blocklen,
+					   &childchanged);
+		if (result == 0 && *child.xv_nentries == 0) {
+			sfs_ext_release(&child);
+			sfs_bfree(sfs, e->ex_block);
+			sfs_ext_remove(xv, *xv->xv_nentries - 1);
+			*changed = true;
+		}
+		else {
+			if (childchanged) {
+				sfs_ext_dirty(sv, &child);
+			}
+			sfs_ext_release(&child);
+		}
+		if (result) {
+			return result;
+		}
+		if (key < blocklen) {
+			break;
+		}
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// Interface
+
+/*
+ * Make an (inline, empty or nearly so) file extent-mapped. If BLOCK
+ * isn't 0, it becomes the file's block 0.
+ */
+void
+sfs_ext_create(struct sfs_vnode *sv, daddr_t block)
+{
+	struct sfs_extroot *root = &sv->sv_i.sfi_u.sfu_extents;
+
+	KASSERT((sv->sv_i.sfi_flags & SFS_IF_EXTENTS) == 0);
+
+	bzero(&sv->sv_i.sfi_u, sizeof(sv->sv_i.sfi_u));
+	sv->sv_i.sfi_flags &= ~SFS_IF_INLINE;
+	sv->sv_i.sfi_flags |= SFS_IF_EXTENTS;
+	if (block != 0) {
+		root->er_nentries = 1;
+		root->er_ext[0].ex_fileblock = 0;
+		root->er_ext[0].ex_block = block;
+		root->er_ext[0].ex_len = 1;
+	}
+	sv->sv_extcache.ex_len = 0;
+	sv->sv_dirty = true;
+}
+
+/*
+ * sfs_bmap for extent-mapped files.
+ */
+int
+sfs_ext_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
+	     daddr_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	daddr_t block, goal;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(sv->sv_i.sfi_flags & SFS_IF_EXTENTS);
+
+	result = sfs_ext_lookup(sv, fileblock, &block);
+	if (result) {
+		return result;
+	}
+
+	if (block == 0 && doalloc) {
+		/* sfi_size is 32 bits */
+		if (fileblock >= (uint32_t)-1 / SFS_BLOCKSIZE) {
+			return EFBIG;
+		}
+
+		/* Put it right after the previous block, if there is one */
+		goal = 0;
+		if (fileblock > 0) {
+			result = sfs_ext_lookup(sv, fileblock - 1, &goal);
+			if (result) {
+				return result;
+			}
+		}
+		goal = goal != 0 ? goal + 1 : sv->sv_ino + 1;
+
+		result = sfs_balloc(sfs, goal, &block);
+		if (result) {
+			return result;
+		}
+		result = sfs_ext_insert(sv, fileblock, block);
+		if (result) {
+			sfs_bfree(sfs, block);
+			return result;
+		}
+	}
+
+	if (block != 0 && !sfs_bused(sfs, block)) {
+		panic("sfs: Data block %u (block %u of file %u) marked free\n",
+		      block, fileblock, sv->sv_ino);
+	}
+	*diskblock = block;
+	return 0;
+}
+
+/*
+ * Free the blocks of an extent-mapped file from BLOCKLEN on.
+ */
+int
+sfs_ext_trunc(struct sfs_vnode *sv, uint32_t blocklen)
+{
+	struct sfs_extroot *root = &sv->sv_i.sfi_u.sfu_extents;
+	struct sfs_extview xv;
+	bool changed;
+	int result;
+
+	KASSERT(sv->sv_i.sfi_flags & SFS_IF_EXTENTS);
+
+	sv->sv_extcache.ex_len = 0;
+
+	sfs_ext_root(sv, &xv);
+	changed = false;
+	result = sfs_ext_truncnode(sv, &xv, blocklen, &changed);
+	if (root->er_nentries == 0 && root->er_depth > 0) {
+		root->er_depth = 0;
+		changed = true;
+	}
+	if (changed) {
+		sv->sv_dirty = true;
+	}
+	return result;
+}
+
+void
+sfs_ext_printstats(void)
+{
+	unsigned lookups, cached, noderead, splits;
+
+	spinlock_acquire(&sfs_extstatlock);
+	lookups = sfs_extstat_lookups;
+	cached = sfs_extstat_cached;
+	noderead = sfs_extstat_noderead;
+	splits = sfs_extstat_splits;
+	spinlock_release(&sfs_extstatlock);
+
+	kprintf("sfs extents: %u lookups, %u from cache (%u%%), "
+		"%u node reads, %u nodes added\n",
+		lookups, cached, lookups ? cached * 100 / lookups : 0,
+		noderead, splits);
+}
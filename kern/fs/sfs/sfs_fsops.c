@@ -38,6 +38,9 @@
 #include <lib.h>
 #include <array.h>
 #include <bitmap.h>
+#include <clock.h>
+#include <synch.h>
+#include <thread.h>
 #include <uio.h>
 #include <vfs.h>
 #include <device.h>
@@ -49,10 +52,24 @@
 #define SFS_FS_BITMAPSIZE(sfs)  SFS_BITMAPSIZE((sfs)->sfs_super.sp_nblocks)
 #define SFS_FS_BITBLOCKS(sfs)   SFS_BITBLOCKS((sfs)->sfs_super.sp_nblocks)
 
+/* Default for sfs_writeback_age, in seconds */
+#define SFS_WRITEBACK_AGE 5
+
+/*
+ * Mounted volumes, for the syncer. sfs_mountlock is held by the
+ * syncer for a whole pass, so a volume can't be unmounted under it;
+ * it ranks above everything in the order given in sfs.h.
+ */
+static struct lock *sfs_mountlock;
+static struct sfs_fs *sfs_mountlist;
+static unsigned sfs_writeback_age = SFS_WRITEBACK_AGE;
+
 /*
  * Routine for doing I/O (reads or writes) on the free block bitmap.
- * We always do the whole bitmap at once; writing individual sectors
- * might or might not be a worthwhile optimization.
+ * Reading (at mount) loads the whole bitmap in one request. Writing
+ * writes only the bitmap blocks that have changed (see
+ * sfs_freemap_takedirty), each run of adjacent ones in one request.
+ * The caller holds sfs_freemaplock when writing.
  *
  * The free block bitmap consists of SFS_BITBLOCKS 512-byte sectors of
  * bits, one bit for each sector on the filesystem. The number of
@@ -70,7 +87,7 @@ static
 int
 sfs_mapio(struct sfs_fs *sfs, enum uio_rw rw)
 {
-	uint32_t j, mapsize;
+	uint32_t j, k, mapsize;
 	char *bitdata;
 	int result;
 
@@ -80,25 +97,151 @@ sfs_mapio(struct sfs_fs *sfs, enum uio_rw rw)
 	/* Pointer to our bitmap data in memory. */
 	bitdata = bitmap_getdata(sfs->sfs_freemap);
 
-	/* For each sector in the bitmap... */
-	for (j=0; j<mapsize; j++) {
+	/* The bitmap starts at sector 2. */
+	if (rw == UIO_READ) {
+		return sfs_readblocks(sfs, SFS_MAP_LOCATION, mapsize, bitdata);
+	}
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+	for (j=0; j<mapsize; j=k) {
+		/* Find the next run of changed blocks */
+		if (!bitmap_isset(sfs->sfs_freemapdirty, j)) {
+			k = j+1;
+			continue;
+		}
+		for (k=j+1; k<mapsize; k++) {
+			if (!bitmap_isset(sfs->sfs_freemapdirty, k)) {
+				break;
+			}
+		}
+
+		result = sfs_writeblocks(sfs, SFS_MAP_LOCATION+j, k-j,
+					 bitdata + j*SFS_BLOCKSIZE);
+		if (result) {
+			return result;
+		}
+		for (; j<k; j++) {
+			sfs_freemap_takedirty(sfs, j);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Helper for sfs_sync: take a reference to each loaded vnode and
+ * put it in the array.
+ */
+struct sfs_sync_grabstate {
+	struct vnodearray *vns;
+	unsigned pos;
+};
+
+static
+void
+sfs_sync_grab(struct sfs_vnode *sv, void *data)
+{
+	struct sfs_sync_grabstate *grab = data;
+
+	VOP_INCREF(&sv->sv_v);
+	vnodearray_set(grab->vns, grab->pos++, &sv->sv_v);
+}
+
+/*
+ * Copy every dirty inode of a volume into the buffer cache.
+ */
+static
+int
+sfs_sync_inodes(struct sfs_fs *sfs)
+{
+	struct vnodearray *vns;
+	struct sfs_sync_grabstate grab;
+	unsigned i, num;
+	int result;
+
+	/*
+	 * Take a reference to each loaded vnode under sfs_vnlock, so
+	 * none of them can be reclaimed while we work, and then copy
+	 * the dirty inodes into the buffer cache one at a time under
+	 * each vnode's own lock. (Not VOP_FSYNC, because that flushes
+	 * the whole buffer cache each time.) Inode locks rank above
+	 * sfs_vnlock, so we cannot hold the latter while taking them.
+	 */
+	vns = vnodearray_create();
+	if (vns == NULL) {
+		return ENOMEM;
+	}
+	lock_acquire(sfs->sfs_vnlock);
+	num = sfs->sfs_nvnodes;
+	result = vnodearray_setsize(vns, num);
+	if (result) {
+		lock_release(sfs->sfs_vnlock);
+		vnodearray_destroy(vns);
+		return result;
+	}
+	grab.vns = vns;
+	grab.pos = 0;
+	sfs_vnhash_foreach(sfs, sfs_sync_grab, &grab);
+	KASSERT(grab.pos == num);
+	lock_release(sfs->sfs_vnlock);
 
-		/* Get a pointer to its data */
-		void *ptr = bitdata + j*SFS_BLOCKSIZE;
+	result = 0;
+	for (i=0; i<num; i++) {
+		struct vnode *v = vnodearray_get(vns, i);
+		struct sfs_vnode *sv = v->vn_data;
 
-		/* and read or write it. The bitmap starts at sector 2. */
-		if (rw == UIO_READ) {
-			result = sfs_readblock(sfs, SFS_MAP_LOCATION+j, ptr);
+		if (result == 0) {
+			result = sfs_jbegin(sfs);
 		}
-		else {
-			result = sfs_writeblock(sfs, SFS_MAP_LOCATION+j, ptr);
+		if (result == 0) {
+			lock_acquire(sv->sv_lock);
+			result = sfs_sync_inode(sv);
+			lock_release(sv->sv_lock);
+			sfs_jend(sfs);
 		}
+		VOP_DECREF(v);
+	}
+	vnodearray_setsize(vns, 0);
+	vnodearray_destroy(vns);
+	return result;
+}
 
-		/* If we failed, stop. */
+/*
+ * Write the free block bitmap and superblock, if they've changed.
+ * On a journaled volume they go out with each journal commit
+ * instead.
+ */
+static
+int
+sfs_sync_freemap(struct sfs_fs *sfs)
+{
+	int result;
+
+	if (sfs->sfs_journal != NULL) {
+		return 0;
+	}
+
+	lock_acquire(sfs->sfs_freemaplock);
+
+	/* Write whatever parts of the free block map have changed. */
+	if (sfs->sfs_nfreemapdirty > 0) {
+		result = sfs_mapio(sfs, UIO_WRITE);
 		if (result) {
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 	}
+
+	/* If the superblock needs to be written, write it. */
+	if (sfs->sfs_superdirty) {
+		result = sfs_writeblock(sfs, SFS_SB_LOCATION, &sfs->sfs_super);
+		if (result) {
+			lock_release(sfs->sfs_freemaplock);
+			return result;
+		}
+		sfs->sfs_superdirty = false;
+	}
+
+	lock_release(sfs->sfs_freemaplock);
 	return 0;
 }
 
@@ -111,11 +254,8 @@ int
 sfs_sync(struct fs *fs)
 {
 	struct sfs_fs *sfs;
-	unsigned i, num;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
 	 *
@@ -148,35 +288,127 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+	result = sfs_sync_inodes(sfs);
+	if (result) {
+		return result;
 	}
 
-	/* If the free block map needs to be written, write it. */
-	if (sfs->sfs_freemapdirty) {
-		result = sfs_mapio(sfs, UIO_WRITE);
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
-		sfs->sfs_freemapdirty = false;
+	/* Make sure new blocks nobody has written read back as zeros. */
+	result = sfs_bzerosync(sfs);
+	if (result) {
+		return result;
 	}
 
-	/* If the superblock needs to be written, write it. */
-	if (sfs->sfs_superdirty) {
-		result = sfs_writeblock(sfs, SFS_SB_LOCATION, &sfs->sfs_super);
-		if (result) {
-			vfs_biglock_release();
-			return result;
+	/* Write back all dirty buffers. */
+	result = sfs_buf_sync(sfs);
+	if (result) {
+		return result;
+	}
+
+	/*
+	 * Commit the metadata changes and write them home, emptying
+	 * the journal. (Nothing happens here on unjournaled volumes.)
+	 */
+	result = sfs_jcommit(sfs);
+	if (result) {
+		return result;
+	}
+	result = sfs_jcheckpoint(sfs, true);
+	if (result) {
+		return result;
+	}
+
+	return sfs_sync_freemap(sfs);
+}
+
+/*
+ * The syncer thread. Once a second, writes back buffers that have
+ * been dirty for sfs_writeback_age seconds, or enough of the oldest
+ * to bring the number of dirty buffers down if it has got high (see
+ * sfs_buf_writeback). Every sfs_writeback_age seconds it first copies
+ * the dirty inodes into the cache and writes the free block bitmap
+ * and superblock, which are not cached. On journaled volumes it also
+ * commits the journal every second, and checkpoints it if it's more
+ * than half full.
+ *
+ * Errors are ignored here; sfs_rwblock has already complained, and
+ * the data stays dirty for the next try.
+ */
+static
+void
+sfs_syncer_thread(void *unused1, unsigned long unused2)
+{
+	struct sfs_fs *sfs;
+	unsigned secs, age;
+
+	(void)unused1;
+	(void)unused2;
+
+	secs = 0;
+	while (1) {
+		clocksleep(1);
+		secs++;
+
+		lock_acquire(sfs_mountlock);
+		age = sfs_writeback_age;
+		for (sfs = sfs_mountlist; sfs != NULL;
+		     sfs = sfs->sfs_nextmount) {
+			if (secs >= age) {
+				(void)sfs_sync_inodes(sfs);
+				(void)sfs_sync_freemap(sfs);
+			}
+			(void)sfs_buf_writeback(sfs, age);
+			if (sfs->sfs_journal != NULL) {
+				(void)sfs_jcommit(sfs);
+				(void)sfs_jcheckpoint(sfs, false);
+			}
+		}
+		lock_release(sfs_mountlock);
+
+		if (secs >= age) {
+			secs = 0;
 		}
-		sfs->sfs_superdirty = false;
 	}
+}
 
-	vfs_biglock_release();
-	return 0;
+/*
+ * Set how long data may stay dirty in memory before the syncer
+ * writes it back.
+ */
+void
+sfs_setwritebackage(unsigned secs)
+{
+	KASSERT(secs > 0);
+	lock_acquire(sfs_mountlock);
+	sfs_writeback_age = secs;
+	lock_release(sfs_mountlock);
+}
+
+unsigned
+sfs_getwritebackage(void)
+{
+	return sfs_writeback_age;
+}
+
+/*
+ * Start the syncer. Called once at boot.
+ */
+void
+sfs_syncer_bootstrap(void)
+{
+	int result;
+
+	sfs_mountlock = lock_create("sfs_mountlock");
+	if (sfs_mountlock == NULL) {
+		panic("sfs: Could not create mount list lock\n");
+	}
+	sfs_mountlist = NULL;
+
+	result = thread_fork("sfs syncer", NULL, sfs_syncer_thread, NULL, 0);
+	if (result) {
+		panic("sfs: Could not start syncer thread: %s\n",
+		      strerror(result));
+	}
 }
 
 /*
@@ -189,13 +421,9 @@ const char *
 sfs_getvolname(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	const char *ret;
-
-	vfs_biglock_acquire();
-	ret = sfs->sfs_super.sp_volname;
-	vfs_biglock_release();
 
-	return ret;
+	/* The volume name never changes after mount; no lock needed. */
+	return sfs->sfs_super.sp_volname;
 }
 
 /*
@@ -208,22 +436,37 @@ int
 sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-
-	vfs_biglock_acquire();
+	struct sfs_fs **pp;
 
 	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
-		vfs_biglock_release();
+	lock_acquire(sfs->sfs_vnlock);
+	if (sfs->sfs_nvnodes > 0) {
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
+	lock_release(sfs->sfs_vnlock);
 
 	/* We should have just had sfs_sync called. */
 	KASSERT(sfs->sfs_superdirty == false);
-	KASSERT(sfs->sfs_freemapdirty == false);
+	KASSERT(sfs->sfs_nfreemapdirty == 0);
+
+	/* Take it away from the syncer. */
+	lock_acquire(sfs_mountlock);
+	for (pp = &sfs_mountlist; *pp != sfs; pp = &(*pp)->sfs_nextmount) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = sfs->sfs_nextmount;
+	lock_release(sfs_mountlock);
 
 	/* Once we start nuking stuff we can't fail. */
-	vnodearray_destroy(sfs->sfs_vnodes);
+	sfs_readahead_unmount(sfs);
+	sfs_buf_unmount(sfs);
+	sfs_vnhash_cleanup(sfs);
+	sfs_balloc_cleanup(sfs);
+	sfs_journal_cleanup(sfs);
 	bitmap_destroy(sfs->sfs_freemap);
+	lock_destroy(sfs->sfs_freemaplock);
+	lock_destroy(sfs->sfs_vnlock);
 
 	/* The vfs layer takes care of the device for us */
 	(void)sfs->sfs_device;
@@ -232,7 +475,6 @@ sfs_unmount(struct fs *fs)
 	kfree(sfs);
 
 	/* nothing else to do */
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -266,8 +508,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	int result;
 	struct sfs_fs *sfs;
 
-	vfs_biglock_acquire();
-
 	/* We don't pass any options through mount */
 	(void)options;
 
@@ -287,7 +527,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	 * don't do that in sfs.)
 	 */
 	if (dev->d_blocksize != SFS_BLOCKSIZE) {
-		vfs_biglock_release();
 		kprintf("sfs: Cannot mount on device with blocksize %zu\n",
 			dev->d_blocksize);
 		return ENXIO;
@@ -296,15 +535,28 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Allocate object */
 	sfs = kmalloc(sizeof(struct sfs_fs));
 	if (sfs==NULL) {
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 
-	/* Allocate array */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
+	/* Allocate vnode table */
+	result = sfs_vnhash_init(sfs);
+	if (result) {
+		kfree(sfs);
+		return result;
+	}
+
+	/* Create the locks */
+	sfs->sfs_vnlock = lock_create("sfs_vnlock");
+	if (sfs->sfs_vnlock == NULL) {
+		sfs_vnhash_cleanup(sfs);
+		kfree(sfs);
+		return ENOMEM;
+	}
+	sfs->sfs_freemaplock = lock_create("sfs_freemaplock");
+	if (sfs->sfs_freemaplock == NULL) {
+		lock_destroy(sfs->sfs_vnlock);
+		sfs_vnhash_cleanup(sfs);
 		kfree(sfs);
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 
@@ -314,9 +566,10 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Load superblock */
 	result = sfs_readblock(sfs, SFS_SB_LOCATION, &sfs->sfs_super);
 	if (result) {
-		vnodearray_destroy(sfs->sfs_vnodes);
+		lock_destroy(sfs->sfs_freemaplock);
+		lock_destroy(sfs->sfs_vnlock);
+		sfs_vnhash_cleanup(sfs);
 		kfree(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -327,9 +580,10 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			"(0x%x, should be 0x%x)\n",
 			sfs->sfs_super.sp_magic,
 			SFS_MAGIC);
-		vnodearray_destroy(sfs->sfs_vnodes);
+		lock_destroy(sfs->sfs_freemaplock);
+		lock_destroy(sfs->sfs_vnlock);
+		sfs_vnhash_cleanup(sfs);
 		kfree(sfs);
-		vfs_biglock_release();
 		return EINVAL;
 	}
 
@@ -341,20 +595,41 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Ensure null termination of the volume name */
 	sfs->sfs_super.sp_volname[sizeof(sfs->sfs_super.sp_volname)-1] = 0;
 
+	/*
+	 * Set up the journal and replay it. This may rewrite the
+	 * superblock, and must come before the bitmap is loaded.
+	 */
+	result = sfs_journal_init(sfs);
+	if (result) {
+		lock_destroy(sfs->sfs_freemaplock);
+		lock_destroy(sfs->sfs_vnlock);
+		sfs_vnhash_cleanup(sfs);
+		kfree(sfs);
+		return result;
+	}
+	sfs->sfs_super.sp_volname[sizeof(sfs->sfs_super.sp_volname)-1] = 0;
+
 	/* Load free space bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_BITMAPSIZE(sfs));
 	if (sfs->sfs_freemap == NULL) {
-		vnodearray_destroy(sfs->sfs_vnodes);
+		sfs_journal_cleanup(sfs);
+		lock_destroy(sfs->sfs_freemaplock);
+		lock_destroy(sfs->sfs_vnlock);
+		sfs_vnhash_cleanup(sfs);
 		kfree(sfs);
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 	result = sfs_mapio(sfs, UIO_READ);
+	if (result == 0) {
+		result = sfs_balloc_init(sfs);
+	}
 	if (result) {
 		bitmap_destroy(sfs->sfs_freemap);
-		vnodearray_destroy(sfs->sfs_vnodes);
+		sfs_journal_cleanup(sfs);
+		lock_destroy(sfs->sfs_freemaplock);
+		lock_destroy(sfs->sfs_vnlock);
+		sfs_vnhash_cleanup(sfs);
 		kfree(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -364,12 +639,16 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 
 	/* the other fields */
 	sfs->sfs_superdirty = false;
-	sfs->sfs_freemapdirty = false;
+
+	/* Let the syncer at it */
+	lock_acquire(sfs_mountlock);
+	sfs->sfs_nextmount = sfs_mountlist;
+	sfs_mountlist = sfs;
+	lock_release(sfs_mountlock);
 
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
 
-	vfs_biglock_release();
 	return 0;
 }
 
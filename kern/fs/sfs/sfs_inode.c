@@ -35,30 +35,238 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
 
 /*
- * Write an on-disk inode structure back out to disk.
+ * Write an on-disk inode structure back out. This copies it into the
+ * buffer cache; it reaches the disk when the buffer is written back.
  */
 int
 sfs_sync_inode(struct sfs_vnode *sv)
 {
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *buf;
 	int result;
 
 	if (sv->sv_dirty) {
-		result = sfs_writeblock(sfs, sv->sv_ino, &sv->sv_i);
+		result = sfs_buf_get(sfs, sv->sv_ino, &buf);
 		if (result) {
 			return result;
 		}
+		memcpy(sfs_buf_map(buf), &sv->sv_i, sizeof(sv->sv_i));
+		sfs_buf_markmeta(buf);
+		sfs_buf_release(buf);
 		sv->sv_dirty = false;
 	}
 	return 0;
 }
 
+/*
+ * Table of loaded vnodes.
+ *
+ * Loaded vnodes are kept in a chained hash table keyed by inode
+ * number, so finding, adding, and removing one is O(1) however many
+ * are loaded. The table doubles in size when the chains average more
+ * than SFS_VNHASH_LOAD entries. All of this is protected by the
+ * volume's sfs_vnlock.
+ */
+
+#define SFS_VNHASH_INITSIZE	64
+#define SFS_VNHASH_LOAD		2
+
+/*
+ * Table statistics, across all volumes. Counted under sfs_vnstatlock
+ * since different volumes have different sfs_vnlocks.
+ */
+static struct spinlock sfs_vnstatlock = SPINLOCK_INITIALIZER;
+static unsigned sfs_vnstat_lookups;	/* calls to sfs_loadvnode */
+static unsigned sfs_vnstat_hits;	/* ... that found the vnode loaded */
+static unsigned sfs_vnstat_grows;	/* times a table was resized */
+
+static
+unsigned
+sfs_vnhash_func(uint32_t ino, unsigned size)
+{
+	/* size is a power of two */
+	return ino & (size - 1);
+}
+
+/*
+ * Set up an empty table for a newly mounted volume.
+ */
+int
+sfs_vnhash_init(struct sfs_fs *sfs)
+{
+	unsigned i;
+
+	sfs->sfs_vnhash = kmalloc(SFS_VNHASH_INITSIZE *
+				  sizeof(struct sfs_vnode *));
+	if (sfs->sfs_vnhash == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<SFS_VNHASH_INITSIZE; i++) {
+		sfs->sfs_vnhash[i] = NULL;
+	}
+	sfs->sfs_vnhashsize = SFS_VNHASH_INITSIZE;
+	sfs->sfs_nvnodes = 0;
+	return 0;
+}
+
+/*
+ * Release the table at unmount. It must be empty.
+ */
+void
+sfs_vnhash_cleanup(struct sfs_fs *sfs)
+{
+	KASSERT(sfs->sfs_nvnodes == 0);
+	kfree(sfs->sfs_vnhash);
+	sfs->sfs_vnhash = NULL;
+	sfs->sfs_vnhashsize = 0;
+}
+
+/*
+ * Find a loaded vnode by inode number. Returns NULL if not loaded.
+ */
+static
+struct sfs_vnode *
+sfs_vnhash_find(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_vnode *sv;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	sv = sfs->sfs_vnhash[sfs_vnhash_func(ino, sfs->sfs_vnhashsize)];
+	while (sv != NULL && sv->sv_ino != ino) {
+		sv = sv->sv_hashnext;
+	}
+	return sv;
+}
+
+/*
+ * Double the number of chains. If we can't get the memory, carry on
+ * with longer chains.
+ */
+static
+void
+sfs_vnhash_grow(struct sfs_fs *sfs)
+{
+	struct sfs_vnode **newtab, *sv, *next;
+	unsigned newsize, i, ix;
+
+	newsize = sfs->sfs_vnhashsize * 2;
+	newtab = kmalloc(newsize * sizeof(struct sfs_vnode *));
+	if (newtab == NULL) {
+		return;
+	}
+	for (i=0; i<newsize; i++) {
+		newtab[i] = NULL;
+	}
+
+	for (i=0; i<sfs->sfs_vnhashsize; i++) {
+		for (sv = sfs->sfs_vnhash[i]; sv != NULL; sv = next) {
+			next = sv->sv_hashnext;
+			ix = sfs_vnhash_func(sv->sv_ino, newsize);
+			sv->sv_hashnext = newtab[ix];
+			newtab[ix] = sv;
+		}
+	}
+
+	kfree(sfs->sfs_vnhash);
+	sfs->sfs_vnhash = newtab;
+	sfs->sfs_vnhashsize = newsize;
+
+	spinlock_acquire(&sfs_vnstatlock);
+	sfs_vnstat_grows++;
+	spinlock_release(&sfs_vnstatlock);
+}
+
+static
+void
+sfs_vnhash_insert(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	unsigned ix;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	if (sfs->sfs_nvnodes >= sfs->sfs_vnhashsize * SFS_VNHASH_LOAD) {
+		sfs_vnhash_grow(sfs);
+	}
+
+	ix = sfs_vnhash_func(sv->sv_ino, sfs->sfs_vnhashsize);
+	sv->sv_hashnext = sfs->sfs_vnhash[ix];
+	sfs->sfs_vnhash[ix] = sv;
+	sfs->sfs_nvnodes++;
+}
+
+static
+void
+sfs_vnhash_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **pp;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	pp = &sfs->sfs_vnhash[sfs_vnhash_func(sv->sv_ino,
+					      sfs->sfs_vnhashsize)];
+	while (*pp != NULL && *pp != sv) {
+		pp = &(*pp)->sv_hashnext;
+	}
+	if (*pp == NULL) {
+		panic("sfs: reclaim vnode %u not in vnode pool\n",
+		      sv->sv_ino);
+	}
+	*pp = sv->sv_hashnext;
+	sv->sv_hashnext = NULL;
+	KASSERT(sfs->sfs_nvnodes > 0);
+	sfs->sfs_nvnodes--;
+}
+
+/*
+ * Call FUNC on every loaded vnode of a volume. The caller must hold
+ * sfs_vnlock.
+ */
+void
+sfs_vnhash_foreach(struct sfs_fs *sfs,
+		   void (*func)(struct sfs_vnode *, void *), void *data)
+{
+	struct sfs_vnode *sv;
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	for (i=0; i<sfs->sfs_vnhashsize; i++) {
+		for (sv = sfs->sfs_vnhash[i]; sv != NULL; sv = sv->sv_hashnext) {
+			func(sv, data);
+		}
+	}
+}
+
+/*
+ * Print the table statistics.
+ */
+void
+sfs_printstats(void)
+{
+	unsigned lookups, hits, grows;
+
+	spinlock_acquire(&sfs_vnstatlock);
+	lookups = sfs_vnstat_lookups;
+	hits = sfs_vnstat_hits;
+	grows = sfs_vnstat_grows;
+	spinlock_release(&sfs_vnstatlock);
+
+	kprintf("sfs vnode table: %u lookups, %u hits (%u%%), %u resizes\n",
+		lookups, hits, lookups ? hits * 100 / lookups : 0, grows);
+	sfs_readahead_printstats();
+	sfs_journal_printstats();
+	sfs_ext_printstats();
+}
+
 /*
  * Called when the vnode refcount (in-memory usage count) hits zero.
  *
@@ -69,31 +277,47 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sfs->sfs_vnlock);
 
 	/*
 	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * decision was made to reclaim it. Holding sfs_vnlock keeps
+	 * sfs_loadvnode from handing out new references while we
+	 * work; vn_countlock covers VOP_INCREF on references that
+	 * already exist.
 	 */
+	spinlock_acquire(&v->vn_countlock);
 	if (v->vn_refcount != 1) {
 
 		/* consume the reference VOP_DECREF gave us */
 		KASSERT(v->vn_refcount>1);
 		v->vn_refcount--;
 
-		vfs_biglock_release();
+		spinlock_release(&v->vn_countlock);
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
+	spinlock_release(&v->vn_countlock);
+
+	/*
+	 * The changes below go in the journal. We may be called from
+	 * within another operation's handle (by VOP_DECREF), so join
+	 * the running transaction rather than waiting to begin one.
+	 */
+	result = sfs_jjoin(sfs);
+	if (result) {
+		lock_release(sfs->sfs_vnlock);
+		return result;
+	}
 
 	/* If there are no on-disk references to the file either, erase it. */
 	if (sv->sv_i.sfi_linkcount==0) {
 		result = sfs_itrunc(sv, 0);
 		if (result) {
-			vfs_biglock_release();
+			sfs_jend(sfs);
+			lock_release(sfs->sfs_vnlock);
 			return result;
 		}
 	}
@@ -101,7 +325,8 @@ sfs_reclaim(struct vnode *v)
 	/* Sync the inode to disk */
 	result = sfs_sync_inode(sv);
 	if (result) {
-		vfs_biglock_release();
+		sfs_jend(sfs);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
@@ -109,29 +334,18 @@ sfs_reclaim(struct vnode *v)
 	if (sv->sv_i.sfi_linkcount==0) {
 		sfs_bfree(sfs, sv->sv_ino);
 	}
+	sfs_jend(sfs);
 
 	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
-		}
-	}
-	if (ix == num) {
-		panic("sfs: reclaim vnode %u not in vnode pool\n",
-		      sv->sv_ino);
-	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
+	sfs_vnhash_remove(sfs, sv);
 
 	vnode_cleanup(&sv->sv_v);
 
-	vfs_biglock_release();
+	lock_release(sfs->sfs_vnlock);
 
 	/* Release the storage for the vnode structure itself. */
+	sfs_dir_dropindex(sv);
+	lock_destroy(sv->sv_lock);
 	kfree(sv);
 
 	/* Done */
@@ -146,42 +360,51 @@ int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
+	struct sfs_buf *buf;
 	const struct vnode_ops *ops;
-	unsigned i, num;
 	int result;
 
+	lock_acquire(sfs->sfs_vnlock);
+
 	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
+	sv = sfs_vnhash_find(sfs, ino);
 
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
+	spinlock_acquire(&sfs_vnstatlock);
+	sfs_vnstat_lookups++;
+	if (sv != NULL) {
+		sfs_vnstat_hits++;
+	}
+	spinlock_release(&sfs_vnstatlock);
 
+	if (sv != NULL) {
 		/* Every inode in memory must be in an allocated block */
 		if (!sfs_bused(sfs, sv->sv_ino)) {
 			panic("sfs: Found inode %u in unallocated block\n",
 			      sv->sv_ino);
 		}
 
-		if (sv->sv_ino==ino) {
-			/* Found */
+		/* forcetype is only allowed when creating objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
 
-			/* forcetype is only allowed when creating objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
-
-			VOP_INCREF(&sv->sv_v);
-			*ret = sv;
-			return 0;
-		}
+		VOP_INCREF(&sv->sv_v);
+		lock_release(sfs->sfs_vnlock);
+		*ret = sv;
+		return 0;
 	}
 
 	/* Didn't have it loaded; load it */
 
 	sv = kmalloc(sizeof(struct sfs_vnode));
 	if (sv==NULL) {
+		lock_release(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+
+	sv->sv_lock = lock_create("sfs_vnode");
+	if (sv->sv_lock == NULL) {
+		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return ENOMEM;
 	}
 
@@ -192,23 +415,29 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	}
 
 	/* Read the block the inode is in */
-	result = sfs_readblock(sfs, ino, &sv->sv_i);
+	result = sfs_buf_read(sfs, ino, &buf);
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
+	memcpy(&sv->sv_i, sfs_buf_map(buf), sizeof(sv->sv_i));
+	sfs_buf_release(buf);
 
 	/* Not dirty yet */
 	sv->sv_dirty = false;
 
 	/*
 	 * FORCETYPE is set if we're creating a new file, because the
-	 * block on disk will have been zeroed out by sfs_balloc and
-	 * thus the type recorded there will be SFS_TYPE_INVAL.
+	 * block will read as zeros (see sfs_balloc) and thus the type
+	 * recorded there will be SFS_TYPE_INVAL.
 	 */
 	if (forcetype != SFS_TYPE_INVAL) {
 		KASSERT(sv->sv_i.sfi_type == SFS_TYPE_INVAL);
 		sv->sv_i.sfi_type = forcetype;
+		/* New objects start out with their data in the inode */
+		sv->sv_i.sfi_flags = SFS_IF_INLINE;
 		sv->sv_dirty = true;
 	}
 
@@ -231,20 +460,27 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = vnode_init(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
 	/* Set the other fields in our vnode structure */
 	sv->sv_ino = ino;
+	sv->sv_hashnext = NULL;
+	sv->sv_dirindex = NULL;
+	sv->sv_ra_next = 0;
+	sv->sv_ra_issued = 0;
+	sv->sv_ra_window = 0;
+	sv->sv_ra_hits = 0;
+	sv->sv_ra_misses = 0;
+	sv->sv_extcache.ex_len = 0;
 
 	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
-	if (result) {
-		vnode_cleanup(&sv->sv_v);
-		kfree(sv);
-		return result;
-	}
+	sfs_vnhash_insert(sfs, sv);
+
+	lock_release(sfs->sfs_vnlock);
 
 	/* Hand it back */
 	*ret = sv;
@@ -252,10 +488,13 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 }
 
 /*
- * Create a new filesystem object and hand back its vnode.
+ * Create a new filesystem object and hand back its vnode. The inode
+ * is placed near NEAR (the directory it's going in), and the file's
+ * data will be placed after the inode.
  */
 int
-sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
+sfs_makeobj(struct sfs_fs *sfs, uint32_t near, int type,
+	    struct sfs_vnode **ret)
 {
 	uint32_t ino;
 	int result;
@@ -265,7 +504,7 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 	 * number is the block number, so just get a block.)
 	 */
 
-	result = sfs_balloc(sfs, &ino);
+	result = sfs_balloc(sfs, near, &ino);
 	if (result) {
 		return result;
 	}
@@ -292,8 +531,6 @@ sfs_getroot(struct fs *fs)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOT_LOCATION, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		panic("sfs: getroot: Cannot load root vnode\n");
@@ -304,7 +541,5 @@ sfs_getroot(struct fs *fs)
 		      sv->sv_i.sfi_type);
 	}
 
-	vfs_biglock_release();
-
 	return &sv->sv_v;
 }
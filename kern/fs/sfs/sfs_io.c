@@ -36,6 +36,7 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
 #include <device.h>
 #include <sfs.h>
@@ -62,8 +63,6 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 	int result;
 	int tries=0;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	DEBUG(DB_SFS, "sfs: %s %llu\n",
 	      uio->uio_rw == UIO_READ ? "read" : "write",
 	      uio->uio_offset / SFS_BLOCKSIZE);
@@ -124,10 +123,53 @@ sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data)
 	return sfs_rwblock(sfs, &ku);
 }
 
+/*
+ * Read or write NBLOCKS consecutive blocks in one request.
+ */
+int
+sfs_readblocks(struct sfs_fs *sfs, daddr_t block, unsigned nblocks,
+	       void *data)
+{
+	struct iovec iov;
+	struct uio ku;
+
+	uio_kinit(&iov, &ku, data, nblocks * SFS_BLOCKSIZE,
+		  ((off_t)block) * SFS_BLOCKSIZE, UIO_READ);
+	return sfs_rwblock(sfs, &ku);
+}
+
+int
+sfs_writeblocks(struct sfs_fs *sfs, daddr_t block, unsigned nblocks,
+		void *data)
+{
+	struct iovec iov;
+	struct uio ku;
+
+	uio_kinit(&iov, &ku, data, nblocks * SFS_BLOCKSIZE,
+		  ((off_t)block) * SFS_BLOCKSIZE, UIO_WRITE);
+	return sfs_rwblock(sfs, &ku);
+}
+
 ////////////////////////////////////////////////////////////
 //
 // File-level I/O
 
+/*
+ * Note that a block of a file has been written to. Directory blocks
+ * are metadata and go through the journal, if there is one.
+ */
+static
+void
+sfs_io_markdirty(struct sfs_vnode *sv, struct sfs_buf *iobuf)
+{
+	if (sv->sv_i.sfi_type == SFS_TYPE_DIR) {
+		sfs_buf_markmeta(iobuf);
+	}
+	else {
+		sfs_buf_markdirty(iobuf);
+	}
+}
+
 /*
  * Do I/O to a block of a file that doesn't cover the whole block.  We
  * need to read in the original block first, even if we're writing, so
@@ -143,16 +185,9 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *iobuf;
+	char *iodata;
 	daddr_t diskblock;
 	uint32_t fileblock;
 	int result;
@@ -162,9 +197,6 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 
 	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
 
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
-
 	/* Compute the block offset of this block in the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
@@ -177,39 +209,42 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * It reads as zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
+		return uiomovezeros(len, uio);
 	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_readblock(sfs, diskblock, iobuf);
-		if (result) {
-			return result;
-		}
+
+	/*
+	 * Get the block from the buffer cache.
+	 */
+	result = sfs_buf_read(sfs, diskblock, &iobuf);
+	if (result) {
+		return result;
+	}
+	if (uio->uio_rw == UIO_READ) {
+		sfs_readahead_account(sv, fileblock, iobuf);
 	}
+	iodata = sfs_buf_map(iobuf);
 
 	/*
 	 * Now perform the requested operation into/out of the buffer.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	result = uiomove(iodata+skipstart, len, uio);
 	if (result) {
+		sfs_buf_release(iobuf);
 		return result;
 	}
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * If it was a write, the buffer is now dirty; it gets written
+	 * back later.
 	 */
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_writeblock(sfs, diskblock, iobuf);
-		if (result) {
-			return result;
-		}
+		sfs_io_markdirty(sv, iobuf);
 	}
 
+	sfs_buf_release(iobuf);
 	return 0;
 }
 
@@ -221,14 +256,11 @@ int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *iobuf;
 	daddr_t diskblock;
 	uint32_t fileblock;
 	int result;
 	bool doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
 
 	/* Get the block number within the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
@@ -250,31 +282,62 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 		return uiomovezeros(SFS_BLOCKSIZE, uio);
 	}
 
-	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
+	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
 
 	/*
-	 * Temporarily set the residue to be one block size.
+	 * Go through the buffer cache. If we're writing we're about to
+	 * replace the whole block, so there's no need to read it first.
 	 */
-	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
+	if (uio->uio_rw == UIO_READ) {
+		result = sfs_buf_read(sfs, diskblock, &iobuf);
+	}
+	else {
+		result = sfs_buf_get(sfs, diskblock, &iobuf);
+	}
+	if (result) {
+		return result;
+	}
+	if (uio->uio_rw == UIO_READ) {
+		sfs_readahead_account(sv, fileblock, iobuf);
+	}
 
-	result = sfs_rwblock(sfs, uio);
+	result = uiomove(sfs_buf_map(iobuf), SFS_BLOCKSIZE, uio);
+	if (uio->uio_rw == UIO_WRITE) {
+		/*
+		 * If the copy failed partway, keep what we got only if
+		 * the rest of the buffer holds the real block contents.
+		 */
+		if (result == 0 || sfs_buf_isvalid(iobuf)) {
+			sfs_io_markdirty(sv, iobuf);
+		}
+	}
 
-	/*
-	 * Now, restore the original uio_offset and uio_resid and update
-	 * them by the amount of I/O done.
-	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+	sfs_buf_release(iobuf);
+	return result;
+}
+
+/*
+ * Do I/O on a file whose data is kept in the inode. For reads the
+ * caller has already trimmed UIO to end at EOF; for writes it has
+ * checked that the result fits.
+ */
+static
+int
+sfs_inlineio(struct sfs_vnode *sv, struct uio *uio)
+{
+	off_t pos = uio->uio_offset;
+	int result;
 
+	KASSERT(sv->sv_i.sfi_flags & SFS_IF_INLINE);
+	KASSERT(pos + uio->uio_resid <= (off_t)SFS_INLINESIZE);
+
+	result = uiomove(sv->sv_i.sfi_u.sfu_inline + pos, uio->uio_resid, uio);
+	if (uio->uio_rw == UIO_WRITE && uio->uio_offset > pos) {
+		if (uio->uio_offset > (off_t)sv->sv_i.sfi_size) {
+			sv->sv_i.sfi_size = uio->uio_offset;
+		}
+		sv->sv_dirty = true;
+	}
 	return result;
 }
 
@@ -288,6 +351,19 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	uint32_t nblocks, i;
 	int result = 0;
 	uint32_t extraresid = 0;
+	off_t startpos = uio->uio_offset;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	/*
+	 * Check the size limit before the offset gets cut down to a
+	 * 32-bit block number or file size, which would make the write
+	 * land somewhere near the start of the file instead.
+	 */
+	if (uio->uio_rw == UIO_WRITE &&
+	    uio->uio_offset + (off_t)uio->uio_resid > SFS_MAXFILESIZE) {
+		return EFBIG;
+	}
 
 	/*
 	 * If reading, check for EOF. If we can read a partial area,
@@ -310,6 +386,25 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 		}
 	}
 
+	/*
+	 * Small files live in the inode, until a write makes them too
+	 * big; then move the data to a block and carry on as usual.
+	 */
+	if (sv->sv_i.sfi_flags & SFS_IF_INLINE) {
+		off_t endpos = uio->uio_offset + uio->uio_resid;
+
+		if (endpos <= (off_t)SFS_INLINESIZE) {
+			result = sfs_inlineio(sv, uio);
+			uio->uio_resid += extraresid;
+			return result;
+		}
+		KASSERT(uio->uio_rw == UIO_WRITE);
+		result = sfs_inline_promote(sv);
+		if (result) {
+			return result;
+		}
+	}
+
 	/*
 	 * First, do any leading partial block.
 	 */
@@ -364,6 +459,13 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 
  out:
 
+	/* If reading sequentially, queue up what's likely to come next */
+	if (uio->uio_rw == UIO_READ && result == 0 &&
+	    uio->uio_offset > startpos) {
+		sfs_readahead(sv, startpos / SFS_BLOCKSIZE,
+			      (uio->uio_offset - 1) / SFS_BLOCKSIZE);
+	}
+
 	/* If writing, adjust file length */
 	if (uio->uio_rw == UIO_WRITE &&
 	    uio->uio_offset > (off_t)sv->sv_i.sfi_size) {
@@ -0,0 +1,1462 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * SFS filesystem
+ *
+ * Metadata journal.
+ *
+ * On a volume with a journal (see kern/sfs.h for the on-disk format)
+ * inode, directory, and indirect blocks, the free block bitmap, and
+ * the superblock only reach their home locations after the change
+ * has been committed to the journal. Changing a metadata block
+ * (sfs_buf_markmeta) copies it into the running transaction instead
+ * of dirtying the buffer; the buffer cache gets the newest copy back
+ * from here if it drops the block (sfs_jread). File data is not
+ * journaled, nor written before a commit except by fsync (see
+ * sfs_fsync).
+ *
+ * Each operation that changes metadata runs inside a handle,
+ * sfs_jbegin .. sfs_jend, and all its changes go in the same
+ * transaction. To commit, new handles are held off, the running
+ * transaction is closed once the ones in progress end, the free
+ * block bitmap and superblock are added to it if they've changed,
+ * and it is written to the log in one sequential pass ending with a
+ * commit block. Many operations, from any number of threads, share
+ * one commit: the syncer commits every second, and sfs_jcommit from
+ * fsync finds its changes already committed if another thread got
+ * there first. Operations don't wait for commit, so a crash may
+ * lose the last second or so of them, but each is either all there
+ * or not there at all.
+ *
+ * Checkpointing writes committed blocks to their home locations and
+ * advances the log tail past them, freeing log space. The syncer
+ * does it once the log is half full, a commit does it if the log is
+ * full, and sync does it completely.
+ *
+ * When a block with copies in the log is freed, a revoke is logged
+ * so that replay doesn't write old metadata over whatever the block
+ * is used for next. Replay at mount time first collects the revokes
+ * of every complete transaction in the log, then writes home each
+ * block copy not revoked by a later transaction.
+ *
+ * Locking: j_iolock is held while committing or checkpointing, and
+ * ranks above every vnode lock. j_lock protects everything else and
+ * ranks below the buffers; sfs_freemaplock is taken inside it to
+ * copy the bitmap. A handle holder must not call sfs_jbegin again,
+ * as a commit would wait for it to end; sfs_jjoin, which never
+ * waits, is for code (sfs_reclaim) that may be reached both inside
+ * and outside a handle.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <vfs.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/* Number of hash chains for block copies (prime) */
+#define SFS_JHASH       31
+
+/*
+ * Log blocks set aside for each handle in progress when deciding
+ * whether the running transaction needs to be committed before
+ * another operation can start. No handle changes more metadata
+ * blocks than this, not counting the freemap and superblock, which
+ * are allowed for separately:
+ *
+ *    - allocating blocks can split one extent tree node per level,
+ *      changing it and a new node, and grow the root into a new
+ *      node (2 * SFS_EXTMAXDEPTH + 1). sfs_write keeps this from
+ *      happening more than once per handle by taking a new handle
+ *      every SFS_WRITECHUNK blocks; everything else allocates at
+ *      most one block.
+ *    - besides that, the most any operation changes is 4 inode and
+ *      directory blocks: rename changes two directory entries, the
+ *      directory's inode, and the file's inode.
+ *
+ * Truncation also logs a revoke for each node block it frees that is
+ * in the log; revokes only take a fraction of a log block each.
+ */
+#define SFS_JCREDITS    (2 * SFS_EXTMAXDEPTH + 1 + 4)
+
+/* Spare records kept for reuse */
+#define SFS_JSPARE      32
+
+/*
+ * A block copy or a revoke in a transaction. Copies are also on a
+ * hash chain by block number, newer ones first.
+ */
+struct sfs_jrec {
+	daddr_t jr_block;		/* home location */
+	struct sfs_jtxn *jr_txn;	/* transaction it belongs to */
+	bool jr_revoke;			/* revoke, not a copy */
+	bool jr_dead;			/* superseded or freed: not to go home */
+	void *jr_data;			/* the copy (SFS_BLOCKSIZE bytes) */
+	struct sfs_jrec *jr_hashnext;	/* hash chain */
+	struct sfs_jrec *jr_txnext;	/* next in transaction */
+};
+
+struct sfs_jtxn {
+	uint32_t jt_seq;		/* sequence number */
+	struct sfs_jrec *jt_recs;	/* copies and revokes */
+	unsigned jt_ncopies;		/* copies in jt_recs */
+	unsigned jt_nrevokes;		/* revokes in jt_recs */
+	unsigned jt_nops;		/* handles that used it */
+	uint32_t jt_logpos;		/* where it is in the log */
+	uint32_t jt_loglen;		/* log blocks it takes */
+	struct sfs_jtxn *jt_next;	/* next newer committed txn */
+};
+
+struct sfs_journal {
+	struct lock *j_iolock;		/* held to commit or checkpoint */
+	struct lock *j_lock;		/* protects everything below */
+	struct cv *j_cv;		/* j_handles or j_closing changed */
+	daddr_t j_start;		/* header block */
+	uint32_t j_size;		/* log blocks (after the header) */
+	uint32_t j_head;		/* log position for the next txn */
+	uint32_t j_tail;		/* log position of the oldest txn */
+	uint32_t j_used;		/* log blocks from tail to head */
+	uint32_t j_doneseq;		/* last txn committed */
+	unsigned j_handles;		/* handles in progress */
+	bool j_closing;			/* commit waiting for handles to end */
+	struct sfs_jtxn *j_running;	/* txn taking new changes */
+	struct sfs_jtxn *j_committing;	/* txn being written to the log */
+	struct sfs_jtxn *j_oldest;	/* committed, not checkpointed */
+	struct sfs_jtxn *j_newest;
+	struct sfs_jrec *j_hash[SFS_JHASH];
+	struct sfs_jrec *j_spare;	/* records for reuse */
+	unsigned j_nspare;
+	void *j_iobuf;			/* descriptor, commit, and header */
+};
+
+/* Statistics, across all volumes */
+static struct spinlock sfs_jstatlock = SPINLOCK_INITIALIZER;
+static unsigned sfs_jstat_commits;	/* transactions committed */
+static unsigned sfs_jstat_ops;		/* handles in them */
+static unsigned sfs_jstat_logblocks;	/* log blocks written */
+static unsigned sfs_jstat_shared;	/* sfs_jcommit calls done by others */
+static unsigned sfs_jstat_forced;	/* commits forced by a full txn */
+static unsigned sfs_jstat_checkpoints;	/* transactions checkpointed */
+static unsigned sfs_jstat_replayed;	/* transactions replayed */
+
+////////////////////////////////////////////////////////////
+// Records and transactions
+
+static
+unsigned
+sfs_jhashfunc(daddr_t block)
+{
+	return block % SFS_JHASH;
+}
+
+/*
+ * Get a record, from the spares if possible.
+ */
+static
+struct sfs_jrec *
+sfs_jrec_get(struct sfs_journal *j)
+{
+	struct sfs_jrec *rec;
+
+	KASSERT(lock_do_i_hold(j->j_lock));
+
+	if (j->j_spare != NULL) {
+		rec = j->j_spare;
+		j->j_spare = rec->jr_txnext;
+		j->j_nspare--;
+		return rec;
+	}
+
+	rec = kmalloc(sizeof(*rec));
+	if (rec == NULL) {
+		return NULL;
+	}
+	rec->jr_data = kmalloc(SFS_BLOCKSIZE);
+	if (rec->jr_data == NULL) {
+		kfree(rec);
+		return NULL;
+	}
+	return rec;
+}
+
+static
+void
+sfs_jrec_put(struct sfs_journal *j, struct sfs_jrec *rec)
+{
+	if (j->j_nspare < SFS_JSPARE) {
+		rec->jr_txnext = j->j_spare;
+		j->j_spare = rec;
+		j->j_nspare++;
+		return;
+	}
+	kfree(rec->jr_data);
+	kfree(rec);
+}
+
+/*
+ * Make sure there are at least N spare records, so that the handles
+ * in progress won't run out of memory halfway through an operation.
+ */
+static
+int
+sfs_jrec_reserve(struct sfs_journal *j, unsigned n)
+{
+	struct sfs_jrec *rec;
+
+	KASSERT(lock_do_i_hold(j->j_lock));
+
+	while (j->j_nspare < n) {
+		rec = kmalloc(sizeof(*rec));
+		if (rec == NULL) {
+			return ENOMEM;
+		}
+		rec->jr_data = kmalloc(SFS_BLOCKSIZE);
+		if (rec->jr_data == NULL) {
+			kfree(rec);
+			return ENOMEM;
+		}
+		rec->jr_txnext = j->j_spare;
+		j->j_spare = rec;
+		j->j_nspare++;
+	}
+	return 0;
+}
+
+static
+void
+sfs_jhash_remove(struct sfs_journal *j, struct sfs_jrec *rec)
+{
+	struct sfs_jrec **pp;
+
+	pp = &j->j_hash[sfs_jhashfunc(rec->jr_block)];
+	while (*pp != rec) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->jr_hashnext;
+	}
+	*pp = rec->jr_hashnext;
+	rec->jr_hashnext = NULL;
+}
+
+/*
+ * Find the newest copy of a block, or NULL.
+ */
+static
+struct sfs_jrec *
+sfs_jfind(struct sfs_journal *j, daddr_t block)
+{
+	struct sfs_jrec *rec;
+
+	KASSERT(lock_do_i_hold(j->j_lock));
+
+	rec = j->j_hash[sfs_jhashfunc(block)];
+	while (rec != NULL && rec->jr_block != block) {
+		rec = rec->jr_hashnext;
+	}
+	return rec;
+}
+
+static
+struct sfs_jtxn *
+sfs_jtxn_create(uint32_t seq)
+{
+	struct sfs_jtxn *txn;
+
+	txn = kmalloc(sizeof(*txn));
+	if (txn == NULL) {
+		return NULL;
+	}
+	txn->jt_seq = seq;
+	txn->jt_recs = NULL;
+	txn->jt_ncopies = 0;
+	txn->jt_nrevokes = 0;
+	txn->jt_nops = 0;
+	txn->jt_logpos = 0;
+	txn->jt_loglen = 0;
+	txn->jt_next = NULL;
+	return txn;
+}
+
+/*
+ * Number of log blocks a transaction takes: descriptors, copies,
+ * and the commit block.
+ */
+static
+uint32_t
+sfs_jtxn_loglen(struct sfs_jtxn *txn)
+{
+	unsigned ntags = txn->jt_ncopies + txn->jt_nrevokes;
+
+	return DIVROUNDUP(ntags, SFS_JTAGS) + txn->jt_ncopies + 1;
+}
+
+/*
+ * Free a transaction that's been checkpointed (or never committed,
+ * at unmount) and all its records.
+ */
+static
+void
+sfs_jtxn_destroy(struct sfs_journal *j, struct sfs_jtxn *txn)
+{
+	struct sfs_jrec *rec;
+
+	KASSERT(lock_do_i_hold(j->j_lock));
+
+	while ((rec = txn->jt_recs) != NULL) {
+		txn->jt_recs = rec->jr_txnext;
+		if (!rec->jr_revoke) {
+			sfs_jhash_remove(j, rec);
+		}
+		sfs_jrec_put(j, rec);
+	}
+	kfree(txn);
+}
+
+/*
+ * Copy a block into the running transaction.
+ */
+static
+void
+sfs_jadd(struct sfs_journal *j, daddr_t block, const void *data)
+{
+	struct sfs_jtxn *txn = j->j_running;
+	struct sfs_jrec *rec;
+	unsigned h;
+
+	KASSERT(lock_do_i_hold(j->j_lock));
+
+	rec = sfs_jfind(j, block);
+	if (rec != NULL && rec->jr_txn == txn) {
+		/* Changed again before commit; just update the copy */
+		memcpy(rec->jr_data, data, SFS_BLOCKSIZE);
+		return;
+	}
+
+	rec = sfs_jrec_get(j);
+	if (rec == NULL) {
+		/* sfs_jrec_reserve should have made this impossible */
+		panic("sfs: journal: Out of memory\n");
+	}
+	rec->jr_block = block;
+	rec->jr_txn = txn;
+	rec->jr_revoke = false;
+	rec->jr_dead = false;
+	memcpy(rec->jr_data, data, SFS_BLOCKSIZE);
+
+	h = sfs_jhashfunc(block);
+	rec->jr_hashnext = j->j_hash[h];
+	j->j_hash[h] = rec;
+	rec->jr_txnext = txn->jt_recs;
+	txn->jt_recs = rec;
+	txn->jt_ncopies++;
+}
+
+////////////////////////////////////////////////////////////
+// Log I/O
+
+/*
+ * Disk block for a log position.
+ */
+static
+daddr_t
+sfs_jlogblock(struct sfs_journal *j, uint32_t pos)
+{
+	return j->j_start + 1 + pos % j->j_size;
+}
+
+/*
+ * Number of log blocks from FROM to TO, going forward.
+ */
+static
+uint32_t
+sfs_jdistance(struct sfs_journal *j, uint32_t from, uint32_t to)
+{
+	return to >= from ? to - from : to + j->j_size - from;
+}
+
+/*
+ * Fold a block into a transaction checksum.
+ */
+static
+uint32_t
+sfs_jsum(uint32_t sum, const void *data)
+{
+	const uint32_t *words = data;
+	unsigned i;
+
+	for (i=0; i<SFS_BLOCKSIZE / sizeof(uint32_t); i++) {
+		sum = ((sum << 1) | (sum >> 31)) ^ words[i];
+	}
+	return sum;
+}
+
+/*
+ * Write the journal header. Uses j_iobuf, so the caller holds
+ * j_iolock.
+ */
+static
+int
+sfs_jwriteheader(struct sfs_fs *sfs, uint32_t tail, uint32_t tailseq)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	struct sfs_jheader *jh = j->j_iobuf;
+
+	bzero(jh, SFS_BLOCKSIZE);
+	jh->jh_magic = SFS_JMAGIC_HEADER;
+	jh->jh_tail = tail;
+	jh->jh_tailseq = tailseq;
+	return sfs_writeblock(sfs, j->j_start, jh);
+}
+
+/*
+ * Write back every committed transaction, or, unless ALL is set,
+ * only enough of the oldest to get the log down to half full; then
+ * move the tail past them. The caller holds j_iolock.
+ *
+ * j_lock is held throughout, rather than just to look at the
+ * records, so that a block can't be freed, reallocated, and written
+ * as file data between our deciding to write it home and doing so.
+ */
+static
+int
+sfs_jcheckpoint_locked(struct sfs_fs *sfs, bool all)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	struct sfs_jtxn *txn, *stop;
+	struct sfs_jrec *rec;
+	uint32_t tail, tailseq;
+	unsigned ntxns;
+	int result;
+
+	KASSERT(lock_do_i_hold(j->j_iolock));
+
+	lock_acquire(j->j_lock);
+
+	/* Decide how far to go */
+	ntxns = 0;
+	tail = j->j_tail;
+	tailseq = j->j_doneseq + 1;
+	for (stop = j->j_oldest; stop != NULL; stop = stop->jt_next) {
+		if (!all && j->j_used - sfs_jdistance(j, j->j_tail,
+		    stop->jt_logpos) <= j->j_size / 2) {
+			break;
+		}
+		ntxns++;
+	}
+	if (ntxns == 0) {
+		lock_release(j->j_lock);
+		return 0;
+	}
+	if (stop != NULL) {
+		tail = stop->jt_logpos;
+		tailseq = stop->jt_seq;
+	}
+	else {
+		tail = j->j_head;
+	}
+
+	/* Write the live copies home */
+	for (txn = j->j_oldest; txn != stop; txn = txn->jt_next) {
+		for (rec = txn->jt_recs; rec != NULL; rec = rec->jr_txnext) {
+			if (rec->jr_revoke || rec->jr_dead) {
+				continue;
+			}
+			result = sfs_writeblock(sfs, rec->jr_block,
+						rec->jr_data);
+			if (result) {
+				lock_release(j->j_lock);
+				return result;
+			}
+			/* It's real on disk now (see sfs_balloc.c) */
+			sfs_bwritten(sfs, rec->jr_block);
+			rec->jr_dead = true;
+		}
+	}
+
+	/* Only now may the log space be reused */
+	result = sfs_jwriteheader(sfs, tail, tailseq);
+	if (result) {
+		lock_release(j->j_lock);
+		return result;
+	}
+
+	while (j->j_oldest != stop) {
+		txn = j->j_oldest;
+		j->j_oldest = txn->jt_next;
+		KASSERT(j->j_used >= txn->jt_loglen);
+		j->j_used -= txn->jt_loglen;
+		sfs_jtxn_destroy(j, txn);
+	}
+	if (j->j_oldest == NULL) {
+		j->j_newest = NULL;
+	}
+	j->j_tail = tail;
+	KASSERT(j->j_oldest != NULL || j->j_used == 0);
+	lock_release(j->j_lock);
+
+	spinlock_acquire(&sfs_jstatlock);
+	sfs_jstat_checkpoints += ntxns;
+	spinlock_release(&sfs_jstatlock);
+
+	return 0;
+}
+
+/*
+ * Write the transaction being committed to the log, checkpointing
+ * first if there isn't room. The caller holds j_iolock. The
+ * transaction's records don't change while it's being committed
+ * (other than jr_dead), so j_lock isn't needed to walk them.
+ */
+static
+int
+sfs_jwrite(struct sfs_fs *sfs, struct sfs_jtxn *txn)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	struct sfs_jdesc *jd = j->j_iobuf;
+	struct sfs_jcommit *jc = j->j_iobuf;
+	struct sfs_jrec *rec, *first, *r;
+	uint32_t len, pos, n, sum;
+	int result;
+
+	KASSERT(lock_do_i_hold(j->j_iolock));
+
+	len = sfs_jtxn_loglen(txn);
+	if (len > j->j_size) {
+		panic("sfs: journal: Transaction of %u blocks does not fit "
+		      "in %u-block log\n", len, j->j_size);
+	}
+
+	lock_acquire(j->j_lock);
+	if (j->j_used + len > j->j_size) {
+		lock_release(j->j_lock);
+		result = sfs_jcheckpoint_locked(sfs, true);
+		if (result) {
+			return result;
+		}
+		lock_acquire(j->j_lock);
+	}
+	KASSERT(j->j_used + len <= j->j_size);
+	pos = j->j_head;
+	lock_release(j->j_lock);
+
+	n = 0;
+	sum = 0;
+	rec = txn->jt_recs;
+	while (rec != NULL) {
+		/* A descriptor for as many records as fit in one */
+		bzero(jd, SFS_BLOCKSIZE);
+		jd->jd_magic = SFS_JMAGIC_DESC;
+		jd->jd_seq = txn->jt_seq;
+		first = rec;
+		for (; rec != NULL && jd->jd_ntags < SFS_JTAGS;
+		     rec = rec->jr_txnext) {
+			KASSERT((rec->jr_block & SFS_JTAG_REVOKE) == 0);
+			jd->jd_tags[jd->jd_ntags++] = rec->jr_block |
+				(rec->jr_revoke ? SFS_JTAG_REVOKE : 0);
+		}
+		sum = sfs_jsum(sum, jd);
+		result = sfs_writeblock(sfs, sfs_jlogblock(j, pos + n++), jd);
+		if (result) {
+			return result;
+		}
+
+		/* followed by the copies it describes */
+		for (r = first; r != rec; r = r->jr_txnext) {
+			if (r->jr_revoke) {
+				continue;
+			}
+			sum = sfs_jsum(sum, r->jr_data);
+			result = sfs_writeblock(sfs,
+						sfs_jlogblock(j, pos + n++),
+						r->jr_data);
+			if (result) {
+				return result;
+			}
+		}
+	}
+
+	/* Everything else is on disk; now it counts. */
+	bzero(jc, SFS_BLOCKSIZE);
+	jc->jc_magic = SFS_JMAGIC_COMMIT;
+	jc->jc_seq = txn->jt_seq;
+	jc->jc_checksum = sum;
+	result = sfs_writeblock(sfs, sfs_jlogblock(j, pos + n++), jc);
+	if (result) {
+		return result;
+	}
+	KASSERT(n == len);
+
+	txn->jt_logpos = pos;
+	txn->jt_loglen = len;
+	return 0;
+}
+
+/*
+ * The transaction being committed has been written; file it with
+ * the other committed ones, and let the blocks it freed be reused.
+ */
+static
+void
+sfs_jcommitted(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	struct sfs_jtxn *txn = j->j_committing;
+	struct sfs_jrec *rec, *old;
+
+	lock_acquire(j->j_lock);
+
+	j->j_head = (txn->jt_logpos + txn->jt_loglen) % j->j_size;
+	j->j_used += txn->jt_loglen;
+
+	/* Older committed copies of the same blocks need not go home */
+	for (rec = txn->jt_recs; rec != NULL; rec = rec->jr_txnext) {
+		if (rec->jr_revoke) {
+			continue;
+		}
+		for (old = rec->jr_hashnext; old != NULL;
+		     old = old->jr_hashnext) {
+			if (old->jr_block == rec->jr_block) {
+				old->jr_dead = true;
+			}
+		}
+	}
+
+	if (j->j_newest != NULL) {
+		j->j_newest->jt_next = txn;
+	}
+	else {
+		j->j_oldest = txn;
+	}
+	j->j_newest = txn;
+	j->j_committing = NULL;
+	j->j_doneseq = txn->jt_seq;
+
+	sfs_bcommitted(sfs, txn->jt_seq);
+
+	lock_release(j->j_lock);
+
+	spinlock_acquire(&sfs_jstatlock);
+	sfs_jstat_commits++;
+	sfs_jstat_ops += txn->jt_nops;
+	sfs_jstat_logblocks += txn->jt_loglen;
+	spinlock_release(&sfs_jstatlock);
+}
+
+/*
+ * Commit the running transaction. The caller holds j_iolock.
+ */
+static
+int
+sfs_jcommit_locked(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	struct sfs_jtxn *txn, *next;
+	unsigned nmeta, mapsize, i;
+	char *bitdata;
+	int result;
+
+	KASSERT(lock_do_i_hold(j->j_iolock));
+
+	/* Finish off a commit that failed partway */
+	if (j->j_committing != NULL) {
+		result = sfs_jwrite(sfs, j->j_committing);
+		if (result) {
+			return result;
+		}
+		sfs_jcommitted(sfs);
+	}
+
+	next = sfs_jtxn_create(0);
+	if (next == NULL) {
+		return ENOMEM;
+	}
+	mapsize = SFS_BITBLOCKS(sfs->sfs_super.sp_nblocks);
+
+	/* Stop new handles, and wait for the ones in progress */
+	lock_acquire(j->j_lock);
+	j->j_closing = true;
+	while (j->j_handles > 0) {
+		cv_wait(j->j_cv, j->j_lock);
+	}
+	txn = j->j_running;
+
+	/* The changed bitmap blocks, and the superblock */
+	lock_acquire(sfs->sfs_freemaplock);
+	nmeta = sfs->sfs_nfreemapdirty + 1;
+	lock_release(sfs->sfs_freemaplock);
+
+	result = sfs_jrec_reserve(j, nmeta);
+	if (result) {
+		goto out;
+	}
+
+	/*
+	 * Add the changed freemap blocks and the superblock. Nobody
+	 * can change them while the handles are held off, so they
+	 * match the rest of the transaction.
+	 */
+	lock_acquire(sfs->sfs_freemaplock);
+	bitdata = bitmap_getdata(sfs->sfs_freemap);
+	for (i=0; i<mapsize && sfs->sfs_nfreemapdirty > 0; i++) {
+		if (sfs_freemap_takedirty(sfs, i)) {
+			sfs_jadd(j, SFS_MAP_LOCATION + i,
+				 bitdata + i * SFS_BLOCKSIZE);
+		}
+	}
+	if (sfs->sfs_superdirty) {
+		sfs_jadd(j, SFS_SB_LOCATION, &sfs->sfs_super);
+		sfs->sfs_superdirty = false;
+	}
+	lock_release(sfs->sfs_freemaplock);
+
+	if (txn->jt_recs == NULL) {
+		/* Nothing to commit */
+		goto out;
+	}
+
+	next->jt_seq = txn->jt_seq + 1;
+	j->j_running = next;
+	next = NULL;
+	j->j_committing = txn;
+
+ out:
+	j->j_closing = false;
+	cv_broadcast(j->j_cv, j->j_lock);
+	lock_release(j->j_lock);
+	if (next != NULL) {
+		kfree(next);
+	}
+	if (result || j->j_committing == NULL) {
+		return result;
+	}
+
+	result = sfs_jwrite(sfs, txn);
+	if (result) {
+		/* It stays j_committing for the next try */
+		return result;
+	}
+	sfs_jcommitted(sfs);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// Interface
+
+/*
+ * Commit every operation that has ended so far, unless another
+ * thread does it first. Returns once they're in the log.
+ */
+int
+sfs_jcommit(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	uint32_t target;
+	bool done;
+	int result;
+
+	if (j == NULL) {
+		return 0;
+	}
+
+	lock_acquire(j->j_lock);
+	target = j->j_running->jt_seq;
+	lock_release(j->j_lock);
+
+	lock_acquire(j->j_iolock);
+	lock_acquire(j->j_lock);
+	done = j->j_doneseq >= target;
+	lock_release(j->j_lock);
+	if (done) {
+		/* Somebody else's commit picked up ours */
+		lock_release(j->j_iolock);
+		spinlock_acquire(&sfs_jstatlock);
+		sfs_jstat_shared++;
+		spinlock_release(&sfs_jstatlock);
+		return 0;
+	}
+	result = sfs_jcommit_locked(sfs);
+	lock_release(j->j_iolock);
+	return result;
+}
+
+/*
+ * Checkpoint: write committed changes home and free up log space.
+ * If ALL is false, only do it if the log is more than half full, and
+ * only that far.
+ */
+int
+sfs_jcheckpoint(struct sfs_fs *sfs, bool all)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	int result;
+
+	if (j == NULL) {
+		return 0;
+	}
+
+	lock_acquire(j->j_iolock);
+	result = sfs_jcheckpoint_locked(sfs, all);
+	lock_release(j->j_iolock);
+	return result;
+}
+
+/*
+ * Start an operation that will change metadata. If the running
+ * transaction is too full to be sure the operation's changes will
+ * fit, commit it first. Must not be called with any vnode locked, or
+ * by a thread already in a handle.
+ */
+int
+sfs_jbegin(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	uint32_t need, nmeta;
+	int result;
+
+	if (j == NULL) {
+		return 0;
+	}
+
+	nmeta = SFS_BITBLOCKS(sfs->sfs_super.sp_nblocks) + 1;
+
+	lock_acquire(j->j_lock);
+	while (1) {
+		while (j->j_closing) {
+			cv_wait(j->j_cv, j->j_lock);
+		}
+		need = sfs_jtxn_loglen(j->j_running) + nmeta +
+			(j->j_handles + 1) * SFS_JCREDITS;
+		if (need <= j->j_size - j->j_size / 4) {
+			break;
+		}
+		if (j->j_running->jt_recs == NULL && j->j_handles == 0) {
+			/* Small log; we'll have to take our chances */
+			break;
+		}
+
+		lock_release(j->j_lock);
+		spinlock_acquire(&sfs_jstatlock);
+		sfs_jstat_forced++;
+		spinlock_release(&sfs_jstatlock);
+		result = sfs_jcommit(sfs);
+		if (result) {
+			return result;
+		}
+		lock_acquire(j->j_lock);
+	}
+
+	result = sfs_jrec_reserve(j, (j->j_handles + 1) * SFS_JCREDITS);
+	if (result) {
+		lock_release(j->j_lock);
+		return result;
+	}
+	j->j_handles++;
+	j->j_running->jt_nops++;
+	lock_release(j->j_lock);
+	return 0;
+}
+
+/*
+ * Start a handle without waiting for anything: for code that may
+ * run within another handle. Its changes are few, so the running
+ * transaction's size isn't checked.
+ */
+int
+sfs_jjoin(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	int result;
+
+	if (j == NULL) {
+		return 0;
+	}
+
+	lock_acquire(j->j_lock);
+	result = sfs_jrec_reserve(j, (j->j_handles + 1) * SFS_JCREDITS);
+	if (result) {
+		lock_release(j->j_lock);
+		return result;
+	}
+	j->j_handles++;
+	lock_release(j->j_lock);
+	return 0;
+}
+
+/*
+ * End an operation started with sfs_jbegin or sfs_jjoin.
+ */
+void
+sfs_jend(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+
+	if (j == NULL) {
+		return;
+	}
+
+	lock_acquire(j->j_lock);
+	KASSERT(j->j_handles > 0);
+	j->j_handles--;
+	if (j->j_handles == 0 && j->j_closing) {
+		cv_broadcast(j->j_cv, j->j_lock);
+	}
+	lock_release(j->j_lock);
+}
+
+/*
+ * Log a change to a metadata block. Called by sfs_buf_markmeta, with
+ * the buffer busy, inside a handle.
+ */
+void
+sfs_jlog(struct sfs_fs *sfs, daddr_t block, const void *data)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+
+	lock_acquire(j->j_lock);
+	KASSERT(j->j_handles > 0);
+	sfs_jadd(j, block, data);
+	lock_release(j->j_lock);
+}
+
+/*
+ * If the journal has a copy of a block that hasn't been written home,
+ * put it in DATA (unless that's NULL) and return true. Called by the
+ * buffer cache with the buffer for the block busy.
+ */
+bool
+sfs_jread(struct sfs_fs *sfs, daddr_t block, void *data)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	struct sfs_jrec *rec;
+	bool ret;
+
+	if (j == NULL) {
+		return false;
+	}
+
+	lock_acquire(j->j_lock);
+	rec = sfs_jfind(j, block);
+	/* If the newest is dead, the block has been freed since. */
+	ret = rec != NULL && !rec->jr_dead;
+	if (ret && data != NULL) {
+		memcpy(data, rec->jr_data, SFS_BLOCKSIZE);
+	}
+	lock_release(j->j_lock);
+	return ret;
+}
+
+/*
+ * Sequence number of the running transaction, which is stable while
+ * the caller is in a handle; 0 on a volume without a journal.
+ */
+uint32_t
+sfs_jrunningseq(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	uint32_t seq;
+
+	if (j == NULL) {
+		return 0;
+	}
+	lock_acquire(j->j_lock);
+	seq = j->j_running->jt_seq;
+	lock_release(j->j_lock);
+	return seq;
+}
+
+/*
+ * A block is being freed. Forget any uncommitted copy of it, and if
+ * there are copies in the log, log a revoke so they aren't replayed.
+ */
+void
+sfs_jrevoke(struct sfs_fs *sfs, daddr_t block)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	struct sfs_jtxn *txn;
+	struct sfs_jrec *rec, **pp, **tp;
+	bool inlog;
+
+	if (j == NULL) {
+		return;
+	}
+
+	lock_acquire(j->j_lock);
+	txn = j->j_running;
+	inlog = false;
+	pp = &j->j_hash[sfs_jhashfunc(block)];
+	while ((rec = *pp) != NULL) {
+		if (rec->jr_block != block) {
+			pp = &rec->jr_hashnext;
+			continue;
+		}
+		if (rec->jr_txn == txn) {
+			/* Never committed; drop it */
+			*pp = rec->jr_hashnext;
+			for (tp = &txn->jt_recs; *tp != rec;
+			     tp = &(*tp)->jr_txnext) {
+				KASSERT(*tp != NULL);
+			}
+			*tp = rec->jr_txnext;
+			txn->jt_ncopies--;
+			sfs_jrec_put(j, rec);
+			continue;
+		}
+		if (!rec->jr_dead) {
+			rec->jr_dead = true;
+			inlog = true;
+		}
+		pp = &rec->jr_hashnext;
+	}
+
+	if (inlog) {
+		rec = sfs_jrec_get(j);
+		if (rec == NULL) {
+			panic("sfs: journal: Out of memory\n");
+		}
+		rec->jr_block = block;
+		rec->jr_txn = txn;
+		rec->jr_revoke = true;
+		rec->jr_dead = true;
+		rec->jr_hashnext = NULL;
+		rec->jr_txnext = txn->jt_recs;
+		txn->jt_recs = rec;
+		txn->jt_nrevokes++;
+	}
+	lock_release(j->j_lock);
+}
+
+////////////////////////////////////////////////////////////
+// Replay
+
+/* A revoke found in the log */
+struct sfs_jrevoked {
+	daddr_t rv_block;
+	uint32_t rv_seq;
+};
+
+struct sfs_jreplay {
+	struct sfs_jdesc *rp_desc;	/* descriptor being looked at */
+	void *rp_data;			/* block copy being looked at */
+	struct sfs_jrevoked *rp_revoked;
+	unsigned rp_nrevoked;
+	unsigned rp_maxrevoked;
+	uint32_t rp_lastseq;		/* last complete transaction */
+};
+
+static
+int
+sfs_jreplay_addrevoke(struct sfs_jreplay *rp, daddr_t block, uint32_t seq)
+{
+	struct sfs_jrevoked *bigger;
+	unsigned i, max;
+
+	for (i=0; i<rp->rp_nrevoked; i++) {
+		if (rp->rp_revoked[i].rv_block == block) {
+			/* Later transactions come later */
+			rp->rp_revoked[i].rv_seq = seq;
+			return 0;
+		}
+	}
+
+	if (rp->rp_nrevoked == rp->rp_maxrevoked) {
+		max = rp->rp_maxrevoked ? rp->rp_maxrevoked * 2 : 16;
+		bigger = kmalloc(max * sizeof(*bigger));
+		if (bigger == NULL) {
+			return ENOMEM;
+		}
+		for (i=0; i<rp->rp_nrevoked; i++) {
+			bigger[i] = rp->rp_revoked[i];
+		}
+		if (rp->rp_revoked != NULL) {
+			kfree(rp->rp_revoked);
+		}
+		rp->rp_revoked = bigger;
+		rp->rp_maxrevoked = max;
+	}
+	rp->rp_revoked[rp->rp_nrevoked].rv_block = block;
+	rp->rp_revoked[rp->rp_nrevoked].rv_seq = seq;
+	rp->rp_nrevoked++;
+	return 0;
+}
+
+/*
+ * Check if the copy of BLOCK in transaction SEQ was revoked by a
+ * later complete transaction.
+ */
+static
+bool
+sfs_jreplay_revoked(struct sfs_jreplay *rp, daddr_t block, uint32_t seq)
+{
+	unsigned i;
+
+	for (i=0; i<rp->rp_nrevoked; i++) {
+		if (rp->rp_revoked[i].rv_block == block) {
+			return rp->rp_revoked[i].rv_seq > seq &&
+				rp->rp_revoked[i].rv_seq <= rp->rp_lastseq;
+		}
+	}
+	return false;
+}
+
+/*
+ * Look at the transaction with sequence number SEQ that should be at
+ * log position POS. If APPLY is false, check it's complete, collect
+ * its revokes, and return its length in *LEN, or 0 if it isn't
+ * there or isn't complete. If APPLY is true, it is known to be
+ * complete; write its copies home, except those revoked later.
+ */
+static
+int
+sfs_jreplay_txn(struct sfs_fs *sfs, struct sfs_jreplay *rp,
+		uint32_t pos, uint32_t seq, bool apply, uint32_t *len)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	struct sfs_jdesc *jd = rp->rp_desc;
+	struct sfs_jcommit *jc = (struct sfs_jcommit *)rp->rp_desc;
+	uint32_t n, sum, i, tag;
+	daddr_t block;
+	int result;
+
+	*len = 0;
+	n = 0;
+	sum = 0;
+	while (n < j->j_size) {
+		result = sfs_readblock(sfs, sfs_jlogblock(j, pos + n++), jd);
+		if (result) {
+			return result;
+		}
+		if (jc->jc_magic == SFS_JMAGIC_COMMIT && jc->jc_seq == seq) {
+			if (n > 1 && jc->jc_checksum == sum) {
+				*len = n;
+			}
+			return 0;
+		}
+		if (jd->jd_magic != SFS_JMAGIC_DESC || jd->jd_seq != seq ||
+		    jd->jd_ntags > SFS_JTAGS) {
+			return 0;
+		}
+		sum = sfs_jsum(sum, jd);
+
+		for (i=0; i<jd->jd_ntags; i++) {
+			tag = jd->jd_tags[i];
+			block = tag & ~SFS_JTAG_REVOKE;
+			if (block >= sfs->sfs_super.sp_nblocks) {
+				return 0;
+			}
+			if (tag & SFS_JTAG_REVOKE) {
+				if (!apply) {
+					result = sfs_jreplay_addrevoke(rp,
+							block, seq);
+					if (result) {
+						return result;
+					}
+				}
+				continue;
+			}
+			if (n >= j->j_size) {
+				return 0;
+			}
+			result = sfs_readblock(sfs,
+					       sfs_jlogblock(j, pos + n++),
+					       rp->rp_data);
+			if (result) {
+				return result;
+			}
+			sum = sfs_jsum(sum, rp->rp_data);
+			if (apply && !sfs_jreplay_revoked(rp, block, seq)) {
+				result = sfs_writeblock(sfs, block,
+							rp->rp_data);
+				if (result) {
+					return result;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Replay the log from the tail, and leave it empty. Returns the
+ * number of transactions replayed in *NTXNS.
+ */
+static
+int
+sfs_jreplay(struct sfs_fs *sfs, uint32_t tailseq, unsigned *ntxns)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	struct sfs_jreplay rp;
+	uint32_t pos, seq, len, used;
+	unsigned i, count;
+	int result;
+
+	rp.rp_desc = kmalloc(SFS_BLOCKSIZE);
+	rp.rp_data = kmalloc(SFS_BLOCKSIZE);
+	rp.rp_revoked = NULL;
+	rp.rp_nrevoked = rp.rp_maxrevoked = 0;
+	if (rp.rp_desc == NULL || rp.rp_data == NULL) {
+		result = ENOMEM;
+		goto out;
+	}
+
+	/* Find the complete transactions and their revokes */
+	pos = j->j_tail;
+	seq = tailseq;
+	used = 0;
+	count = 0;
+	while (1) {
+		result = sfs_jreplay_txn(sfs, &rp, pos, seq, false, &len);
+		if (result) {
+			goto out;
+		}
+		if (len == 0 || used + len > j->j_size) {
+			break;
+		}
+		pos = (pos + len) % j->j_size;
+		used += len;
+		seq++;
+		count++;
+	}
+	rp.rp_lastseq = seq - 1;
+
+	/* Write them home */
+	pos = j->j_tail;
+	seq = tailseq;
+	for (i=0; i<count; i++) {
+		result = sfs_jreplay_txn(sfs, &rp, pos, seq, true, &len);
+		if (result) {
+			goto out;
+		}
+		pos = (pos + len) % j->j_size;
+		seq++;
+	}
+
+	/* Now the log is empty */
+	if (count > 0) {
+		result = sfs_jwriteheader(sfs, pos, seq);
+		if (result) {
+			goto out;
+		}
+	}
+	j->j_head = j->j_tail = pos;
+	j->j_used = 0;
+	j->j_doneseq = seq - 1;
+	j->j_running->jt_seq = seq;
+	*ntxns = count;
+	result = 0;
+
+ out:
+	if (rp.rp_revoked != NULL) {
+		kfree(rp.rp_revoked);
+	}
+	if (rp.rp_data != NULL) {
+		kfree(rp.rp_data);
+	}
+	if (rp.rp_desc != NULL) {
+		kfree(rp.rp_desc);
+	}
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// Mount and unmount
+
+/*
+ * Set up the journal of a volume being mounted, if it has one, and
+ * replay it. Called after the superblock is loaded and before the
+ * freemap is.
+ */
+int
+sfs_journal_init(struct sfs_fs *sfs)
+{
+	struct sfs_super *sp = &sfs->sfs_super;
+	struct sfs_journal *j;
+	struct sfs_jheader *jh;
+	unsigned i, ntxns;
+	int result;
+
+	sfs->sfs_journal = NULL;
+	if (sp->sp_jstart == 0) {
+		return 0;
+	}
+
+	if (sp->sp_jstart < SFS_MAP_LOCATION + SFS_BITBLOCKS(sp->sp_nblocks) ||
+	    sp->sp_jblocks < 4 || sp->sp_jblocks > sp->sp_nblocks ||
+	    sp->sp_jstart > sp->sp_nblocks - sp->sp_jblocks) {
+		kprintf("sfs: %s: Invalid journal location %u (%u blocks)\n",
+			sp->sp_volname, sp->sp_jstart, sp->sp_jblocks);
+		return EINVAL;
+	}
+
+	j = kmalloc(sizeof(*j));
+	if (j == NULL) {
+		return ENOMEM;
+	}
+	j->j_iolock = lock_create("sfs journal io");
+	j->j_lock = lock_create("sfs journal");
+	j->j_cv = cv_create("sfs journal");
+	j->j_iobuf = kmalloc(SFS_BLOCKSIZE);
+	j->j_running = sfs_jtxn_create(0);
+	if (j->j_iolock == NULL || j->j_lock == NULL || j->j_cv == NULL ||
+	    j->j_iobuf == NULL || j->j_running == NULL) {
+		result = ENOMEM;
+		goto fail;
+	}
+	j->j_start = sp->sp_jstart;
+	j->j_size = sp->sp_jblocks - 1;
+	j->j_handles = 0;
+	j->j_closing = false;
+	j->j_committing = NULL;
+	j->j_oldest = j->j_newest = NULL;
+	for (i=0; i<SFS_JHASH; i++) {
+		j->j_hash[i] = NULL;
+	}
+	j->j_spare = NULL;
+	j->j_nspare = 0;
+	sfs->sfs_journal = j;
+
+	jh = j->j_iobuf;
+	result = sfs_readblock(sfs, j->j_start, jh);
+	if (result) {
+		goto fail;
+	}
+	if (jh->jh_magic != SFS_JMAGIC_HEADER || jh->jh_tail >= j->j_size) {
+		kprintf("sfs: %s: Invalid journal header\n", sp->sp_volname);
+		result = EINVAL;
+		goto fail;
+	}
+	j->j_tail = jh->jh_tail;
+
+	/* No other thread can see the volume yet; j_iolock for form */
+	lock_acquire(j->j_iolock);
+	result = sfs_jreplay(sfs, jh->jh_tailseq, &ntxns);
+	lock_release(j->j_iolock);
+	if (result) {
+		goto fail;
+	}
+	if (ntxns > 0) {
+		kprintf("sfs: %s: Replayed %u journal transactions\n",
+			sp->sp_volname, ntxns);
+		spinlock_acquire(&sfs_jstatlock);
+		sfs_jstat_replayed += ntxns;
+		spinlock_release(&sfs_jstatlock);
+
+		/* The superblock may have been among them */
+		result = sfs_readblock(sfs, SFS_SB_LOCATION, sp);
+		if (result) {
+			goto fail;
+		}
+	}
+	return 0;
+
+ fail:
+	sfs->sfs_journal = NULL;
+	if (j->j_running != NULL) {
+		kfree(j->j_running);
+	}
+	if (j->j_iobuf != NULL) {
+		kfree(j->j_iobuf);
+	}
+	if (j->j_cv != NULL) {
+		cv_destroy(j->j_cv);
+	}
+	if (j->j_lock != NULL) {
+		lock_destroy(j->j_lock);
+	}
+	if (j->j_iolock != NULL) {
+		lock_destroy(j->j_iolock);
+	}
+	kfree(j);
+	return result;
+}
+
+/*
+ * Free the journal at unmount. The volume has been synced, so there
+ * is nothing in it.
+ */
+void
+sfs_journal_cleanup(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	struct sfs_jrec *rec;
+
+	if (j == NULL) {
+		return;
+	}
+
+	KASSERT(j->j_handles == 0);
+	KASSERT(j->j_committing == NULL);
+	KASSERT(j->j_oldest == NULL);
+	KASSERT(j->j_running->jt_recs == NULL);
+
+	while ((rec = j->j_spare) != NULL) {
+		j->j_spare = rec->jr_txnext;
+		kfree(rec->jr_data);
+		kfree(rec);
+	}
+	kfree(j->j_running);
+	kfree(j->j_iobuf);
+	cv_destroy(j->j_cv);
+	lock_destroy(j->j_lock);
+	lock_destroy(j->j_iolock);
+	kfree(j);
+	sfs->sfs_journal = NULL;
+}
+
+////////////////////////////////////////////////////////////
+// Statistics
+
+void
+sfs_journal_printstats(void)
+{
+	unsigned commits, ops, logblocks, shared, forced, checkpoints;
+	unsigned replayed;
+
+	spinlock_acquire(&sfs_jstatlock);
+	commits = sfs_jstat_commits;
+	ops = sfs_jstat_ops;
+	logblocks = sfs_jstat_logblocks;
+	shared = sfs_jstat_shared;
+	forced = sfs_jstat_forced;
+	checkpoints = sfs_jstat_checkpoints;
+	replayed = sfs_jstat_replayed;
+	spinlock_release(&sfs_jstatlock);
+
+	kprintf("sfs journal: %u commits of %u operations "
+		"(%u.%02u per commit), %u log blocks\n",
+		commits, ops,
+		commits ? ops / commits : 0,
+		commits ? (ops * 100 / commits) % 100 : 0,
+		logblocks);
+	kprintf("sfs journal: %u fsync commits shared, %u forced by a full "
+		"transaction, %u checkpointed, %u replayed\n",
+		shared, forced, checkpoints, replayed);
+}
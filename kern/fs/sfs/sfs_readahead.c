@@ -0,0 +1,393 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * SFS filesystem
+ *
+ * Sequential read-ahead.
+ *
+ * Each file remembers where the last read stopped (sv_ra_next). A
+ * read that starts there, or in the same block for small reads,
+ * continues a sequential stream, and the blocks after it are queued
+ * for the read-ahead thread, which reads them into the buffer cache
+ * so they're there when the reader arrives. The number of blocks kept
+ * queued ahead of the reader (sv_ra_window) starts at SFS_RA_MIN and
+ * follows the hit rate: it doubles while nearly every prefetched
+ * block is found ready, and halves when they mostly aren't (because
+ * they were evicted before use, or the disk can't keep up). A read
+ * anywhere else turns read-ahead off for the file until it goes
+ * sequential again.
+ *
+ * Only the reader looks at the per-file state, under sv_lock. The
+ * reader maps file blocks to disk blocks itself, so the thread only
+ * deals in disk blocks and needs no vnode references or vnode locks.
+ * That's safe against the file changing underneath: the cache is
+ * indexed by disk block and everything else goes through it. A stale
+ * request can cache the old contents of a block that's been freed;
+ * sfs_balloc marks the block new before it throws such a buffer
+ * away, so a request that comes after that fills it with zeros
+ * instead (see sfs_balloc.c).
+ *
+ * sfs_ralock protects the request queue. Nothing else is acquired
+ * while it is held.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <thread.h>
+#include <vfs.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/* Window size limits, in blocks */
+#define SFS_RA_MIN      4
+#define SFS_RA_MAX      16
+
+/* Size of the request queue */
+#define SFS_RA_QUEUE    64
+
+struct sfs_rareq {
+	struct sfs_fs *rr_fs;
+	daddr_t rr_block;
+};
+
+static struct lock *sfs_ralock;		/* protects the queue */
+static struct cv *sfs_racv;		/* queue or sfs_rabusy changed */
+static struct sfs_rareq sfs_raqueue[SFS_RA_QUEUE];
+static unsigned sfs_rahead;		/* oldest request */
+static unsigned sfs_racount;		/* number of requests queued */
+static struct sfs_fs *sfs_rabusy;	/* volume the thread is reading */
+
+/* Statistics */
+static struct spinlock sfs_rastatlock = SPINLOCK_INITIALIZER;
+static unsigned sfs_rastat_queued;	/* blocks queued for prefetch */
+static unsigned sfs_rastat_dropped;	/* not queued: queue was full */
+static unsigned sfs_rastat_hits;	/* prefetched and found ready */
+static unsigned sfs_rastat_misses;	/* prefetched but not ready */
+static unsigned sfs_rastat_wasted;	/* evicted without being read */
+static unsigned sfs_rastat_grows;	/* window doubled */
+static unsigned sfs_rastat_shrinks;	/* window halved */
+
+////////////////////////////////////////////////////////////
+// The queue and the thread
+
+/*
+ * Queue a disk block for prefetch. Returns false if the queue is
+ * full, in which case the request is just dropped.
+ */
+static
+bool
+sfs_raqueue_add(struct sfs_fs *sfs, daddr_t block)
+{
+	struct sfs_rareq *rr;
+
+	lock_acquire(sfs_ralock);
+	if (sfs_racount == SFS_RA_QUEUE) {
+		lock_release(sfs_ralock);
+		spinlock_acquire(&sfs_rastatlock);
+		sfs_rastat_dropped++;
+		spinlock_release(&sfs_rastatlock);
+		return false;
+	}
+	rr = &sfs_raqueue[(sfs_rahead + sfs_racount) % SFS_RA_QUEUE];
+	rr->rr_fs = sfs;
+	rr->rr_block = block;
+	sfs_racount++;
+	cv_broadcast(sfs_racv, sfs_ralock);
+	lock_release(sfs_ralock);
+
+	spinlock_acquire(&sfs_rastatlock);
+	sfs_rastat_queued++;
+	spinlock_release(&sfs_rastatlock);
+	return true;
+}
+
+/*
+ * The read-ahead thread. Reads queued blocks into the buffer cache,
+ * oldest first.
+ */
+static
+void
+sfs_readahead_thread(void *unused1, unsigned long unused2)
+{
+	struct sfs_rareq rr;
+
+	(void)unused1;
+	(void)unused2;
+
+	lock_acquire(sfs_ralock);
+	while (1) {
+		while (sfs_racount == 0) {
+			cv_wait(sfs_racv, sfs_ralock);
+		}
+		rr = sfs_raqueue[sfs_rahead];
+		sfs_rahead = (sfs_rahead + 1) % SFS_RA_QUEUE;
+		sfs_racount--;
+		sfs_rabusy = rr.rr_fs;
+		lock_release(sfs_ralock);
+
+		/*
+		 * Ignore errors; if the reader gets there it will
+		 * retry the read and report the error itself.
+		 */
+		(void)sfs_buf_prefetch(rr.rr_fs, rr.rr_block);
+
+		lock_acquire(sfs_ralock);
+		sfs_rabusy = NULL;
+		cv_broadcast(sfs_racv, sfs_ralock);
+	}
+}
+
+/*
+ * Forget any read-ahead for a volume being unmounted, and wait until
+ * the thread isn't using it.
+ */
+void
+sfs_readahead_unmount(struct sfs_fs *sfs)
+{
+	unsigned i, n;
+	struct sfs_rareq *rr;
+
+	lock_acquire(sfs_ralock);
+	n = 0;
+	for (i=0; i<sfs_racount; i++) {
+		rr = &sfs_raqueue[(sfs_rahead + i) % SFS_RA_QUEUE];
+		if (rr->rr_fs != sfs) {
+			sfs_raqueue[(sfs_rahead + n) % SFS_RA_QUEUE] = *rr;
+			n++;
+		}
+	}
+	sfs_racount = n;
+	while (sfs_rabusy == sfs) {
+		cv_wait(sfs_racv, sfs_ralock);
+	}
+	lock_release(sfs_ralock);
+}
+
+/*
+ * Set up read-ahead and start the thread. Called once at boot.
+ */
+void
+sfs_readahead_bootstrap(void)
+{
+	int result;
+
+	sfs_ralock = lock_create("sfs readahead");
+	if (sfs_ralock == NULL) {
+		panic("sfs: Could not create readahead lock\n");
+	}
+	sfs_racv = cv_create("sfs readahead");
+	if (sfs_racv == NULL) {
+		panic("sfs: Could not create readahead cv\n");
+	}
+	sfs_rahead = sfs_racount = 0;
+	sfs_rabusy = NULL;
+
+	result = thread_fork("sfs readahead", NULL,
+			     sfs_readahead_thread, NULL, 0);
+	if (result) {
+		panic("sfs: Could not start readahead thread: %s\n",
+		      strerror(result));
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Per-file logic
+
+/*
+ * Called by sfs_io for each file block it reads from a buffer, to
+ * note whether read-ahead had it ready.
+ */
+void
+sfs_readahead_account(struct sfs_vnode *sv, uint32_t fileblock,
+		      struct sfs_buf *buf)
+{
+	bool ready;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	/* Always consume the mark, even if this block doesn't count */
+	ready = sfs_buf_wasprefetched(buf);
+
+	if (sv->sv_ra_window == 0 ||
+	    fileblock < sv->sv_ra_next || fileblock >= sv->sv_ra_issued) {
+		/* not a block we prefetched */
+		return;
+	}
+
+	if (ready) {
+		sv->sv_ra_hits++;
+	}
+	else {
+		sv->sv_ra_misses++;
+	}
+
+	spinlock_acquire(&sfs_rastatlock);
+	if (ready) {
+		sfs_rastat_hits++;
+	}
+	else {
+		sfs_rastat_misses++;
+	}
+	spinlock_release(&sfs_rastatlock);
+}
+
+/*
+ * Resize the window according to the hit rate since it was last
+ * looked at, once there have been enough reads to judge by.
+ */
+static
+void
+sfs_readahead_adapt(struct sfs_vnode *sv)
+{
+	unsigned samples = sv->sv_ra_hits + sv->sv_ra_misses;
+
+	if (samples == 0 || samples < sv->sv_ra_window / 2) {
+		return;
+	}
+
+	if (sv->sv_ra_misses * 8 <= samples) {
+		/* 7/8 or better: get further ahead */
+		if (sv->sv_ra_window < SFS_RA_MAX) {
+			sv->sv_ra_window *= 2;
+			spinlock_acquire(&sfs_rastatlock);
+			sfs_rastat_grows++;
+			spinlock_release(&sfs_rastatlock);
+		}
+	}
+	else if (sv->sv_ra_misses * 2 > samples) {
+		/* Worse than half: we're wasting cache or disk time */
+		if (sv->sv_ra_window > SFS_RA_MIN) {
+			sv->sv_ra_window /= 2;
+			spinlock_acquire(&sfs_rastatlock);
+			sfs_rastat_shrinks++;
+			spinlock_release(&sfs_rastatlock);
+		}
+	}
+	sv->sv_ra_hits = sv->sv_ra_misses = 0;
+}
+
+/*
+ * Called by sfs_io after a successful read of file blocks FIRSTBLOCK
+ * through LASTBLOCK. Decide whether the file is being read
+ * sequentially, and if so, top up the blocks queued ahead of it.
+ */
+void
+sfs_readahead(struct sfs_vnode *sv, uint32_t firstblock, uint32_t lastblock)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t fileblocks, target, b;
+	daddr_t diskblock;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(firstblock <= lastblock);
+
+	if (firstblock != sv->sv_ra_next && firstblock + 1 != sv->sv_ra_next) {
+		/* Random access; stop until it goes sequential again. */
+		sv->sv_ra_window = 0;
+		sv->sv_ra_next = lastblock + 1;
+		sv->sv_ra_issued = sv->sv_ra_next;
+		sv->sv_ra_hits = sv->sv_ra_misses = 0;
+		return;
+	}
+
+	sv->sv_ra_next = lastblock + 1;
+	if (sv->sv_ra_window == 0) {
+		sv->sv_ra_window = SFS_RA_MIN;
+	}
+	else {
+		sfs_readahead_adapt(sv);
+	}
+	if (sv->sv_ra_issued < sv->sv_ra_next) {
+		sv->sv_ra_issued = sv->sv_ra_next;
+	}
+
+	/* Top up only once the reader is halfway through what's queued. */
+	if (sv->sv_ra_issued - sv->sv_ra_next > sv->sv_ra_window / 2) {
+		return;
+	}
+
+	fileblocks = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+	target = sv->sv_ra_next + sv->sv_ra_window;
+	if (target > fileblocks) {
+		target = fileblocks;
+	}
+	for (b = sv->sv_ra_issued; b < target; b++) {
+		result = sfs_bmap(sv, b, false, &diskblock);
+		if (result) {
+			break;
+		}
+		if (diskblock != 0 && !sfs_raqueue_add(sfs, diskblock)) {
+			break;
+		}
+	}
+	sv->sv_ra_issued = b;
+}
+
+////////////////////////////////////////////////////////////
+// Statistics
+
+/*
+ * Called by the buffer cache when it recycles a prefetched buffer
+ * nobody read.
+ */
+void
+sfs_readahead_wasted(void)
+{
+	spinlock_acquire(&sfs_rastatlock);
+	sfs_rastat_wasted++;
+	spinlock_release(&sfs_rastatlock);
+}
+
+void
+sfs_readahead_printstats(void)
+{
+	unsigned queued, dropped, hits, misses, wasted, grows, shrinks;
+
+	spinlock_acquire(&sfs_rastatlock);
+	queued = sfs_rastat_queued;
+	dropped = sfs_rastat_dropped;
+	hits = sfs_rastat_hits;
+	misses = sfs_rastat_misses;
+	wasted = sfs_rastat_wasted;
+	grows = sfs_rastat_grows;
+	shrinks = sfs_rastat_shrinks;
+	spinlock_release(&sfs_rastatlock);
+
+	kprintf("sfs readahead: %u blocks queued, %u dropped, "
+		"%u evicted unused\n", queued, dropped, wasted);
+	kprintf("sfs readahead: %u hits, %u misses (%u%%), "
+		"window grew %u times, shrank %u times\n",
+		hits, misses,
+		hits + misses ? hits * 100 / (hits + misses) : 0,
+		grows, shrinks);
+}
@@ -37,6 +37,7 @@
 #include <kern/fcntl.h>
 #include <stat.h>
 #include <lib.h>
+#include <synch.h>
 #include <uio.h>
 #include <vfs.h>
 #include <sfs.h>
@@ -90,6 +91,20 @@ sfs_eachopendir(struct vnode *v, int openflags)
 	return 0;
 }
 
+/*
+ * Copy an inode changed by a namespace operation into the buffer
+ * cache while the operation's journal handle is still open, so the
+ * change commits together with the directory change. If that fails
+ * the inode just stays dirty, and sfs_sync_inodes writes it later.
+ */
+static
+void
+sfs_logvnode(struct sfs_vnode *sv)
+{
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	(void)sfs_sync_inode(sv);
+}
+
 /*
  * Called on the *last* close().
  *
@@ -100,8 +115,26 @@ static
 int
 sfs_lastclose(struct vnode *v)
 {
-	/* Sync it. */
-	return VOP_FSYNC(v);
+	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	int result;
+
+	/*
+	 * Push the inode into the buffer cache. Closing a file doesn't
+	 * promise anything about it being on disk, so don't force the
+	 * cache out (or commit the journal); that's what fsync and sync
+	 * are for.
+	 */
+	result = sfs_jbegin(sfs);
+	if (result) {
+		return result;
+	}
+	lock_acquire(sv->sv_lock);
+	result = sfs_sync_inode(sv);
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
+
+	return result;
 }
 
 /*
@@ -116,13 +149,21 @@ sfs_read(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 
 	return result;
 }
 
+/*
+ * Most blocks written under one journal handle. Fewer consecutive
+ * blocks than half an extent tree node holds can't split any node
+ * twice, which bounds the metadata one handle changes (see
+ * SFS_JCREDITS in sfs_journal.c).
+ */
+#define SFS_WRITECHUNK  (SFS_EXTPERNODE / 2)
+
 /*
  * Called for write(). sfs_io() does the work.
  */
@@ -131,15 +172,47 @@ int
 sfs_write(struct vnode *v, struct uio *uio)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	size_t total, chunk;
 	int result;
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	vfs_biglock_acquire();
-	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	/*
+	 * Writing may allocate blocks, so the file's new size and block
+	 * pointers go into the journal with the freemap changes. A big
+	 * write could change more metadata than fits in one handle, so
+	 * do it SFS_WRITECHUNK blocks at a time.
+	 */
+	while (uio->uio_resid > 0) {
+		total = uio->uio_resid;
+		chunk = SFS_WRITECHUNK * SFS_BLOCKSIZE -
+			uio->uio_offset % SFS_BLOCKSIZE;
+		if (chunk > total) {
+			chunk = total;
+		}
 
-	return result;
+		result = sfs_jbegin(sfs);
+		if (result) {
+			return result;
+		}
+		uio->uio_resid = chunk;
+		lock_acquire(sv->sv_lock);
+		result = sfs_io(sv, uio);
+		if (result == 0) {
+			result = sfs_sync_inode(sv);
+		}
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
+
+		/* Put back what's left beyond this chunk */
+		uio->uio_resid += total - chunk;
+		if (result) {
+			return result;
+		}
+	}
+
+	return 0;
 }
 
 /*
@@ -178,8 +251,10 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 		return result;
 	}
 
+	lock_acquire(sv->sv_lock);
 	statbuf->st_size = sv->sv_i.sfi_size;
 	statbuf->st_nlink = sv->sv_i.sfi_linkcount;
+	lock_release(sv->sv_lock);
 
 	/* We don't support this yet */
 	statbuf->st_blocks = 0;
@@ -198,16 +273,13 @@ sfs_gettype(struct vnode *v, uint32_t *ret)
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
+	/* The type never changes once the vnode is loaded; no lock. */
 	switch (sv->sv_i.sfi_type) {
 	case SFS_TYPE_FILE:
 		*ret = S_IFREG;
-		vfs_biglock_release();
 		return 0;
 	case SFS_TYPE_DIR:
 		*ret = S_IFDIR;
-		vfs_biglock_release();
 		return 0;
 	}
 	panic("sfs: gettype: Invalid inode type (inode %u, type %u)\n",
@@ -245,11 +317,35 @@ int
 sfs_fsync(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	int result;
 
-	vfs_biglock_acquire();
+	result = sfs_jbegin(sfs);
+	if (result) {
+		return result;
+	}
+	lock_acquire(sv->sv_lock);
 	result = sfs_sync_inode(sv);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
+	if (result == 0) {
+		/*
+		 * We don't keep track of which buffers belong to which
+		 * file, so write back everything dirty on the volume.
+		 * Doing it before the commit means that what this
+		 * commit records for the file points only at blocks
+		 * already written. That holds only for fsync: the
+		 * syncer's and sfs_jbegin's commits don't write data
+		 * first, so after a crash a file written since its last
+		 * fsync may have blocks that were never written and
+		 * hold whatever was there before.
+		 */
+		result = sfs_buf_sync(sfs);
+	}
+	if (result == 0) {
+		/* This also picks up everyone else's metadata changes. */
+		result = sfs_jcommit(sfs);
+	}
 
 	return result;
 }
@@ -273,8 +369,22 @@ int
 sfs_truncate(struct vnode *v, off_t len)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	int result;
+
+	result = sfs_jbegin(sfs);
+	if (result) {
+		return result;
+	}
+	lock_acquire(sv->sv_lock);
+	result = sfs_itrunc(sv, len);
+	if (result == 0) {
+		result = sfs_sync_inode(sv);
+	}
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
 
-	return sfs_itrunc(sv, len);
+	return result;
 }
 
 /*
@@ -312,18 +422,24 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	uint32_t ino;
 	int result;
 
-	vfs_biglock_acquire();
+	result = sfs_jbegin(sfs);
+	if (result) {
+		return result;
+	}
+	lock_acquire(sv->sv_lock);
 
 	/* Look up the name */
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return EEXIST;
 	}
 
@@ -331,18 +447,20 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 		/* We got something; load its vnode and return */
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sv->sv_lock);
 			return result;
 		}
 		*ret = &newguy->sv_v;
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return 0;
 	}
 
 	/* Didn't exist - create it */
-	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
+	result = sfs_makeobj(sfs, sv->sv_ino, SFS_TYPE_FILE, &newguy);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
 
@@ -353,19 +471,25 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
 	if (result) {
 		VOP_DECREF(&newguy->sv_v);
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
 
 	/* Update the linkcount of the new file */
+	lock_acquire(newguy->sv_lock);
 	newguy->sv_i.sfi_linkcount++;
 
 	/* and consequently mark it dirty. */
 	newguy->sv_dirty = true;
+	sfs_logvnode(newguy);
+	lock_release(newguy->sv_lock);
 
 	*ret = &newguy->sv_v;
 
-	vfs_biglock_release();
+	sfs_logvnode(sv);
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
 	return 0;
 }
 
@@ -378,26 +502,41 @@ static
 int
 sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 {
+	struct sfs_fs *sfs = dir->vn_fs->fs_data;
 	struct sfs_vnode *sv = dir->vn_data;
 	struct sfs_vnode *f = file->vn_data;
 	int result;
 
 	KASSERT(file->vn_fs == dir->vn_fs);
 
-	vfs_biglock_acquire();
+	result = sfs_jbegin(sfs);
+	if (result) {
+		return result;
+	}
+	lock_acquire(sv->sv_lock);
 
 	/* Just create a link */
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
 
 	/* and update the link count, marking the inode dirty */
+	if (f != sv) {
+		lock_acquire(f->sv_lock);
+	}
 	f->sv_i.sfi_linkcount++;
 	f->sv_dirty = true;
+	sfs_logvnode(f);
+	if (f != sv) {
+		lock_release(f->sv_lock);
+	}
 
-	vfs_biglock_release();
+	sfs_logvnode(sv);
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
 	return 0;
 }
 
@@ -408,17 +547,23 @@ static
 int
 sfs_remove(struct vnode *dir, const char *name)
 {
+	struct sfs_fs *sfs = dir->vn_fs->fs_data;
 	struct sfs_vnode *sv = dir->vn_data;
 	struct sfs_vnode *victim;
 	int slot;
 	int result;
 
-	vfs_biglock_acquire();
+	result = sfs_jbegin(sfs);
+	if (result) {
+		return result;
+	}
+	lock_acquire(sv->sv_lock);
 
 	/* Look for the file and fetch a vnode for it. */
 	result = sfs_lookonce(sv, name, &victim, &slot);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
 
@@ -426,15 +571,25 @@ sfs_remove(struct vnode *dir, const char *name)
 	result = sfs_dir_unlink(sv, slot);
 	if (result==0) {
 		/* If we succeeded, decrement the link count. */
+		lock_acquire(victim->sv_lock);
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
 		victim->sv_dirty = true;
+		sfs_logvnode(victim);
+		lock_release(victim->sv_lock);
+		sfs_logvnode(sv);
 	}
 
-	/* Discard the reference that sfs_lookonce got us */
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
+
+	/*
+	 * Discard the reference that sfs_lookonce got us. If this was
+	 * the last link, reclaiming the file frees its blocks in a
+	 * journal handle of its own.
+	 */
 	VOP_DECREF(&victim->sv_v);
 
-	vfs_biglock_release();
 	return result;
 }
 
@@ -449,26 +604,39 @@ int
 sfs_rename(struct vnode *d1, const char *n1,
 	   struct vnode *d2, const char *n2)
 {
+	struct sfs_fs *sfs = d1->vn_fs->fs_data;
 	struct sfs_vnode *sv = d1->vn_data;
 	struct sfs_vnode *g1;
 	int slot1, slot2;
 	int result, result2;
 
-	vfs_biglock_acquire();
-
 	KASSERT(d1==d2);
 	KASSERT(sv->sv_ino == SFS_ROOT_LOCATION);
 
+	result = sfs_jbegin(sfs);
+	if (result) {
+		return result;
+	}
+
+	/*
+	 * With only one directory there is only one directory lock
+	 * to take; the file's own lock nests inside it as usual.
+	 */
+	lock_acquire(sv->sv_lock);
+
 	/* Look up the old name of the file and get its inode and slot number*/
 	result = sfs_lookonce(sv, n1, &g1, &slot1);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
 
 	/* We don't support subdirectories */
 	KASSERT(g1->sv_i.sfi_type == SFS_TYPE_FILE);
 
+	lock_acquire(g1->sv_lock);
+
 	/*
 	 * Link it under the new name.
 	 *
@@ -500,10 +668,15 @@ sfs_rename(struct vnode *d1, const char *n1,
 	g1->sv_i.sfi_linkcount--;
 	g1->sv_dirty = true;
 
+	sfs_logvnode(g1);
+	sfs_logvnode(sv);
+	lock_release(g1->sv_lock);
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
+
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
 
-	vfs_biglock_release();
 	return 0;
 
  puke_harder:
@@ -518,10 +691,14 @@ sfs_rename(struct vnode *d1, const char *n1,
 		panic("sfs: rename: Cannot recover\n");
 	}
 	g1->sv_i.sfi_linkcount--;
+	sfs_logvnode(g1);
+	sfs_logvnode(sv);
  puke:
+	lock_release(g1->sv_lock);
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
-	vfs_biglock_release();
 	return result;
 }
 
@@ -539,15 +716,12 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
+	/* Nothing here touches mutable inode state; no lock needed. */
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
 	if (strlen(path)+1 > buflen) {
-		vfs_biglock_release();
 		return ENAMETOOLONG;
 	}
 	strcpy(buf, path);
@@ -555,7 +729,6 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 	VOP_INCREF(&sv->sv_v);
 	*ret = &sv->sv_v;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -573,22 +746,20 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 	struct sfs_vnode *final;
 	int result;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
+	lock_acquire(sv->sv_lock);
 	result = sfs_lookonce(sv, path, &final, NULL);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	*ret = &final->sv_v;
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return 0;
 }
 
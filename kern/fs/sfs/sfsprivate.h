@@ -39,38 +39,110 @@ extern const struct vnode_ops sfs_dirops;
 #define SFSUIO(iov, uio, ptr, block, rw) \
     uio_kinit(iov, uio, ptr, SFS_BLOCKSIZE, ((off_t)(block))*SFS_BLOCKSIZE, rw)
 
+/* Largest file: sfi_size and file block numbers are 32 bits */
+#define SFS_MAXFILESIZE \
+    ((off_t)((uint32_t)-1 / SFS_BLOCKSIZE) * SFS_BLOCKSIZE)
+
+
+/* Functions in sfs_buf.c */
+struct sfs_buf;
+int sfs_buf_read(struct sfs_fs *sfs, daddr_t block, struct sfs_buf **ret);
+int sfs_buf_get(struct sfs_fs *sfs, daddr_t block, struct sfs_buf **ret);
+void *sfs_buf_map(struct sfs_buf *b);
+bool sfs_buf_isvalid(struct sfs_buf *b);
+void sfs_buf_markdirty(struct sfs_buf *b);
+void sfs_buf_markmeta(struct sfs_buf *b);
+void sfs_buf_release(struct sfs_buf *b);
+int sfs_buf_prefetch(struct sfs_fs *sfs, daddr_t block);
+bool sfs_buf_wasprefetched(struct sfs_buf *b);
+void sfs_buf_discard(struct sfs_fs *sfs, daddr_t block);
+int sfs_buf_sync(struct sfs_fs *sfs);
+int sfs_buf_writeback(struct sfs_fs *sfs, unsigned age);
+void sfs_buf_unmount(struct sfs_fs *sfs);
 
 /* Functions in sfs_balloc.c */
-int sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock);
+int sfs_balloc_init(struct sfs_fs *sfs);
+void sfs_balloc_cleanup(struct sfs_fs *sfs);
+bool sfs_freemap_takedirty(struct sfs_fs *sfs, unsigned mapblock);
+int sfs_balloc(struct sfs_fs *sfs, daddr_t goal, daddr_t *diskblock);
+bool sfs_bisnew(struct sfs_fs *sfs, daddr_t diskblock);
+void sfs_bwritten(struct sfs_fs *sfs, daddr_t diskblock);
+int sfs_bzerosync(struct sfs_fs *sfs);
 void sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock);
+void sfs_bcommitted(struct sfs_fs *sfs, uint32_t seq);
 int sfs_bused(struct sfs_fs *sfs, daddr_t diskblock);
 
+/* Functions in sfs_journal.c */
+int sfs_journal_init(struct sfs_fs *sfs);
+void sfs_journal_cleanup(struct sfs_fs *sfs);
+int sfs_jbegin(struct sfs_fs *sfs);
+int sfs_jjoin(struct sfs_fs *sfs);
+void sfs_jend(struct sfs_fs *sfs);
+void sfs_jlog(struct sfs_fs *sfs, daddr_t block, const void *data);
+bool sfs_jread(struct sfs_fs *sfs, daddr_t block, void *data);
+void sfs_jrevoke(struct sfs_fs *sfs, daddr_t block);
+uint32_t sfs_jrunningseq(struct sfs_fs *sfs);
+int sfs_jcommit(struct sfs_fs *sfs);
+int sfs_jcheckpoint(struct sfs_fs *sfs, bool all);
+void sfs_journal_printstats(void);
+
+/* Functions in sfs_fsops.c */
+void sfs_syncer_bootstrap(void);
+
 /* Functions in sfs_bmap.c */
 int sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		daddr_t *diskblock);
+int sfs_inline_promote(struct sfs_vnode *sv);
 int sfs_itrunc(struct sfs_vnode *sv, off_t len);
 
+/* Functions in sfs_extent.c */
+void sfs_ext_create(struct sfs_vnode *sv, daddr_t block);
+int sfs_ext_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
+		daddr_t *diskblock);
+int sfs_ext_trunc(struct sfs_vnode *sv, uint32_t blocklen);
+void sfs_ext_printstats(void);
+
 /* Functions in sfs_dir.c */
 int sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 		uint32_t *ino, int *slot, int *emptyslot);
 int sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino,
 		int *slot);
 int sfs_dir_unlink(struct sfs_vnode *sv, int slot);
+void sfs_dir_dropindex(struct sfs_vnode *sv);
 int sfs_lookonce(struct sfs_vnode *sv, const char *name,
 		struct sfs_vnode **ret,
 		int *slot);
 
 /* Functions in sfs_inode.c */
+int sfs_vnhash_init(struct sfs_fs *sfs);
+void sfs_vnhash_cleanup(struct sfs_fs *sfs);
+void sfs_vnhash_foreach(struct sfs_fs *sfs,
+		void (*func)(struct sfs_vnode *, void *), void *data);
 int sfs_sync_inode(struct sfs_vnode *sv);
 int sfs_reclaim(struct vnode *v);
 int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		struct sfs_vnode **ret);
-int sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret);
+int sfs_makeobj(struct sfs_fs *sfs, uint32_t near, int type,
+		struct sfs_vnode **ret);
 struct vnode *sfs_getroot(struct fs *fs);
 
+/* Functions in sfs_readahead.c */
+void sfs_readahead_bootstrap(void);
+void sfs_readahead_account(struct sfs_vnode *sv, uint32_t fileblock,
+		struct sfs_buf *buf);
+void sfs_readahead(struct sfs_vnode *sv, uint32_t firstblock,
+		uint32_t lastblock);
+void sfs_readahead_unmount(struct sfs_fs *sfs);
+void sfs_readahead_wasted(void);
+void sfs_readahead_printstats(void);
+
 /* Functions in sfs_io.c */
 int sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data);
 int sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data);
+int sfs_readblocks(struct sfs_fs *sfs, daddr_t block, unsigned nblocks,
+		void *data);
+int sfs_writeblocks(struct sfs_fs *sfs, daddr_t block, unsigned nblocks,
+		void *data);
 int sfs_io(struct sfs_vnode *sv, struct uio *uio);
 
 
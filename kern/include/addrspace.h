@@ -39,13 +39,40 @@
 #include "opt-dumbvm.h"
 
 struct vnode;
+struct pagetable;
 
 
+/*
+ * Size of the user stack, in pages. Stack pages are only allocated
+ * when first touched.
+ */
+#define VM_STACKPAGES    1024
+
+/*
+ * A region: a range of pages set up by as_define_region or
+ * as_define_stack. Addresses outside every region are invalid.
+ *
+ * A region loaded from an executable also records where in the file
+ * its contents come from (see as_map_file); the rest of it, and all
+ * of any other region, starts out zero-filled.
+ */
+struct region {
+	vaddr_t rg_vbase;		/* first address */
+	size_t rg_npages;		/* length */
+	bool rg_writeable;		/* writes allowed (after loading) */
+	struct vnode *rg_vnode;		/* executable, or NULL */
+	vaddr_t rg_filevaddr;		/* address of the file data */
+	off_t rg_fileoffset;		/* where it is in the file */
+	size_t rg_filesize;		/* how much of it there is */
+	struct region *rg_next;
+};
+
 /*
  * Address space - data structure associated with the virtual memory
  * space of a process.
  *
- * You write this.
+ * Pages are allocated zero-filled on first touch and shared
+ * copy-on-write by as_copy; see vm_fault.
  */
 
 struct addrspace {
@@ -58,7 +85,9 @@ struct addrspace {
         size_t as_npages2;
         paddr_t as_stackpbase;
 #else
-        /* Put stuff here for your VM system */
+        struct region *as_regions;	/* list of regions */
+        struct pagetable *as_pt;	/* page table */
+        bool as_loading;		/* between prepare and complete_load */
 #endif
 };
 
@@ -99,6 +128,12 @@ struct addrspace {
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
  *
+ *    as_map_file - (not with dumbvm) arrange for the FILESIZE bytes at
+ *                VADDR to be read from file V at OFFSET as they're
+ *                touched, instead of loading them now. Called for
+ *                each segment between as_prepare_load and
+ *                as_complete_load.
+ *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
  */
@@ -118,6 +153,15 @@ int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 
+#if !OPT_DUMBVM
+int               as_map_file(struct addrspace *as, vaddr_t vaddr,
+                              size_t memsize, struct vnode *v,
+                              off_t offset, size_t filesize);
+
+/* Find the region containing VADDR, or NULL. */
+struct region    *as_findregion(struct addrspace *as, vaddr_t vaddr);
+#endif
+
 
 /*
  * Functions in loadelf.c
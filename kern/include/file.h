@@ -10,21 +10,71 @@
  */
 #include <limits.h>
 #include <types.h>
+#include <spinlock.h>
 
 /*
  * Put your function declarations and data types here ...
  */
 #define NO_ERROR 0
 
-struct file_descriptor {
-	char* name;
-	int flags;
-	off_t offset;
-	int ref_count;
-	struct lock* lock;
-	struct vnode* vnode;
+/*
+ * Size of the system-wide open file table. Every open() anywhere in
+ * the system takes one entry until the last descriptor referring to
+ * it is closed.
+ */
+#define SYS_OPEN_MAX 256
+
+/*
+ * An open file. These live in the system-wide open file table and
+ * are shared by every descriptor that refers to them: descriptors
+ * made by dup2() in the same process and descriptors inherited
+ * across fork().
+ *
+ * of_refcount is the number of descriptors (plus any in-flight
+ * syscalls) referring to the file, protected by of_countlock.
+ * of_offsetlock serialises I/O on the offset. It is created once,
+ * when the table is set up, not on each open, and is only taken when
+ * the file is shared (see file.c).
+ */
+struct bitmap;
+
+struct open_file {
+	struct vnode *of_vnode;		/* file opened */
+	int of_flags;			/* flags passed to open() */
+	off_t of_offset;		/* current seek position */
+	struct lock *of_offsetlock;	/* protects of_offset */
+	struct spinlock of_countlock;	/* protects of_refcount */
+	unsigned of_refcount;		/* 0 if this table entry is free */
+	struct open_file *of_nextfree;	/* free list link */
 };
 
+/*
+ * Per-process descriptor table, in struct proc. Maps descriptor
+ * numbers to open files; each non-NULL entry holds a reference.
+ * fdt_lock is taken by writers only; lookups are lock-free.
+ */
+struct fdtable {
+	struct spinlock fdt_lock;		/* serialises updates */
+	struct open_file *fdt_files[OPEN_MAX];	/* NULL if not open */
+	struct bitmap *fdt_used;		/* set for each open fd */
+	unsigned fdt_lowfree;			/* no free fd below this */
+};
+
+/* Open file table. */
+void filetable_bootstrap(void);
+int file_open(char *path, int flags, mode_t mode, struct open_file **ret);
+void file_incref(struct open_file *file);
+void file_decref(struct open_file *file);
+
+/* Descriptor tables. */
+int fdtable_init(struct fdtable *fdt);
+void fdtable_copy(struct fdtable *src, struct fdtable *dst);
+void fdtable_closeall(struct fdtable *fdt);
+struct open_file *fdtable_get(struct fdtable *fdt, int fd);
+int fdtable_alloc(struct fdtable *fdt, struct open_file *file, int *fd_ret);
+struct open_file *fdtable_replace(struct fdtable *fdt, int fd,
+				  struct open_file *file);
+
 struct retval {
 	int errno;
 	void* val_h;
@@ -34,6 +84,10 @@ struct retval {
 struct retval mywrite(int fd, void *buf, size_t nbytes);
 struct retval myopen(const_userptr_t filename, int flags);
 struct retval myread(int fd, void *buf, size_t buflen);
+struct retval mypread(int fd, void *buf, size_t buflen, off_t pos);
+struct retval mypwrite(int fd, void *buf, size_t nbytes, off_t pos);
+struct retval myreadv(int fd, const_userptr_t iov, int iovcnt);
+struct retval mywritev(int fd, const_userptr_t iov, int iovcnt);
 struct retval mylseek(int fd, off_t pos, int whence);
 struct retval myclose(int fd);
 struct retval mydup2(int oldfd, int newfd);
@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _IOSCHED_H_
+#define _IOSCHED_H_
+
+/*
+ * Block I/O scheduler.
+ *
+ * A disk driver keeps the requests it hasn't started yet in a struct
+ * iosched instead of a plain FIFO, and asks it which request to
+ * start next each time the disk goes idle. The policy that makes
+ * that choice can be switched at runtime:
+ *
+ *    fifo      - arrival order.
+ *    clook     - one-way elevator: the lowest block at or beyond
+ *                the last one serviced, wrapping to the lowest
+ *                block overall when there is none.
+ *    deadline  - clook, except that a request that has waited past
+ *                its deadline (shorter for reads than for writes)
+ *                goes first.
+ *
+ * Whatever the policy, when a request is dispatched any queued
+ * requests in the same direction that continue it on disk are
+ * dispatched with it as a batch, chained through ir_merged, so the
+ * driver can run them back to back without seeking.
+ *
+ * The scheduler has no lock of its own: all calls must be made with
+ * the driver's queue lock held, which is passed to iosched_create so
+ * the functions can assert it. That lock is normally a spinlock
+ * taken in the interrupt handler, so nothing here sleeps.
+ */
+
+#include <kern/time.h>
+
+struct spinlock;
+
+/*
+ * One request. Embedded in the driver's own request structure.
+ */
+struct ioreq {
+	uint32_t ir_block;		/* first block */
+	uint32_t ir_nblocks;		/* number of blocks */
+	bool ir_write;			/* true for write */
+	struct timespec ir_queued;	/* when iosched_add was called */
+	struct timespec ir_deadline;	/* for the deadline policy */
+	struct ioreq *ir_next;		/* queue link (private) */
+	struct ioreq *ir_merged;	/* next request in dispatched batch */
+};
+
+struct iosched;
+
+/* Setup/teardown; name is used for stats output and is not copied. */
+struct iosched *iosched_create(const char *name, struct spinlock *lock);
+void iosched_destroy(struct iosched *ios);
+
+/*
+ * iosched_add     - queue a request. Fills in ir_queued.
+ * iosched_next    - pick the next request to start, or NULL if the
+ *                   queue is empty. Requests merged with it follow
+ *                   via ir_merged.
+ * iosched_done    - a dispatched request has completed; account for
+ *                   its latency.
+ */
+void iosched_add(struct iosched *ios, struct ioreq *req);
+struct ioreq *iosched_next(struct iosched *ios);
+void iosched_done(struct iosched *ios, struct ioreq *req);
+
+/*
+ * Change the policy on every registered device (name is "fifo",
+ * "clook", or "deadline"); returns EINVAL for an unknown name.
+ * Print per-device statistics.
+ */
+int iosched_setpolicy(const char *policy);
+void iosched_printstats(void);
+
+#endif /* _IOSCHED_H_ */
@@ -74,11 +74,120 @@ struct sfs_super {
 	uint32_t sp_magic;		/* Magic number; should be SFS_MAGIC */
 	uint32_t sp_nblocks;			/* Number of blocks in fs */
 	char sp_volname[SFS_VOLNAME_SIZE];	/* Name of this volume */
-	uint32_t reserved[118];			/* unused, set to 0 */
+	uint32_t sp_jstart;			/* 1st block of journal, or 0 */
+	uint32_t sp_jblocks;			/* Number of blocks in journal */
+	uint32_t reserved[116];			/* unused, set to 0 */
+};
+
+/*
+ * Metadata journal.
+ *
+ * If sp_jstart is nonzero, the sp_jblocks blocks starting there
+ * (marked in use in the freemap) hold a write-ahead log of metadata
+ * updates. The first is a header; the rest are used as a circular
+ * log of transactions, each written as:
+ *
+ *    descriptor block, followed by a copy of each block it tags
+ *    (more descriptors and copies, if there are many)
+ *    commit block
+ *
+ * A tag with SFS_JTAG_REVOKE set is a revoke: the block named was
+ * freed, and copies of it in earlier transactions must not be
+ * replayed. Revoke tags have no copy after them.
+ *
+ * jh_tail is the log position (0 being the block after the header)
+ * of the oldest transaction not yet written back in place, and
+ * jh_tailseq its sequence number. Transactions from there on with
+ * consecutive sequence numbers and a commit block whose checksum
+ * matches are replayed at mount time.
+ */
+#define SFS_JMAGIC_HEADER 0x4a726e6c    /* journal header */
+#define SFS_JMAGIC_DESC   0x4a446573    /* descriptor block */
+#define SFS_JMAGIC_COMMIT 0x4a436d74    /* commit block */
+#define SFS_JTAG_REVOKE   0x80000000    /* tag flag: block was freed */
+#define SFS_JTAGS         ((SFS_BLOCKSIZE / sizeof(uint32_t)) - 3)
+
+struct sfs_jheader {
+	uint32_t jh_magic;			/* SFS_JMAGIC_HEADER */
+	uint32_t jh_tail;			/* log position of oldest txn */
+	uint32_t jh_tailseq;			/* its sequence number */
+	uint32_t reserved[125];			/* unused, set to 0 */
+};
+
+struct sfs_jdesc {
+	uint32_t jd_magic;			/* SFS_JMAGIC_DESC */
+	uint32_t jd_seq;			/* transaction sequence number */
+	uint32_t jd_ntags;			/* number of tags used */
+	uint32_t jd_tags[SFS_JTAGS];		/* block numbers */
+};
+
+struct sfs_jcommit {
+	uint32_t jc_magic;			/* SFS_JMAGIC_COMMIT */
+	uint32_t jc_seq;			/* transaction sequence number */
+	uint32_t jc_checksum;			/* over the txn's other blocks */
+	uint32_t reserved[125];			/* unused, set to 0 */
+};
+
+/* Flags for sfi_flags */
+#define SFS_IF_INLINE     0x00000001    /* data is in sfi_u.sfu_inline */
+#define SFS_IF_EXTENTS    0x00000002    /* sfi_u.sfu_extents maps blocks */
+
+/* Bytes of data that fit in the inode itself */
+#define SFS_INLINESIZE    ((128-4-SFS_NDIRECT) * sizeof(uint32_t))
+
+/*
+ * Extent tree, for files with SFS_IF_EXTENTS set.
+ *
+ * An extent maps a run of ex_len consecutive file blocks, starting
+ * at ex_fileblock, to as many consecutive disk blocks starting at
+ * ex_block. The extents of a file are kept sorted by ex_fileblock in
+ * a B-tree whose root is in the inode (struct sfs_extroot) and whose
+ * other nodes are disk blocks (struct sfs_extnode). A node of depth
+ * 0 holds extents; a node of depth N > 0 holds index entries, each
+ * pointing (in ex_block) at a node of depth N-1 whose blocks all lie
+ * at or after ex_fileblock and before the next entry's ex_fileblock.
+ * ex_len is 0 in index entries. File blocks not covered by any
+ * extent are holes.
+ */
+struct sfs_extent {
+	uint32_t ex_fileblock;			/* first file block */
+	uint32_t ex_block;			/* first disk block, or node */
+	uint32_t ex_len;			/* # blocks; 0 in index entries */
+};
+
+#define SFS_EXTMAGIC      0x45787473    /* magic number for extent nodes */
+#define SFS_EXTMAXDEPTH   4             /* max extent tree depth */
+
+/* Entries in an extent tree node and in the root in the inode */
+#define SFS_EXTPERNODE \
+	((SFS_BLOCKSIZE - 2*sizeof(uint32_t)) / sizeof(struct sfs_extent))
+#define SFS_EXTPERROOT \
+	((SFS_INLINESIZE - sizeof(uint32_t)) / sizeof(struct sfs_extent))
+
+struct sfs_extroot {
+	uint16_t er_nentries;			/* entries in use */
+	uint16_t er_depth;			/* 0 if er_ext holds extents */
+	struct sfs_extent er_ext[SFS_EXTPERROOT];
+};
+
+struct sfs_extnode {
+	uint32_t en_magic;			/* SFS_EXTMAGIC */
+	uint16_t en_nentries;			/* entries in use */
+	uint16_t en_depth;			/* 0 if en_ext holds extents */
+	struct sfs_extent en_ext[SFS_EXTPERNODE];
 };
 
 /*
  * On-disk inode
+ *
+ * If SFS_IF_INLINE is set, the file's contents (sfi_size bytes, at
+ * most SFS_INLINESIZE) are kept in sfi_u.sfu_inline rather than in
+ * data blocks. The data bytes of an inline directory are directory
+ * entries, as in a directory block. If SFS_IF_EXTENTS is set, the
+ * file's blocks are found through the extent tree rooted at
+ * sfi_u.sfu_extents. In either case the block pointers are all 0;
+ * otherwise the block pointers are used and sfi_u is unused and set
+ * to 0.
  */
 struct sfs_dinode {
 	uint32_t sfi_size;			/* Size of this file (bytes) */
@@ -86,7 +195,11 @@ struct sfs_dinode {
 	uint16_t sfi_linkcount;			/* # hard links to this file */
 	uint32_t sfi_direct[SFS_NDIRECT];	/* Direct blocks */
 	uint32_t sfi_indirect;			/* Indirect block */
-	uint32_t sfi_waste[128-3-SFS_NDIRECT];	/* unused space, set to 0 */
+	uint32_t sfi_flags;			/* SFS_IF_* above */
+	union {
+		uint8_t sfu_inline[SFS_INLINESIZE];	/* inline data */
+		struct sfs_extroot sfu_extents;	/* extent tree root */
+	} sfi_u;
 };
 
 /*
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _PAGETABLE_H_
+#define _PAGETABLE_H_
+
+/*
+ * Page tables.
+ *
+ * A two-level table mapping user virtual pages to page table entries.
+ * The top level is indexed by the top ten bits of the address; the
+ * second-level tables are allocated as they're first needed.
+ *
+ * A page table entry is a uint32_t. When PTE_VALID is set, the top
+ * twenty bits are the physical page, whose coremap reference the
+ * entry holds. When PTE_SWAPPED is set instead, they're the swap slot
+ * the page was written to, which the entry owns. PTE_COW means the
+ * page may be shared with another address space and has to be copied
+ * before it can be written.
+ *
+ * Entries are read and changed with the page table's spinlock held
+ * (pt_acquire/pt_release), since the pageout code changes them from
+ * outside the address space. Second-level tables are only allocated
+ * by the thread running in the address space, and only freed by
+ * pt_destroy, so pt_lookup itself needs no lock. The lock ranks
+ * above the coremap's.
+ */
+
+struct addrspace;
+
+#define PTE_FRAME   0xfffff000	/* physical page, if PTE_VALID */
+#define PTE_VALID   0x00000001	/* page is in memory */
+#define PTE_COW     0x00000002	/* copy before writing */
+#define PTE_SWAPPED 0x00000004	/* page is in swap */
+
+#define PTE_SLOT(pte)   ((pte) >> 12)		/* swap slot */
+#define PTE_MKSLOT(slot) ((uint32_t)(slot) << 12)
+
+struct pagetable;
+
+/*
+ * pt_create  - make an empty page table.
+ * pt_destroy - drop AS's references to all its pages, free its swap
+ *              slots, and free the table.
+ * pt_lookup  - return the entry for VADDR. If there's no second-level
+ *              table for it, make one if CREATE is set, otherwise
+ *              return NULL. Also returns NULL if out of memory.
+ * pt_share   - copy the entries of FROM into TO, which must be empty,
+ *              marking every page copy-on-write in both. Pages in
+ *              swap are copied to new slots.
+ * pt_acquire/pt_release - lock and unlock the entries.
+ */
+struct pagetable *pt_create(void);
+void pt_destroy(struct pagetable *pt, struct addrspace *as);
+uint32_t *pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create);
+int pt_share(struct pagetable *from, struct pagetable *to);
+void pt_acquire(struct pagetable *pt);
+void pt_release(struct pagetable *pt);
+
+#endif /* _PAGETABLE_H_ */
@@ -38,6 +38,7 @@
 
 #include <spinlock.h>
 #include <thread.h> /* required for struct threadarray */
+#include <file.h> /* required for struct fdtable */
 
 struct addrspace;
 struct vnode;
@@ -55,6 +56,7 @@ struct proc {
 
 	/* VFS */
 	struct vnode *p_cwd;		/* current working directory */
+	struct fdtable p_fdtable;	/* open file descriptors */
 
 	/* add more material here as needed */
 };
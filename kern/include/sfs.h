@@ -48,6 +48,48 @@
  */
 #include <kern/sfs.h>
 
+/*
+ * Locking.
+ *
+ * Each in-memory inode has a sleep lock, sv_lock, that protects the
+ * inode contents (sv_i, sv_dirty) and, for directories, the directory
+ * entries. Each volume has sfs_vnlock, protecting the hash table of
+ * loaded vnodes, and sfs_freemaplock, protecting the free block bitmap,
+ * its per-region free counts, the map of new blocks, and the
+ * superblock.
+ *
+ * Locks are acquired in this order:
+ *
+ *    0. sfs_mountlock (the syncer's list of volumes; sfs_fsops.c)
+ *    1. j_iolock (journal commit and checkpoint; sfs_journal.c)
+ *    2. sv_lock of a directory
+ *    3. sv_lock of a file (or directory) named in it
+ *    4. sfs_vnlock
+ *    5. buffers in the buffer cache
+ *    6. j_lock (journal state; sfs_journal.c)
+ *    7. sfs_freemaplock
+ *
+ * When two inodes at the same level must be locked together (e.g.
+ * the old and new parent directories in a rename, or the source and
+ * target files) the one with the lower inode number goes first.
+ * VOP_LOOKPARENT and VOP_LOOKUP return their results referenced but
+ * unlocked, so callers start again from the top of the order.
+ *
+ * On a journaled volume, operations that change metadata run between
+ * sfs_jbegin and sfs_jend, which may wait for the journal to commit;
+ * so sfs_jbegin is called before taking any sv_lock.
+ *
+ * sv_lock is not needed to read sv_ino or sfi_type, which never change
+ * while the vnode is loaded, and is not taken by sfs_reclaim, which
+ * only runs once nobody else has a reference.
+ */
+
+/* Directory name index (private to sfs_dir.c) */
+struct sfs_dirindex;
+
+/* Metadata journal (private to sfs_journal.c) */
+struct sfs_journal;
+
 /*
  * In-memory inode
  */
@@ -56,6 +98,19 @@ struct sfs_vnode {
 	struct sfs_dinode sv_i;		/* copy of on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	struct lock *sv_lock;           /* lock for sv_i and contents */
+	struct sfs_vnode *sv_hashnext;  /* next in sfs_vnhash chain */
+	struct sfs_dirindex *sv_dirindex; /* name index (directories) */
+
+	/* Read-ahead state (sfs_readahead.c); protected by sv_lock */
+	uint32_t sv_ra_next;		/* block a sequential read reads next */
+	uint32_t sv_ra_issued;		/* prefetch queued up to here */
+	uint32_t sv_ra_window;		/* blocks to stay ahead; 0 if random */
+	uint32_t sv_ra_hits;		/* prefetched blocks found ready */
+	uint32_t sv_ra_misses;		/* prefetched blocks not ready */
+
+	/* Last extent looked up (sfs_extent.c); protected by sv_lock */
+	struct sfs_extent sv_extcache;	/* ex_len is 0 if none */
 };
 
 /*
@@ -66,9 +121,22 @@ struct sfs_fs {
 	struct sfs_super sfs_super;	/* copy of on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct sfs_vnode **sfs_vnhash;  /* vnodes loaded, hashed by inode */
+	unsigned sfs_vnhashsize;        /* number of sfs_vnhash chains */
+	unsigned sfs_nvnodes;           /* number of vnodes loaded */
+	struct lock *sfs_vnlock;        /* lock for sfs_vnhash */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
-	bool sfs_freemapdirty;          /* true if freemap modified */
+	struct bitmap *sfs_freemapdirty; /* freemap blocks modified */
+	unsigned sfs_nfreemapdirty;     /* number of bits set in that */
+	uint32_t *sfs_regionfree;       /* free blocks in each region */
+	unsigned sfs_nregions;          /* number of regions */
+	struct bitmap *sfs_zeromap;     /* new blocks, not yet written */
+	unsigned sfs_nzero;             /* number of bits set in zeromap */
+	struct bitmap *sfs_freedmap[2]; /* freed, not committed (journal) */
+	unsigned sfs_nfreed[2];         /* number of bits set in those */
+	struct lock *sfs_freemaplock;   /* lock for freemap and superblock */
+	struct sfs_journal *sfs_journal; /* metadata journal, or NULL */
+	struct sfs_fs *sfs_nextmount;   /* list of mounted volumes */
 };
 
 /*
@@ -76,5 +144,21 @@ struct sfs_fs {
  */
 int sfs_mount(const char *device);
 
+/*
+ * Set up global SFS state (the buffer cache). Call once at boot.
+ */
+void sfs_bootstrap(void);
+
+/*
+ * Print SFS statistics (for the kernel menu).
+ */
+void sfs_printstats(void);
+
+/*
+ * Get/set the age in seconds at which dirty data is written back.
+ */
+unsigned sfs_getwritebackage(void);
+void sfs_setwritebackage(unsigned secs);
+
 
 #endif /* _SFS_H_ */
@@ -60,6 +60,8 @@ int writestress(int, char **);
 int writestress2(int, char **);
 int longstress(int, char **);
 int createstress(int, char **);
+int dirtest(int, char **);
+int fragtest(int, char **);
 int printfile(int, char **);
 
 /* other tests */
@@ -39,10 +39,10 @@
 #include <array.h>
 #include <spinlock.h>
 #include <threadlist.h>
-#include <file.h>
 #include <synch.h>
 
 struct cpu;
+struct vnode;
 
 /* get machine-dependent defs */
 #include <machine/thread.h>
@@ -107,11 +107,14 @@ struct thread {
 	 * Public fields
 	 */
 
-	/* add more here as needed */
+	/*
+	 * File this thread is reading into or writing from user
+	 * memory, if any, so a page fault during the copy doesn't try
+	 * to page in from the same filesystem (see vm_pagein).
+	 */
+	struct vnode *t_iovnode;
 
-	 struct file_descriptor* file_descriptors[OPEN_MAX];
-	 struct lock* fd_table_lock;
-	 int previous_fd;
+	/* add more here as needed */
 };
 
 /*
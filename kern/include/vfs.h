@@ -81,6 +81,29 @@ int vfs_lookup(char *path, struct vnode **result);
 int vfs_lookparent(char *path, struct vnode **result,
 		   char *buf, size_t buflen);
 
+/*
+ * Name cache (vfscache.c), used by vfs_lookup.
+ *
+ *    vfs_cache_lookup   - Look up a name in a directory. Returns true
+ *                         on a hit, with *RESULT NULL if the name is
+ *                         known not to exist; on a miss, returns false
+ *                         and sets *GEN for vfs_cache_enter.
+ *    vfs_cache_enter    - Remember the result of a lookup that missed.
+ *    vfs_cache_purge    - Forget a name in a directory; call after any
+ *                         operation that adds, removes, or renames it.
+ *    vfs_cache_purgefs  - Forget everything on a filesystem, so it can
+ *                         be unmounted.
+ */
+
+bool vfs_cache_lookup(struct vnode *dir, const char *name,
+		      struct vnode **result, unsigned *gen);
+void vfs_cache_enter(struct vnode *dir, const char *name, struct vnode *vn,
+		     unsigned gen);
+void vfs_cache_purge(struct vnode *dir, const char *name);
+void vfs_cache_purgefs(struct fs *fs);
+void vfs_cache_bootstrap(void);
+void vfs_cache_printstats(void);
+
 /*
  * VFS layer high-level operations on pathnames
  * Because lookup may destroy pathnames, these all may too.
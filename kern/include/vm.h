@@ -59,5 +59,123 @@ void free_kpages(vaddr_t addr);
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
 
+/* Invalidate this CPU's TLB (not with dumbvm) */
+void vm_tlbflush(void);
+
+/*
+ * Physical page allocator (coremap.c).
+ *
+ *    coremap_bootstrap  - take over the memory ram_getsize reports.
+ *    coremap_alloc      - allocate NPAGES contiguous pages, owned by AS
+ *                         at VADDR or by the kernel if AS is NULL.
+ *                         User pages come back busy. Returns 0 if
+ *                         there's no room.
+ *    coremap_free       - free a run returned by coremap_alloc.
+ *    coremap_nfree      - number of free pages.
+ *    coremap_npages     - number of pages that can be allocated.
+ *
+ * The rest deal with single user pages; see coremap.c for busy pages.
+ *
+ *    coremap_incref     - add a mapping.
+ *    coremap_share      - add a mapping, unless the page is busy.
+ *    coremap_decref     - drop AS's mapping; the page is freed with
+ *                         the last one.
+ *    coremap_release    - drop AS's mapping, unless the page is busy.
+ *    coremap_decref_busy - drop AS's mapping of a page the caller made
+ *                         busy, and make it unbusy.
+ *    coremap_unbusy     - make a page the caller made busy unbusy.
+ *    coremap_waitbusy   - wait for a page to be unbusy.
+ *    coremap_touch      - mark a page referenced, unless it's busy.
+ *    coremap_claim      - AS is about to write to a copy-on-write page;
+ *                         returns one of the CLAIM_* codes below.
+ *    coremap_pickvictims - choose pages to page out, by clock.
+ *    coremap_evicted    - free a page chosen by coremap_pickvictims.
+ *    coremap_printstats - print page usage.
+ */
+struct addrspace;
+
+#define CLAIM_BUSY    0		/* page is busy; wait and try again */
+#define CLAIM_OWNED   1		/* AS has the only mapping, and owns it */
+#define CLAIM_SHARED  2		/* page is shared; now busy, to copy */
+
+void coremap_bootstrap(void);
+paddr_t coremap_alloc(unsigned long npages, struct addrspace *as,
+		      vaddr_t vaddr);
+void coremap_free(paddr_t pa);
+unsigned coremap_nfree(void);
+unsigned coremap_npages(void);
+void coremap_incref(paddr_t pa);
+bool coremap_share(paddr_t pa);
+void coremap_decref(paddr_t pa, struct addrspace *as);
+bool coremap_release(paddr_t pa, struct addrspace *as);
+void coremap_decref_busy(paddr_t pa, struct addrspace *as);
+void coremap_unbusy(paddr_t pa);
+void coremap_waitbusy(paddr_t pa);
+bool coremap_touch(paddr_t pa);
+int coremap_claim(paddr_t pa, struct addrspace *as, vaddr_t vaddr);
+unsigned coremap_pickvictims(paddr_t *pas, struct addrspace **ases,
+			     vaddr_t *vaddrs, unsigned max);
+void coremap_evicted(paddr_t pa);
+void coremap_printstats(void);
+
+/*
+ * Text page cache (textcache.c; not with dumbvm). Pages of read-only
+ * executable segments, shared by every address space that maps
+ * them.
+ *
+ *    textcache_lookup  - find the page at OFFSET in VN mapped at VADDR;
+ *                        returns it with a reference added, or 0 and
+ *                        a generation number for textcache_enter.
+ *    textcache_enter   - add a page read after a miss.
+ *    textcache_shrink  - throw out up to N least recently used pages.
+ */
+struct vnode;
+
+void textcache_bootstrap(void);
+paddr_t textcache_lookup(struct vnode *vn, off_t offset, vaddr_t vaddr,
+			 unsigned *gen);
+void textcache_enter(struct vnode *vn, off_t offset, vaddr_t vaddr,
+		     paddr_t pa, unsigned gen);
+unsigned textcache_shrink(unsigned n);
+void textcache_printstats(void);
+
+/*
+ * Swap (swap.c; not with dumbvm). Pages are stored in page-sized
+ * slots on a raw disk device.
+ *
+ *    swap_on       - start swapping to DEVICE.
+ *    swap_alloc    - allocate N consecutive slots.
+ *    swap_free     - free a slot.
+ *    swap_read     - read the page in SLOT into the page at PA.
+ *    swap_write    - write the N pages in PAS to consecutive slots
+ *                    starting at SLOT, with a single I/O.
+ *    swap_dup      - copy SLOT into a newly allocated slot.
+ */
+int swap_on(const char *device);
+bool swap_enabled(void);
+int swap_alloc(unsigned n, unsigned *slot);
+void swap_free(unsigned slot);
+int swap_read(unsigned slot, paddr_t pa);
+int swap_write(unsigned slot, const paddr_t *pas, unsigned n);
+int swap_dup(unsigned slot, unsigned *ret);
+void swap_printstats(void);
+
+/* Forget cached pages of VN; called by vfs_open when opening to write */
+void vm_textpurge(struct vnode *vn);
+
+/* Forget cached pages of files on FS; called before unmounting it */
+struct fs;
+void vm_textpurgefs(struct fs *fs);
+
+/* Bring in the file-backed pages of UIO's user buffer ahead of I/O */
+struct uio;
+void vm_prefault(const struct uio *uio);
+
+/* Start paging to the raw disk device DEVICE (e.g. "lhd1raw:") */
+int vm_swapon(const char *device);
+
+/* Print VM statistics */
+void vm_printstats(void);
+
 
 #endif /* _VM_H_ */
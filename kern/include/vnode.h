@@ -30,6 +30,7 @@
 #ifndef _VNODE_H_
 #define _VNODE_H_
 
+#include <spinlock.h>
 
 struct uio;
 struct stat;
@@ -49,11 +50,23 @@ struct stat;
  *
  * vn_opencount is managed using VOP_INCOPEN and VOP_DECOPEN by
  * vfs_open() and vfs_close(). Code above the VFS layer should not
- * need to worry about it.
+ * need to worry about it. vn_writecount is the number of those opens
+ * that were for writing; since vfs_close doesn't know which kind of
+ * open it's closing, it only goes back to 0 when vn_opencount does.
+ * The text page cache doesn't take pages of a file while it's
+ * nonzero.
+ *
+ * vn_countlock protects vn_refcount, vn_opencount, and vn_writecount.
+ * A filesystem's
+ * reclaim routine must recheck vn_refcount under vn_countlock (while
+ * holding whatever lock protects its own table of loaded vnodes),
+ * because someone may have picked the vnode up again in the meantime.
  */
 struct vnode {
 	int vn_refcount;                /* Reference count */
 	int vn_opencount;
+	int vn_writecount;              /* Opens for writing; see above */
+	struct spinlock vn_countlock;   /* Lock for the counts */
 
 	struct fs *vn_fs;               /* Filesystem vnode belongs to */
 
@@ -288,11 +301,13 @@ void vnode_decref(struct vnode *);
  *
  * VOP_INCOPEN is called by vfs_open. VOP_DECOPEN is called by vfs_close.
  * Neither of these should need to be called from outside vfs-level code.
+ * vnode_haswriters returns whether vn_writecount is nonzero.
  */
-void vnode_incopen(struct vnode *);
+void vnode_incopen(struct vnode *, bool write);
 void vnode_decopen(struct vnode *);
+bool vnode_haswriters(struct vnode *);
 
-#define VOP_INCOPEN(vn) 		vnode_incopen(vn)
+#define VOP_INCOPEN(vn, write) 		vnode_incopen(vn, write)
 #define VOP_DECOPEN(vn) 		vnode_decopen(vn)
 
 /*
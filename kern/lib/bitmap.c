@@ -95,29 +95,87 @@ bitmap_getdata(struct bitmap *b)
         return b->v;
 }
 
+/*
+ * Index of the lowest clear bit in a word that has one.
+ */
+static
+inline
+unsigned
+bitmap_lowclear(WORD_TYPE w)
+{
+        KASSERT(w != WORD_ALLBITS);
+        return __builtin_ctz(~(unsigned)w);
+}
+
+/*
+ * Find the first clear bit at or after START.
+ *
+ * The bits are stored a byte at a time (see above), but to skip over
+ * full stretches quickly we look at them four bytes at once where we
+ * can: a run of four 0xff bytes is 0xffffffff in either byte order.
+ * The storage comes from kmalloc, so it is suitably aligned.
+ */
 int
-bitmap_alloc(struct bitmap *b, unsigned *index)
+bitmap_findfree(struct bitmap *b, unsigned start, unsigned *index)
 {
         unsigned ix;
         unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
-        unsigned offset;
+        WORD_TYPE w;
 
-        for (ix=0; ix<maxix; ix++) {
-                if (b->v[ix]!=WORD_ALLBITS) {
-                        for (offset = 0; offset < BITS_PER_WORD; offset++) {
-                                WORD_TYPE mask = ((WORD_TYPE)1) << offset;
-
-                                if ((b->v[ix] & mask)==0) {
-                                        b->v[ix] |= mask;
-                                        *index = (ix*BITS_PER_WORD)+offset;
-                                        KASSERT(*index < b->nbits);
-                                        return 0;
-                                }
-                        }
-                        KASSERT(0);
+        if (start >= b->nbits) {
+                return ENOSPC;
+        }
+
+        /* Check the rest of the byte START is in. */
+        ix = start / BITS_PER_WORD;
+        w = b->v[ix] | (WORD_TYPE)((1U << (start % BITS_PER_WORD)) - 1);
+        if (w != WORD_ALLBITS) {
+                goto found;
+        }
+        ix++;
+
+        /* Bytewise up to a 32-bit boundary... */
+        while (ix < maxix && ix % sizeof(uint32_t) != 0) {
+                if (b->v[ix] != WORD_ALLBITS) {
+                        w = b->v[ix];
+                        goto found;
                 }
+                ix++;
+        }
+
+        /* ...then 32 bits at a time... */
+        while (ix + sizeof(uint32_t) <= maxix &&
+               *(uint32_t *)&b->v[ix] == 0xffffffff) {
+                ix += sizeof(uint32_t);
+        }
+
+        /* ...and the last few bytes, or the word that had a hole. */
+        while (ix < maxix) {
+                if (b->v[ix] != WORD_ALLBITS) {
+                        w = b->v[ix];
+                        goto found;
+                }
+                ix++;
         }
         return ENOSPC;
+
+ found:
+        *index = ix*BITS_PER_WORD + bitmap_lowclear(w);
+        KASSERT(*index < b->nbits);
+        return 0;
+}
+
+int
+bitmap_alloc(struct bitmap *b, unsigned *index)
+{
+        int result;
+
+        result = bitmap_findfree(b, 0, index);
+        if (result) {
+                return result;
+        }
+        bitmap_mark(b, *index);
+        return 0;
 }
 
 static
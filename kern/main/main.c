@@ -47,9 +47,12 @@
 #include <vfs.h>
 #include <device.h>
 #include <syscall.h>
+#include <file.h>
 #include <test.h>
 #include <version.h>
+#include <sfs.h>
 #include "autoconf.h"  // for pseudoconfig
+#include "opt-sfs.h"
 
 
 /*
@@ -112,6 +115,10 @@ boot(void)
 	thread_bootstrap();
 	hardclock_bootstrap();
 	vfs_bootstrap();
+	filetable_bootstrap();
+#if OPT_SFS
+	sfs_bootstrap();
+#endif
 	kheap_nextgeneration();
 
 	/* Probe and initialize devices. Interrupts should come on. */
@@ -39,6 +39,8 @@
 #include <proc.h>
 #include <vfs.h>
 #include <sfs.h>
+#include <iosched.h>
+#include <vm.h>
 #include <syscall.h>
 #include <test.h>
 #include "opt-sfs.h"
@@ -362,6 +364,30 @@ cmd_bootfs(int nargs, char **args)
 	return vfs_setbootfs(device);
 }
 
+/*
+ * Command for turning on swapping, to a raw disk device such as
+ * lhd1raw:.
+ */
+static
+int
+cmd_swapon(int nargs, char **args)
+{
+	int result;
+
+	if (nargs != 2) {
+		kprintf("Usage: swapon device\n");
+		return EINVAL;
+	}
+
+	result = vm_swapon(args[1]);
+	if (result) {
+		kprintf("swapon: %s: %s\n", args[1], strerror(result));
+		return result;
+	}
+
+	return 0;
+}
+
 static
 int
 cmd_kheapstats(int nargs, char **args)
@@ -374,6 +400,98 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+/*
+ * Command for showing disk scheduler stats, or with an argument,
+ * changing the scheduling policy.
+ */
+static
+int
+cmd_iosched(int nargs, char **args)
+{
+	int result;
+
+	if (nargs > 2) {
+		kprintf("Usage: ios [fifo|clook|deadline]\n");
+		return EINVAL;
+	}
+	if (nargs == 2) {
+		result = iosched_setpolicy(args[1]);
+		if (result) {
+			kprintf("ios: unknown policy %s\n", args[1]);
+			return result;
+		}
+	}
+
+	iosched_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_vfscachestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vfs_cache_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_printstats();
+
+	return 0;
+}
+
+#if OPT_SFS
+static
+int
+cmd_sfsstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	sfs_printstats();
+
+	return 0;
+}
+
+/*
+ * Command for showing or setting the SFS write-back age.
+ */
+static
+int
+cmd_sfswriteback(int nargs, char **args)
+{
+	int secs;
+
+	if (nargs > 2) {
+		kprintf("Usage: sfswb [seconds]\n");
+		return EINVAL;
+	}
+	if (nargs == 2) {
+		secs = atoi(args[1]);
+		if (secs <= 0) {
+			kprintf("sfswb: age must be at least 1 second\n");
+			return EINVAL;
+		}
+		sfs_setwritebackage(secs);
+	}
+
+	kprintf("SFS write-back age: %u seconds\n", sfs_getwritebackage());
+
+	return 0;
+}
+#endif
+
 static
 int
 cmd_kheapgeneration(int nargs, char **args)
@@ -442,6 +560,7 @@ static const char *opsmenu[] = {
 	"[cd]      Change directory          ",
 	"[pwd]     Print current directory   ",
 	"[sync]    Sync filesystems          ",
+	"[swapon]  Swap to a raw disk        ",
 	"[panic]   Intentional panic         ",
 	"[q]       Quit and shut down        ",
 	NULL
@@ -480,6 +599,8 @@ static const char *testmenu[] = {
 	"[fs4] FS write stress 2             ",
 	"[fs5] FS long stress                ",
 	"[fs6] FS create stress              ",
+	"[fs7] FS directory test             ",
+	"[fs8] FS fragmented write test      ",
 	NULL
 };
 
@@ -502,6 +623,13 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[ios] Disk scheduler stats/policy   ",
+	"[vcs] VFS name cache stats          ",
+	"[vms] VM stats                      ",
+#if OPT_SFS
+	"[sfss] SFS stats                    ",
+	"[sfswb] SFS write-back age          ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -542,6 +670,7 @@ static struct {
 	{ "cd",		cmd_chdir },
 	{ "pwd",	cmd_pwd },
 	{ "sync",	cmd_sync },
+	{ "swapon",	cmd_swapon },
 	{ "panic",	cmd_panic },
 	{ "q",		cmd_quit },
 	{ "exit",	cmd_quit },
@@ -551,6 +680,13 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "ios",        cmd_iosched },
+	{ "vcs",        cmd_vfscachestats },
+	{ "vms",        cmd_vmstats },
+#if OPT_SFS
+	{ "sfss",       cmd_sfsstats },
+	{ "sfswb",      cmd_sfswriteback },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -578,6 +714,8 @@ static struct {
 	{ "fs4",	writestress2 },
 	{ "fs5",	longstress },
 	{ "fs6",	createstress },
+	{ "fs7",	dirtest },
+	{ "fs8",	fragtest },
 
 	{ NULL, NULL }
 };
@@ -81,6 +81,13 @@ proc_create(const char *name)
 
 	/* VFS fields */
 	proc->p_cwd = NULL;
+	if (fdtable_init(&proc->p_fdtable)) {
+		spinlock_cleanup(&proc->p_lock);
+		threadarray_cleanup(&proc->p_threads);
+		kfree(proc->p_name);
+		kfree(proc);
+		return NULL;
+	}
 
 	return proc;
 }
@@ -112,6 +119,7 @@ proc_destroy(struct proc *proc)
 	 */
 
 	/* VFS fields */
+	fdtable_closeall(&proc->p_fdtable);
 	if (proc->p_cwd) {
 		VOP_DECREF(proc->p_cwd);
 		proc->p_cwd = NULL;
@@ -12,17 +12,362 @@
 #include <synch.h>
 #include <vfs.h>
 #include <vnode.h>
+#include <vm.h>
 #include <file.h>
 #include <syscall.h>
 #include <copyinout.h>
 #include <proc.h>
 #include <endian.h>
+#include <bitmap.h>
 
 #define FAILED -1
 #define FREE_FD -1
 #define TWO_BITS 3
 
-int get_next_free_fd(void);
+////////////////////////////////////////////////////////////
+// System-wide open file table
+
+static struct open_file filetable[SYS_OPEN_MAX];
+static struct open_file *filetable_free;
+static struct spinlock filetable_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Set up the open file table. The offset locks are made here, once,
+ * so that open() never has to create one.
+ */
+void filetable_bootstrap(void) {
+	int i;
+
+	filetable_free = NULL;
+	for (i = SYS_OPEN_MAX - 1; i >= 0; i--) {
+		struct open_file *file = &filetable[i];
+
+		file->of_vnode = NULL;
+		file->of_flags = 0;
+		file->of_offset = 0;
+		file->of_offsetlock = lock_create("open file");
+		if (file->of_offsetlock == NULL) {
+			panic("filetable_bootstrap: out of memory\n");
+		}
+		spinlock_init(&file->of_countlock);
+		file->of_refcount = 0;
+		file->of_nextfree = filetable_free;
+		filetable_free = file;
+	}
+}
+
+/*
+ * Open PATH (which vfs_open may destroy) and hand back a new table
+ * entry holding one reference.
+ */
+int file_open(char *path, int flags, mode_t mode, struct open_file **ret) {
+	struct open_file *file;
+	struct vnode *vn;
+	int result;
+
+	spinlock_acquire(&filetable_lock);
+	file = filetable_free;
+	if (file == NULL) {
+		spinlock_release(&filetable_lock);
+		return ENFILE;
+	}
+	filetable_free = file->of_nextfree;
+	spinlock_release(&filetable_lock);
+
+	KASSERT(file->of_refcount == 0);
+
+	result = vfs_open(path, flags, mode, &vn);
+	if (result) {
+		spinlock_acquire(&filetable_lock);
+		file->of_nextfree = filetable_free;
+		filetable_free = file;
+		spinlock_release(&filetable_lock);
+		return result;
+	}
+
+	file->of_vnode = vn;
+	file->of_flags = flags;
+	file->of_offset = 0;
+	file->of_nextfree = NULL;
+	file->of_refcount = 1;
+
+	*ret = file;
+	return NO_ERROR;
+}
+
+/*
+ * Take a reference to a table entry that might have been closed and
+ * recycled since we found it. Fails if it is currently free. Table
+ * entries are never freed, only reused, so this is always safe to
+ * call; see fdtable_get.
+ */
+static bool file_tryincref(struct open_file *file) {
+	bool ok;
+
+	spinlock_acquire(&file->of_countlock);
+	ok = (file->of_refcount > 0);
+	if (ok) {
+		file->of_refcount++;
+	}
+	spinlock_release(&file->of_countlock);
+
+	return ok;
+}
+
+void file_incref(struct open_file *file) {
+	spinlock_acquire(&file->of_countlock);
+	KASSERT(file->of_refcount > 0);
+	file->of_refcount++;
+	spinlock_release(&file->of_countlock);
+}
+
+/*
+ * Drop a reference. The last one closes the vnode and puts the entry
+ * back on the free list.
+ */
+void file_decref(struct open_file *file) {
+	bool last;
+
+	spinlock_acquire(&file->of_countlock);
+	KASSERT(file->of_refcount > 0);
+	file->of_refcount--;
+	last = (file->of_refcount == 0);
+	spinlock_release(&file->of_countlock);
+
+	if (!last) {
+		return;
+	}
+
+	vfs_close(file->of_vnode);
+	file->of_vnode = NULL;
+
+	spinlock_acquire(&filetable_lock);
+	file->of_nextfree = filetable_free;
+	filetable_free = file;
+	spinlock_release(&filetable_lock);
+}
+
+////////////////////////////////////////////////////////////
+// Per-process descriptor tables
+
+/*
+ * Free descriptors are found with a bitmap of the ones in use, which
+ * bitmap_findfree searches a word at a time starting from
+ * fdt_lowfree. That keeps allocation lowest-free-first and cheap
+ * even with a large OPEN_MAX.
+ */
+int fdtable_init(struct fdtable *fdt) {
+	int i;
+
+	fdt->fdt_used = bitmap_create(OPEN_MAX);
+	if (fdt->fdt_used == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&fdt->fdt_lock);
+	for (i = 0; i < OPEN_MAX; i++) {
+		fdt->fdt_files[i] = NULL;
+	}
+	fdt->fdt_lowfree = 0;
+	return NO_ERROR;
+}
+
+/*
+ * Fill the (new, empty) table DST with the descriptors of SRC, as
+ * fork() does. The open files are shared, not duplicated.
+ */
+void fdtable_copy(struct fdtable *src, struct fdtable *dst) {
+	int i;
+
+	spinlock_acquire(&src->fdt_lock);
+	for (i = 0; i < OPEN_MAX; i++) {
+		KASSERT(dst->fdt_files[i] == NULL);
+		if (src->fdt_files[i] != NULL) {
+			file_incref(src->fdt_files[i]);
+			dst->fdt_files[i] = src->fdt_files[i];
+			bitmap_mark(dst->fdt_used, i);
+		}
+	}
+	dst->fdt_lowfree = src->fdt_lowfree;
+	spinlock_release(&src->fdt_lock);
+}
+
+void fdtable_closeall(struct fdtable *fdt) {
+	struct open_file *file;
+	int i;
+
+	for (i = 0; i < OPEN_MAX; i++) {
+		if (fdt->fdt_files[i] == NULL) {
+			continue;
+		}
+		file = fdtable_replace(fdt, i, NULL);
+		if (file != NULL) {
+			file_decref(file);
+		}
+	}
+	spinlock_cleanup(&fdt->fdt_lock);
+	bitmap_destroy(fdt->fdt_used);
+}
+
+/*
+ * Look up a descriptor. Returns the open file with a reference the
+ * caller must drop with file_decref, or NULL if FD isn't open.
+ *
+ * This doesn't take fdt_lock. Open files are never freed, only put
+ * back on the table's free list, so the pointer we read is always
+ * safe to look at even if the descriptor is closed under us. We take
+ * a reference if the entry is still in use and then check the slot
+ * still points to it; if not, it was closed (and perhaps reused) in
+ * between, so let go and try again. The spinlock in file_tryincref
+ * orders the two reads of the slot.
+ */
+struct open_file *fdtable_get(struct fdtable *fdt, int fd) {
+	struct open_file *file;
+
+	if (fd < 0 || fd >= OPEN_MAX) {
+		return NULL;
+	}
+
+	while (1) {
+		file = ((struct open_file *volatile *)fdt->fdt_files)[fd];
+		if (file == NULL) {
+			return NULL;
+		}
+		if (file_tryincref(file)) {
+			if (((struct open_file *volatile *)fdt->fdt_files)[fd] == file) {
+				return file;
+			}
+			file_decref(file);
+		}
+	}
+}
+
+/*
+ * Install FILE in the lowest free descriptor. The caller's reference
+ * moves into the table.
+ */
+int fdtable_alloc(struct fdtable *fdt, struct open_file *file, int *fd_ret) {
+	unsigned fd;
+
+	spinlock_acquire(&fdt->fdt_lock);
+	if (bitmap_findfree(fdt->fdt_used, fdt->fdt_lowfree, &fd)) {
+		fdt->fdt_lowfree = OPEN_MAX;
+		spinlock_release(&fdt->fdt_lock);
+		return EMFILE;
+	}
+	KASSERT(fdt->fdt_files[fd] == NULL);
+	bitmap_mark(fdt->fdt_used, fd);
+	fdt->fdt_files[fd] = file;
+	fdt->fdt_lowfree = fd + 1;
+	spinlock_release(&fdt->fdt_lock);
+
+	*fd_ret = fd;
+	return NO_ERROR;
+}
+
+/*
+ * Put FILE (which may be NULL) in slot FD and return what was there.
+ * A reference passed in moves into the table; the one handed back
+ * belongs to the caller.
+ */
+struct open_file *fdtable_replace(struct fdtable *fdt, int fd,
+				  struct open_file *file) {
+	struct open_file *old;
+
+	KASSERT(fd >= 0 && fd < OPEN_MAX);
+
+	spinlock_acquire(&fdt->fdt_lock);
+	old = fdt->fdt_files[fd];
+	fdt->fdt_files[fd] = file;
+	if (old == NULL && file != NULL) {
+		bitmap_mark(fdt->fdt_used, fd);
+	}
+	else if (old != NULL && file == NULL) {
+		bitmap_unmark(fdt->fdt_used, fd);
+		if ((unsigned)fd < fdt->fdt_lowfree) {
+			fdt->fdt_lowfree = fd;
+		}
+	}
+	spinlock_release(&fdt->fdt_lock);
+
+	return old;
+}
+
+////////////////////////////////////////////////////////////
+// System calls
+
+/*
+ * Descriptor lookup for read, write and lseek.
+ *
+ * Only a process's own threads change its descriptor table, so in a
+ * single-threaded process nothing can close FD_ID while we're in the
+ * middle of a system call: the table's reference keeps the file open
+ * and we can borrow it without taking any lock at all. Otherwise take
+ * a reference of our own with fdtable_get.
+ */
+static struct open_file *fd_begin(int fd_id, bool *borrowed) {
+	struct fdtable *fdt = &curproc->p_fdtable;
+
+	if (threadarray_num(&curproc->p_threads) == 1) {
+		if (fd_id < 0 || fd_id >= OPEN_MAX) {
+			return NULL;
+		}
+		*borrowed = true;
+		return fdt->fdt_files[fd_id];
+	}
+
+	*borrowed = false;
+	return fdtable_get(fdt, fd_id);
+}
+
+static void fd_end(struct open_file *file, bool borrowed) {
+	if (!borrowed) {
+		file_decref(file);
+	}
+}
+
+/*
+ * Lock the offset, unless nobody else can be using it. If we borrowed
+ * the file and our descriptor holds the only reference, there is no
+ * other descriptor (here or in another process) and no other system
+ * call in progress on it, and none can appear until we return, since
+ * only this thread could make one.
+ */
+static bool offset_lock(struct open_file *file, bool borrowed) {
+	if (borrowed && file->of_refcount == 1) {
+		return false;
+	}
+	lock_acquire(file->of_offsetlock);
+	return true;
+}
+
+static void offset_unlock(struct open_file *file, bool locked) {
+	if (locked) {
+		lock_release(file->of_offsetlock);
+	}
+}
+
+/*
+ * Do the VOP_READ or VOP_WRITE for a system call, with UIO pointing
+ * at user memory. The filesystem copies to or from the user buffer
+ * holding its own locks, and a page fault then can't safely read the
+ * page in from the same filesystem (see vm_pagein), so bring in the
+ * buffer's file-backed pages first, and mark what we're doing so
+ * vm_pagein can tell.
+ */
+static int file_uio_io(struct vnode *vn, struct uio *uio) {
+	vm_prefault(uio);
+
+	KASSERT(curthread->t_iovnode == NULL);
+	curthread->t_iovnode = vn;
+	int result;
+	if (uio->uio_rw == UIO_READ) {
+		result = VOP_READ(vn, uio);
+	} else {
+		result = VOP_WRITE(vn, uio);
+	}
+	curthread->t_iovnode = NULL;
+	return result;
+}
 
 struct retval mywrite(int fd_id, void* buf, size_t nbytes) {
 	struct retval retval;
@@ -30,45 +375,53 @@ struct retval mywrite(int fd_id, void* buf, size_t nbytes) {
 	retval.val_h = (int*) FAILED;
 	retval.val_l = (int*) FAILED;
 
-	if (fd_id <= FREE_FD || fd_id >= OPEN_MAX) {
-		retval.errno = EBADF;
-		return retval;
-	}
-
-	lock_acquire(curthread->fd_table_lock);
-	struct file_descriptor* fd = curthread->file_descriptors[fd_id];
-	if (fd == NULL) {
-		lock_release(curthread->fd_table_lock);
+	bool borrowed;
+	struct open_file* file = fd_begin(fd_id, &borrowed);
+	if (file == NULL) {
 		retval.errno = EBADF;
 		return retval;
 	}
-	lock_release(curthread->fd_table_lock);
 
-	if ((fd->flags & TWO_BITS) == O_RDONLY) {
+	if ((file->of_flags & TWO_BITS) == O_RDONLY) {
+		fd_end(file, borrowed);
 		retval.errno = EACCES;
 		return retval;
 	}
 
-	lock_acquire(fd->lock);
+	bool locked = offset_lock(file, borrowed);
+
+	if ((file->of_flags & O_APPEND) == O_APPEND) {
+		struct stat stat_buffer;
+		int result = VOP_STAT(file->of_vnode, &stat_buffer);
+		if (result) {
+			offset_unlock(file, locked);
+			fd_end(file, borrowed);
+			retval.errno = result;
+			return retval;
+		}
+		file->of_offset = stat_buffer.st_size;
+	}
 
 	struct iovec iov;
 	struct uio uio_writer;
 
-	uio_kinit(&iov, &uio_writer, (void*) buf, nbytes, fd->offset, UIO_WRITE);
+	uio_kinit(&iov, &uio_writer, (void*) buf, nbytes, file->of_offset, UIO_WRITE);
 	uio_writer.uio_segflg = UIO_USERSPACE;
-	uio_writer.uio_space = curthread->t_proc->p_addrspace;
+	uio_writer.uio_space = curproc->p_addrspace;
 
-	int err = VOP_WRITE(fd->vnode, &uio_writer);
+	int err = file_uio_io(file->of_vnode, &uio_writer);
 	if (err) {
-		lock_release(fd->lock);
+		offset_unlock(file, locked);
+		fd_end(file, borrowed);
 		retval.errno = err;
 		return retval;
 	}
 
-	fd->offset += nbytes - uio_writer.uio_resid;
+	file->of_offset += nbytes - uio_writer.uio_resid;
 	retval.val_h = (void*)(nbytes - uio_writer.uio_resid);
 
-	lock_release(fd->lock);
+	offset_unlock(file, locked);
+	fd_end(file, borrowed);
 
 	return retval;
 }
@@ -76,7 +429,6 @@ struct retval mywrite(int fd_id, void* buf, size_t nbytes) {
 struct retval myopen(const_userptr_t filename, int flags) {
 	size_t length;
 	struct retval retval;
-	struct vnode* vn;
 	retval.errno = NO_ERROR;
 	retval.val_h = (int*) FAILED;
 	retval.val_l = (int*) FAILED;
@@ -107,163 +459,310 @@ struct retval myopen(const_userptr_t filename, int flags) {
 
 	int result = copyinstr(filename, sys_filename, PATH_MAX, &length);
 	if (result != NO_ERROR) {
+		kfree(sys_filename);
 		retval.errno = result;
 		return retval;
 	}
-	
-	struct file_descriptor* fd = (struct file_descriptor*)kmalloc(sizeof(struct file_descriptor));
-	if (fd == NULL) {
-		retval.errno = ENOMEM;
+
+	struct open_file *file;
+	result = file_open(sys_filename, flags, 0664, &file);
+	kfree(sys_filename);
+	if (result != NO_ERROR) {
+		retval.errno = result;
 		return retval;
 	}
 
-	fd->name = (char*)filename;
-	fd->flags = flags;
-	fd->ref_count = 0;
+	int current_fd;
+	result = fdtable_alloc(&curproc->p_fdtable, file, &current_fd);
+	if (result != NO_ERROR) {
+		file_decref(file);
+		retval.errno = result;
+		return retval;
+	}
 
-	if ((flags & O_APPEND) == O_APPEND) {
-		struct stat stat_buffer;
-		VOP_STAT(fd->vnode, &stat_buffer);
+	retval.val_h = (int*) current_fd;
+	return retval;
+}
 
-		fd->offset = stat_buffer.st_size;
-	} else {
-		fd->offset = 0;
-	}
+struct retval myread(int fd_id, void *buf, size_t nbytes) {
+	struct retval retval;
+	retval.errno = NO_ERROR;
+	retval.val_h = (int*) FAILED;
+	retval.val_l = (int*) FAILED;
 
-	fd->lock = lock_create(sys_filename);
-	if (fd->lock == NULL) {
-		retval.errno = ENOMEM;
+	bool borrowed;
+	struct open_file* file = fd_begin(fd_id, &borrowed);
+	if (file == NULL) {
+		retval.errno = EBADF;
 		return retval;
 	}
 
-	lock_acquire(curthread->fd_table_lock);
-	int current_fd = get_next_free_fd();
-
-	if (current_fd == FREE_FD) {
-		lock_release(curthread->fd_table_lock);
-		retval.errno = ENFILE;
+	if ((file->of_flags & O_WRONLY) == O_WRONLY) {
+		fd_end(file, borrowed);
+		retval.errno = EACCES;
 		return retval;
 	}
 
-	curthread->file_descriptors[current_fd] = fd;
-	curthread->previous_fd = current_fd;
+	bool locked = offset_lock(file, borrowed);
 
-	lock_release(curthread->fd_table_lock);
+	struct iovec iov;
+	struct uio uio_reader;
+	uio_kinit(&iov, &uio_reader, (void*) buf, nbytes, file->of_offset, UIO_READ);
+	uio_reader.uio_segflg = UIO_USERSPACE;
+	uio_reader.uio_space = curproc->p_addrspace;
 
-	result = vfs_open(sys_filename, flags, 0664, &vn);
-	fd->vnode = vn;
-	if (result != NO_ERROR) {
-		retval.errno = result;
+	int err = file_uio_io(file->of_vnode, &uio_reader);
+	if (err) {
+		offset_unlock(file, locked);
+		fd_end(file, borrowed);
+		retval.errno = err;
 		return retval;
 	}
-	retval.val_h = (int*) current_fd;
+
+	file->of_offset += nbytes - uio_reader.uio_resid;
+	retval.val_h = (void*)(nbytes - uio_reader.uio_resid);
+
+	offset_unlock(file, locked);
+	fd_end(file, borrowed);
 
 	return retval;
 }
 
-struct retval myread(int fd_id, void *buf, size_t nbytes) {
+/*
+ * pread and pwrite: I/O at POS without using or changing the file's
+ * offset, so unlike read and write they never take the offset lock,
+ * and threads sharing a descriptor can do them concurrently.
+ */
+static struct retval positional_io(int fd_id, void *buf, size_t nbytes,
+				   off_t pos, enum uio_rw rw) {
 	struct retval retval;
 	retval.errno = NO_ERROR;
 	retval.val_h = (int*) FAILED;
 	retval.val_l = (int*) FAILED;
 
-	if (fd_id <= FREE_FD || fd_id >= OPEN_MAX) {
+	bool borrowed;
+	struct open_file* file = fd_begin(fd_id, &borrowed);
+	if (file == NULL) {
 		retval.errno = EBADF;
 		return retval;
 	}
 
-	lock_acquire(curthread->fd_table_lock);
-	struct file_descriptor* fd = curthread->file_descriptors[fd_id];
-	if (fd == NULL) {
-		lock_release(curthread->fd_table_lock);
-		retval.errno = EBADF;
+	int accmode = file->of_flags & TWO_BITS;
+	if ((rw == UIO_READ && accmode == O_WRONLY) ||
+	    (rw == UIO_WRITE && accmode == O_RDONLY)) {
+		fd_end(file, borrowed);
+		retval.errno = EACCES;
 		return retval;
 	}
-	lock_release(curthread->fd_table_lock);
 
-	if ((fd->flags & O_WRONLY) == O_WRONLY) {
-		retval.errno = EACCES;
+	if (pos < 0) {
+		fd_end(file, borrowed);
+		retval.errno = EINVAL;
 		return retval;
 	}
 
-	lock_acquire(fd->lock);
+	/* Fails with ESPIPE on the console and other unseekable things */
+	int result = VOP_TRYSEEK(file->of_vnode, pos);
+	if (result != NO_ERROR) {
+		fd_end(file, borrowed);
+		retval.errno = result;
+		return retval;
+	}
 
 	struct iovec iov;
-	struct uio uio_reader;
-	uio_kinit(&iov, &uio_reader, (void*) buf, nbytes, fd->offset, UIO_READ);
-	uio_reader.uio_segflg = UIO_USERSPACE;
-	uio_reader.uio_space = curthread->t_proc->p_addrspace;	
-	
-	int err = VOP_READ(fd->vnode, &uio_reader);
-	if (err) {
-		lock_release(fd->lock);
-		retval.errno = err;
+	struct uio uio;
+	uio_kinit(&iov, &uio, buf, nbytes, pos, rw);
+	uio.uio_segflg = UIO_USERSPACE;
+	uio.uio_space = curproc->p_addrspace;
+
+	result = file_uio_io(file->of_vnode, &uio);
+	fd_end(file, borrowed);
+	if (result) {
+		retval.errno = result;
 		return retval;
 	}
 
-	fd->offset += nbytes - uio_reader.uio_resid;
-	retval.val_h = (void*)(nbytes - uio_reader.uio_resid);
+	retval.val_h = (void*)(nbytes - uio.uio_resid);
+	return retval;
+}
 
-	lock_release(fd->lock);
+struct retval mypread(int fd_id, void *buf, size_t nbytes, off_t pos) {
+	return positional_io(fd_id, buf, nbytes, pos, UIO_READ);
+}
 
-	return retval;
+struct retval mypwrite(int fd_id, void *buf, size_t nbytes, off_t pos) {
+	return positional_io(fd_id, buf, nbytes, pos, UIO_WRITE);
 }
 
-struct retval mylseek(int fd_id, off_t pos, int whence) {
+/*
+ * readv and writev: like read and write, but scattering into or
+ * gathering from IOVCNT user buffers, described by the iovec array
+ * at USER_IOV, in one VOP_READ or VOP_WRITE. The array is copied in
+ * once, onto the stack if it's small.
+ */
+#define SMALL_IOVCNT 8
+
+static struct retval vectored_io(int fd_id, const_userptr_t user_iov,
+				 int iovcnt, enum uio_rw rw) {
 	struct retval retval;
 	retval.errno = NO_ERROR;
 	retval.val_h = (int*) FAILED;
 	retval.val_l = (int*) FAILED;
 
-	if (fd_id <= FREE_FD || fd_id >= OPEN_MAX) {
+	if (iovcnt <= 0 || iovcnt > IOV_MAX) {
+		retval.errno = EINVAL;
+		return retval;
+	}
+
+	struct iovec small_iov[SMALL_IOVCNT];
+	struct iovec *iov = small_iov;
+	if (iovcnt > SMALL_IOVCNT) {
+		iov = kmalloc(iovcnt * sizeof(struct iovec));
+		if (iov == NULL) {
+			retval.errno = ENOMEM;
+			return retval;
+		}
+	}
+
+	int result = copyin(user_iov, iov, iovcnt * sizeof(struct iovec));
+	size_t nbytes = 0;
+	int i;
+	for (i = 0; result == NO_ERROR && i < iovcnt; i++) {
+		/* The total has to fit in the ssize_t we return */
+		nbytes += iov[i].iov_len;
+		if ((ssize_t)nbytes < 0 || nbytes < iov[i].iov_len) {
+			result = EINVAL;
+		}
+	}
+	if (result != NO_ERROR) {
+		if (iov != small_iov) {
+			kfree(iov);
+		}
+		retval.errno = result;
+		return retval;
+	}
+
+	bool borrowed;
+	struct open_file* file = fd_begin(fd_id, &borrowed);
+	if (file == NULL) {
+		if (iov != small_iov) {
+			kfree(iov);
+		}
 		retval.errno = EBADF;
 		return retval;
 	}
 
-	struct file_descriptor* fd = curthread->file_descriptors[fd_id];
-	if (fd == NULL) {
+	int accmode = file->of_flags & TWO_BITS;
+	if ((rw == UIO_READ && accmode == O_WRONLY) ||
+	    (rw == UIO_WRITE && accmode == O_RDONLY)) {
+		result = EACCES;
+	}
+
+	bool locked = false;
+	if (result == NO_ERROR) {
+		locked = offset_lock(file, borrowed);
+	}
+
+	if (result == NO_ERROR && rw == UIO_WRITE &&
+	    (file->of_flags & O_APPEND) == O_APPEND) {
+		struct stat stat_buffer;
+		result = VOP_STAT(file->of_vnode, &stat_buffer);
+		if (result == NO_ERROR) {
+			file->of_offset = stat_buffer.st_size;
+		}
+	}
+
+	struct uio uio;
+	if (result == NO_ERROR) {
+		uio.uio_iov = iov;
+		uio.uio_iovcnt = iovcnt;
+		uio.uio_offset = file->of_offset;
+		uio.uio_resid = nbytes;
+		uio.uio_segflg = UIO_USERSPACE;
+		uio.uio_rw = rw;
+		uio.uio_space = curproc->p_addrspace;
+
+		result = file_uio_io(file->of_vnode, &uio);
+	}
+
+	if (result == NO_ERROR) {
+		file->of_offset += nbytes - uio.uio_resid;
+		retval.val_h = (void*)(nbytes - uio.uio_resid);
+	}
+	retval.errno = result;
+
+	offset_unlock(file, locked);
+	fd_end(file, borrowed);
+	if (iov != small_iov) {
+		kfree(iov);
+	}
+
+	return retval;
+}
+
+struct retval myreadv(int fd_id, const_userptr_t iov, int iovcnt) {
+	return vectored_io(fd_id, iov, iovcnt, UIO_READ);
+}
+
+struct retval mywritev(int fd_id, const_userptr_t iov, int iovcnt) {
+	return vectored_io(fd_id, iov, iovcnt, UIO_WRITE);
+}
+
+struct retval mylseek(int fd_id, off_t pos, int whence) {
+	struct retval retval;
+	retval.errno = NO_ERROR;
+	retval.val_h = (int*) FAILED;
+	retval.val_l = (int*) FAILED;
+
+	bool borrowed;
+	struct open_file* file = fd_begin(fd_id, &borrowed);
+	if (file == NULL) {
 		retval.errno = EBADF;
 		return retval;
 	}
 
-	lock_acquire(fd->lock);
-	int new_position = 0;
+	bool locked = offset_lock(file, borrowed);
+	off_t new_position = 0;
 	if (whence == SEEK_SET) {
 		new_position = pos;
 	} else if (whence == SEEK_CUR) {
-		new_position = fd->offset + pos;
+		new_position = file->of_offset + pos;
 	} else if (whence == SEEK_END) {
 		struct stat stat_buffer;
-		int result = VOP_STAT(fd->vnode, &stat_buffer);
+		int result = VOP_STAT(file->of_vnode, &stat_buffer);
 		if (result) {
-			lock_release(fd->lock);
+			offset_unlock(file, locked);
+			fd_end(file, borrowed);
 			retval.errno = result;
 			return retval;
 		}
 
 		new_position = stat_buffer.st_size + pos;
 	} else {
-		lock_release(fd->lock);
+		offset_unlock(file, locked);
+		fd_end(file, borrowed);
 		retval.errno = EINVAL;
 		return retval;
 	}
 
 	if (new_position < 0) {
-		lock_release(fd->lock);
+		offset_unlock(file, locked);
+		fd_end(file, borrowed);
 		retval.errno = EINVAL;
 		return retval;
 	}
 
-	int result = VOP_TRYSEEK(fd->vnode, new_position);
+	int result = VOP_TRYSEEK(file->of_vnode, new_position);
 	if (result != NO_ERROR) {
-		lock_release(fd->lock);
+		offset_unlock(file, locked);
+		fd_end(file, borrowed);
 		retval.errno = result;
 		return retval;
 	}
 
-	fd->offset = new_position;
+	file->of_offset = new_position;
 
-	uint64_t word = fd->offset;
+	uint64_t word = file->of_offset;
 	uint32_t high = 0;
 	uint32_t low = 0;
 	split64to32(word, &high, &low);
@@ -271,7 +770,8 @@ struct retval mylseek(int fd_id, off_t pos, int whence) {
 	retval.val_h = (int*) high;
 	retval.val_l = (int*) low;
 
-	lock_release(fd->lock);
+	offset_unlock(file, locked);
+	fd_end(file, borrowed);
 
 	return retval;
 }
@@ -287,28 +787,14 @@ struct retval myclose(int fd_id) {
 		return retval;
 	}
 
-	struct file_descriptor* fd = curthread->file_descriptors[fd_id];
-	if (fd == NULL) {
+	struct open_file* file = fdtable_replace(&curproc->p_fdtable, fd_id, NULL);
+	if (file == NULL) {
 		retval.errno = EBADF;
 		return retval;
 	}
 
-	lock_acquire(fd->lock);
+	file_decref(file);
 
-	if (fd->ref_count == 0) {
-		vfs_close(fd->vnode);
-		lock_release(fd->lock);
-		lock_destroy(fd->lock);
-		kfree(fd);
-	} else {
-		fd->ref_count--;
-		lock_release(fd->lock);
-	}
-
-	curthread->file_descriptors[fd_id] = NULL;
-	if (fd_id < curthread->previous_fd) {
-		curthread->previous_fd = fd_id;
-	}
 	retval.val_h = (int*) 0;
 	return retval;
 }
@@ -324,55 +810,24 @@ struct retval mydup2(int oldfd_id, int newfd_id) {
 		return retval;
 	}
 
-	if (oldfd_id == newfd_id) {
-		retval.errno = NO_ERROR;
-		retval.val_h = (int*) newfd_id;
+	struct open_file *file = fdtable_get(&curproc->p_fdtable, oldfd_id);
+	if (file == NULL) {
+		retval.errno = EBADF;
 		return retval;
 	}
 
-	struct file_descriptor *fd = curthread->file_descriptors[oldfd_id];
-	if (fd == NULL) {
-		retval.errno = EBADF;
+	if (oldfd_id == newfd_id) {
+		file_decref(file);
+		retval.val_h = (int*) newfd_id;
 		return retval;
 	}
 
-	lock_acquire(fd->lock);
-	struct file_descriptor *new_fd = curthread->file_descriptors[newfd_id];
-	if (new_fd != NULL) {
-		if (fd->lock == new_fd->lock) {
-			// The are actually the same fd so dont do anything
-			lock_release(fd->lock);
-			retval.errno = NO_ERROR;
-			retval.val_h = (int*) newfd_id;
-			return retval;
-		}
-
-		struct retval result = myclose(newfd_id);
-
-		if (result.errno != NO_ERROR) {
-			lock_release(fd->lock);
-			return result;
-		}
+	// Our reference moves into the new slot; drop whatever was there
+	struct open_file *old_file = fdtable_replace(&curproc->p_fdtable, newfd_id, file);
+	if (old_file != NULL) {
+		file_decref(old_file);
 	}
 
-	curthread->file_descriptors[newfd_id] = fd;
-	fd->ref_count++;
-
-	lock_release(fd->lock);
-
 	retval.val_h = (int*) newfd_id;
 	return retval;
 }
-
-int get_next_free_fd(void) {
-	int next_free = curthread->previous_fd;
-
-	while(next_free < OPEN_MAX) {
-		if (curthread->file_descriptors[next_free] == NULL) {
-			return next_free;
-		}
-		next_free++;
-	}
-
-	return FAILED;
-}
@@ -28,13 +28,19 @@ struct retval myfork(struct trapframe *tf) {
 
 	struct proc *new_proc = proc_create_runprogram((const char*)"child");
 	if (new_proc == NULL) {
+		kfree(new_tf);
 		rv.errno = ENOMEM;
 		return rv;
 	}
 
+	// The child shares the parent's open files
+	fdtable_copy(&curproc->p_fdtable, &new_proc->p_fdtable);
+
 	struct addrspace *new_as;
 	int result = as_copy(curthread->t_proc->p_addrspace, &new_as);
 	if (result) {
+		kfree(new_tf);
+		proc_destroy(new_proc);
 		rv.errno = result;
 		return rv;
 	}
@@ -43,6 +49,7 @@ struct retval myfork(struct trapframe *tf) {
 	if (result) {
 		kfree(new_tf);
 		as_destroy(new_as);
+		proc_destroy(new_proc);
 		rv.errno = result;
 		return rv;
 	}
@@ -37,6 +37,10 @@
  *    - then it loads each chunk of the program;
  *    - finally, as_complete_load.
  *
+ * Without dumbvm, "loading" a chunk is just as_map_file, which
+ * records where it is in the file; its pages are read in by vm_fault
+ * when the program first touches them.
+ *
  * This gives the VM code enough flexibility to deal with even grossly
  * mis-linked executables if that proves desirable. Under normal
  * circumstances, as_prepare_load and as_complete_load probably don't
@@ -60,6 +64,7 @@
 #include <vnode.h>
 #include <elf.h>
 
+#if OPT_DUMBVM
 /*
  * Load a segment at virtual address VADDR. The segment in memory
  * extends from VADDR up to (but not including) VADDR+MEMSIZE. The
@@ -144,6 +149,7 @@ load_segment(struct addrspace *as, struct vnode *v,
 
 	return result;
 }
+#endif /* OPT_DUMBVM */
 
 /*
  * Load an ELF executable user program into the current address space.
@@ -288,9 +294,14 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return ENOEXEC;
 		}
 
+#if OPT_DUMBVM
 		result = load_segment(as, v, ph.p_offset, ph.p_vaddr,
 				      ph.p_memsz, ph.p_filesz,
 				      ph.p_flags & PF_X);
+#else
+		result = as_map_file(as, ph.p_vaddr, ph.p_memsz,
+				     v, ph.p_offset, ph.p_filesz);
+#endif
 		if (result) {
 			return result;
 		}
@@ -47,8 +47,8 @@
 #include <file.h>
 #include <kern/unistd.h>
 
-int initialise_std_fds(struct thread *curthread);
-int open_console_file(struct thread *curthread, int fd_id, int flags);
+int initialise_std_fds(void);
+int open_console_file(int fd_id, int flags);
 
 /*
  * Load program "progname" and start running it in usermode.
@@ -102,7 +102,7 @@ runprogram(char *progname)
 		return result;
 	}
 
-	result = initialise_std_fds(curthread);
+	result = initialise_std_fds();
 	if (result) {
 		return result;
 	}
@@ -117,42 +117,38 @@ runprogram(char *progname)
 	return EINVAL;
 }
 
-int initialise_std_fds(struct thread *curthread) {
+int initialise_std_fds(void) {
 	int result = 0;
-	result = open_console_file(curthread, STDIN_FILENO, O_RDONLY);
+	result = open_console_file(STDIN_FILENO, O_RDONLY);
 	if (result != 0) {
 		return result;
 	}
-	result = open_console_file(curthread, STDOUT_FILENO, O_WRONLY);
+	result = open_console_file(STDOUT_FILENO, O_WRONLY);
 	if (result != 0) {
 		return result;
 	}
-	result = open_console_file(curthread, STDERR_FILENO, O_WRONLY);
+	result = open_console_file(STDERR_FILENO, O_WRONLY);
 	if (result != 0) {
 		return result;
 	}
 	return 0;
 }
 
-int open_console_file(struct thread *curthread, int fd_id, int flags) {
+int open_console_file(int fd_id, int flags) {
 	int result;
-	struct vnode *vn;	
-	struct file_descriptor *fd = (struct file_descriptor *) kmalloc(sizeof(struct file_descriptor));
-	curthread->file_descriptors[fd_id] = fd;
+	struct open_file *file;
 	char console[] = "con:";
 
-	result = vfs_open(console, flags, 0664, &vn);
-	
+	result = file_open(console, flags, 0664, &file);
 	if (result) {
-		kprintf("vfs_open failed with args %s, %d\n", console, flags);
+		kprintf("vfs_open failed with args %s, %d\n", "con:", flags);
 		return result;
 	}
-	
-	fd->vnode = vn;
-	fd->flags = flags;
-	fd->offset = 0;	
-	fd->ref_count = 0;
-	fd->lock = lock_create(console);
+
+	file = fdtable_replace(&curproc->p_fdtable, fd_id, file);
+	if (file != NULL) {
+		file_decref(file);
+	}
 
 	return 0;
 }
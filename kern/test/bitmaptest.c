@@ -40,7 +40,7 @@ bitmaptest(int nargs, char **args)
 	struct bitmap *b;
 	char data[TESTSIZE];
 	uint32_t x;
-	int i;
+	int i, j, result;
 
 	(void)nargs;
 	(void)args;
@@ -89,6 +89,21 @@ bitmaptest(int nargs, char **args)
 		}
 	}
 
+	/* Clear bits are now where data[] is 1. */
+	for (i=0; i<TESTSIZE; i++) {
+		for (j=i; j<TESTSIZE && !data[j]; j++) {
+			/* nothing */
+		}
+		result = bitmap_findfree(b, i, &x);
+		if (j == TESTSIZE) {
+			KASSERT(result != 0);
+		}
+		else {
+			KASSERT(result == 0);
+			KASSERT(x == (uint32_t)j);
+		}
+	}
+
 	while (bitmap_alloc(b, &x)==0) {
 		KASSERT(x < TESTSIZE);
 		KASSERT(bitmap_isset(b, x));
@@ -42,23 +42,40 @@
 #include <kern/errno.h>
 #include <kern/fcntl.h>
 #include <lib.h>
+#include <clock.h>
 #include <uio.h>
 #include <thread.h>
 #include <synch.h>
 #include <vfs.h>
 #include <fs.h>
 #include <vnode.h>
+#include <sfs.h>
 #include <test.h>
+#include "opt-sfs.h"
 
 #define SLOGAN   "HODIE MIHI - CRAS TIBI\n"
 #define FILENAME "fstest.tmp"
 #define NCHUNKS  720
 #define NTHREADS 12
+#define MAXTHREADS 32
 #define NLONG    32
 #define NCREATE  24
+#define NDIRFILES 48
+#define NDIRROUNDS 8
+#define DIRSLACK 1024
+#define NFRAGFILES 512
+#define FRAGBUFSIZE 4096
+#define FRAGNIOV 64
 
 static struct semaphore *threadsem = NULL;
 
+/*
+ * Thread counts run by "scale" mode; each count runs the whole test
+ * once and reports how long it took.
+ */
+static const unsigned scalecounts[] = { 1, 2, 4, 8, 12 };
+#define NSCALECOUNTS (sizeof(scalecounts) / sizeof(scalecounts[0]))
+
 static
 void
 init_threadsem(void)
@@ -275,8 +292,11 @@ fstest_read(const char *fs, const char *namesuffix)
 
 static
 void
-dofstest(const char *filesys)
+dofstest(const char *filesys, unsigned nthreads)
 {
+	/* Single-threaded by nature */
+	(void)nthreads;
+
 	kprintf("*** Starting filesystem test on %s:\n", filesys);
 
 	if (fstest_write(filesys, "", 1, 0)) {
@@ -312,9 +332,10 @@ readstress_thread(void *fs, unsigned long num)
 
 static
 void
-doreadstress(const char *filesys)
+doreadstress(const char *filesys, unsigned nthreads)
 {
-	int i, err;
+	unsigned i;
+	int err;
 
 	init_threadsem();
 
@@ -325,7 +346,7 @@ doreadstress(const char *filesys)
 		return;
 	}
 
-	for (i=0; i<NTHREADS; i++) {
+	for (i=0; i<nthreads; i++) {
 		err = thread_fork("readstress", NULL,
 				  readstress_thread, (char *)filesys, i);
 		if (err) {
@@ -334,7 +355,7 @@ doreadstress(const char *filesys)
 		}
 	}
 
-	for (i=0; i<NTHREADS; i++) {
+	for (i=0; i<nthreads; i++) {
 		P(threadsem);
 	}
 
@@ -379,15 +400,16 @@ writestress_thread(void *fs, unsigned long num)
 
 static
 void
-dowritestress(const char *filesys)
+dowritestress(const char *filesys, unsigned nthreads)
 {
-	int i, err;
+	unsigned i;
+	int err;
 
 	init_threadsem();
 
 	kprintf("*** Starting fs write stress test on %s:\n", filesys);
 
-	for (i=0; i<NTHREADS; i++) {
+	for (i=0; i<nthreads; i++) {
 		err = thread_fork("writestress", NULL,
 				  writestress_thread, (char *)filesys, i);
 		if (err) {
@@ -395,7 +417,7 @@ dowritestress(const char *filesys)
 		}
 	}
 
-	for (i=0; i<NTHREADS; i++) {
+	for (i=0; i<nthreads; i++) {
 		P(threadsem);
 	}
 
@@ -404,13 +426,16 @@ dowritestress(const char *filesys)
 
 ////////////////////////////////////////////////////////////
 
+/* Number of threads, and thus the stride, of the running fs4 test */
+static unsigned writestress2_nthreads;
+
 static
 void
 writestress2_thread(void *fs, unsigned long num)
 {
 	const char *filesys = fs;
 
-	if (fstest_write(filesys, "", NTHREADS, num)) {
+	if (fstest_write(filesys, "", writestress2_nthreads, num)) {
 		kprintf("*** Thread %lu: failed\n", num);
 		V(threadsem);
 		return;
@@ -421,9 +446,10 @@ writestress2_thread(void *fs, unsigned long num)
 
 static
 void
-dowritestress2(const char *filesys)
+dowritestress2(const char *filesys, unsigned nthreads)
 {
-	int i, err;
+	unsigned i;
+	int err;
 	char name[32];
 	struct vnode *vn;
 
@@ -441,7 +467,8 @@ dowritestress2(const char *filesys)
 	}
 	vfs_close(vn);
 
-	for (i=0; i<NTHREADS; i++) {
+	writestress2_nthreads = nthreads;
+	for (i=0; i<nthreads; i++) {
 		err = thread_fork("writestress2", NULL,
 				  writestress2_thread, (char *)filesys, i);
 		if (err) {
@@ -450,7 +477,7 @@ dowritestress2(const char *filesys)
 		}
 	}
 
-	for (i=0; i<NTHREADS; i++) {
+	for (i=0; i<nthreads; i++) {
 		P(threadsem);
 	}
 
@@ -506,15 +533,16 @@ longstress_thread(void *fs, unsigned long num)
 
 static
 void
-dolongstress(const char *filesys)
+dolongstress(const char *filesys, unsigned nthreads)
 {
-	int i, err;
+	unsigned i;
+	int err;
 
 	init_threadsem();
 
 	kprintf("*** Starting fs long stress test on %s:\n", filesys);
 
-	for (i=0; i<NTHREADS; i++) {
+	for (i=0; i<nthreads; i++) {
 		err = thread_fork("longstress", NULL,
 				  longstress_thread, (char *)filesys, i);
 		if (err) {
@@ -523,7 +551,7 @@ dolongstress(const char *filesys)
 		}
 	}
 
-	for (i=0; i<NTHREADS; i++) {
+	for (i=0; i<nthreads; i++) {
 		P(threadsem);
 	}
 
@@ -648,15 +676,16 @@ createstress_thread(void *fs, unsigned long num)
 
 static
 void
-docreatestress(const char *filesys)
+docreatestress(const char *filesys, unsigned nthreads)
 {
-	int i, err;
+	unsigned i;
+	int err;
 
 	init_threadsem();
 
 	kprintf("*** Starting fs create stress test on %s:\n", filesys);
 
-	for (i=0; i<NTHREADS; i++) {
+	for (i=0; i<nthreads; i++) {
 		err = thread_fork("createstress", NULL,
 				  createstress_thread, (char *)filesys, i);
 		if (err) {
@@ -665,7 +694,7 @@ docreatestress(const char *filesys)
 		}
 	}
 
-	for (i=0; i<NTHREADS; i++) {
+	for (i=0; i<nthreads; i++) {
 		P(threadsem);
 	}
 
@@ -674,17 +703,307 @@ docreatestress(const char *filesys)
 
 ////////////////////////////////////////////////////////////
 
+#if OPT_SFS
+
+/*
+ * Fill the root directory, look everything in it up (which builds
+ * its name index), empty it, and unmount and remount the volume, so
+ * the directory's vnode is reclaimed. (SFS has no subdirectories, so
+ * the root is the only directory there is.)
+ */
 static
 int
-checkfilesystem(int nargs, char **args)
+dirtest_round(const char *fs)
+{
+	char name[48], buf[48];
+	struct vnode *vn;
+	int i, err;
+
+	for (i=0; i<NDIRFILES; i++) {
+		snprintf(name, sizeof(name), "%s:%s-%d", fs, FILENAME, i);
+		strcpy(buf, name);
+		err = vfs_open(buf, O_WRONLY|O_CREAT|O_EXCL, 0664, &vn);
+		if (err) {
+			kprintf("Could not create %s: %s\n",
+				name, strerror(err));
+			return -1;
+		}
+		vfs_close(vn);
+	}
+
+	for (i=0; i<NDIRFILES; i++) {
+		snprintf(name, sizeof(name), "%s:%s-%d", fs, FILENAME, i);
+		strcpy(buf, name);
+		err = vfs_open(buf, O_RDONLY, 0, &vn);
+		if (err) {
+			kprintf("Could not open %s: %s\n",
+				name, strerror(err));
+			return -1;
+		}
+		vfs_close(vn);
+	}
+
+	for (i=0; i<NDIRFILES; i++) {
+		snprintf(name, sizeof(name), "%s:%s-%d", fs, FILENAME, i);
+		strcpy(buf, name);
+		err = vfs_remove(buf);
+		if (err) {
+			kprintf("Could not remove %s: %s\n",
+				name, strerror(err));
+			return -1;
+		}
+	}
+
+	err = vfs_unmount(fs);
+	if (err) {
+		kprintf("Could not unmount %s: %s\n", fs, strerror(err));
+		return -1;
+	}
+	err = sfs_mount(fs);
+	if (err) {
+		kprintf("Could not remount %s: %s\n", fs, strerror(err));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Directory test: fills and empties an SFS volume's root directory,
+ * remounting it each time, and checks the kernel heap doesn't grow,
+ * i.e., that a reclaimed directory's name index is freed. The first
+ * round is left out of the comparison so caches have a chance to fill
+ * up; DIRSLACK allows for other threads allocating in the meantime.
+ *
+ * Takes the device name (e.g. lhd1), not a volume name, and needs
+ * nothing else to be using the volume (including as current
+ * directory).
+ */
+int
+dirtest(int nargs, char **args)
 {
 	char *device;
+	size_t before, after;
+	int i;
 
 	if (nargs != 2) {
-		kprintf("Usage: fs[12345] filesystem:\n");
+		kprintf("Usage: fs7 device:\n");
 		return EINVAL;
 	}
+	device = args[1];
+
+	/* Allow (but do not require) colon after device name */
+	if (device[strlen(device)-1]==':') {
+		device[strlen(device)-1] = 0;
+	}
+
+	kprintf("*** Starting fs directory test on %s:\n", device);
+
+	if (dirtest_round(device)) {
+		kprintf("*** Test failed\n");
+		return 0;
+	}
+	before = kheap_getused();
+	for (i=1; i<NDIRROUNDS; i++) {
+		if (dirtest_round(device)) {
+			kprintf("*** Test failed\n");
+			return 0;
+		}
+	}
+	after = kheap_getused();
+
+	if (after > before + DIRSLACK) {
+		kprintf("*** Test failed: kernel heap grew by %lu bytes "
+			"over %d rounds\n", (unsigned long)(after - before),
+			NDIRROUNDS - 1);
+		return 0;
+	}
+
+	kprintf("*** fs directory test done\n");
+	return 0;
+}
+
+#else /* !OPT_SFS */
+
+int
+dirtest(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+	kprintf("fs7: No SFS in this kernel\n");
+	return ENOSYS;
+}
+
+#endif /* OPT_SFS */
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Create or remove the fragmenting files: every STEP'th one of
+ * NFRAGFILES one-block files, starting at START.
+ */
+static
+int
+fragtest_files(const char *fs, int start, int step, bool create)
+{
+	char name[48], buf[48];
+	struct vnode *vn;
+	struct iovec iov;
+	struct uio ku;
+	int i, err;
+
+	for (i=start; i<NFRAGFILES; i+=step) {
+		snprintf(name, sizeof(name), "%s:%s-f%d", fs, FILENAME, i);
+		strcpy(buf, name);
+		if (!create) {
+			err = vfs_remove(buf);
+			if (err) {
+				kprintf("Could not remove %s: %s\n",
+					name, strerror(err));
+				return -1;
+			}
+			continue;
+		}
+		err = vfs_open(buf, O_WRONLY|O_CREAT|O_TRUNC, 0664, &vn);
+		if (err) {
+			kprintf("Could not create %s: %s\n",
+				name, strerror(err));
+			return -1;
+		}
+		strcpy(buf, SLOGAN);
+		uio_kinit(&iov, &ku, buf, strlen(SLOGAN), 0, UIO_WRITE);
+		err = VOP_WRITE(vn, &ku);
+		vfs_close(vn);
+		if (err) {
+			kprintf("%s: Write error: %s\n", name, strerror(err));
+			return -1;
+		}
+	}
+	return 0;
+}
 
+/*
+ * Write the big file with a single VOP_WRITE, FRAGNIOV copies of
+ * BUF, and read it back.
+ */
+static
+int
+fragtest_bigfile(const char *fs, char *buf)
+{
+	char name[48], nbuf[48];
+	char *rbuf;
+	struct vnode *vn;
+	struct iovec iovs[FRAGNIOV], iov;
+	struct uio ku;
+	size_t j;
+	int i, err;
+
+	snprintf(name, sizeof(name), "%s:%s-big", fs, FILENAME);
+	strcpy(nbuf, name);
+	err = vfs_open(nbuf, O_WRONLY|O_CREAT|O_TRUNC, 0664, &vn);
+	if (err) {
+		kprintf("Could not open %s for write: %s\n",
+			name, strerror(err));
+		return -1;
+	}
+
+	for (i=0; i<FRAGNIOV; i++) {
+		iovs[i].iov_kbase = buf;
+		iovs[i].iov_len = FRAGBUFSIZE;
+	}
+	ku.uio_iov = iovs;
+	ku.uio_iovcnt = FRAGNIOV;
+	ku.uio_offset = 0;
+	ku.uio_resid = FRAGNIOV * FRAGBUFSIZE;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = UIO_WRITE;
+	ku.uio_space = NULL;
+	err = VOP_WRITE(vn, &ku);
+	vfs_close(vn);
+	if (err) {
+		kprintf("%s: Write error: %s\n", name, strerror(err));
+		return -1;
+	}
+	if (ku.uio_resid > 0) {
+		kprintf("%s: Short write: %lu bytes left over\n",
+			name, (unsigned long) ku.uio_resid);
+		return -1;
+	}
+
+	rbuf = kmalloc(FRAGBUFSIZE);
+	if (rbuf == NULL) {
+		kprintf("fs8: Out of memory\n");
+		return -1;
+	}
+
+	strcpy(nbuf, name);
+	err = vfs_open(nbuf, O_RDONLY, 0664, &vn);
+	if (err) {
+		kprintf("Could not open %s for read: %s\n",
+			name, strerror(err));
+		kfree(rbuf);
+		return -1;
+	}
+	for (i=0; i<FRAGNIOV; i++) {
+		uio_kinit(&iov, &ku, rbuf, FRAGBUFSIZE,
+			  (off_t)i * FRAGBUFSIZE, UIO_READ);
+		err = VOP_READ(vn, &ku);
+		if (err) {
+			kprintf("%s: Read error: %s\n", name, strerror(err));
+			break;
+		}
+		if (ku.uio_resid > 0) {
+			kprintf("%s: Short read: %lu bytes left over\n",
+				name, (unsigned long) ku.uio_resid);
+			err = -1;
+			break;
+		}
+		for (j=0; j<FRAGBUFSIZE && rbuf[j] == buf[j]; j++) {
+			/* nothing */
+		}
+		if (j < FRAGBUFSIZE) {
+			kprintf("%s: Test failed: byte %lu mismatched\n",
+				name, (unsigned long) i * FRAGBUFSIZE + j);
+			err = -1;
+			break;
+		}
+	}
+	vfs_close(vn);
+	kfree(rbuf);
+	if (err) {
+		return -1;
+	}
+
+	kprintf("%s: %lu bytes written and read\n", name,
+		(unsigned long) FRAGNIOV * FRAGBUFSIZE);
+
+	strcpy(nbuf, name);
+	err = vfs_remove(nbuf);
+	if (err) {
+		kprintf("Could not remove %s: %s\n", name, strerror(err));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Fragmented write test: fills part of the disk with small files,
+ * removes every other one to chop the free space up, and then writes
+ * one big file in a single call. The big file ends up with hundreds
+ * of extents, so the write changes a lot of metadata at once, which
+ * is the worst case for the size of a journal transaction.
+ */
+int
+fragtest(int nargs, char **args)
+{
+	char *device;
+	char *buf;
+	size_t len, pos;
+	int i, ret;
+
+	if (nargs != 2) {
+		kprintf("Usage: fs8 filesystem:\n");
+		return EINVAL;
+	}
 	device = args[1];
 
 	/* Allow (but do not require) colon after device name */
@@ -692,29 +1011,155 @@ checkfilesystem(int nargs, char **args)
 		device[strlen(device)-1] = 0;
 	}
 
+	buf = kmalloc(FRAGBUFSIZE);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+	len = strlen(SLOGAN);
+	for (pos=0, i=0; pos < FRAGBUFSIZE; pos += len, i++) {
+		char line[32];
+
+		strcpy(line, SLOGAN);
+		rotate(line, i);
+		memcpy(buf + pos, line,
+		       len < FRAGBUFSIZE - pos ? len : FRAGBUFSIZE - pos);
+	}
+
+	kprintf("*** Starting fs fragmented write test on %s:\n", device);
+
+	ret = fragtest_files(device, 0, 1, true);
+	if (ret == 0) {
+		ret = fragtest_files(device, 1, 2, false);
+	}
+	if (ret == 0) {
+		ret = fragtest_bigfile(device, buf);
+	}
+	if (ret == 0) {
+		ret = fragtest_files(device, 0, 2, false);
+	}
+	kfree(buf);
+
+	if (ret) {
+		kprintf("*** Test failed\n");
+		return 0;
+	}
+	kprintf("*** fs fragmented write test done\n");
 	return 0;
 }
 
-#define DEFTEST(testname)                         \
-  int                                             \
-  testname(int nargs, char **args)                \
-  {                                               \
-	int result;                               \
-	result = checkfilesystem(nargs, args);    \
-	if (result) {                             \
-		return result;                    \
-	}                                         \
-	do##testname(args[1]);                    \
-	return 0;                                 \
+////////////////////////////////////////////////////////////
+
+static
+int
+checkfilesystem(int nargs, char **args, unsigned *nthreads, bool *scale)
+{
+	char *device;
+	int n;
+
+	*nthreads = NTHREADS;
+	*scale = false;
+
+	if (nargs != 2 && nargs != 3) {
+		kprintf("Usage: fs[23456] filesystem: [nthreads|scale]\n");
+		return EINVAL;
+	}
+
+	if (nargs == 3) {
+		if (!strcmp(args[2], "scale")) {
+			*scale = true;
+		}
+		else {
+			n = atoi(args[2]);
+			if (n < 1 || n > MAXTHREADS) {
+				kprintf("fstest: thread count must be "
+					"between 1 and %d\n", MAXTHREADS);
+				return EINVAL;
+			}
+			*nthreads = n;
+		}
+	}
+
+	device = args[1];
+
+	/* Allow (but do not require) colon after device name */
+	if (device[strlen(device)-1]==':') {
+		device[strlen(device)-1] = 0;
+	}
+
+	return 0;
+}
+
+/*
+ * Run a test once with a given number of threads, reporting the time
+ * taken so runs with different thread counts can be compared.
+ */
+static
+void
+timetest(void (*func)(const char *, unsigned),
+	 const char *filesys, unsigned nthreads)
+{
+	struct timespec before, after, duration;
+
+	gettime(&before);
+	func(filesys, nthreads);
+	gettime(&after);
+	timespec_sub(&after, &before, &duration);
+
+	kprintf("*** %u thread%s: %llu.%09lu seconds\n", nthreads,
+		nthreads == 1 ? "" : "s",
+		(unsigned long long) duration.tv_sec,
+		(unsigned long) duration.tv_nsec);
+}
+
+#define DEFTEST(testname)                                        \
+  int                                                            \
+  testname(int nargs, char **args)                               \
+  {                                                              \
+	unsigned nthreads, i;                                    \
+	bool scale;                                              \
+	int result;                                              \
+	result = checkfilesystem(nargs, args, &nthreads, &scale); \
+	if (result) {                                            \
+		return result;                                   \
+	}                                                        \
+	if (!scale) {                                            \
+		timetest(do##testname, args[1], nthreads);       \
+		return 0;                                        \
+	}                                                        \
+	for (i=0; i<NSCALECOUNTS; i++) {                         \
+		timetest(do##testname, args[1], scalecounts[i]); \
+	}                                                        \
+	return 0;                                                \
   }
 
-DEFTEST(fstest);
 DEFTEST(readstress);
 DEFTEST(writestress);
 DEFTEST(writestress2);
 DEFTEST(longstress);
 DEFTEST(createstress);
 
+/*
+ * fs1 is single-threaded by nature, so it takes no thread count.
+ */
+int
+fstest(int nargs, char **args)
+{
+	unsigned nthreads;
+	bool scale;
+	int result;
+
+	if (nargs != 2) {
+		kprintf("Usage: fs1 filesystem:\n");
+		return EINVAL;
+	}
+	result = checkfilesystem(nargs, args, &nthreads, &scale);
+	if (result) {
+		return result;
+	}
+	timetest(dofstest, args[1], 1);
+	return 0;
+}
+
 ////////////////////////////////////////////////////////////
 
 int
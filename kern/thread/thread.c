@@ -76,8 +76,6 @@ static struct wchanarray allwchans;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
-int initialise_fd_table(struct thread* thread);
-
 ////////////////////////////////////////////////////////////
 
 /*
@@ -155,34 +153,14 @@ thread_create(const char *name)
 	thread->t_curspl = IPL_HIGH;
 	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
 
-	/* If you add to struct thread, be sure to initialize here */
+	/* Public fields */
+	thread->t_iovnode = NULL;
 
-	int result = initialise_fd_table(thread);
-	if (!result) {
-		kfree(thread->t_name);
-		kfree(thread);
-		return NULL;
-	}
+	/* If you add to struct thread, be sure to initialize here */
 
 	return thread;
 }
 
-int initialise_fd_table(struct thread* thread) {
-	int i = 0;
-	while (i < OPEN_MAX) {
-		thread->file_descriptors[i] = NULL;
-		i++;
-	}
-
-	thread->fd_table_lock = lock_create("fd table lock");
-	if (thread->fd_table_lock == NULL) {
-		return 0;
-	}
-
-	thread->previous_fd = 0;
-	return 1;
-}
-
 /*
  * Create a CPU structure. This is used for the bootup CPU and
  * also for secondary CPUs.
@@ -276,16 +254,6 @@ thread_destroy(struct thread *thread)
 	 * either here or in thread_exit(). (And not both...)
 	 */
 
-	lock_destroy(thread->fd_table_lock); 
-	int i = 0;
-	while (i < OPEN_MAX) {
-		struct file_descriptor* fd = thread->file_descriptors[i];
-		if (fd != NULL) {
-			myclose(i);
-		}
-		i++;
-	}
-
 	/* Thread subsystem fields */
 	KASSERT(thread->t_proc == NULL);
 	if (thread->t_stack != NULL) {
@@ -569,28 +537,6 @@ thread_fork(const char *name,
 	 */
 	newthread->t_iplhigh_count++;
 
-	// *****************************
-	// MAKING A COPY OF THE FD TABLE
-	// *****************************
-
-	newthread->previous_fd = curthread->previous_fd;
-	int i = 0;
-	while (i < OPEN_MAX) {
-		struct file_descriptor *old_fd = curthread->file_descriptors[i];
-		if (old_fd != NULL) {
-			old_fd->ref_count++;
-
-			newthread->file_descriptors[i] = old_fd;
-		} else {
-			newthread->file_descriptors[i] = NULL;
-		}
-
-		i++;
-	}
-	// *********************************
-	// FIN MAKING A COPY OF THE FD TABLE
-	// *********************************
-
 	/* Set up the switchframe so entrypoint() gets called */
 	switchframe_init(newthread, entrypoint, data1, data2);
 
@@ -1226,6 +1172,23 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	spinlock_release(&target->c_ipi_lock);
 }
 
+unsigned
+ipi_tlbshootdown_broadcast(const struct tlbshootdown *mapping)
+{
+	unsigned i, n;
+	struct cpu *c;
+
+	n = 0;
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self) {
+			ipi_tlbshootdown(c, mapping);
+			n++;
+		}
+	}
+	return n;
+}
+
 void
 interprocessor_interrupt(void)
 {
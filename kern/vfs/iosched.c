@@ -0,0 +1,427 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Block I/O scheduler. See iosched.h for the interface.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <iosched.h>
+
+/*
+ * How long a request may wait under the deadline policy before it is
+ * served ahead of the elevator order. Reads are usually synchronous
+ * (someone is waiting for the data), so they get the shorter one.
+ */
+#define IOSCHED_READ_DEADLINE_NS   50000000	/* 50 ms */
+#define IOSCHED_WRITE_DEADLINE_NS 500000000	/* 500 ms */
+
+/*
+ * Largest batch of blocks built by merging at dispatch time, so one
+ * long sequential stream can't hold the disk indefinitely.
+ */
+#define IOSCHED_MAXMERGE 128
+
+struct iosched_policy;
+
+/*
+ * Scheduler state for one device.
+ *
+ * ios_queue is in arrival order; the policies search it rather than
+ * keeping it sorted, since queues are short (one entry per thread
+ * doing I/O) and FIFO and deadline both want arrival order anyway.
+ *
+ * ios_pos is the block just past the end of the last batch
+ * dispatched, i.e. where the disk head will be.
+ */
+struct iosched {
+	const char *ios_name;
+	struct spinlock *ios_lock;		/* driver's queue lock */
+	const struct iosched_policy *ios_policy;
+	struct ioreq *ios_queue;		/* waiting, oldest first */
+	uint32_t ios_pos;			/* current head position */
+	struct iosched *ios_nextsched;		/* registry link */
+
+	/* statistics */
+	unsigned ios_depth;			/* requests outstanding */
+	unsigned ios_maxdepth;			/* high-water mark */
+	uint64_t ios_depthsum;			/* ios_depth summed at add */
+	unsigned ios_nreqs;			/* requests added */
+	unsigned ios_ndone;			/* requests completed */
+	unsigned ios_ndispatch;			/* batches started */
+	unsigned ios_nmerged;			/* requests merged into a batch */
+	unsigned ios_nexpired;			/* served early by deadline */
+	uint64_t ios_seekdist;			/* blocks moved between batches */
+	uint64_t ios_latsum;			/* total latency, usec */
+	uint32_t ios_latmax;			/* worst latency, usec */
+};
+
+/*
+ * A policy. pick returns the link pointing at the request to start
+ * next; the queue is known to be non-empty.
+ */
+struct iosched_policy {
+	const char *name;
+	struct ioreq **(*pick)(struct iosched *ios);
+};
+
+/* All schedulers, for iosched_setpolicy and iosched_printstats. */
+static struct spinlock iosched_listlock = SPINLOCK_INITIALIZER;
+static struct iosched *iosched_list;
+
+////////////////////////////////////////////////////////////
+// Policies
+
+/*
+ * FIFO: the oldest request.
+ */
+static
+struct ioreq **
+iosched_pick_fifo(struct iosched *ios)
+{
+	return &ios->ios_queue;
+}
+
+/*
+ * C-LOOK: the lowest-numbered request at or beyond the head, or if
+ * there is none, the lowest-numbered request overall. Ties go to the
+ * older request.
+ */
+static
+struct ioreq **
+iosched_pick_clook(struct iosched *ios)
+{
+	struct ioreq **pp, **ahead, **lowest;
+
+	ahead = lowest = NULL;
+	for (pp = &ios->ios_queue; *pp != NULL; pp = &(*pp)->ir_next) {
+		uint32_t block = (*pp)->ir_block;
+
+		if (block >= ios->ios_pos &&
+		    (ahead == NULL || block < (*ahead)->ir_block)) {
+			ahead = pp;
+		}
+		if (lowest == NULL || block < (*lowest)->ir_block) {
+			lowest = pp;
+		}
+	}
+	return ahead != NULL ? ahead : lowest;
+}
+
+/*
+ * Deadline: the request whose deadline passed longest ago, if any
+ * have passed; otherwise C-LOOK.
+ */
+static
+struct ioreq **
+iosched_pick_deadline(struct iosched *ios)
+{
+	struct timespec now, diff;
+	struct ioreq **pp, **late;
+
+	gettime(&now);
+	late = NULL;
+	for (pp = &ios->ios_queue; *pp != NULL; pp = &(*pp)->ir_next) {
+		/* skip if not yet expired */
+		timespec_sub(&now, &(*pp)->ir_deadline, &diff);
+		if (diff.tv_sec < 0) {
+			continue;
+		}
+		if (late == NULL) {
+			late = pp;
+			continue;
+		}
+		/* keep the earlier deadline */
+		timespec_sub(&(*late)->ir_deadline, &(*pp)->ir_deadline,
+			     &diff);
+		if (diff.tv_sec >= 0 && (diff.tv_sec > 0 || diff.tv_nsec > 0)) {
+			late = pp;
+		}
+	}
+	if (late != NULL) {
+		ios->ios_nexpired++;
+		return late;
+	}
+	return iosched_pick_clook(ios);
+}
+
+static const struct iosched_policy iosched_policies[] = {
+	{ "fifo",	iosched_pick_fifo },
+	{ "clook",	iosched_pick_clook },
+	{ "deadline",	iosched_pick_deadline },
+};
+#define NPOLICIES (sizeof(iosched_policies) / sizeof(iosched_policies[0]))
+
+/* Policy for new devices. */
+#define IOSCHED_DEFAULT (&iosched_policies[2])
+
+////////////////////////////////////////////////////////////
+// Setup
+
+struct iosched *
+iosched_create(const char *name, struct spinlock *lock)
+{
+	struct iosched *ios;
+
+	ios = kmalloc(sizeof(*ios));
+	if (ios == NULL) {
+		return NULL;
+	}
+	bzero(ios, sizeof(*ios));
+	ios->ios_name = name;
+	ios->ios_lock = lock;
+	ios->ios_policy = IOSCHED_DEFAULT;
+	ios->ios_queue = NULL;
+	ios->ios_pos = 0;
+
+	spinlock_acquire(&iosched_listlock);
+	ios->ios_nextsched = iosched_list;
+	iosched_list = ios;
+	spinlock_release(&iosched_listlock);
+
+	return ios;
+}
+
+void
+iosched_destroy(struct iosched *ios)
+{
+	struct iosched **pp;
+
+	KASSERT(ios->ios_queue == NULL);
+	KASSERT(ios->ios_depth == 0);
+
+	spinlock_acquire(&iosched_listlock);
+	for (pp = &iosched_list; *pp != ios; pp = &(*pp)->ios_nextsched) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = ios->ios_nextsched;
+	spinlock_release(&iosched_listlock);
+
+	kfree(ios);
+}
+
+////////////////////////////////////////////////////////////
+// Requests
+
+void
+iosched_add(struct iosched *ios, struct ioreq *req)
+{
+	struct timespec wait;
+	struct ioreq **pp;
+
+	KASSERT(spinlock_do_i_hold(ios->ios_lock));
+	KASSERT(req->ir_nblocks > 0);
+
+	gettime(&req->ir_queued);
+	wait.tv_sec = 0;
+	wait.tv_nsec = req->ir_write ? IOSCHED_WRITE_DEADLINE_NS :
+		IOSCHED_READ_DEADLINE_NS;
+	timespec_add(&req->ir_queued, &wait, &req->ir_deadline);
+	req->ir_merged = NULL;
+	req->ir_next = NULL;
+
+	/* append; the queue is short */
+	for (pp = &ios->ios_queue; *pp != NULL; pp = &(*pp)->ir_next) {
+		/* nothing */
+	}
+	*pp = req;
+
+	ios->ios_nreqs++;
+	ios->ios_depth++;
+	ios->ios_depthsum += ios->ios_depth;
+	if (ios->ios_depth > ios->ios_maxdepth) {
+		ios->ios_maxdepth = ios->ios_depth;
+	}
+}
+
+/*
+ * Find a queued request in direction WRITE starting exactly at BLOCK,
+ * and unlink it.
+ */
+static
+struct ioreq *
+iosched_takeadjacent(struct iosched *ios, uint32_t block, bool write)
+{
+	struct ioreq **pp, *req;
+
+	for (pp = &ios->ios_queue; *pp != NULL; pp = &(*pp)->ir_next) {
+		req = *pp;
+		if (req->ir_block == block && req->ir_write == write) {
+			*pp = req->ir_next;
+			req->ir_next = NULL;
+			return req;
+		}
+	}
+	return NULL;
+}
+
+struct ioreq *
+iosched_next(struct iosched *ios)
+{
+	struct ioreq **pp, *first, *last, *req;
+	uint32_t end, total;
+
+	KASSERT(spinlock_do_i_hold(ios->ios_lock));
+
+	if (ios->ios_queue == NULL) {
+		return NULL;
+	}
+
+	pp = ios->ios_policy->pick(ios);
+	first = *pp;
+	*pp = first->ir_next;
+	first->ir_next = NULL;
+	first->ir_merged = NULL;
+
+	/* Pull in any requests that carry on where this one stops. */
+	last = first;
+	total = first->ir_nblocks;
+	end = first->ir_block + first->ir_nblocks;
+	while (total < IOSCHED_MAXMERGE) {
+		req = iosched_takeadjacent(ios, end, first->ir_write);
+		if (req == NULL) {
+			break;
+		}
+		req->ir_merged = NULL;
+		last->ir_merged = req;
+		last = req;
+		total += req->ir_nblocks;
+		end += req->ir_nblocks;
+		ios->ios_nmerged++;
+	}
+
+	ios->ios_seekdist += first->ir_block > ios->ios_pos ?
+		first->ir_block - ios->ios_pos : ios->ios_pos - first->ir_block;
+	ios->ios_pos = end;
+	ios->ios_ndispatch++;
+
+	return first;
+}
+
+void
+iosched_done(struct iosched *ios, struct ioreq *req)
+{
+	struct timespec now, diff;
+	uint64_t usec;
+
+	KASSERT(spinlock_do_i_hold(ios->ios_lock));
+	KASSERT(ios->ios_depth > 0);
+
+	gettime(&now);
+	timespec_sub(&now, &req->ir_queued, &diff);
+	usec = (uint64_t)diff.tv_sec * 1000000 + diff.tv_nsec / 1000;
+
+	ios->ios_depth--;
+	ios->ios_ndone++;
+	ios->ios_latsum += usec;
+	if (usec > ios->ios_latmax) {
+		ios->ios_latmax = usec;
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Control and statistics
+
+int
+iosched_setpolicy(const char *policy)
+{
+	const struct iosched_policy *p;
+	struct iosched *ios;
+	unsigned i;
+
+	p = NULL;
+	for (i=0; i<NPOLICIES; i++) {
+		if (!strcmp(iosched_policies[i].name, policy)) {
+			p = &iosched_policies[i];
+			break;
+		}
+	}
+	if (p == NULL) {
+		return EINVAL;
+	}
+
+	spinlock_acquire(&iosched_listlock);
+	for (ios = iosched_list; ios != NULL; ios = ios->ios_nextsched) {
+		spinlock_acquire(ios->ios_lock);
+		ios->ios_policy = p;
+		spinlock_release(ios->ios_lock);
+	}
+	spinlock_release(&iosched_listlock);
+
+	return 0;
+}
+
+void
+iosched_printstats(void)
+{
+	struct iosched *ios, snap;
+	unsigned i, n;
+
+	/*
+	 * Can't kprintf with spinlocks held, so copy each device's
+	 * state out and print the copy. Devices are found by position
+	 * each time round in case the list changes.
+	 */
+	for (n=0; ; n++) {
+		spinlock_acquire(&iosched_listlock);
+		ios = iosched_list;
+		for (i=0; i<n && ios != NULL; i++) {
+			ios = ios->ios_nextsched;
+		}
+		if (ios == NULL) {
+			spinlock_release(&iosched_listlock);
+			break;
+		}
+		spinlock_acquire(ios->ios_lock);
+		snap = *ios;
+		spinlock_release(ios->ios_lock);
+		spinlock_release(&iosched_listlock);
+
+		kprintf("%s: policy %s, %u requests, %u batches, "
+			"%u merged, %u expired\n",
+			snap.ios_name, snap.ios_policy->name, snap.ios_nreqs,
+			snap.ios_ndispatch, snap.ios_nmerged,
+			snap.ios_nexpired);
+		kprintf("%s: queue depth %u now, %u max, %u avg; "
+			"seek distance %llu blocks\n",
+			snap.ios_name, snap.ios_depth, snap.ios_maxdepth,
+			snap.ios_nreqs ?
+			(unsigned)(snap.ios_depthsum / snap.ios_nreqs) : 0,
+			(unsigned long long)snap.ios_seekdist);
+		kprintf("%s: latency %u us avg, %u us max\n",
+			snap.ios_name,
+			snap.ios_ndone ?
+			(unsigned)(snap.ios_latsum / snap.ios_ndone) : 0,
+			(unsigned)snap.ios_latmax);
+	}
+}
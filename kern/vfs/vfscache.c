@@ -0,0 +1,382 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * VFS name cache.
+ *
+ * Remembers the results of looking up single names in directories:
+ * (directory vnode, name) -> vnode, or -> nothing for names that
+ * turned out not to exist. vfs_lookup consults it before asking the
+ * filesystem, so opening the same file over and over doesn't search
+ * the directory each time, and neither does probing for a file that
+ * isn't there.
+ *
+ * Each entry holds a reference to its directory and, if positive,
+ * to its vnode, so neither can be reclaimed (and its vnode reused
+ * for something else) while the entry exists. The number of entries
+ * is fixed; when they're all in use the least recently used one is
+ * thrown out. Only short names are cached, and not "." or "..".
+ *
+ * Whenever a name in a directory is added, removed, or renamed, the
+ * code in vfspath.c calls vfs_cache_purge after the operation. To
+ * keep a lookup that was already in progress from then entering
+ * what it found before the change, every purge bumps a generation
+ * number; vfs_cache_lookup hands back the number it saw along with
+ * a miss, and vfs_cache_enter ignores entries made against an older
+ * one.
+ *
+ * vc_lock protects everything here. It ranks below all filesystem
+ * locks. References are never dropped while it's held, since that
+ * can reclaim the vnode and go into the filesystem.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <synch.h>
+#include <vfs.h>
+#include <vnode.h>
+
+/* Number of entries and hash chains */
+#define VC_SIZE      256
+#define VC_HASHSIZE  64
+
+/* Longest name cached */
+#define VC_NAMELEN   31
+
+struct vcentry {
+	struct vnode *vc_dir;		/* directory (referenced) */
+	struct vnode *vc_vn;		/* result (referenced), or NULL */
+	struct vcentry *vc_hashnext;	/* hash chain, or free list */
+	struct vcentry *vc_lruprev;	/* LRU list; NULL if not in use */
+	struct vcentry *vc_lrunext;
+	char vc_name[VC_NAMELEN+1];
+};
+
+static struct lock *vc_lock;
+static struct vcentry *vc_entries;
+static struct vcentry *vc_hash[VC_HASHSIZE];
+static struct vcentry *vc_free;
+static struct vcentry vc_lru;		/* head; vc_lrunext is most recent */
+static unsigned vc_gen;
+
+/* Statistics, under vc_lock */
+static unsigned vc_lookups, vc_hits, vc_neghits, vc_enters, vc_evictions;
+
+/*
+ * Set up at boot.
+ */
+void
+vfs_cache_bootstrap(void)
+{
+	unsigned i;
+
+	vc_lock = lock_create("vfs name cache");
+	if (vc_lock == NULL) {
+		panic("vfs: Could not create name cache lock\n");
+	}
+	vc_entries = kmalloc(VC_SIZE * sizeof(struct vcentry));
+	if (vc_entries == NULL) {
+		panic("vfs: Could not allocate name cache\n");
+	}
+
+	vc_free = NULL;
+	for (i=0; i<VC_SIZE; i++) {
+		vc_entries[i].vc_dir = NULL;
+		vc_entries[i].vc_vn = NULL;
+		vc_entries[i].vc_lruprev = NULL;
+		vc_entries[i].vc_lrunext = NULL;
+		vc_entries[i].vc_hashnext = vc_free;
+		vc_free = &vc_entries[i];
+	}
+	for (i=0; i<VC_HASHSIZE; i++) {
+		vc_hash[i] = NULL;
+	}
+	vc_lru.vc_lrunext = vc_lru.vc_lruprev = &vc_lru;
+	vc_gen = 0;
+}
+
+/*
+ * Names we don't cache: long ones, "." and "..", which would need
+ * purging whenever a directory moves, and anything that isn't a
+ * single component.
+ */
+static
+bool
+vc_cacheable(const char *name)
+{
+	return strlen(name) <= VC_NAMELEN &&
+		strcmp(name, ".") && strcmp(name, "..") &&
+		strchr(name, '/') == NULL;
+}
+
+static
+unsigned
+vc_hashfunc(struct vnode *dir, const char *name)
+{
+	unsigned h = (uintptr_t)dir / sizeof(struct vnode);
+
+	while (*name) {
+		h = h*33 + (unsigned char)*name++;
+	}
+	return h % VC_HASHSIZE;
+}
+
+static
+struct vcentry *
+vc_find(struct vnode *dir, const char *name)
+{
+	struct vcentry *e;
+
+	for (e = vc_hash[vc_hashfunc(dir, name)]; e; e = e->vc_hashnext) {
+		if (e->vc_dir == dir && !strcmp(e->vc_name, name)) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+vc_lru_insert(struct vcentry *e)
+{
+	e->vc_lruprev = &vc_lru;
+	e->vc_lrunext = vc_lru.vc_lrunext;
+	e->vc_lrunext->vc_lruprev = e;
+	vc_lru.vc_lrunext = e;
+}
+
+static
+void
+vc_lru_remove(struct vcentry *e)
+{
+	e->vc_lruprev->vc_lrunext = e->vc_lrunext;
+	e->vc_lrunext->vc_lruprev = e->vc_lruprev;
+	e->vc_lruprev = e->vc_lrunext = NULL;
+}
+
+/*
+ * Take an entry out of the cache. Hands back the references it held
+ * for the caller to drop once vc_lock is released.
+ */
+static
+void
+vc_remove(struct vcentry *e, struct vnode **dir, struct vnode **vn)
+{
+	struct vcentry **pp;
+
+	pp = &vc_hash[vc_hashfunc(e->vc_dir, e->vc_name)];
+	while (*pp != e) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->vc_hashnext;
+	}
+	*pp = e->vc_hashnext;
+	vc_lru_remove(e);
+
+	*dir = e->vc_dir;
+	*vn = e->vc_vn;
+	e->vc_dir = e->vc_vn = NULL;
+}
+
+static
+void
+vc_drop(struct vnode *dir, struct vnode *vn)
+{
+	if (vn != NULL) {
+		VOP_DECREF(vn);
+	}
+	if (dir != NULL) {
+		VOP_DECREF(dir);
+	}
+}
+
+/*
+ * Look up NAME in DIR. On a hit, returns true with *RET set to the
+ * vnode (with a reference added for the caller), or to NULL if the
+ * name is known not to exist. On a miss, returns false and sets *GEN
+ * for passing to vfs_cache_enter.
+ */
+bool
+vfs_cache_lookup(struct vnode *dir, const char *name, struct vnode **ret,
+		 unsigned *gen)
+{
+	struct vcentry *e;
+
+	if (!vc_cacheable(name)) {
+		*gen = 0;
+		return false;
+	}
+
+	lock_acquire(vc_lock);
+	vc_lookups++;
+	e = vc_find(dir, name);
+	if (e == NULL) {
+		*gen = vc_gen;
+		lock_release(vc_lock);
+		return false;
+	}
+
+	vc_lru_remove(e);
+	vc_lru_insert(e);
+	if (e->vc_vn != NULL) {
+		VOP_INCREF(e->vc_vn);
+		vc_hits++;
+	}
+	else {
+		vc_neghits++;
+	}
+	*ret = e->vc_vn;
+	lock_release(vc_lock);
+	return true;
+}
+
+/*
+ * Remember that NAME in DIR is VN (or doesn't exist, if VN is NULL),
+ * as found by a lookup that missed in the cache with generation GEN.
+ */
+void
+vfs_cache_enter(struct vnode *dir, const char *name, struct vnode *vn,
+		unsigned gen)
+{
+	struct vcentry *e;
+	struct vnode *olddir = NULL, *oldvn = NULL;
+
+	if (!vc_cacheable(name)) {
+		return;
+	}
+
+	lock_acquire(vc_lock);
+	if (gen != vc_gen || vc_find(dir, name) != NULL) {
+		/* Changed since, or someone else got here first */
+		lock_release(vc_lock);
+		return;
+	}
+
+	if (vc_free != NULL) {
+		e = vc_free;
+		vc_free = e->vc_hashnext;
+	}
+	else {
+		e = vc_lru.vc_lruprev;
+		KASSERT(e != &vc_lru);
+		vc_remove(e, &olddir, &oldvn);
+		vc_evictions++;
+	}
+
+	VOP_INCREF(dir);
+	e->vc_dir = dir;
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+	e->vc_vn = vn;
+	strcpy(e->vc_name, name);
+
+	e->vc_hashnext = vc_hash[vc_hashfunc(dir, name)];
+	vc_hash[vc_hashfunc(dir, name)] = e;
+	vc_lru_insert(e);
+	vc_enters++;
+	lock_release(vc_lock);
+
+	vc_drop(olddir, oldvn);
+}
+
+/*
+ * Forget NAME in DIR. Call after anything that might have changed
+ * what NAME in DIR refers to, whether it succeeded or not.
+ */
+void
+vfs_cache_purge(struct vnode *dir, const char *name)
+{
+	struct vcentry *e;
+	struct vnode *olddir = NULL, *oldvn = NULL;
+
+	lock_acquire(vc_lock);
+	vc_gen++;
+	e = vc_find(dir, name);
+	if (e != NULL) {
+		vc_remove(e, &olddir, &oldvn);
+		e->vc_hashnext = vc_free;
+		vc_free = e;
+	}
+	lock_release(vc_lock);
+
+	vc_drop(olddir, oldvn);
+}
+
+/*
+ * Forget everything on FS, so the references held here don't keep
+ * it from being unmounted.
+ */
+void
+vfs_cache_purgefs(struct fs *fs)
+{
+	struct vcentry *e;
+	struct vnode *olddir, *oldvn;
+
+	while (1) {
+		olddir = oldvn = NULL;
+
+		lock_acquire(vc_lock);
+		vc_gen++;
+		for (e = vc_lru.vc_lrunext; e != &vc_lru; e = e->vc_lrunext) {
+			if (e->vc_dir->vn_fs == fs) {
+				vc_remove(e, &olddir, &oldvn);
+				e->vc_hashnext = vc_free;
+				vc_free = e;
+				break;
+			}
+		}
+		lock_release(vc_lock);
+
+		if (olddir == NULL) {
+			break;
+		}
+		/* Dropping these may reclaim them; start over */
+		vc_drop(olddir, oldvn);
+	}
+}
+
+/*
+ * Print the statistics.
+ */
+void
+vfs_cache_printstats(void)
+{
+	unsigned lookups, hits, neghits;
+
+	lock_acquire(vc_lock);
+	lookups = vc_lookups;
+	hits = vc_hits;
+	neghits = vc_neghits;
+	kprintf("vfs name cache: %u lookups, %u hits, %u negative hits "
+		"(%u%%), %u entered, %u evicted\n",
+		lookups, hits, neghits,
+		lookups ? (hits + neghits) * 100 / lookups : 0,
+		vc_enters, vc_evictions);
+	lock_release(vc_lock);
+}
@@ -235,11 +235,15 @@ vfs_lookparent(char *path, struct vnode **retval,
 	struct vnode *startvn;
 	int result;
 
+	/*
+	 * The big lock only covers the device/mount lists walked by
+	 * getdevice; once we hold a reference to the starting vnode
+	 * the filesystem does its own locking.
+	 */
 	vfs_biglock_acquire();
-
 	result = getdevice(path, &path, &startvn);
+	vfs_biglock_release();
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -257,7 +261,6 @@ vfs_lookparent(char *path, struct vnode **retval,
 
 	VOP_DECREF(startvn);
 
-	vfs_biglock_release();
 	return result;
 }
 
@@ -265,25 +268,42 @@ int
 vfs_lookup(char *path, struct vnode **retval)
 {
 	struct vnode *startvn;
+	char name[NAME_MAX+1];
+	unsigned gen;
 	int result;
 
 	vfs_biglock_acquire();
-
 	result = getdevice(path, &path, &startvn);
+	vfs_biglock_release();
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	if (strlen(path)==0) {
 		*retval = startvn;
-		vfs_biglock_release();
 		return 0;
 	}
 
+	/* Try the name cache first */
+	if (vfs_cache_lookup(startvn, path, retval, &gen)) {
+		VOP_DECREF(startvn);
+		return *retval == NULL ? ENOENT : 0;
+	}
+
+	/* VOP_LOOKUP may destroy the path; keep the name to cache */
+	if (strlen(path) < sizeof(name)) {
+		strcpy(name, path);
+	}
+	else {
+		name[0] = 0;
+	}
+
 	result = VOP_LOOKUP(startvn, path, retval);
+	if (name[0] != 0 && (result == 0 || result == ENOENT)) {
+		vfs_cache_enter(startvn, name,
+				result == 0 ? *retval : NULL, gen);
+	}
 
 	VOP_DECREF(startvn);
-	vfs_biglock_release();
 	return result;
 }
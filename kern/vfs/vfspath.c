@@ -36,6 +36,7 @@
 #include <kern/fcntl.h>
 #include <limits.h>
 #include <lib.h>
+#include <vm.h>
 #include <vfs.h>
 #include <vnode.h>
 
@@ -74,6 +75,7 @@ vfs_open(char *path, int openflags, mode_t mode, struct vnode **ret)
 		}
 
 		result = VOP_CREAT(dir, name, excl, mode, &vn);
+		vfs_cache_purge(dir, name);
 
 		VOP_DECREF(dir);
 	}
@@ -93,7 +95,12 @@ vfs_open(char *path, int openflags, mode_t mode, struct vnode **ret)
 		return result;
 	}
 
-	VOP_INCOPEN(vn);
+	VOP_INCOPEN(vn, canwrite);
+
+	/* Programs started from now on must see what gets written. */
+	if (canwrite) {
+		vm_textpurge(vn);
+	}
 
 	if (openflags & O_TRUNC) {
 		if (canwrite==0) {
@@ -150,6 +157,7 @@ vfs_remove(char *path)
 	}
 
 	result = VOP_REMOVE(dir, name);
+	vfs_cache_purge(dir, name);
 	VOP_DECREF(dir);
 
 	return result;
@@ -183,6 +191,8 @@ vfs_rename(char *oldpath, char *newpath)
 	}
 
 	result = VOP_RENAME(olddir, oldname, newdir, newname);
+	vfs_cache_purge(olddir, oldname);
+	vfs_cache_purge(newdir, newname);
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(olddir);
@@ -217,6 +227,7 @@ vfs_link(char *oldpath, char *newpath)
 	}
 
 	result = VOP_LINK(newdir, newname, oldfile);
+	vfs_cache_purge(newdir, newname);
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(oldfile);
@@ -244,6 +255,7 @@ vfs_symlink(const char *contents, char *path)
 	}
 
 	result = VOP_SYMLINK(newdir, newname, contents);
+	vfs_cache_purge(newdir, newname);
 	VOP_DECREF(newdir);
 
 	return result;
@@ -290,6 +302,7 @@ vfs_mkdir(char *path, mode_t mode)
 	}
 
 	result = VOP_MKDIR(parent, name, mode);
+	vfs_cache_purge(parent, name);
 
 	VOP_DECREF(parent);
 
@@ -312,6 +325,7 @@ vfs_rmdir(char *path)
 	}
 
 	result = VOP_RMDIR(parent, name);
+	vfs_cache_purge(parent, name);
 
 	VOP_DECREF(parent);
 
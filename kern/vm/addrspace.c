@@ -30,13 +30,20 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <proc.h>
 #include <addrspace.h>
+#include <pagetable.h>
+#include <vnode.h>
 #include <vm.h>
 
 /*
- * Note! If OPT_DUMBVM is set, as is the case until you start the VM
- * assignment, this file is not compiled or linked or in any way
- * used. The cheesy hack versions in dumbvm.c are used instead.
+ * Note! If OPT_DUMBVM is set, this file is not compiled or linked or
+ * in any way used. The cheesy hack versions in dumbvm.c are used
+ * instead.
+ *
+ * No physical memory is allocated here, and nothing is read from
+ * the executable: pages are allocated, read in, or copied for
+ * copy-on-write, by vm_fault as they're touched.
  */
 
 struct addrspace *
@@ -49,28 +56,89 @@ as_create(void)
 		return NULL;
 	}
 
-	/*
-	 * Initialize as needed.
-	 */
+	as->as_pt = pt_create();
+	if (as->as_pt == NULL) {
+		kfree(as);
+		return NULL;
+	}
+	as->as_regions = NULL;
+	as->as_loading = false;
 
 	return as;
 }
 
+/*
+ * Add a region to AS.
+ */
+static
+int
+as_addregion(struct addrspace *as, vaddr_t vbase, size_t npages,
+	     bool writeable)
+{
+	struct region *rg;
+
+	rg = kmalloc(sizeof(struct region));
+	if (rg == NULL) {
+		return ENOMEM;
+	}
+	rg->rg_vbase = vbase;
+	rg->rg_npages = npages;
+	rg->rg_writeable = writeable;
+	rg->rg_vnode = NULL;
+	rg->rg_filevaddr = 0;
+	rg->rg_fileoffset = 0;
+	rg->rg_filesize = 0;
+	rg->rg_next = as->as_regions;
+	as->as_regions = rg;
+	return 0;
+}
+
+/*
+ * The copy shares every page with the original; both sides copy a
+ * page only when they first write to it.
+ */
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
 	struct addrspace *newas;
+	struct region *rg, *newrg;
+	int result;
 
 	newas = as_create();
 	if (newas==NULL) {
 		return ENOMEM;
 	}
 
+	for (rg = old->as_regions; rg != NULL; rg = rg->rg_next) {
+		result = as_addregion(newas, rg->rg_vbase, rg->rg_npages,
+				      rg->rg_writeable);
+		if (result) {
+			as_destroy(newas);
+			return result;
+		}
+		newrg = newas->as_regions;
+		if (rg->rg_vnode != NULL) {
+			VOP_INCREF(rg->rg_vnode);
+			newrg->rg_vnode = rg->rg_vnode;
+			newrg->rg_filevaddr = rg->rg_filevaddr;
+			newrg->rg_fileoffset = rg->rg_fileoffset;
+			newrg->rg_filesize = rg->rg_filesize;
+		}
+	}
+
+	result = pt_share(old->as_pt, newas->as_pt);
+	if (result) {
+		as_destroy(newas);
+		return result;
+	}
+
 	/*
-	 * Write this.
+	 * The old address space's pages are now copy-on-write; get
+	 * rid of any TLB entries that still allow writing them.
 	 */
-
-	(void)old;
+	if (old == proc_getas()) {
+		vm_tlbflush();
+	}
 
 	*ret = newas;
 	return 0;
@@ -79,10 +147,17 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 void
 as_destroy(struct addrspace *as)
 {
-	/*
-	 * Clean up as needed.
-	 */
+	struct region *rg;
 
+	pt_destroy(as->as_pt, as);
+	while (as->as_regions != NULL) {
+		rg = as->as_regions;
+		as->as_regions = rg->rg_next;
+		if (rg->rg_vnode != NULL) {
+			VOP_DECREF(rg->rg_vnode);
+		}
+		kfree(rg);
+	}
 	kfree(as);
 }
 
@@ -91,7 +166,7 @@ as_activate(void)
 {
 	struct addrspace *as;
 
-	as = curproc_getas();
+	as = proc_getas();
 	if (as == NULL) {
 		/*
 		 * Kernel thread without an address space; leave the
@@ -100,19 +175,13 @@ as_activate(void)
 		return;
 	}
 
-	/*
-	 * Write this.
-	 */
+	vm_tlbflush();
 }
 
 void
 as_deactivate(void)
 {
-	/*
-	 * Write this. For many designs it won't need to actually do
-	 * anything. See proc.c for an explanation of why it (might)
-	 * be needed.
-	 */
+	/* nothing */
 }
 
 /*
@@ -120,58 +189,97 @@ as_deactivate(void)
  * segment in memory extends from VADDR up to (but not including)
  * VADDR+MEMSIZE.
  *
- * The READABLE, WRITEABLE, and EXECUTABLE flags are set if read,
- * write, or execute permission should be set on the segment. At the
- * moment, these are ignored. When you write the VM system, you may
- * want to implement them.
+ * Only WRITEABLE is used; the MIPS can't enforce the others.
  */
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 		 int readable, int writeable, int executable)
 {
-	/*
-	 * Write this.
-	 */
+	size_t npages;
+
+	/* Align the region. First, the base... */
+	sz += vaddr & ~(vaddr_t)PAGE_FRAME;
+	vaddr &= PAGE_FRAME;
+
+	/* ...and now the length. */
+	sz = (sz + PAGE_SIZE - 1) & PAGE_FRAME;
+
+	npages = sz / PAGE_SIZE;
 
-	(void)as;
-	(void)vaddr;
-	(void)sz;
 	(void)readable;
-	(void)writeable;
 	(void)executable;
-	return EUNIMP;
+
+	if (vaddr + sz > USERSTACK - VM_STACKPAGES * PAGE_SIZE ||
+	    vaddr + sz < vaddr) {
+		return EFAULT;
+	}
+
+	return as_addregion(as, vaddr, npages, writeable != 0);
 }
 
+/*
+ * While loading, read-only regions can be written so the executable
+ * can be read into them.
+ */
 int
 as_prepare_load(struct addrspace *as)
 {
-	/*
-	 * Write this.
-	 */
-
-	(void)as;
+	as->as_loading = true;
 	return 0;
 }
 
 int
 as_complete_load(struct addrspace *as)
 {
-	/*
-	 * Write this.
-	 */
+	as->as_loading = false;
+
+	/* Take back write access to the read-only regions. */
+	vm_tlbflush();
+	return 0;
+}
+
+int
+as_map_file(struct addrspace *as, vaddr_t vaddr, size_t memsize,
+	    struct vnode *v, off_t offset, size_t filesize)
+{
+	struct region *rg;
+
+	KASSERT(as->as_loading);
+
+	if (filesize > memsize) {
+		kprintf("ELF: warning: segment filesize > segment memsize\n");
+		filesize = memsize;
+	}
+
+	rg = as_findregion(as, vaddr);
+	if (rg == NULL || rg->rg_vnode != NULL || offset < 0 ||
+	    memsize > rg->rg_vbase + rg->rg_npages * PAGE_SIZE - vaddr) {
+		return ENOEXEC;
+	}
+
+	if (filesize == 0) {
+		/* All BSS; nothing to read. */
+		return 0;
+	}
 
-	(void)as;
+	VOP_INCREF(v);
+	rg->rg_vnode = v;
+	rg->rg_filevaddr = vaddr;
+	rg->rg_fileoffset = offset;
+	rg->rg_filesize = filesize;
 	return 0;
 }
 
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
-	/*
-	 * Write this.
-	 */
+	int result;
 
-	(void)as;
+	result = as_addregion(as, USERSTACK - VM_STACKPAGES * PAGE_SIZE,
+			      VM_STACKPAGES, true);
+	if (result) {
+		return result;
+	}
 
 	/* Initial user-level stack pointer */
 	*stackptr = USERSTACK;
@@ -179,3 +287,16 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+struct region *
+as_findregion(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *rg;
+
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		if (vaddr >= rg->rg_vbase &&
+		    vaddr < rg->rg_vbase + rg->rg_npages * PAGE_SIZE) {
+			return rg;
+		}
+	}
+	return NULL;
+}
@@ -0,0 +1,610 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Coremap: the physical page allocator.
+ *
+ * There is one entry for every page of physical memory, indexed by
+ * physical page number. A free page has state CM_FREE. Allocated
+ * pages come in runs: kernel allocations (alloc_kpages) may be
+ * several physically contiguous pages, and the first page of a run
+ * records its length so the run can be given back with just its
+ * address. User pages also record the address space and virtual
+ * address they belong to.
+ *
+ * User pages are reference counted so copy-on-write can share them
+ * between address spaces. A shared page has no single owner: when a
+ * reference is dropped by the recorded owner, the owner is cleared,
+ * and the last remaining holder claims it again (coremap_claim) when
+ * it next writes to the page. Only a page with one reference and a
+ * recorded owner can be paged out, since that's the only page whose
+ * page table entry the pageout code can find.
+ *
+ * A user page is busy while it's being filled in, copied from for
+ * copy-on-write, or written out to swap. Whoever makes it busy makes
+ * it unbusy again; meanwhile it can't be paged out or unmapped, and
+ * anyone else who wants it waits in coremap_waitbusy. Every time a
+ * page is mapped into the TLB it is marked referenced; the pageout
+ * code's clock hand clears the mark, and takes pages that haven't
+ * been referenced again by the time it comes back round.
+ *
+ * Memory the kernel was loaded into, memory taken with ram_stealmem
+ * before the coremap existed, and the coremap itself are CM_FIXED
+ * and are never handed out or freed. Attempts to free them (e.g. a
+ * kfree of something kmalloc'd during early boot) are ignored.
+ *
+ * Runs are found by next-fit: the search starts where the previous
+ * one left off, so single-page allocations don't rescan the full
+ * low end of memory every time.
+ *
+ * cm_lock protects everything here. It's a spinlock because
+ * alloc_kpages can be called from places that can't sleep. It ranks
+ * below the page table locks.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <vm.h>
+
+/* Page states */
+#define CM_FREE     0	/* available */
+#define CM_FIXED    1	/* kernel image, boot allocations, coremap */
+#define CM_KERNEL   2	/* from alloc_kpages */
+#define CM_USER     3	/* owned by an address space */
+
+struct coremap_entry {
+	struct addrspace *cme_as;	/* owner, for CM_USER */
+	vaddr_t cme_vaddr;		/* user address, for CM_USER */
+	unsigned cme_npages;		/* run length; first page only */
+	unsigned short cme_refcount;	/* mappings, for CM_USER */
+	unsigned char cme_state;	/* CM_* */
+	bool cme_busy;			/* see above, for CM_USER */
+	bool cme_referenced;		/* mapped since the clock passed */
+};
+
+static struct spinlock cm_lock = SPINLOCK_INITIALIZER;
+static struct coremap_entry *coremap;
+static unsigned cm_npages;		/* number of entries */
+static unsigned cm_base;		/* first page ever allocatable */
+static unsigned cm_hint;		/* where the next search starts */
+static unsigned cm_clockhand;		/* next page pageout looks at */
+static struct wchan *cm_wchan;		/* for waiting on busy pages */
+static bool cm_ready;
+
+/* Page counts, under cm_lock */
+static unsigned cm_nfree, cm_nkernel, cm_nuser;
+
+/*
+ * Set up the coremap. Called from vm_bootstrap; until then pages
+ * come from ram_stealmem and can't be returned.
+ */
+void
+coremap_bootstrap(void)
+{
+	paddr_t lo, hi;
+	size_t cmsize;
+	unsigned i, cmpages;
+
+	cm_wchan = wchan_create("coremap");
+	if (cm_wchan == NULL) {
+		panic("coremap: Could not create wchan\n");
+	}
+
+	ram_getsize(&lo, &hi);
+	KASSERT((lo & PAGE_FRAME) == lo);
+	KASSERT((hi & PAGE_FRAME) == hi);
+
+	/* The coremap goes at the bottom of the remaining memory. */
+	cm_npages = hi / PAGE_SIZE;
+	cmsize = cm_npages * sizeof(struct coremap_entry);
+	cmpages = (cmsize + PAGE_SIZE - 1) / PAGE_SIZE;
+	coremap = (struct coremap_entry *)PADDR_TO_KVADDR(lo);
+	cm_base = lo / PAGE_SIZE + cmpages;
+	if (cm_base >= cm_npages) {
+		panic("coremap: no memory left after the coremap\n");
+	}
+
+	for (i=0; i<cm_npages; i++) {
+		coremap[i].cme_as = NULL;
+		coremap[i].cme_vaddr = 0;
+		coremap[i].cme_npages = 0;
+		coremap[i].cme_refcount = 0;
+		coremap[i].cme_state = i < cm_base ? CM_FIXED : CM_FREE;
+		coremap[i].cme_busy = false;
+		coremap[i].cme_referenced = false;
+	}
+
+	spinlock_acquire(&cm_lock);
+	cm_nfree = cm_npages - cm_base;
+	cm_nkernel = cm_nuser = 0;
+	cm_hint = cm_base;
+	cm_clockhand = cm_base;
+	cm_ready = true;
+	spinlock_release(&cm_lock);
+}
+
+/*
+ * Find NPAGES free contiguous pages, searching from cm_hint and
+ * wrapping around once. Returns the first page number, or 0.
+ */
+static
+unsigned
+coremap_findrun(unsigned npages)
+{
+	unsigned start, i, run, passes;
+
+	KASSERT(spinlock_do_i_hold(&cm_lock));
+
+	if (npages > cm_nfree) {
+		return 0;
+	}
+
+	start = cm_hint;
+	run = 0;
+	for (passes = 0; passes < 2; passes++) {
+		for (i = start; i < cm_npages; i++) {
+			if (coremap[i].cme_state != CM_FREE) {
+				run = 0;
+				continue;
+			}
+			run++;
+			if (run == npages) {
+				return i + 1 - npages;
+			}
+		}
+		/* Runs don't wrap past the end of memory. */
+		start = cm_base;
+		run = 0;
+	}
+	return 0;
+}
+
+/*
+ * Allocate NPAGES physically contiguous pages. AS is the owning
+ * address space and VADDR the user address of the first page, or
+ * NULL and 0 for kernel memory. User pages come back busy. Returns 0
+ * if there's no such run.
+ */
+paddr_t
+coremap_alloc(unsigned long npages, struct addrspace *as, vaddr_t vaddr)
+{
+	paddr_t pa;
+	unsigned first, i;
+
+	KASSERT(npages > 0);
+
+	spinlock_acquire(&cm_lock);
+
+	if (!cm_ready) {
+		pa = ram_stealmem(npages);
+		spinlock_release(&cm_lock);
+		return pa;
+	}
+
+	first = coremap_findrun(npages);
+	if (first == 0) {
+		spinlock_release(&cm_lock);
+		return 0;
+	}
+
+	for (i=0; i<npages; i++) {
+		KASSERT(coremap[first + i].cme_state == CM_FREE);
+		coremap[first + i].cme_state = as ? CM_USER : CM_KERNEL;
+		coremap[first + i].cme_as = as;
+		coremap[first + i].cme_vaddr = as ? vaddr + i * PAGE_SIZE : 0;
+		coremap[first + i].cme_npages = 0;
+		coremap[first + i].cme_refcount = as ? 1 : 0;
+		coremap[first + i].cme_busy = as != NULL;
+		coremap[first + i].cme_referenced = true;
+	}
+	coremap[first].cme_npages = npages;
+
+	cm_nfree -= npages;
+	if (as != NULL) {
+		cm_nuser += npages;
+	}
+	else {
+		cm_nkernel += npages;
+	}
+	cm_hint = first + npages < cm_npages ? first + npages : cm_base;
+
+	spinlock_release(&cm_lock);
+
+	return (paddr_t)first * PAGE_SIZE;
+}
+
+/*
+ * Free the run of pages starting at PA.
+ */
+void
+coremap_free(paddr_t pa)
+{
+	unsigned first, npages, i;
+	bool user;
+
+	KASSERT((pa & PAGE_FRAME) == pa);
+
+	spinlock_acquire(&cm_lock);
+
+	first = pa / PAGE_SIZE;
+	if (!cm_ready || first < cm_base) {
+		/* Boot-time memory; it stays where it is. */
+		spinlock_release(&cm_lock);
+		return;
+	}
+	KASSERT(first < cm_npages);
+
+	npages = coremap[first].cme_npages;
+	if (npages == 0) {
+		panic("coremap_free: 0x%x is not the start of a run\n", pa);
+	}
+	user = coremap[first].cme_state == CM_USER;
+
+	for (i=0; i<npages; i++) {
+		KASSERT(coremap[first + i].cme_state ==
+			(user ? CM_USER : CM_KERNEL));
+		coremap[first + i].cme_state = CM_FREE;
+		coremap[first + i].cme_as = NULL;
+		coremap[first + i].cme_vaddr = 0;
+		coremap[first + i].cme_npages = 0;
+		coremap[first + i].cme_refcount = 0;
+		coremap[first + i].cme_busy = false;
+	}
+
+	cm_nfree += npages;
+	if (user) {
+		cm_nuser -= npages;
+	}
+	else {
+		cm_nkernel -= npages;
+	}
+
+	spinlock_release(&cm_lock);
+}
+
+/*
+ * Number of free pages, and of pages altogether.
+ */
+unsigned
+coremap_nfree(void)
+{
+	return cm_nfree;
+}
+
+unsigned
+coremap_npages(void)
+{
+	return cm_npages - cm_base;
+}
+
+/*
+ * Look up the entry for the single user page at PA.
+ */
+static
+struct coremap_entry *
+coremap_userpage(paddr_t pa)
+{
+	struct coremap_entry *cme;
+
+	KASSERT(spinlock_do_i_hold(&cm_lock));
+	KASSERT((pa & PAGE_FRAME) == pa);
+	KASSERT(pa / PAGE_SIZE >= cm_base && pa / PAGE_SIZE < cm_npages);
+
+	cme = &coremap[pa / PAGE_SIZE];
+	KASSERT(cme->cme_state == CM_USER);
+	KASSERT(cme->cme_npages == 1);
+	KASSERT(cme->cme_refcount > 0);
+	return cme;
+}
+
+/*
+ * Drop a reference to the user page CME on behalf of AS, and free it
+ * if that was the last.
+ */
+static
+void
+coremap_dropref(struct coremap_entry *cme, struct addrspace *as)
+{
+	KASSERT(spinlock_do_i_hold(&cm_lock));
+
+	cme->cme_refcount--;
+	if (cme->cme_refcount == 0) {
+		KASSERT(!cme->cme_busy);
+		cme->cme_state = CM_FREE;
+		cme->cme_npages = 0;
+		cm_nfree++;
+		cm_nuser--;
+	}
+	if (cme->cme_refcount == 0 || cme->cme_as == as) {
+		cme->cme_as = NULL;
+		cme->cme_vaddr = 0;
+	}
+}
+
+/*
+ * Add a mapping of the user page at PA. It may be busy.
+ */
+void
+coremap_incref(paddr_t pa)
+{
+	struct coremap_entry *cme;
+
+	spinlock_acquire(&cm_lock);
+	cme = coremap_userpage(pa);
+	KASSERT(cme->cme_refcount < 0xffff);
+	cme->cme_refcount++;
+	spinlock_release(&cm_lock);
+}
+
+/*
+ * Like coremap_incref, but fails if the page is busy.
+ */
+bool
+coremap_share(paddr_t pa)
+{
+	struct coremap_entry *cme;
+
+	spinlock_acquire(&cm_lock);
+	cme = coremap_userpage(pa);
+	if (cme->cme_busy) {
+		spinlock_release(&cm_lock);
+		return false;
+	}
+	KASSERT(cme->cme_refcount < 0xffff);
+	cme->cme_refcount++;
+	spinlock_release(&cm_lock);
+	return true;
+}
+
+/*
+ * Drop AS's mapping of the user page at PA, freeing the page if it
+ * was the last one. It must not be the last one if the page is busy.
+ */
+void
+coremap_decref(paddr_t pa, struct addrspace *as)
+{
+	spinlock_acquire(&cm_lock);
+	coremap_dropref(coremap_userpage(pa), as);
+	spinlock_release(&cm_lock);
+}
+
+/*
+ * Like coremap_decref, but for use when taking down a mapping: fails
+ * if the page is busy.
+ */
+bool
+coremap_release(paddr_t pa, struct addrspace *as)
+{
+	struct coremap_entry *cme;
+
+	spinlock_acquire(&cm_lock);
+	cme = coremap_userpage(pa);
+	if (cme->cme_busy) {
+		spinlock_release(&cm_lock);
+		return false;
+	}
+	coremap_dropref(cme, as);
+	spinlock_release(&cm_lock);
+	return true;
+}
+
+/*
+ * Drop AS's mapping of a page the caller made busy, and make it
+ * unbusy, all at once so nothing can get at it in between.
+ */
+void
+coremap_decref_busy(paddr_t pa, struct addrspace *as)
+{
+	struct coremap_entry *cme;
+
+	spinlock_acquire(&cm_lock);
+	cme = coremap_userpage(pa);
+	KASSERT(cme->cme_busy);
+	cme->cme_busy = false;
+	coremap_dropref(cme, as);
+	wchan_wakeall(cm_wchan, &cm_lock);
+	spinlock_release(&cm_lock);
+}
+
+/*
+ * Make a page the caller made busy unbusy.
+ */
+void
+coremap_unbusy(paddr_t pa)
+{
+	struct coremap_entry *cme;
+
+	spinlock_acquire(&cm_lock);
+	cme = coremap_userpage(pa);
+	KASSERT(cme->cme_busy);
+	cme->cme_busy = false;
+	wchan_wakeall(cm_wchan, &cm_lock);
+	spinlock_release(&cm_lock);
+}
+
+/*
+ * Wait until the page at PA isn't busy (or has been freed, or is
+ * someone else's by now: the caller is expected to look again at
+ * whatever made it wait).
+ */
+void
+coremap_waitbusy(paddr_t pa)
+{
+	struct coremap_entry *cme;
+
+	spinlock_acquire(&cm_lock);
+	cme = &coremap[pa / PAGE_SIZE];
+	while (cme->cme_state == CM_USER && cme->cme_busy) {
+		wchan_sleep(cm_wchan, &cm_lock);
+	}
+	spinlock_release(&cm_lock);
+}
+
+/*
+ * Mark the user page at PA referenced, unless it's busy, in which
+ * case return false.
+ */
+bool
+coremap_touch(paddr_t pa)
+{
+	struct coremap_entry *cme;
+	bool ret;
+
+	spinlock_acquire(&cm_lock);
+	cme = coremap_userpage(pa);
+	ret = !cme->cme_busy;
+	if (ret) {
+		cme->cme_referenced = true;
+	}
+	spinlock_release(&cm_lock);
+	return ret;
+}
+
+/*
+ * AS is about to write to the copy-on-write page at PA, mapped at
+ * VADDR. Returns:
+ *    CLAIM_OWNED  if AS holds the only mapping; it's now the owner.
+ *    CLAIM_SHARED if not; the page is now busy, for copying.
+ *    CLAIM_BUSY   if the page is busy.
+ */
+int
+coremap_claim(paddr_t pa, struct addrspace *as, vaddr_t vaddr)
+{
+	struct coremap_entry *cme;
+	int ret;
+
+	spinlock_acquire(&cm_lock);
+	cme = coremap_userpage(pa);
+	if (cme->cme_busy) {
+		ret = CLAIM_BUSY;
+	}
+	else if (cme->cme_refcount == 1) {
+		cme->cme_as = as;
+		cme->cme_vaddr = vaddr;
+		ret = CLAIM_OWNED;
+	}
+	else {
+		cme->cme_busy = true;
+		ret = CLAIM_SHARED;
+	}
+	spinlock_release(&cm_lock);
+	return ret;
+}
+
+/*
+ * Choose up to MAX pages to page out, by the clock algorithm, and
+ * make them busy. Their addresses, owners, and user addresses are
+ * put in PAS, ASES, and VADDRS. Returns how many were chosen. Going
+ * twice round is enough to find every candidate, since the first
+ * time round clears all the referenced marks.
+ */
+unsigned
+coremap_pickvictims(paddr_t *pas, struct addrspace **ases, vaddr_t *vaddrs,
+		    unsigned max)
+{
+	struct coremap_entry *cme;
+	unsigned n, scanned;
+
+	n = 0;
+	spinlock_acquire(&cm_lock);
+	for (scanned = 0;
+	     n < max && scanned < 2 * (cm_npages - cm_base);
+	     scanned++) {
+		cme = &coremap[cm_clockhand];
+		cm_clockhand++;
+		if (cm_clockhand == cm_npages) {
+			cm_clockhand = cm_base;
+		}
+
+		if (cme->cme_state != CM_USER || cme->cme_busy ||
+		    cme->cme_refcount != 1 || cme->cme_as == NULL) {
+			continue;
+		}
+		if (cme->cme_referenced) {
+			/* Second chance */
+			cme->cme_referenced = false;
+			continue;
+		}
+
+		cme->cme_busy = true;
+		pas[n] = (paddr_t)(cme - coremap) * PAGE_SIZE;
+		ases[n] = cme->cme_as;
+		vaddrs[n] = cme->cme_vaddr;
+		n++;
+	}
+	spinlock_release(&cm_lock);
+	return n;
+}
+
+/*
+ * A page chosen by coremap_pickvictims has been written out and its
+ * page table entry changed to point to swap; free it.
+ */
+void
+coremap_evicted(paddr_t pa)
+{
+	struct coremap_entry *cme;
+
+	spinlock_acquire(&cm_lock);
+	cme = coremap_userpage(pa);
+	KASSERT(cme->cme_busy);
+	KASSERT(cme->cme_refcount == 1);
+	cme->cme_busy = false;
+	coremap_dropref(cme, NULL);
+	wchan_wakeall(cm_wchan, &cm_lock);
+	spinlock_release(&cm_lock);
+}
+
+/*
+ * Print page usage. Called from kheap_printstats.
+ */
+void
+coremap_printstats(void)
+{
+	unsigned nfree, nkernel, nuser, nfixed;
+
+	spinlock_acquire(&cm_lock);
+	if (!cm_ready) {
+		spinlock_release(&cm_lock);
+		kprintf("Coremap not set up yet\n");
+		return;
+	}
+	nfree = cm_nfree;
+	nkernel = cm_nkernel;
+	nuser = cm_nuser;
+	nfixed = cm_base;
+	spinlock_release(&cm_lock);
+
+	kprintf("Physical pages: %u total, %u free, %u used "
+		"(%u fixed, %u kernel, %u user)\n",
+		cm_npages, nfree, nfixed + nkernel + nuser,
+		nfixed, nkernel, nuser);
+}
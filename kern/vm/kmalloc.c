@@ -812,6 +812,32 @@ kheap_printstats(void)
 	}
 
 	spinlock_release(&kmalloc_spinlock);
+
+	coremap_printstats();
+}
+
+/*
+ * Return the number of bytes in use by sub-page allocations. Used by
+ * tests to look for leaks.
+ */
+size_t
+kheap_getused(void)
+{
+	struct pageref *pr;
+	size_t total;
+	int blktype;
+
+	total = 0;
+	spinlock_acquire(&kmalloc_spinlock);
+	for (pr = allbase; pr != NULL; pr = pr->next_all) {
+		blktype = PR_BLOCKTYPE(pr);
+		KASSERT(blktype >= 0 && blktype < NSIZES);
+		total += (PAGE_SIZE / sizes[blktype] - pr->nfree) *
+			sizes[blktype];
+	}
+	spinlock_release(&kmalloc_spinlock);
+
+	return total;
 }
 
 ////////////////////////////////////////
@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Two-level page tables. See pagetable.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <pagetable.h>
+
+#define PT_NENTRIES   1024		/* entries per level */
+#define PT_L1INDEX(va) ((va) >> 22)
+#define PT_L2INDEX(va) (((va) >> 12) & (PT_NENTRIES - 1))
+
+struct pagetable {
+	struct spinlock pt_spinlock;	/* protects the entries */
+	uint32_t *pt_l2[PT_NENTRIES];	/* second-level tables, or NULL */
+};
+
+struct pagetable *
+pt_create(void)
+{
+	struct pagetable *pt;
+	unsigned i;
+
+	pt = kmalloc(sizeof(struct pagetable));
+	if (pt == NULL) {
+		return NULL;
+	}
+	spinlock_init(&pt->pt_spinlock);
+	for (i=0; i<PT_NENTRIES; i++) {
+		pt->pt_l2[i] = NULL;
+	}
+	return pt;
+}
+
+void
+pt_acquire(struct pagetable *pt)
+{
+	spinlock_acquire(&pt->pt_spinlock);
+}
+
+void
+pt_release(struct pagetable *pt)
+{
+	spinlock_release(&pt->pt_spinlock);
+}
+
+/*
+ * A page that's busy, most likely being paged out, can't be let go
+ * of until it's done; wait, then look at the entry again.
+ */
+void
+pt_destroy(struct pagetable *pt, struct addrspace *as)
+{
+	unsigned i, j;
+	uint32_t *l2, pte;
+
+	for (i=0; i<PT_NENTRIES; i++) {
+		l2 = pt->pt_l2[i];
+		if (l2 == NULL) {
+			continue;
+		}
+		for (j=0; j<PT_NENTRIES; j++) {
+			/* Empty entries stay empty; no need to lock */
+			if (l2[j] == 0) {
+				continue;
+			}
+		 again:
+			spinlock_acquire(&pt->pt_spinlock);
+			pte = l2[j];
+			if (pte & PTE_VALID) {
+				if (!coremap_release(pte & PTE_FRAME, as)) {
+					spinlock_release(&pt->pt_spinlock);
+					coremap_waitbusy(pte & PTE_FRAME);
+					goto again;
+				}
+			}
+			l2[j] = 0;
+			spinlock_release(&pt->pt_spinlock);
+			if (pte & PTE_SWAPPED) {
+				swap_free(PTE_SLOT(pte));
+			}
+		}
+		kfree(l2);
+	}
+	spinlock_cleanup(&pt->pt_spinlock);
+	kfree(pt);
+}
+
+/*
+ * Allocate an empty second-level table.
+ */
+static
+uint32_t *
+pt_newl2(void)
+{
+	uint32_t *l2;
+	unsigned j;
+
+	l2 = kmalloc(PT_NENTRIES * sizeof(uint32_t));
+	if (l2 == NULL) {
+		return NULL;
+	}
+	for (j=0; j<PT_NENTRIES; j++) {
+		l2[j] = 0;
+	}
+	return l2;
+}
+
+uint32_t *
+pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create)
+{
+	unsigned i;
+
+	i = PT_L1INDEX(vaddr);
+	if (pt->pt_l2[i] == NULL) {
+		if (!create) {
+			return NULL;
+		}
+		pt->pt_l2[i] = pt_newl2();
+		if (pt->pt_l2[i] == NULL) {
+			return NULL;
+		}
+	}
+	return &pt->pt_l2[i][PT_L2INDEX(vaddr)];
+}
+
+/*
+ * Used by fork (via as_copy): nothing in memory is copied but the
+ * entries. On failure TO holds references to whatever was copied so
+ * far, which pt_destroy will drop.
+ *
+ * Only the thread running in FROM changes entries other than valid
+ * ones, so a swapped entry stays swapped while its slot is copied.
+ */
+int
+pt_share(struct pagetable *from, struct pagetable *to)
+{
+	unsigned i, j, slot;
+	uint32_t *src, *dst, pte;
+	int result;
+
+	for (i=0; i<PT_NENTRIES; i++) {
+		src = from->pt_l2[i];
+		if (src == NULL) {
+			continue;
+		}
+		KASSERT(to->pt_l2[i] == NULL);
+		dst = pt_newl2();
+		if (dst == NULL) {
+			return ENOMEM;
+		}
+		to->pt_l2[i] = dst;
+		for (j=0; j<PT_NENTRIES; j++) {
+			if (src[j] == 0) {
+				continue;
+			}
+		 again:
+			spinlock_acquire(&from->pt_spinlock);
+			pte = src[j];
+			if (pte & PTE_VALID) {
+				if (!coremap_share(pte & PTE_FRAME)) {
+					spinlock_release(&from->pt_spinlock);
+					coremap_waitbusy(pte & PTE_FRAME);
+					goto again;
+				}
+				src[j] |= PTE_COW;
+				dst[j] = src[j];
+				spinlock_release(&from->pt_spinlock);
+			}
+			else {
+				spinlock_release(&from->pt_spinlock);
+				KASSERT(pte & PTE_SWAPPED);
+				result = swap_dup(PTE_SLOT(pte), &slot);
+				if (result) {
+					return result;
+				}
+				dst[j] = PTE_MKSLOT(slot) | (pte & ~PTE_FRAME);
+			}
+		}
+	}
+	return 0;
+}
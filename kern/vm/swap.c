@@ -0,0 +1,356 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Swap space.
+ *
+ * Pages are written to page-sized slots on a raw disk device, named
+ * with the "swapon" menu command; until then there's no swap and
+ * nothing is ever paged out. (Swapping isn't turned on at boot so a
+ * disk holding a filesystem can't be clobbered by accident.) Free
+ * slots are kept in a bitmap. The pageout code writes a batch of
+ * pages at once when it can get consecutive slots for them, so
+ * allocation is next-fit, which tends to leave the free slots in
+ * long runs.
+ *
+ * sw_lock protects the bitmap and the statistics. The I/O is done
+ * without it; a slot is only ever used by the page table entry it
+ * was allocated for. Once swap is on, sw_vnode and sw_nslots never
+ * change.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <bitmap.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <vm.h>
+
+/* The page table keeps slot numbers in the frame bits of an entry */
+#define SWAP_MAXSLOTS  (1U << 20)
+
+/* Most pages swap_write can do at once */
+#define SWAP_MAXIO     16
+
+static struct spinlock sw_lock = SPINLOCK_INITIALIZER;
+static struct vnode *sw_vnode;		/* device, NULL if swap is off */
+static struct bitmap *sw_map;		/* set for each slot in use */
+static unsigned sw_nslots;		/* slots on the device */
+static unsigned sw_hint;		/* where to look next */
+
+/* Statistics, under sw_lock */
+static unsigned sw_used, sw_peak;
+static unsigned sw_reads, sw_writes, sw_pagesout;
+
+/*
+ * Turn swapping on, to DEVICE.
+ */
+int
+swap_on(const char *device)
+{
+	struct vnode *vn;
+	struct bitmap *map;
+	struct stat st;
+	char *path;
+	unsigned nslots;
+	int result;
+
+	if (swap_enabled()) {
+		return EBUSY;
+	}
+
+	/* vfs_open destroys the string it's passed */
+	path = kstrdup(device);
+	if (path == NULL) {
+		return ENOMEM;
+	}
+	result = vfs_open(path, O_RDWR, 0, &vn);
+	kfree(path);
+	if (result) {
+		return result;
+	}
+
+	result = VOP_STAT(vn, &st);
+	if (result) {
+		vfs_close(vn);
+		return result;
+	}
+	nslots = st.st_size / PAGE_SIZE;
+	if (nslots > SWAP_MAXSLOTS) {
+		nslots = SWAP_MAXSLOTS;
+	}
+	if (nslots == 0) {
+		vfs_close(vn);
+		return ENOSPC;
+	}
+
+	map = bitmap_create(nslots);
+	if (map == NULL) {
+		vfs_close(vn);
+		return ENOMEM;
+	}
+
+	spinlock_acquire(&sw_lock);
+	if (sw_vnode != NULL) {
+		/* Somebody else got there first */
+		spinlock_release(&sw_lock);
+		bitmap_destroy(map);
+		vfs_close(vn);
+		return EBUSY;
+	}
+	sw_map = map;
+	sw_nslots = nslots;
+	sw_hint = 0;
+	sw_vnode = vn;
+	spinlock_release(&sw_lock);
+
+	kprintf("swap: %s, %u pages\n", device, nslots);
+	return 0;
+}
+
+bool
+swap_enabled(void)
+{
+	bool ret;
+
+	spinlock_acquire(&sw_lock);
+	ret = sw_vnode != NULL;
+	spinlock_release(&sw_lock);
+	return ret;
+}
+
+/*
+ * Find N free slots in a row, at or after START.
+ */
+static
+int
+swap_findrun(unsigned start, unsigned n, unsigned *ret)
+{
+	unsigned i, j;
+
+	KASSERT(spinlock_do_i_hold(&sw_lock));
+
+	while (bitmap_findfree(sw_map, start, &i) == 0) {
+		for (j=1; j<n && i+j < sw_nslots; j++) {
+			if (bitmap_isset(sw_map, i+j)) {
+				break;
+			}
+		}
+		if (j == n) {
+			*ret = i;
+			return 0;
+		}
+		start = i + j;
+	}
+	return ENOSPC;
+}
+
+int
+swap_alloc(unsigned n, unsigned *slot)
+{
+	unsigned i;
+	int result;
+
+	KASSERT(n > 0);
+
+	spinlock_acquire(&sw_lock);
+	if (sw_vnode == NULL) {
+		spinlock_release(&sw_lock);
+		return ENOSPC;
+	}
+	result = swap_findrun(sw_hint, n, slot);
+	if (result && sw_hint > 0) {
+		result = swap_findrun(0, n, slot);
+	}
+	if (result) {
+		spinlock_release(&sw_lock);
+		return result;
+	}
+	for (i=0; i<n; i++) {
+		bitmap_mark(sw_map, *slot + i);
+	}
+	sw_hint = *slot + n;
+	sw_used += n;
+	if (sw_used > sw_peak) {
+		sw_peak = sw_used;
+	}
+	spinlock_release(&sw_lock);
+	return 0;
+}
+
+void
+swap_free(unsigned slot)
+{
+	spinlock_acquire(&sw_lock);
+	KASSERT(slot < sw_nslots);
+	KASSERT(bitmap_isset(sw_map, slot));
+	bitmap_unmark(sw_map, slot);
+	sw_used--;
+	spinlock_release(&sw_lock);
+}
+
+/*
+ * Read or write the N pages at KVADDRS, in consecutive slots starting
+ * at SLOT.
+ */
+static
+int
+swap_io(unsigned slot, const vaddr_t *kvaddrs, unsigned n, enum uio_rw rw)
+{
+	struct iovec iov[SWAP_MAXIO];
+	struct uio ku;
+	unsigned i;
+	int result;
+
+	KASSERT(n > 0 && n <= SWAP_MAXIO);
+	KASSERT(slot + n <= sw_nslots);
+
+	for (i=0; i<n; i++) {
+		iov[i].iov_kbase = (void *)kvaddrs[i];
+		iov[i].iov_len = PAGE_SIZE;
+	}
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = n;
+	ku.uio_offset = (off_t)slot * PAGE_SIZE;
+	ku.uio_resid = n * PAGE_SIZE;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = rw;
+	ku.uio_space = NULL;
+
+	if (rw == UIO_READ) {
+		result = VOP_READ(sw_vnode, &ku);
+	}
+	else {
+		result = VOP_WRITE(sw_vnode, &ku);
+	}
+	if (result) {
+		kprintf("swap: %s error on slot %u: %s\n",
+			rw == UIO_READ ? "read" : "write", slot,
+			strerror(result));
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		kprintf("swap: short %s on slot %u\n",
+			rw == UIO_READ ? "read" : "write", slot);
+		return EIO;
+	}
+
+	spinlock_acquire(&sw_lock);
+	if (rw == UIO_READ) {
+		sw_reads++;
+	}
+	else {
+		sw_writes++;
+		sw_pagesout += n;
+	}
+	spinlock_release(&sw_lock);
+	return 0;
+}
+
+int
+swap_read(unsigned slot, paddr_t pa)
+{
+	vaddr_t kva;
+
+	kva = PADDR_TO_KVADDR(pa);
+	return swap_io(slot, &kva, 1, UIO_READ);
+}
+
+int
+swap_write(unsigned slot, const paddr_t *pas, unsigned n)
+{
+	vaddr_t kvas[SWAP_MAXIO];
+	unsigned i;
+
+	KASSERT(n <= SWAP_MAXIO);
+	for (i=0; i<n; i++) {
+		kvas[i] = PADDR_TO_KVADDR(pas[i]);
+	}
+	return swap_io(slot, kvas, n, UIO_WRITE);
+}
+
+/*
+ * Used by fork, for pages of the parent that are out in swap. They
+ * aren't shared the way pages in memory are, to keep the swap slot
+ * owned by a single page table entry.
+ */
+int
+swap_dup(unsigned slot, unsigned *ret)
+{
+	vaddr_t buf;
+	int result;
+
+	buf = (vaddr_t)kmalloc(PAGE_SIZE);
+	if (buf == 0) {
+		return ENOMEM;
+	}
+	result = swap_alloc(1, ret);
+	if (result) {
+		kfree((void *)buf);
+		return result;
+	}
+	result = swap_io(slot, &buf, 1, UIO_READ);
+	if (result == 0) {
+		result = swap_io(*ret, &buf, 1, UIO_WRITE);
+	}
+	kfree((void *)buf);
+	if (result) {
+		swap_free(*ret);
+		return result;
+	}
+	return 0;
+}
+
+void
+swap_printstats(void)
+{
+	unsigned nslots, used, peak, reads, writes, pagesout;
+
+	spinlock_acquire(&sw_lock);
+	nslots = sw_nslots;
+	used = sw_used;
+	peak = sw_peak;
+	reads = sw_reads;
+	writes = sw_writes;
+	pagesout = sw_pagesout;
+	spinlock_release(&sw_lock);
+
+	if (nslots == 0) {
+		kprintf("Swap: off\n");
+		return;
+	}
+	kprintf("Swap: %u/%u slots in use (peak %u), %u reads, "
+		"%u writes (%u pages)\n",
+		used, nslots, peak, reads, writes, pagesout);
+}
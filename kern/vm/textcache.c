@@ -0,0 +1,407 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Text page cache.
+ *
+ * Keeps pages of read-only regions of executables, keyed by (vnode,
+ * file offset of the start of the page), so every address space
+ * running the same program maps the same physical pages instead of
+ * reading its own copies in. vm_fault looks a page up here before
+ * reading it from the file, and enters what it read after a miss.
+ *
+ * Each entry holds a reference to its vnode and a coremap reference
+ * to its page, so cached pages stay around after the last process
+ * using them exits and the next exec finds them without any I/O.
+ * The number of entries is fixed at boot, at most TC_SIZE and no more
+ * than 1/TC_MEMFRACTION of physical memory, since pageout can't take
+ * pages that only the cache holds; when they're all in use the least
+ * recently used one is thrown out. A page stays in memory after
+ * that for as long as some address space still maps it. Under
+ * memory pressure the pageout thread also throws out the least
+ * recently used entries when it finds nothing else to page out
+ * (textcache_shrink).
+ *
+ * Whenever a file is opened for writing, vfs_open calls
+ * vm_textpurge, which throws out its pages, and nothing more is
+ * cached for it until everyone has closed it (see vn_writecount in
+ * vnode.h), when it's purged again. As in the VFS name cache, a
+ * generation number keeps a page that was read before a purge from
+ * being entered after it. Before a filesystem is unmounted,
+ * vfs_unmount calls vm_textpurgefs to drop the references to its
+ * vnodes.
+ *
+ * tc_lock protects everything here. Vnode references are never
+ * dropped while it's held.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <synch.h>
+#include <vnode.h>
+#include <vm.h>
+
+/* Most entries (pages), share of memory they may take, hash chains */
+#define TC_SIZE         256
+#define TC_MEMFRACTION  8
+#define TC_HASHSIZE     64
+
+/* Most entries textcache_shrink throws out at once */
+#define TC_SHRINKMAX    16
+
+struct tcentry {
+	struct vnode *tc_vn;		/* file (referenced), NULL if free */
+	off_t tc_offset;		/* file offset of page start */
+	vaddr_t tc_vaddr;		/* user address of page */
+	paddr_t tc_pa;			/* page (referenced) */
+	struct tcentry *tc_hashnext;	/* hash chain, or free list */
+	struct tcentry *tc_lruprev;	/* LRU list */
+	struct tcentry *tc_lrunext;
+};
+
+static struct lock *tc_lock;
+static struct tcentry *tc_entries;
+static unsigned tc_size;		/* number of tc_entries */
+static struct tcentry *tc_hash[TC_HASHSIZE];
+static struct tcentry *tc_free;
+static struct tcentry tc_lru;		/* head; tc_lrunext is most recent */
+static unsigned tc_gen;
+
+/* Statistics, under tc_lock */
+static unsigned tc_lookups, tc_hits, tc_enters, tc_evictions, tc_purges;
+
+/*
+ * Set up at boot, from vm_bootstrap.
+ */
+void
+textcache_bootstrap(void)
+{
+	unsigned i;
+
+	tc_lock = lock_create("text page cache");
+	if (tc_lock == NULL) {
+		panic("vm: Could not create text page cache lock\n");
+	}
+	tc_size = coremap_npages() / TC_MEMFRACTION;
+	if (tc_size > TC_SIZE) {
+		tc_size = TC_SIZE;
+	}
+	if (tc_size == 0) {
+		tc_size = 1;
+	}
+	tc_entries = kmalloc(tc_size * sizeof(struct tcentry));
+	if (tc_entries == NULL) {
+		panic("vm: Could not allocate text page cache\n");
+	}
+
+	tc_free = NULL;
+	for (i=0; i<tc_size; i++) {
+		tc_entries[i].tc_vn = NULL;
+		tc_entries[i].tc_offset = 0;
+		tc_entries[i].tc_vaddr = 0;
+		tc_entries[i].tc_pa = 0;
+		tc_entries[i].tc_lruprev = NULL;
+		tc_entries[i].tc_lrunext = NULL;
+		tc_entries[i].tc_hashnext = tc_free;
+		tc_free = &tc_entries[i];
+	}
+	for (i=0; i<TC_HASHSIZE; i++) {
+		tc_hash[i] = NULL;
+	}
+	tc_lru.tc_lrunext = tc_lru.tc_lruprev = &tc_lru;
+	tc_gen = 0;
+}
+
+static
+unsigned
+tc_hashfunc(struct vnode *vn, off_t offset)
+{
+	unsigned h = (uintptr_t)vn / sizeof(struct vnode);
+
+	h = h*33 + (unsigned)(offset / PAGE_SIZE);
+	return h % TC_HASHSIZE;
+}
+
+static
+struct tcentry *
+tc_find(struct vnode *vn, off_t offset, vaddr_t vaddr)
+{
+	struct tcentry *e;
+
+	for (e = tc_hash[tc_hashfunc(vn, offset)]; e; e = e->tc_hashnext) {
+		if (e->tc_vn == vn && e->tc_offset == offset &&
+		    e->tc_vaddr == vaddr) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+tc_lru_insert(struct tcentry *e)
+{
+	e->tc_lruprev = &tc_lru;
+	e->tc_lrunext = tc_lru.tc_lrunext;
+	e->tc_lrunext->tc_lruprev = e;
+	tc_lru.tc_lrunext = e;
+}
+
+static
+void
+tc_lru_remove(struct tcentry *e)
+{
+	e->tc_lruprev->tc_lrunext = e->tc_lrunext;
+	e->tc_lrunext->tc_lruprev = e->tc_lruprev;
+	e->tc_lruprev = e->tc_lrunext = NULL;
+}
+
+/*
+ * Take an entry out of the cache and put it on the free list. Drops
+ * its page reference and hands back the vnode for the caller to
+ * release once tc_lock is released.
+ */
+static
+struct vnode *
+tc_remove(struct tcentry *e)
+{
+	struct tcentry **pp;
+	struct vnode *vn;
+
+	pp = &tc_hash[tc_hashfunc(e->tc_vn, e->tc_offset)];
+	while (*pp != e) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->tc_hashnext;
+	}
+	*pp = e->tc_hashnext;
+	tc_lru_remove(e);
+
+	coremap_decref(e->tc_pa, NULL);
+	vn = e->tc_vn;
+	e->tc_vn = NULL;
+	e->tc_pa = 0;
+	e->tc_hashnext = tc_free;
+	tc_free = e;
+	return vn;
+}
+
+/*
+ * Look up the page at OFFSET in VN, mapped at VADDR. (The address is
+ * part of the key because where the page's file data starts and ends
+ * within it depends on the segment it's in.) On a hit, returns its physical
+ * address with a coremap reference added for the caller. On a miss,
+ * returns 0 and sets *GEN for passing to textcache_enter.
+ */
+paddr_t
+textcache_lookup(struct vnode *vn, off_t offset, vaddr_t vaddr,
+		 unsigned *gen)
+{
+	struct tcentry *e;
+	paddr_t pa;
+
+	lock_acquire(tc_lock);
+	tc_lookups++;
+	e = tc_find(vn, offset, vaddr);
+	if (e == NULL) {
+		*gen = tc_gen;
+		lock_release(tc_lock);
+		return 0;
+	}
+
+	tc_lru_remove(e);
+	tc_lru_insert(e);
+	coremap_incref(e->tc_pa);
+	pa = e->tc_pa;
+	tc_hits++;
+	lock_release(tc_lock);
+	return pa;
+}
+
+/*
+ * Remember that the page at OFFSET in VN, mapped at VADDR, is at PA,
+ * as read after a lookup that missed with generation GEN. The cache takes its own
+ * reference to the page.
+ */
+void
+textcache_enter(struct vnode *vn, off_t offset, vaddr_t vaddr, paddr_t pa,
+		unsigned gen)
+{
+	struct tcentry *e;
+	struct vnode *oldvn = NULL;
+
+	lock_acquire(tc_lock);
+	if (gen != tc_gen || tc_find(vn, offset, vaddr) != NULL) {
+		/* Changed since, or someone else got here first */
+		lock_release(tc_lock);
+		return;
+	}
+	if (vnode_haswriters(vn)) {
+		/* Could change under us; don't keep it */
+		lock_release(tc_lock);
+		return;
+	}
+
+	if (tc_free == NULL) {
+		e = tc_lru.tc_lruprev;
+		KASSERT(e != &tc_lru);
+		oldvn = tc_remove(e);
+		tc_evictions++;
+	}
+	e = tc_free;
+	tc_free = e->tc_hashnext;
+
+	VOP_INCREF(vn);
+	coremap_incref(pa);
+	e->tc_vn = vn;
+	e->tc_offset = offset;
+	e->tc_vaddr = vaddr;
+	e->tc_pa = pa;
+
+	e->tc_hashnext = tc_hash[tc_hashfunc(vn, offset)];
+	tc_hash[tc_hashfunc(vn, offset)] = e;
+	tc_lru_insert(e);
+	tc_enters++;
+	lock_release(tc_lock);
+
+	if (oldvn != NULL) {
+		VOP_DECREF(oldvn);
+	}
+}
+
+/*
+ * Forget every page of VN, which the caller holds a reference to.
+ * Address spaces already mapping them keep them.
+ */
+void
+vm_textpurge(struct vnode *vn)
+{
+	unsigned i, ndropped = 0;
+
+	lock_acquire(tc_lock);
+	tc_gen++;
+	for (i=0; i<tc_size; i++) {
+		if (tc_entries[i].tc_vn == vn) {
+			tc_remove(&tc_entries[i]);
+			ndropped++;
+		}
+	}
+	tc_purges += ndropped;
+	lock_release(tc_lock);
+
+	for (i=0; i<ndropped; i++) {
+		VOP_DECREF(vn);
+	}
+}
+
+/*
+ * Throw out up to N (at most TC_SHRINKMAX) of the least recently
+ * used entries, to let their pages go if nothing else maps them.
+ * Returns how many were thrown out. Called by the pageout thread
+ * when it finds nothing to page out; may drop the last reference to
+ * a vnode, so the caller must not hold any filesystem locks.
+ */
+unsigned
+textcache_shrink(unsigned n)
+{
+	struct vnode *vns[TC_SHRINKMAX];
+	struct tcentry *e;
+	unsigned i, got;
+
+	if (n > TC_SHRINKMAX) {
+		n = TC_SHRINKMAX;
+	}
+	got = 0;
+	lock_acquire(tc_lock);
+	while (got < n && (e = tc_lru.tc_lruprev) != &tc_lru) {
+		vns[got++] = tc_remove(e);
+	}
+	tc_evictions += got;
+	lock_release(tc_lock);
+
+	for (i=0; i<got; i++) {
+		VOP_DECREF(vns[i]);
+	}
+	return got;
+}
+
+/*
+ * Forget every page of a file on FS, so the vnode references held
+ * here don't keep it from being unmounted.
+ */
+void
+vm_textpurgefs(struct fs *fs)
+{
+	unsigned i;
+	struct vnode *vn;
+
+	while (1) {
+		vn = NULL;
+
+		lock_acquire(tc_lock);
+		tc_gen++;
+		for (i=0; i<tc_size; i++) {
+			if (tc_entries[i].tc_vn != NULL &&
+			    tc_entries[i].tc_vn->vn_fs == fs) {
+				vn = tc_remove(&tc_entries[i]);
+				tc_purges++;
+				break;
+			}
+		}
+		lock_release(tc_lock);
+
+		if (vn == NULL) {
+			break;
+		}
+		/* Dropping this may reclaim it; start over */
+		VOP_DECREF(vn);
+	}
+}
+
+void
+textcache_printstats(void)
+{
+	unsigned lookups, hits, enters, evictions, purges, used;
+	struct tcentry *e;
+
+	lock_acquire(tc_lock);
+	lookups = tc_lookups;
+	hits = tc_hits;
+	enters = tc_enters;
+	evictions = tc_evictions;
+	purges = tc_purges;
+	used = 0;
+	for (e = tc_lru.tc_lrunext; e != &tc_lru; e = e->tc_lrunext) {
+		used++;
+	}
+	lock_release(tc_lock);
+
+	kprintf("Text page cache: %u/%u pages, %u lookups, %u hits, "
+		"%u entered, %u evicted, %u purged\n",
+		used, tc_size, lookups, hits, enters, evictions, purges);
+}
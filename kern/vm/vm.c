@@ -0,0 +1,902 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Machine-independent parts of the VM system: kernel page allocation,
+ * the page fault handler, and pageout.
+ *
+ * User pages are allocated the first time they're touched. Pages
+ * backed by an executable (see as_map_file) are read from it then;
+ * the rest, including the part of any page past the end of the file
+ * data (BSS), are zero-filled. Pages of read-only regions of an
+ * executable come from the text page cache, which shares them among
+ * every address space running the program. After fork, parent and
+ * child share all their pages; each entry is marked PTE_COW and
+ * mapped read-only in the TLB. The first write to such a page gets a
+ * private copy, unless every other sharer has already let go of it,
+ * in which case the page is just made writable again.
+ *
+ * Once swap is turned on (vm_swapon), pages are paged out when
+ * memory runs short, in batches of up to VM_PAGEOUT_BATCH chosen by
+ * the coremap's clock. A batch is shot down from every TLB, written
+ * to swap with one I/O if there are enough consecutive free slots,
+ * and then the page table entries are changed to point to the slots.
+ * The next fault on one of them reads it back in. The MIPS TLB has
+ * no referenced bit, so a page counts as referenced when it's loaded
+ * into the TLB; since the TLB is flushed on every context switch,
+ * pages in use get loaded, and marked, often.
+ *
+ * Normally pages are paged out ahead of time by the pageout thread,
+ * which is woken whenever the number of free pages falls below
+ * vm_lowater and runs until it's back up to vm_hiwater. If that
+ * doesn't keep up, allocations page out a batch themselves.
+ *
+ * Page table entries are only changed with the page table locked,
+ * and pages being worked on are kept busy in the coremap (see
+ * coremap.c) so pageout leaves them alone. Neither lock is held
+ * across I/O or page allocation; the fault handler just looks at the
+ * entry again afterwards.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <thread.h>
+#include <uio.h>
+#include <proc.h>
+#include <current.h>
+#include <mips/tlb.h>
+#include <addrspace.h>
+#include <pagetable.h>
+#include <vnode.h>
+#include <vm.h>
+
+/* Most pages paged out at once */
+#define VM_PAGEOUT_BATCH  8
+
+/* Times alloc_kpages pages out before giving up */
+#define VM_KPAGES_TRIES   4
+
+static struct lock *vm_pageoutlock;	/* one pageout at a time */
+static struct semaphore *vm_shootsem;	/* shootdown acknowledgements */
+static struct semaphore *vm_pageoutsem;	/* wakes the pageout thread */
+static unsigned vm_lowater, vm_hiwater;	/* free page targets */
+
+/*
+ * vm_spinlock protects the statistics and the pageout thread's
+ * state. Nothing else is ever acquired while it's held.
+ */
+static struct spinlock vm_spinlock = SPINLOCK_INITIALIZER;
+static bool vm_daemonrunning;		/* pageout thread has started */
+static bool vm_pageoutwanted;		/* pageout thread has been woken */
+
+/* Statistics */
+static unsigned vs_faults, vs_newpages, vs_filereads, vs_cowcopies;
+static unsigned vs_cowclaims, vs_swapins, vs_evictions, vs_batches;
+static unsigned vs_directreclaims, vs_daemonruns;
+
+static
+void
+vm_stat(unsigned *stat, unsigned n)
+{
+	spinlock_acquire(&vm_spinlock);
+	*stat += n;
+	spinlock_release(&vm_spinlock);
+}
+
+void
+vm_bootstrap(void)
+{
+	coremap_bootstrap();
+	textcache_bootstrap();
+
+	vm_pageoutlock = lock_create("pageout");
+	if (vm_pageoutlock == NULL) {
+		panic("vm: Could not create pageout lock\n");
+	}
+	vm_shootsem = sem_create("tlb shootdown", 0);
+	if (vm_shootsem == NULL) {
+		panic("vm: Could not create shootdown semaphore\n");
+	}
+	vm_pageoutsem = sem_create("pageout", 0);
+	if (vm_pageoutsem == NULL) {
+		panic("vm: Could not create pageout semaphore\n");
+	}
+
+	vm_lowater = coremap_npages() / 32;
+	if (vm_lowater < 2 * VM_PAGEOUT_BATCH) {
+		vm_lowater = 2 * VM_PAGEOUT_BATCH;
+	}
+	vm_hiwater = 2 * vm_lowater;
+}
+
+void
+vm_printstats(void)
+{
+	unsigned faults, newpages, filereads, cowcopies, cowclaims, swapins;
+	unsigned evictions, batches, directreclaims, daemonruns;
+
+	spinlock_acquire(&vm_spinlock);
+	faults = vs_faults;
+	newpages = vs_newpages;
+	filereads = vs_filereads;
+	cowcopies = vs_cowcopies;
+	cowclaims = vs_cowclaims;
+	swapins = vs_swapins;
+	evictions = vs_evictions;
+	batches = vs_batches;
+	directreclaims = vs_directreclaims;
+	daemonruns = vs_daemonruns;
+	spinlock_release(&vm_spinlock);
+
+	kprintf("VM: %u faults, %u new pages (%u read from files), "
+		"%u copy-on-write copies, %u claimed, %u swapped in\n",
+		faults, newpages, filereads, cowcopies, cowclaims, swapins);
+	kprintf("Pageout: %u pages in %u batches, %u direct, "
+		"%u wakeups; %u free (low %u, high %u)\n",
+		evictions, batches, directreclaims, daemonruns,
+		coremap_nfree(), vm_lowater, vm_hiwater);
+	coremap_printstats();
+	textcache_printstats();
+	swap_printstats();
+}
+
+/*
+ * Invalidate the whole TLB on this CPU.
+ */
+void
+vm_tlbflush(void)
+{
+	int i, spl;
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+
+	splx(spl);
+}
+
+/*
+ * Invalidate the TLB entry for VADDR on this CPU, if there is one.
+ */
+static
+void
+vm_tlbinvalidate(vaddr_t vaddr)
+{
+	int i, spl;
+
+	spl = splhigh();
+	i = tlb_probe(vaddr, 0);
+	if (i >= 0) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	splx(spl);
+}
+
+/*
+ * Shootdowns are only sent by vm_pageout, which waits for each CPU
+ * to acknowledge one before sending the next, so a CPU never has
+ * more than one queued and these are called once per shootdown.
+ */
+void
+vm_tlbshootdown_all(void)
+{
+	vm_tlbflush();
+	V(vm_shootsem);
+}
+
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	unsigned i;
+
+	for (i=0; i<ts->ts_count; i++) {
+		vm_tlbinvalidate(ts->ts_vaddrs[i]);
+	}
+	V(vm_shootsem);
+}
+
+/*
+ * Remove the pages in TS from every CPU's TLB, and wait until they're
+ * gone.
+ */
+static
+void
+vm_shootdown(const struct tlbshootdown *ts)
+{
+	unsigned i, n;
+	int spl;
+
+	/* Stay on this CPU until the others have been sent theirs. */
+	spl = splhigh();
+	for (i=0; i<ts->ts_count; i++) {
+		vm_tlbinvalidate(ts->ts_vaddrs[i]);
+	}
+	n = ipi_tlbshootdown_broadcast(ts);
+	splx(spl);
+
+	for (i=0; i<n; i++) {
+		P(vm_shootsem);
+	}
+}
+
+/*
+ * Write one page out to a slot of its own.
+ */
+static
+bool
+vm_writepage(paddr_t pa, unsigned *slot)
+{
+	if (swap_alloc(1, slot)) {
+		return false;
+	}
+	if (swap_write(*slot, &pa, 1)) {
+		swap_free(*slot);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Page out up to N pages. Returns how many were freed; 0 if swap is
+ * off, or full, or there's nothing that can be paged out.
+ */
+static
+unsigned
+vm_pageout(unsigned n)
+{
+	paddr_t pas[VM_PAGEOUT_BATCH];
+	struct addrspace *ases[VM_PAGEOUT_BATCH];
+	vaddr_t vaddrs[VM_PAGEOUT_BATCH];
+	unsigned slots[VM_PAGEOUT_BATCH];
+	bool written[VM_PAGEOUT_BATCH];
+	struct tlbshootdown ts;
+	struct pagetable *pt;
+	unsigned i, got, slot, freed;
+	uint32_t *pte;
+	int result;
+
+	if (!swap_enabled()) {
+		return 0;
+	}
+	if (n > VM_PAGEOUT_BATCH) {
+		n = VM_PAGEOUT_BATCH;
+	}
+
+	lock_acquire(vm_pageoutlock);
+
+	got = coremap_pickvictims(pas, ases, vaddrs, n);
+	if (got == 0) {
+		lock_release(vm_pageoutlock);
+		return 0;
+	}
+
+	/* They're busy now, so nobody can map them again. */
+	ts.ts_vaddrs = vaddrs;
+	ts.ts_count = got;
+	vm_shootdown(&ts);
+
+	/* Write them out, with one I/O if there's room in a row. */
+	result = swap_alloc(got, &slot);
+	if (result == 0) {
+		result = swap_write(slot, pas, got);
+		if (result) {
+			for (i=0; i<got; i++) {
+				swap_free(slot + i);
+			}
+		}
+	}
+	for (i=0; i<got; i++) {
+		if (result == 0) {
+			slots[i] = slot + i;
+			written[i] = true;
+		}
+		else {
+			written[i] = vm_writepage(pas[i], &slots[i]);
+		}
+	}
+
+	freed = 0;
+	for (i=0; i<got; i++) {
+		if (!written[i]) {
+			coremap_unbusy(pas[i]);
+			continue;
+		}
+
+		/*
+		 * The owner can't let go of the page while it's busy,
+		 * so its page table is still there.
+		 */
+		pt = ases[i]->as_pt;
+		pte = pt_lookup(pt, vaddrs[i], false);
+		KASSERT(pte != NULL);
+
+		pt_acquire(pt);
+		KASSERT((*pte & PTE_VALID) && (*pte & PTE_FRAME) == pas[i]);
+		*pte = PTE_MKSLOT(slots[i]) | PTE_SWAPPED | (*pte & PTE_COW);
+		pt_release(pt);
+
+		coremap_evicted(pas[i]);
+		freed++;
+	}
+
+	lock_release(vm_pageoutlock);
+
+	spinlock_acquire(&vm_spinlock);
+	vs_evictions += freed;
+	vs_batches++;
+	spinlock_release(&vm_spinlock);
+
+	return freed;
+}
+
+/*
+ * Whether the current thread can page out: it has to be able to
+ * sleep, and not already be doing it.
+ */
+static
+bool
+vm_canpageout(void)
+{
+	return vm_pageoutlock != NULL &&
+		!curthread->t_in_interrupt &&
+		curcpu->c_spinlocks == 0 &&
+		!lock_do_i_hold(vm_pageoutlock);
+}
+
+/*
+ * Wake the pageout thread if free pages are running low.
+ */
+static
+void
+vm_checkfree(void)
+{
+	bool wake;
+
+	if (coremap_nfree() >= vm_lowater) {
+		return;
+	}
+
+	spinlock_acquire(&vm_spinlock);
+	wake = vm_daemonrunning && !vm_pageoutwanted;
+	if (wake) {
+		vm_pageoutwanted = true;
+	}
+	spinlock_release(&vm_spinlock);
+
+	if (wake) {
+		V(vm_pageoutsem);
+	}
+}
+
+/*
+ * The pageout thread.
+ */
+static
+void
+vm_pageoutthread(void *data1, unsigned long data2)
+{
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		P(vm_pageoutsem);
+
+		spinlock_acquire(&vm_spinlock);
+		vm_pageoutwanted = false;
+		vs_daemonruns++;
+		spinlock_release(&vm_spinlock);
+
+		while (coremap_nfree() < vm_hiwater) {
+			if (vm_pageout(VM_PAGEOUT_BATCH) > 0) {
+				continue;
+			}
+			/*
+			 * Nothing left that can be paged out; maybe
+			 * some of what the text cache holds can go.
+			 */
+			if (textcache_shrink(VM_PAGEOUT_BATCH) == 0) {
+				break;
+			}
+		}
+	}
+}
+
+int
+vm_swapon(const char *device)
+{
+	int result;
+
+	result = swap_on(device);
+	if (result) {
+		return result;
+	}
+
+	result = thread_fork("pageout", NULL, vm_pageoutthread, NULL, 0);
+	if (result) {
+		/* Allocations can still page out for themselves. */
+		kprintf("vm: Could not start pageout thread: %s\n",
+			strerror(result));
+		return 0;
+	}
+
+	spinlock_acquire(&vm_spinlock);
+	vm_daemonrunning = true;
+	spinlock_release(&vm_spinlock);
+	return 0;
+}
+
+/* Allocate/free some kernel-space virtual pages */
+vaddr_t
+alloc_kpages(int npages)
+{
+	paddr_t pa;
+	unsigned tries;
+
+	tries = 0;
+	while ((pa = coremap_alloc(npages, NULL, 0)) == 0) {
+		/* Pageout frees single pages, which may not be enough. */
+		if (tries++ == VM_KPAGES_TRIES || !vm_canpageout() ||
+		    vm_pageout(VM_PAGEOUT_BATCH) == 0) {
+			return 0;
+		}
+		vm_stat(&vs_directreclaims, 1);
+	}
+	vm_checkfree();
+	return PADDR_TO_KVADDR(pa);
+}
+
+void
+free_kpages(vaddr_t addr)
+{
+	coremap_free(KVADDR_TO_PADDR(addr));
+}
+
+/*
+ * Allocate a page for AS at VADDR, paging something out to make room
+ * if need be. The page comes back busy.
+ */
+static
+int
+vm_getpage(struct addrspace *as, vaddr_t vaddr, paddr_t *ret)
+{
+	paddr_t pa;
+
+	while ((pa = coremap_alloc(1, as, vaddr)) == 0) {
+		if (!vm_canpageout() || vm_pageout(VM_PAGEOUT_BATCH) == 0) {
+			return ENOMEM;
+		}
+		vm_stat(&vs_directreclaims, 1);
+	}
+	vm_checkfree();
+	*ret = pa;
+	return 0;
+}
+
+/*
+ * Load a TLB entry for VADDR, replacing any existing one.
+ */
+static
+void
+vm_tlbload(vaddr_t vaddr, uint32_t elo)
+{
+	int i, spl;
+
+	spl = splhigh();
+	i = tlb_probe(vaddr, 0);
+	if (i >= 0) {
+		tlb_write(vaddr, elo, i);
+	}
+	else {
+		tlb_random(vaddr, elo);
+	}
+	splx(spl);
+}
+
+/*
+ * Fill in the page at VADDR in region RG, which has been allocated at
+ * PA and zeroed, from the file backing the region, if any of it is.
+ *
+ * The fault may have come from the middle of a read() or write(),
+ * while the filesystem is copying to or from user memory holding its
+ * own locks (sfs_io holds the file's sv_lock and a busy buffer; emufs
+ * holds the device lock). Reading the page from the same filesystem
+ * then would deadlock, e.g. a program read()ing its own binary into
+ * an untouched page of its data segment. The system call layer
+ * brings such pages in beforehand (vm_prefault, from file_uio_io),
+ * and once in, a page that's evicted goes to swap and comes back
+ * through vm_swapin, not here. So this only happens for a page
+ * vm_prefault couldn't bring in, e.g. for lack of memory; fail the
+ * copy with EFAULT rather than hang. Paging in from a different
+ * filesystem is allowed, though two threads doing that crosswise
+ * can still deadlock.
+ */
+static
+int
+vm_pagein(struct region *rg, vaddr_t vaddr, paddr_t pa)
+{
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t start, end, fileend;
+	int result;
+
+	if (rg->rg_vnode == NULL) {
+		return 0;
+	}
+
+	fileend = rg->rg_filevaddr + rg->rg_filesize;
+	start = vaddr > rg->rg_filevaddr ? vaddr : rg->rg_filevaddr;
+	end = vaddr + PAGE_SIZE < fileend ? vaddr + PAGE_SIZE : fileend;
+	if (start >= end) {
+		/* Entirely outside the file data */
+		return 0;
+	}
+
+	if (curthread->t_iovnode != NULL &&
+	    curthread->t_iovnode->vn_fs == rg->rg_vnode->vn_fs) {
+		return EFAULT;
+	}
+
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(pa + (start - vaddr)),
+		  end - start,
+		  rg->rg_fileoffset + (start - rg->rg_filevaddr), UIO_READ);
+	result = VOP_READ(rg->rg_vnode, &ku);
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		/* short read; problem with executable? */
+		kprintf("vm: short read on page - file truncated?\n");
+		return ENOEXEC;
+	}
+	vm_stat(&vs_filereads, 1);
+	return 0;
+}
+
+/*
+ * Fill in the empty entry PTE, for VADDR in region RG, with a new
+ * page.
+ */
+static
+int
+vm_newpage(struct addrspace *as, struct region *rg, vaddr_t vaddr,
+	   uint32_t *pte)
+{
+	paddr_t pa;
+	int result;
+
+	result = vm_getpage(as, vaddr, &pa);
+	if (result) {
+		return result;
+	}
+	bzero((void *)PADDR_TO_KVADDR(pa), PAGE_SIZE);
+	result = vm_pagein(rg, vaddr, pa);
+	if (result) {
+		coremap_decref_busy(pa, as);
+		return result;
+	}
+
+	pt_acquire(as->as_pt);
+	KASSERT(*pte == 0);
+	*pte = pa | PTE_VALID;
+	pt_release(as->as_pt);
+
+	coremap_unbusy(pa);
+	vm_stat(&vs_newpages, 1);
+	return 0;
+}
+
+/*
+ * Fill in the empty entry PTE, for VADDR in region RG, a read-only
+ * region backed by a file, with the page from the text page cache
+ * or, failing that, by reading it in and adding it to the cache.
+ */
+static
+int
+vm_textpage(struct addrspace *as, struct region *rg, vaddr_t vaddr,
+	    uint32_t *pte)
+{
+	off_t offset;
+	paddr_t pa;
+	unsigned gen;
+	bool fresh;
+	int result;
+
+	offset = rg->rg_fileoffset + ((off_t)vaddr - rg->rg_filevaddr);
+	pa = textcache_lookup(rg->rg_vnode, offset, vaddr, &gen);
+	fresh = (pa == 0);
+	if (fresh) {
+		result = vm_getpage(as, vaddr, &pa);
+		if (result) {
+			return result;
+		}
+		bzero((void *)PADDR_TO_KVADDR(pa), PAGE_SIZE);
+		result = vm_pagein(rg, vaddr, pa);
+		if (result) {
+			coremap_decref_busy(pa, as);
+			return result;
+		}
+		textcache_enter(rg->rg_vnode, offset, vaddr, pa, gen);
+	}
+
+	pt_acquire(as->as_pt);
+	KASSERT(*pte == 0);
+	/* Shared; copy-on-write just in case. */
+	*pte = pa | PTE_VALID | PTE_COW;
+	pt_release(as->as_pt);
+
+	if (fresh) {
+		coremap_unbusy(pa);
+		vm_stat(&vs_newpages, 1);
+	}
+	return 0;
+}
+
+/*
+ * Read the page at VADDR back in from swap. PTE is its entry, which
+ * was SWAPPEDPTE.
+ */
+static
+int
+vm_swapin(struct addrspace *as, vaddr_t vaddr, uint32_t *pte,
+	  uint32_t swappedpte)
+{
+	paddr_t pa;
+	int result;
+
+	result = vm_getpage(as, vaddr, &pa);
+	if (result) {
+		return result;
+	}
+	result = swap_read(PTE_SLOT(swappedpte), pa);
+	if (result) {
+		coremap_decref_busy(pa, as);
+		return result;
+	}
+
+	pt_acquire(as->as_pt);
+	KASSERT(*pte == swappedpte);
+	*pte = pa | PTE_VALID | (swappedpte & PTE_COW);
+	pt_release(as->as_pt);
+
+	swap_free(PTE_SLOT(swappedpte));
+	coremap_unbusy(pa);
+	vm_stat(&vs_swapins, 1);
+	return 0;
+}
+
+/*
+ * Give AS its own copy of the copy-on-write page OLDPA, mapped at
+ * VADDR by PTE, which coremap_claim has made busy.
+ */
+static
+int
+vm_cowcopy(struct addrspace *as, vaddr_t vaddr, uint32_t *pte,
+	   paddr_t oldpa)
+{
+	paddr_t newpa;
+	int result;
+
+	result = vm_getpage(as, vaddr, &newpa);
+	if (result) {
+		coremap_unbusy(oldpa);
+		return result;
+	}
+	memcpy((void *)PADDR_TO_KVADDR(newpa),
+	       (const void *)PADDR_TO_KVADDR(oldpa), PAGE_SIZE);
+
+	pt_acquire(as->as_pt);
+	KASSERT((*pte & PTE_FRAME) == oldpa);
+	*pte = newpa | PTE_VALID;
+	pt_release(as->as_pt);
+
+	coremap_decref_busy(oldpa, as);
+	coremap_unbusy(newpa);
+	vm_stat(&vs_cowcopies, 1);
+	return 0;
+}
+
+/*
+ * Fault in the pages of UIO's user buffer that would be read from an
+ * executable, before a filesystem starts copying to or from it (see
+ * vm_pagein). Only those: other pages can be faulted in during the
+ * copy, so a huge read() into fresh memory doesn't allocate it all
+ * up front. Errors are left for the copy to run into.
+ */
+void
+vm_prefault(const struct uio *uio)
+{
+	struct addrspace *as;
+	struct region *rg;
+	vaddr_t addr, end, filestart, fileend;
+	unsigned i;
+
+	KASSERT(uio->uio_segflg == UIO_USERSPACE);
+	as = proc_getas();
+	if (as == NULL) {
+		return;
+	}
+
+	for (i=0; i<uio->uio_iovcnt; i++) {
+		addr = (vaddr_t)uio->uio_iov[i].iov_ubase & PAGE_FRAME;
+		end = (vaddr_t)uio->uio_iov[i].iov_ubase +
+			uio->uio_iov[i].iov_len;
+		if (end < addr) {
+			/* Wraps around; the copy will fail */
+			continue;
+		}
+		for (; addr < end; addr += PAGE_SIZE) {
+			rg = as_findregion(as, addr);
+			if (rg == NULL || rg->rg_vnode == NULL) {
+				continue;
+			}
+			filestart = rg->rg_filevaddr;
+			fileend = rg->rg_filevaddr + rg->rg_filesize;
+			if (addr + PAGE_SIZE <= filestart ||
+			    addr >= fileend) {
+				continue;
+			}
+			(void)vm_fault(VM_FAULT_READ, addr);
+		}
+	}
+}
+
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+	struct addrspace *as;
+	struct region *rg;
+	uint32_t *pte, e, elo;
+	paddr_t pa;
+	bool write, writeable;
+	int result;
+
+	faultaddress &= PAGE_FRAME;
+
+	DEBUG(DB_VM, "vm: fault: 0x%x\n", faultaddress);
+
+	switch (faulttype) {
+	    case VM_FAULT_READ:
+		write = false;
+		break;
+	    case VM_FAULT_WRITE:
+	    case VM_FAULT_READONLY:
+		write = true;
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	if (curproc == NULL) {
+		/*
+		 * No process. This is probably a kernel fault early
+		 * in boot. Return EFAULT so as to panic instead of
+		 * getting into an infinite faulting loop.
+		 */
+		return EFAULT;
+	}
+
+	as = proc_getas();
+	if (as == NULL) {
+		/*
+		 * No address space set up. This is probably also a
+		 * kernel fault early in boot.
+		 */
+		return EFAULT;
+	}
+
+	rg = as_findregion(as, faultaddress);
+	if (rg == NULL) {
+		return EFAULT;
+	}
+	writeable = rg->rg_writeable || as->as_loading;
+	if (write && !writeable) {
+		return EFAULT;
+	}
+
+	vm_stat(&vs_faults, 1);
+
+	pte = pt_lookup(as->as_pt, faultaddress, true);
+	if (pte == NULL) {
+		return ENOMEM;
+	}
+
+	/*
+	 * Anything that has to sleep is done with the page table
+	 * unlocked, after which the entry is looked at again.
+	 */
+ again:
+	pt_acquire(as->as_pt);
+	e = *pte;
+
+	if ((e & PTE_VALID) == 0) {
+		pt_release(as->as_pt);
+		if (e & PTE_SWAPPED) {
+			result = vm_swapin(as, faultaddress, pte, e);
+		}
+		else if (!rg->rg_writeable && rg->rg_vnode != NULL) {
+			result = vm_textpage(as, rg, faultaddress, pte);
+		}
+		else {
+			result = vm_newpage(as, rg, faultaddress, pte);
+		}
+		if (result) {
+			return result;
+		}
+		goto again;
+	}
+
+	pa = e & PTE_FRAME;
+	if (write && (e & PTE_COW)) {
+		switch (coremap_claim(pa, as, faultaddress)) {
+		    case CLAIM_OWNED:
+			/* Everyone else has let go of it already. */
+			e &= ~PTE_COW;
+			*pte = e;
+			vm_stat(&vs_cowclaims, 1);
+			break;
+		    case CLAIM_SHARED:
+			pt_release(as->as_pt);
+			result = vm_cowcopy(as, faultaddress, pte, pa);
+			if (result) {
+				return result;
+			}
+			goto again;
+		    default:
+			pt_release(as->as_pt);
+			coremap_waitbusy(pa);
+			goto again;
+		}
+	}
+
+	if (!coremap_touch(pa)) {
+		/* Being paged out */
+		pt_release(as->as_pt);
+		coremap_waitbusy(pa);
+		goto again;
+	}
+
+	/* Map it; writable unless it still has to be copied first. */
+	elo = pa | TLBLO_VALID;
+	if (writeable && (e & PTE_COW) == 0) {
+		elo |= TLBLO_DIRTY;
+	}
+	DEBUG(DB_VM, "vm: 0x%x -> 0x%x\n", faultaddress, elo & TLBLO_PPAGE);
+	vm_tlbload(faultaddress, elo);
+	pt_release(as->as_pt);
+
+	return 0;
+}
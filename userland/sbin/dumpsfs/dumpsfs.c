@@ -58,7 +58,7 @@
 
 static
 uint32_t
-dumpsb(void)
+dumpsb(uint32_t *jstart, uint32_t *jblocks)
 {
 	struct sfs_super sp;
 	diskread(&sp, SFS_SB_LOCATION);
@@ -69,20 +69,38 @@ dumpsb(void)
 	printf("Volume name: %-40s  %u blocks\n", sp.sp_volname,
 	       SWAPL(sp.sp_nblocks));
 
+	*jstart = SWAPL(sp.sp_jstart);
+	*jblocks = SWAPL(sp.sp_jblocks);
 	return SWAPL(sp.sp_nblocks);
 }
 
 static
 void
-dodirblock(uint32_t block)
+dumpjournal(uint32_t jstart, uint32_t jblocks)
 {
-	struct sfs_dir sds[SFS_BLOCKSIZE/sizeof(struct sfs_dir)];
-	int nsds = SFS_BLOCKSIZE/sizeof(struct sfs_dir);
-	int i;
+	struct sfs_jheader jh;
 
-	diskread(&sds, block);
+	if (jstart == 0) {
+		printf("Journal: none\n");
+		return;
+	}
+	diskread(&jh, jstart);
+	if (SWAPL(jh.jh_magic) != SFS_JMAGIC_HEADER) {
+		printf("Journal: blocks %u-%u, bad header magic 0x%x\n",
+		       jstart, jstart + jblocks - 1, SWAPL(jh.jh_magic));
+		return;
+	}
+	printf("Journal: blocks %u-%u, tail at %u (sequence %u)\n",
+	       jstart, jstart + jblocks - 1,
+	       SWAPL(jh.jh_tail), SWAPL(jh.jh_tailseq));
+}
+
+static
+void
+dodirentries(struct sfs_dir *sds, int nsds)
+{
+	int i;
 
-	printf("    [block %u]\n", block);
 	for (i=0; i<nsds; i++) {
 		uint32_t ino = SWAPL(sds[i].sfd_ino);
 		if (ino==SFS_NOINO) {
@@ -95,11 +113,77 @@ dodirblock(uint32_t block)
 	}
 }
 
+static
+void
+dodirblock(uint32_t block)
+{
+	struct sfs_dir sds[SFS_BLOCKSIZE/sizeof(struct sfs_dir)];
+
+	diskread(&sds, block);
+
+	printf("    [block %u]\n", block);
+	dodirentries(sds, SFS_BLOCKSIZE/sizeof(struct sfs_dir));
+}
+
+static
+void
+dodirinline(struct sfs_dinode *sfi)
+{
+	struct sfs_dir sds[SFS_INLINESIZE/sizeof(struct sfs_dir)];
+	uint32_t size = SWAPL(sfi->sfi_size);
+
+	if (size > sizeof(sds)) {
+		warnx("Warning: inline dir size is too large");
+		size = sizeof(sds);
+	}
+	memcpy(sds, sfi->sfi_u.sfu_inline, size);
+
+	printf("    [inline]\n");
+	dodirentries(sds, size/sizeof(struct sfs_dir));
+}
+
+/*
+ * Dump the directory blocks named by an extent tree node with
+ * entries EXT (N of them) at depth DEPTH. Returns the number of
+ * blocks.
+ */
+static
+uint32_t
+dodirextents(const struct sfs_extent *ext, unsigned n, unsigned depth)
+{
+	struct sfs_extnode node;
+	uint32_t block, len, j, nblocks=0;
+	unsigned i;
+
+	for (i=0; i<n; i++) {
+		block = SWAPL(ext[i].ex_block);
+		if (depth == 0) {
+			len = SWAPL(ext[i].ex_len);
+			for (j=0; j<len; j++) {
+				dodirblock(block + j);
+				nblocks++;
+			}
+			continue;
+		}
+		diskread(&node, block);
+		if (SWAPL(node.en_magic) != SFS_EXTMAGIC ||
+		    SWAPS(node.en_nentries) > SFS_EXTPERNODE) {
+			warnx("Warning: bad extent node %u", block);
+			continue;
+		}
+		printf("    [extent node %u]\n", block);
+		nblocks += dodirextents(node.en_ext, SWAPS(node.en_nentries),
+					depth - 1);
+	}
+	return nblocks;
+}
+
 static
 void
 dumpdir(uint32_t ino)
 {
 	struct sfs_dinode sfi;
+	struct sfs_extroot *er = &sfi.sfi_u.sfu_extents;
 	uint32_t ib[SFS_DBPERIDB];
 	int nentries, i;
 	uint32_t block, nblocks=0;
@@ -112,6 +196,22 @@ dumpdir(uint32_t ino)
 	}
 	printf("Directory %u: %d entries\n", ino, nentries);
 
+	if (SWAPL(sfi.sfi_flags) & SFS_IF_INLINE) {
+		dodirinline(&sfi);
+		return;
+	}
+
+	if (SWAPL(sfi.sfi_flags) & SFS_IF_EXTENTS) {
+		if (SWAPS(er->er_nentries) > SFS_EXTPERROOT) {
+			warnx("Warning: bad extent tree root");
+			return;
+		}
+		nblocks = dodirextents(er->er_ext, SWAPS(er->er_nentries),
+				       SWAPS(er->er_depth));
+		printf("    %u blocks in directory\n", nblocks);
+		return;
+	}
+
 	for (i=0; i<SFS_NDIRECT; i++) {
 		block = SWAPL(sfi.sfi_direct[i]);
 		if (block) {
@@ -157,7 +257,7 @@ dumpbits(uint32_t fsblocks)
 int
 main(int argc, char **argv)
 {
-	uint32_t nblocks;
+	uint32_t nblocks, jstart, jblocks;
 
 #ifdef HOST
 	hostcompat_init(argc, argv);
@@ -168,7 +268,8 @@ main(int argc, char **argv)
 	}
 
 	opendisk(argv[1]);
-	nblocks = dumpsb();
+	nblocks = dumpsb(&jstart, &jblocks);
+	dumpjournal(jstart, jblocks);
 	dumpbits(nblocks);
 	dumpdir(SFS_ROOT_LOCATION);
 
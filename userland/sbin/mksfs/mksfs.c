@@ -57,6 +57,13 @@
 
 #define MAXBITBLOCKS 32
 
+/*
+ * The metadata journal is about 1/64 of the volume, within these
+ * limits; volumes too small for the minimum don't get one.
+ */
+#define MINJOURNAL 32
+#define MAXJOURNAL 128
+
 static
 void
 check(void)
@@ -64,11 +71,15 @@ check(void)
 	assert(sizeof(struct sfs_super)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_dir) == 0);
+	assert(sizeof(struct sfs_jheader)==SFS_BLOCKSIZE);
+	assert(sizeof(struct sfs_jdesc)==SFS_BLOCKSIZE);
+	assert(sizeof(struct sfs_jcommit)==SFS_BLOCKSIZE);
 }
 
 static
 void
-writesuper(const char *volname, uint32_t nblocks)
+writesuper(const char *volname, uint32_t nblocks,
+	   uint32_t jstart, uint32_t jblocks)
 {
 	struct sfs_super sp;
 
@@ -81,6 +92,8 @@ writesuper(const char *volname, uint32_t nblocks)
 	sp.sp_magic = SWAPL(SFS_MAGIC);
 	sp.sp_nblocks = SWAPL(nblocks);
 	strcpy(sp.sp_volname, volname);
+	sp.sp_jstart = SWAPL(jstart);
+	sp.sp_jblocks = SWAPL(jblocks);
 
 	diskwrite(&sp, SFS_SB_LOCATION);
 }
@@ -96,6 +109,7 @@ writerootdir(void)
 	sfi.sfi_size = SWAPL(0);
 	sfi.sfi_type = SWAPS(SFS_TYPE_DIR);
 	sfi.sfi_linkcount = SWAPS(1);
+	sfi.sfi_flags = SWAPL(SFS_IF_INLINE);
 
 	diskwrite(&sfi, SFS_ROOT_LOCATION);
 }
@@ -115,7 +129,7 @@ doallocbit(uint32_t bit)
 
 static
 void
-writebitmap(uint32_t fsblocks)
+writebitmap(uint32_t fsblocks, uint32_t jstart, uint32_t jblocks)
 {
 
 	uint32_t nbits = SFS_BITMAPSIZE(fsblocks);
@@ -133,6 +147,9 @@ writebitmap(uint32_t fsblocks)
 	for (i=0; i<nblocks; i++) {
 		doallocbit(SFS_MAP_LOCATION+i);
 	}
+	for (i=0; i<jblocks; i++) {
+		doallocbit(jstart+i);
+	}
 	for (i=fsblocks; i<nbits; i++) {
 		doallocbit(i);
 	}
@@ -143,10 +160,59 @@ writebitmap(uint32_t fsblocks)
 	}
 }
 
+/*
+ * Choose how big a journal to make; 0 for none.
+ */
+static
+uint32_t
+journalsize(uint32_t fsblocks)
+{
+	uint32_t jblocks = fsblocks / 64;
+
+	if (jblocks < MINJOURNAL) {
+		return 0;
+	}
+	if (jblocks > MAXJOURNAL) {
+		jblocks = MAXJOURNAL;
+	}
+	return jblocks;
+}
+
+/*
+ * Write an empty journal: a header whose tail is at the start of the
+ * log, and a log with nothing in it. The log is cleared so nothing
+ * left over from a previous filesystem can be mistaken for a
+ * transaction.
+ */
+static
+void
+writejournal(uint32_t jstart, uint32_t jblocks)
+{
+	struct sfs_jheader jh;
+	char zeros[SFS_BLOCKSIZE];
+	uint32_t i;
+
+	if (jblocks == 0) {
+		return;
+	}
+
+	bzero((void *)&jh, sizeof(jh));
+	jh.jh_magic = SWAPL(SFS_JMAGIC_HEADER);
+	jh.jh_tail = SWAPL(0);
+	jh.jh_tailseq = SWAPL(1);
+	diskwrite(&jh, jstart);
+
+	bzero(zeros, sizeof(zeros));
+	for (i=1; i<jblocks; i++) {
+		diskwrite(zeros, jstart+i);
+	}
+}
+
 int
 main(int argc, char **argv)
 {
 	uint32_t size, blocksize;
+	uint32_t jstart, jblocks;
 	char *volname, *s;
 
 #ifdef HOST
@@ -185,9 +251,14 @@ main(int argc, char **argv)
 	}
 	size = diskblocks();
 
-	writesuper(volname, size);
+	/* The journal goes right after the freemap */
+	jblocks = journalsize(size);
+	jstart = jblocks > 0 ? SFS_MAP_LOCATION + SFS_BITBLOCKS(size) : 0;
+
+	writesuper(volname, size, jstart, jblocks);
 	writerootdir();
-	writebitmap(size);
+	writebitmap(size, jstart, jblocks);
+	writejournal(jstart, jblocks);
 
 	closedisk();
 
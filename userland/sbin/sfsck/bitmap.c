@@ -77,6 +77,11 @@ bitmap_setup(void)
 	for (i=0; i<bitblocks; i++) {
 		bitmap_blockinuse(SFS_MAP_LOCATION+i, B_BITBLOCK, i);
 	}
+
+	/* And the journal, if any */
+	for (i=0; i<sb_journalblocks(); i++) {
+		bitmap_blockinuse(sb_journalstart()+i, B_JOURNAL, i);
+	}
 }
 
 /*
@@ -94,6 +99,10 @@ blockusagestr(blockusage_t how, uint32_t howdesc)
 		snprintf(rv, sizeof(rv), "bitmap block %lu",
 			 (unsigned long) howdesc);
 		break;
+	    case B_JOURNAL:
+		snprintf(rv, sizeof(rv), "journal block %lu",
+			 (unsigned long) howdesc);
+		break;
 	    case B_INODE:
 		snprintf(rv, sizeof(rv), "inode %lu",
 			 (unsigned long) howdesc);
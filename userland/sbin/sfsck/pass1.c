@@ -238,6 +238,295 @@ check_inode_blocks(uint32_t ino, struct sfs_dinode *sfi, int isdir)
 	return changed;
 }
 
+/*
+ * State for checking extent trees.
+ */
+struct extstate {
+	uint32_t ino;		/* inode we're doing (constant) */
+	uint32_t nextfileblock;	/* no extent seen so far reaches here */
+	uint32_t fileblocks;	/* file size in blocks (constant) */
+	uint32_t volblocks;	/* volume size in blocks (constant) */
+	unsigned pasteofcount;	/* number of blocks found past eof */
+	blockusage_t usagetype;	/* how to call bitmap_blockinuse() */
+};
+
+/*
+ * Check one leaf extent E: record its blocks as in use, and free
+ * whatever part of it is past EOF. Returns nonzero if the extent
+ * should be dropped; sets *CHANGEDP if it was otherwise changed.
+ */
+static
+int
+check_leaf_extent(struct extstate *xs, struct sfs_extent *e, int *changedp)
+{
+	uint32_t keep, j;
+
+	if (e->ex_len == 0 || e->ex_block == 0 ||
+	    e->ex_block >= xs->volblocks ||
+	    e->ex_len > xs->volblocks - e->ex_block) {
+		warnx("Inode %lu: extent for block %lu has bad disk range "
+		      "(dropped)", (unsigned long)xs->ino,
+		      (unsigned long)e->ex_fileblock);
+		setbadness(EXIT_RECOV);
+		return 1;
+	}
+	if (e->ex_fileblock < xs->nextfileblock ||
+	    e->ex_len > (uint32_t)-1 - e->ex_fileblock) {
+		warnx("Inode %lu: extent for block %lu out of order "
+		      "(dropped)", (unsigned long)xs->ino,
+		      (unsigned long)e->ex_fileblock);
+		setbadness(EXIT_RECOV);
+		return 1;
+	}
+
+	keep = e->ex_len;
+	if (e->ex_fileblock >= xs->fileblocks) {
+		keep = 0;
+	}
+	else if (e->ex_len > xs->fileblocks - e->ex_fileblock) {
+		keep = xs->fileblocks - e->ex_fileblock;
+	}
+	for (j=keep; j<e->ex_len; j++) {
+		xs->pasteofcount++;
+		bitmap_blockfree(e->ex_block + j);
+	}
+	if (keep == 0) {
+		return 1;
+	}
+	if (keep < e->ex_len) {
+		e->ex_len = keep;
+		*changedp = 1;
+	}
+
+	for (j=0; j<keep; j++) {
+		bitmap_blockinuse(e->ex_block + j, xs->usagetype, xs->ino);
+	}
+	xs->nextfileblock = e->ex_fileblock + keep;
+	return 0;
+}
+
+/*
+ * Check the extent tree node with entries EXT (*NP of them) at depth
+ * DEPTH, recursively, dropping entries that are bad or entirely past
+ * EOF. Sets *CHANGEDP if the node is changed.
+ */
+static
+void
+check_extent_node(struct extstate *xs, struct sfs_extent *ext, uint16_t *np,
+		  unsigned depth, int *changedp)
+{
+	struct sfs_extnode node;
+	struct sfs_extent *e;
+	int drop, nodechanged;
+	unsigned i;
+
+	i = 0;
+	while (i < *np) {
+		e = &ext[i];
+		drop = 0;
+
+		if (depth == 0) {
+			drop = check_leaf_extent(xs, e, changedp);
+		}
+		else if (e->ex_block == 0 || e->ex_block >= xs->volblocks) {
+			warnx("Inode %lu: extent node pointer for block %lu "
+			      "outside of volume (dropped)",
+			      (unsigned long)xs->ino,
+			      (unsigned long)e->ex_fileblock);
+			setbadness(EXIT_RECOV);
+			drop = 1;
+		}
+		else {
+			sfs_readextnode(e->ex_block, &node);
+			if (node.en_magic != SFS_EXTMAGIC ||
+			    node.en_depth != depth - 1 ||
+			    node.en_nentries > SFS_EXTPERNODE) {
+				warnx("Inode %lu: bad extent node %lu "
+				      "(dropped)", (unsigned long)xs->ino,
+				      (unsigned long)e->ex_block);
+				setbadness(EXIT_RECOV);
+				drop = 1;
+			}
+			else {
+				bitmap_blockinuse(e->ex_block, B_IBLOCK,
+						  xs->ino);
+				nodechanged = 0;
+				check_extent_node(xs, node.en_ext,
+						  &node.en_nentries,
+						  depth - 1, &nodechanged);
+				if (node.en_nentries == 0) {
+					bitmap_blockfree(e->ex_block);
+					drop = 1;
+				}
+				else {
+					if (nodechanged) {
+						sfs_writeextnode(e->ex_block,
+								 &node);
+					}
+					/* The key is the child's first block */
+					if (e->ex_fileblock !=
+					    node.en_ext[0].ex_fileblock) {
+						e->ex_fileblock =
+						    node.en_ext[0].ex_fileblock;
+						*changedp = 1;
+					}
+				}
+			}
+		}
+
+		if (drop) {
+			memmove(&ext[i], &ext[i+1],
+				(*np - i - 1) * sizeof(struct sfs_extent));
+			bzero(&ext[*np - 1], sizeof(struct sfs_extent));
+			(*np)--;
+			*changedp = 1;
+		}
+		else {
+			i++;
+		}
+	}
+}
+
+/*
+ * Clear the block pointers of an inode that shouldn't have any.
+ * Returns nonzero if there were any.
+ */
+static
+int
+clear_block_pointers(struct sfs_dinode *sfi)
+{
+	int i, hasblocks = 0;
+
+	for (i=0; i<NUM_D; i++) {
+		if (GET_D(sfi, i) != 0) {
+			SET_D(sfi, i) = 0;
+			hasblocks = 1;
+		}
+	}
+	for (i=0; i<NUM_I; i++) {
+		if (GET_I(sfi, i) != 0) {
+			SET_I(sfi, i) = 0;
+			hasblocks = 1;
+		}
+	}
+	for (i=0; i<NUM_II; i++) {
+		if (GET_II(sfi, i) != 0) {
+			SET_II(sfi, i) = 0;
+			hasblocks = 1;
+		}
+	}
+	for (i=0; i<NUM_III; i++) {
+		if (GET_III(sfi, i) != 0) {
+			SET_III(sfi, i) = 0;
+			hasblocks = 1;
+		}
+	}
+	return hasblocks;
+}
+
+/*
+ * Check the blocks of an extent-mapped inode INO (already loaded
+ * into SFI): walk its extent tree, recording the blocks in use and
+ * dropping extents that are bad or past EOF.
+ *
+ * Returns nonzero if SFI has been modified and needs to be written
+ * back.
+ */
+static
+int
+check_inode_extents(uint32_t ino, struct sfs_dinode *sfi, int isdir)
+{
+	struct sfs_extroot *er = &sfi->sfi_u.sfu_extents;
+	struct extstate xs;
+	int changed = 0;
+
+	if (clear_block_pointers(sfi)) {
+		warnx("Inode %lu: extent-mapped file has block pointers "
+		      "(cleared)", (unsigned long) ino);
+		setbadness(EXIT_RECOV);
+		changed = 1;
+	}
+
+	if (er->er_nentries > SFS_EXTPERROOT ||
+	    er->er_depth > SFS_EXTMAXDEPTH) {
+		warnx("Inode %lu: bad extent tree root (cleared)",
+		      (unsigned long) ino);
+		setbadness(EXIT_RECOV);
+		bzero(er, sizeof(*er));
+		changed = 1;
+	}
+
+	xs.ino = ino;
+	xs.nextfileblock = 0;
+	xs.fileblocks = SFS_ROUNDUP(sfi->sfi_size, SFS_BLOCKSIZE) /
+		SFS_BLOCKSIZE;
+	xs.volblocks = sb_totalblocks();
+	xs.pasteofcount = 0;
+	xs.usagetype = isdir ? B_DIRDATA : B_DATA;
+
+	check_extent_node(&xs, er->er_ext, &er->er_nentries, er->er_depth,
+			  &changed);
+	if (er->er_nentries == 0 && er->er_depth != 0) {
+		er->er_depth = 0;
+		changed = 1;
+	}
+
+	if (xs.pasteofcount > 0) {
+		warnx("Inode %lu: %u blocks after EOF (freed)",
+		     (unsigned long) ino, xs.pasteofcount);
+		setbadness(EXIT_RECOV);
+	}
+
+	return changed;
+}
+
+/*
+ * Check an inode whose data is inline (in sfi_u.sfu_inline): it should
+ * have no blocks and fit, and the space past EOF should be zero.
+ *
+ * Returns nonzero if SFI has been modified and needs to be written
+ * back.
+ */
+static
+int
+check_inode_inline(uint32_t ino, struct sfs_dinode *sfi, int isdir)
+{
+	uint32_t maxsize;
+	int changed = 0;
+
+	/* Directories hold only whole entries */
+	maxsize = SFS_INLINESIZE;
+	if (isdir) {
+		maxsize -= maxsize % sizeof(struct sfs_dir);
+	}
+
+	if (clear_block_pointers(sfi)) {
+		/* Whatever they pointed to is left unclaimed and freed */
+		warnx("Inode %lu: inline file has block pointers (cleared)",
+		      (unsigned long) ino);
+		setbadness(EXIT_RECOV);
+		changed = 1;
+	}
+
+	if (sfi->sfi_size > maxsize) {
+		warnx("Inode %lu: inline file size %lu too large (truncated)",
+		      (unsigned long) ino, (unsigned long) sfi->sfi_size);
+		setbadness(EXIT_RECOV);
+		sfi->sfi_size = maxsize;
+		changed = 1;
+	}
+
+	if (checkzeroed(sfi->sfi_u.sfu_inline + sfi->sfi_size,
+			SFS_INLINESIZE - sfi->sfi_size)) {
+		warnx("Inode %lu: inline data past EOF not zeroed (fixed)",
+		      (unsigned long) ino);
+		setbadness(EXIT_RECOV);
+		changed = 1;
+	}
+
+	return changed;
+}
+
 /*
  * Do the pass1 inode-level checks on inode INO, which has already
  * been loaded into SFI. Note that sfi_type has already been
@@ -261,17 +550,47 @@ pass1_inode(uint32_t ino, struct sfs_dinode *sfi, int alreadychanged)
 
 	bitmap_blockinuse(ino, B_INODE, ino);
 
-	if (checkzeroed(sfi->sfi_waste, sizeof(sfi->sfi_waste))) {
-		warnx("Inode %lu: sfi_waste section not zeroed (fixed)",
-		      (unsigned long) ino);
+	if (sfi->sfi_flags & ~(uint32_t)(SFS_IF_INLINE | SFS_IF_EXTENTS)) {
+		warnx("Inode %lu: unknown flags 0x%lx (cleared)",
+		      (unsigned long) ino, (unsigned long) sfi->sfi_flags);
 		setbadness(EXIT_RECOV);
+		sfi->sfi_flags &= SFS_IF_INLINE | SFS_IF_EXTENTS;
 		changed = 1;
 	}
-
-	if (check_inode_blocks(ino, sfi, isdir)) {
+	if ((sfi->sfi_flags & SFS_IF_INLINE) &&
+	    (sfi->sfi_flags & SFS_IF_EXTENTS)) {
+		/* Can't tell which; the extent root is more likely junk */
+		warnx("Inode %lu: both inline and extent-mapped "
+		      "(made inline)", (unsigned long) ino);
+		setbadness(EXIT_RECOV);
+		sfi->sfi_flags &= ~(uint32_t)SFS_IF_EXTENTS;
 		changed = 1;
 	}
 
+	if (sfi->sfi_flags & SFS_IF_INLINE) {
+		if (check_inode_inline(ino, sfi, isdir)) {
+			changed = 1;
+		}
+	}
+	else if (sfi->sfi_flags & SFS_IF_EXTENTS) {
+		if (check_inode_extents(ino, sfi, isdir)) {
+			changed = 1;
+		}
+	}
+	else {
+		if (checkzeroed(sfi->sfi_u.sfu_inline,
+				sizeof(sfi->sfi_u.sfu_inline))) {
+			warnx("Inode %lu: sfi_u.sfu_inline section not zeroed "
+			      "(fixed)", (unsigned long) ino);
+			setbadness(EXIT_RECOV);
+			changed = 1;
+		}
+
+		if (check_inode_blocks(ino, sfi, isdir)) {
+			changed = 1;
+		}
+	}
+
 	if (changed) {
 		sfs_writeinode(ino, sfi);
 	}
@@ -427,7 +746,7 @@ pass1_dir(uint32_t ino, const char *pathsofar)
 	}
 
 	if (dchanged) {
-		sfs_writedir(&sfi, direntries, ndirentries);
+		sfs_writedir(ino, &sfi, direntries, ndirentries);
 	}
 
 	free(direntries);
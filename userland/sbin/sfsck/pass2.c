@@ -78,13 +78,18 @@ pass2_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 
 	/*
 	 * Load the directory. If there is any leftover room in the
-	 * last block, allocate space for it in case we want to insert
-	 * entries.
+	 * last block (or in the inode, for an inline directory),
+	 * allocate space for it in case we want to insert entries.
 	 */
 
 	ndirentries = sfi.sfi_size/sizeof(struct sfs_dir);
-	maxdirentries = SFS_ROUNDUP(ndirentries,
-				    SFS_BLOCKSIZE/sizeof(struct sfs_dir));
+	if (sfi.sfi_flags & SFS_IF_INLINE) {
+		maxdirentries = SFS_INLINESIZE/sizeof(struct sfs_dir);
+	}
+	else {
+		maxdirentries = SFS_ROUNDUP(ndirentries,
+				SFS_BLOCKSIZE/sizeof(struct sfs_dir));
+	}
 	dirsize = maxdirentries * sizeof(struct sfs_dir);
 	direntries = domalloc(dirsize);
 
@@ -302,7 +307,7 @@ pass2_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 	 */
 
 	if (dchanged) {
-		sfs_writedir(&sfi, direntries, ndirentries);
+		sfs_writedir(ino, &sfi, direntries, ndirentries);
 	}
 
 	if (ichanged) {
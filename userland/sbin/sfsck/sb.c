@@ -43,6 +43,7 @@
 #include "main.h"
 
 static struct sfs_super sp;
+static int journalok;	/* set if sp_jstart/sp_jblocks are usable */
 
 /*
  * Load the superblock.
@@ -59,6 +60,46 @@ sb_load(void)
 	assert(SFS_BITBLOCKS(sp.sp_nblocks) > 0);
 }
 
+/*
+ * Check the journal. If it's in a bad place, ignore it (so its blocks
+ * get reported, rather than whatever else is there). If it holds
+ * transactions that haven't been replayed, the rest of the volume is
+ * out of date, so checking it would do more harm than good.
+ */
+static
+void
+sb_checkjournal(void)
+{
+	struct sfs_jheader jh;
+	struct sfs_jdesc jd;
+	uint32_t firstfree = SFS_MAP_LOCATION + SFS_BITBLOCKS(sp.sp_nblocks);
+
+	if (sp.sp_jstart < firstfree || sp.sp_jblocks < 2 ||
+	    sp.sp_jstart + sp.sp_jblocks > sp.sp_nblocks ||
+	    sp.sp_jstart + sp.sp_jblocks < sp.sp_jstart) {
+		warnx("Journal at %lu (%lu blocks) is not within the volume "
+		      "(NOT FIXED)", (unsigned long) sp.sp_jstart,
+		      (unsigned long) sp.sp_jblocks);
+		setbadness(EXIT_UNRECOV);
+		return;
+	}
+	journalok = 1;
+
+	sfs_readjheader(sp.sp_jstart, &jh);
+	if (jh.jh_magic != SFS_JMAGIC_HEADER ||
+	    jh.jh_tail >= sp.sp_jblocks - 1) {
+		warnx("Journal header is invalid (NOT FIXED)");
+		setbadness(EXIT_UNRECOV);
+		return;
+	}
+
+	sfs_readjdesc(sp.sp_jstart + 1 + jh.jh_tail, &jd);
+	if (jd.jd_magic == SFS_JMAGIC_DESC && jd.jd_seq == jh.jh_tailseq) {
+		errx(EXIT_FATAL, "Journal needs to be replayed; "
+		     "mount the volume first");
+	}
+}
+
 /*
  * Validate the superblock.
  */
@@ -89,6 +130,10 @@ sb_check(void)
 		schanged = 1;
 	}
 
+	if (sp.sp_jstart != 0 || sp.sp_jblocks != 0) {
+		sb_checkjournal();
+	}
+
 	/* Write the superblock back if necessary */
 	if (schanged) {
 		sfs_writesb(SFS_SB_LOCATION, &sp);
@@ -114,6 +159,21 @@ sb_bitmapblocks(void)
 	return SFS_BITBLOCKS(sp.sp_nblocks);
 }
 
+/*
+ * Return the journal's location and size.
+ */
+uint32_t
+sb_journalstart(void)
+{
+	return journalok ? sp.sp_jstart : 0;
+}
+
+uint32_t
+sb_journalblocks(void)
+{
+	return journalok ? sp.sp_jblocks : 0;
+}
+
 /*
  * Return the volume name.
  */
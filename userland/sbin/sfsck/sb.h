@@ -49,6 +49,13 @@ uint32_t sb_bitmapblocks(void);
 /* After the superblock is loaded: return volume name. */
 const char *sb_volname(void);
 
+/*
+ * After the superblock is checked: return the first block and size
+ * of the journal (both 0 if there isn't one).
+ */
+uint32_t sb_journalstart(void);
+uint32_t sb_journalblocks(void);
+
 /* Check the superblock. Must load it first. */
 void sb_check(void);
 
@@ -62,6 +62,31 @@ swapsb(struct sfs_super *sp)
 {
 	sp->sp_magic = SWAPL(sp->sp_magic);
 	sp->sp_nblocks = SWAPL(sp->sp_nblocks);
+	sp->sp_jstart = SWAPL(sp->sp_jstart);
+	sp->sp_jblocks = SWAPL(sp->sp_jblocks);
+}
+
+static
+void
+swapjheader(struct sfs_jheader *jh)
+{
+	jh->jh_magic = SWAPL(jh->jh_magic);
+	jh->jh_tail = SWAPL(jh->jh_tail);
+	jh->jh_tailseq = SWAPL(jh->jh_tailseq);
+}
+
+static
+void
+swapjdesc(struct sfs_jdesc *jd)
+{
+	unsigned i;
+
+	jd->jd_magic = SWAPL(jd->jd_magic);
+	jd->jd_seq = SWAPL(jd->jd_seq);
+	jd->jd_ntags = SWAPL(jd->jd_ntags);
+	for (i=0; i<SFS_JTAGS; i++) {
+		jd->jd_tags[i] = SWAPL(jd->jd_tags[i]);
+	}
 }
 
 static
@@ -81,6 +106,7 @@ swapinode(struct sfs_dinode *sfi)
 	sfi->sfi_size = SWAPL(sfi->sfi_size);
 	sfi->sfi_type = SWAPS(sfi->sfi_type);
 	sfi->sfi_linkcount = SWAPS(sfi->sfi_linkcount);
+	sfi->sfi_flags = SWAPL(sfi->sfi_flags);
 
 	for (i=0; i<NUM_D; i++) {
 		SET_D(sfi, i) = SWAPL(GET_D(sfi, i));
@@ -99,6 +125,38 @@ swapinode(struct sfs_dinode *sfi)
 	}
 }
 
+static
+void
+swapextents(struct sfs_extent *ext, unsigned n)
+{
+	unsigned i;
+
+	for (i=0; i<n; i++) {
+		ext[i].ex_fileblock = SWAPL(ext[i].ex_fileblock);
+		ext[i].ex_block = SWAPL(ext[i].ex_block);
+		ext[i].ex_len = SWAPL(ext[i].ex_len);
+	}
+}
+
+static
+void
+swapextroot(struct sfs_extroot *er)
+{
+	er->er_nentries = SWAPS(er->er_nentries);
+	er->er_depth = SWAPS(er->er_depth);
+	swapextents(er->er_ext, SFS_EXTPERROOT);
+}
+
+static
+void
+swapextnode(struct sfs_extnode *en)
+{
+	en->en_magic = SWAPL(en->en_magic);
+	en->en_nentries = SWAPS(en->en_nentries);
+	en->en_depth = SWAPS(en->en_depth);
+	swapextents(en->en_ext, SFS_EXTPERNODE);
+}
+
 static
 void
 swapdir(struct sfs_dir *sfd)
@@ -152,6 +210,43 @@ ibmap(uint32_t iblock, uint32_t offset, uint32_t entrysize)
 	}
 }
 
+/*
+ * Extent tree bmap: look FILEBLOCK up in the tree node with entries
+ * EXT (N of them) at depth DEPTH. Assumes pass 1 has already checked
+ * the tree.
+ */
+static
+uint32_t
+extbmap(const struct sfs_extent *ext, unsigned n, unsigned depth,
+	uint32_t fileblock)
+{
+	struct sfs_extnode node;
+	const struct sfs_extent *e;
+
+	/* Find the last entry starting at or before FILEBLOCK */
+	while (n > 0 && ext[n-1].ex_fileblock > fileblock) {
+		n--;
+	}
+	if (n == 0) {
+		return 0;
+	}
+	e = &ext[n-1];
+
+	if (depth == 0) {
+		if (fileblock - e->ex_fileblock < e->ex_len) {
+			return e->ex_block + (fileblock - e->ex_fileblock);
+		}
+		return 0;
+	}
+
+	sfs_readextnode(e->ex_block, &node);
+	if (node.en_magic != SFS_EXTMAGIC || node.en_depth != depth - 1 ||
+	    node.en_nentries > SFS_EXTPERNODE) {
+		return 0;
+	}
+	return extbmap(node.en_ext, node.en_nentries, depth - 1, fileblock);
+}
+
 /*
  * bmap() for SFS.
  *
@@ -161,8 +256,18 @@ static
 uint32_t
 bmap(const struct sfs_dinode *sfi, uint32_t fileblock)
 {
+	const struct sfs_extroot *er;
 	uint32_t iblock, offset;
 
+	if (sfi->sfi_flags & SFS_IF_EXTENTS) {
+		er = &sfi->sfi_u.sfu_extents;
+		if (er->er_nentries > SFS_EXTPERROOT) {
+			return 0;
+		}
+		return extbmap(er->er_ext, er->er_nentries, er->er_depth,
+			       fileblock);
+	}
+
 	if (fileblock < INOMAX_D) {
 		return GET_D(sfi, fileblock);
 	}
@@ -206,6 +311,25 @@ sfs_writesb(uint32_t blocknum, struct sfs_super *sb)
 	swapsb(sb);
 }
 
+/*
+ *  journal - blocknum is a disk block number. (Read only; sfsck
+ *  does not replay the journal.)
+ */
+
+void
+sfs_readjheader(uint32_t blocknum, struct sfs_jheader *jh)
+{
+	diskread(jh, blocknum);
+	swapjheader(jh);
+}
+
+void
+sfs_readjdesc(uint32_t blocknum, struct sfs_jdesc *jd)
+{
+	diskread(jd, blocknum);
+	swapjdesc(jd);
+}
+
 /*
  *  bitmap blocks - whichblock is a block number within the bitmap.
  */
@@ -227,21 +351,43 @@ sfs_writebitmapblock(uint32_t whichblock, uint8_t *bits)
 
 /*
  *  inodes - ino is an inode number, which is a disk block number.
+ *  The extent root is only swapped if the inode says it has one;
+ *  otherwise that space holds inline data, which is bytes. (If both
+ *  flags are set, pass 1 keeps the inline data.)
  */
 
+static
+int
+hasextroot(const struct sfs_dinode *sfi)
+{
+	return (sfi->sfi_flags & (SFS_IF_INLINE | SFS_IF_EXTENTS)) ==
+		SFS_IF_EXTENTS;
+}
+
 void
 sfs_readinode(uint32_t ino, struct sfs_dinode *sfi)
 {
 	diskread(sfi, ino);
 	swapinode(sfi);
+	if (hasextroot(sfi)) {
+		swapextroot(&sfi->sfi_u.sfu_extents);
+	}
 }
 
 void
 sfs_writeinode(uint32_t ino, struct sfs_dinode *sfi)
 {
+	int extents = hasextroot(sfi);
+
+	if (extents) {
+		swapextroot(&sfi->sfi_u.sfu_extents);
+	}
 	swapinode(sfi);
 	diskwrite(sfi, ino);
 	swapinode(sfi);
+	if (extents) {
+		swapextroot(&sfi->sfi_u.sfu_extents);
+	}
 }
 
 /*
@@ -263,6 +409,25 @@ sfs_writeindirect(uint32_t blocknum, uint32_t *entries)
 	swapindir(entries);
 }
 
+/*
+ *  extent tree nodes - blocknum is a disk block number.
+ */
+
+void
+sfs_readextnode(uint32_t blocknum, struct sfs_extnode *en)
+{
+	diskread(en, blocknum);
+	swapextnode(en);
+}
+
+void
+sfs_writeextnode(uint32_t blocknum, struct sfs_extnode *en)
+{
+	swapextnode(en);
+	diskwrite(en, blocknum);
+	swapextnode(en);
+}
+
 ////////////////////////////////////////////////////////////
 // directory I/O
 
@@ -303,6 +468,15 @@ sfs_readdir(struct sfs_dinode *sfi, struct sfs_dir *d, unsigned nd)
 	struct sfs_dir buffer[atonce];
 	uint32_t diskblock;
 
+	if (sfi->sfi_flags & SFS_IF_INLINE) {
+		assert(nd * sizeof(struct sfs_dir) <= SFS_INLINESIZE);
+		memcpy(d, sfi->sfi_u.sfu_inline, nd * sizeof(struct sfs_dir));
+		for (j=0; j<nd; j++) {
+			swapdir(&d[j]);
+		}
+		return;
+	}
+
 	left = nd;
 	for (i=0; i<nblocks; i++) {
 		diskblock = bmap(sfi, i);
@@ -354,12 +528,14 @@ sfs_writedirblock(struct sfs_dir *d, uint32_t diskblock)
 }
 
 /*
- * Write out a directory, from the inode SFI, using D, which is a
- * buffer with ND slots. The caller is assumed to have set the inode
- * size accordingly.
+ * Write out a directory, from the inode SFI (number INO), using D,
+ * which is a buffer with ND slots. The caller is assumed to have set
+ * the inode size accordingly. If the directory is inline, this
+ * writes the inode.
  */
 void
-sfs_writedir(const struct sfs_dinode *sfi, struct sfs_dir *d, unsigned nd)
+sfs_writedir(uint32_t ino, struct sfs_dinode *sfi,
+	     struct sfs_dir *d, unsigned nd)
 {
 	const unsigned atonce = SFS_BLOCKSIZE/sizeof(struct sfs_dir);
 	unsigned nblocks = SFS_ROUNDUP(nd, atonce) / atonce;
@@ -368,6 +544,18 @@ sfs_writedir(const struct sfs_dinode *sfi, struct sfs_dir *d, unsigned nd)
 	struct sfs_dir buffer[atonce];
 	uint32_t diskblock;
 
+	if (sfi->sfi_flags & SFS_IF_INLINE) {
+		assert(nd * sizeof(struct sfs_dir) <= SFS_INLINESIZE);
+		for (j=0; j<nd; j++) {
+			buffer[j] = d[j];
+			swapdir(&buffer[j]);
+		}
+		memcpy(sfi->sfi_u.sfu_inline, buffer,
+		       nd * sizeof(struct sfs_dir));
+		sfs_writeinode(ino, sfi);
+		return;
+	}
+
 	left = nd;
 	for (i=0; i<nblocks; i++) {
 		diskblock = bmap(sfi, i);
@@ -39,7 +39,10 @@
 #include <stdint.h>
 
 struct sfs_super;
+struct sfs_jheader;
+struct sfs_jdesc;
 struct sfs_dinode;
+struct sfs_extnode;
 struct sfs_dir;
 
 /* Call this before anything else in this module */
@@ -53,6 +56,10 @@ void sfs_setup(void);
 void sfs_readsb(uint32_t blocknum, struct sfs_super *sb);
 void sfs_writesb(uint32_t blocknum, struct sfs_super *sb);
 
+/* journal header and descriptor blocks (read only) */
+void sfs_readjheader(uint32_t blocknum, struct sfs_jheader *jh);
+void sfs_readjdesc(uint32_t blocknum, struct sfs_jdesc *jd);
+
 /* bitmap blocks; whichblock is 0..SFS_BITBLOCKS(nblocks)-1 */
 void sfs_readbitmapblock(uint32_t whichblock, uint8_t *bits);
 void sfs_writebitmapblock(uint32_t whichblock, uint8_t *bits);
@@ -65,9 +72,12 @@ void sfs_writeinode(uint32_t inum, struct sfs_dinode *sfi);
 void sfs_readindirect(uint32_t blocknum, uint32_t *entries);
 void sfs_writeindirect(uint32_t blocknum, uint32_t *entries);
 
+void sfs_readextnode(uint32_t blocknum, struct sfs_extnode *en);
+void sfs_writeextnode(uint32_t blocknum, struct sfs_extnode *en);
+
 /* directory - ND should be the number of directory entries D points to */
 void sfs_readdir(struct sfs_dinode *sfi, struct sfs_dir *d, unsigned nd);
-void sfs_writedir(const struct sfs_dinode *sfi,
+void sfs_writedir(uint32_t ino, struct sfs_dinode *sfi,
 		  struct sfs_dir *d, unsigned nd);
 
 /* Try to add an entry to a directory. */
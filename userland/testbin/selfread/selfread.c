@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * selfread - read our own executable into our own data segment.
+ *
+ * BUF is initialized data, so its pages come from the executable
+ * and nothing has touched them yet; reading the executable into it
+ * makes the kernel page them in from the file being read, in the
+ * middle of the read. That must neither deadlock nor fail.
+ *
+ * Usage: selfread [path-to-selfread]; argv[0] is used by default.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+#define BUFSIZE (4 * 4096)
+
+static char buf[BUFSIZE] = { 1 };
+static char check[BUFSIZE];
+
+static
+int
+readall(const char *path, char *p)
+{
+	int fd, r, total;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open", path);
+	}
+	total = 0;
+	while (total < BUFSIZE) {
+		r = read(fd, p + total, BUFSIZE - total);
+		if (r < 0) {
+			err(1, "%s: read", path);
+		}
+		if (r == 0) {
+			break;
+		}
+		total += r;
+	}
+	close(fd);
+	return total;
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *path;
+	int n, m;
+
+	if (argc > 2) {
+		errx(1, "Usage: selfread [path]");
+	}
+	path = argc == 2 ? argv[1] : argv[0];
+
+	n = readall(path, buf);
+	m = readall(path, check);
+	if (n != m) {
+		errx(1, "%s: read %d bytes, then %d", path, n, m);
+	}
+	if (memcmp(buf, check, n) != 0) {
+		errx(1, "%s: contents differ between reads", path);
+	}
+
+	printf("selfread: %d bytes read; passed\n", n);
+	return 0;
+}